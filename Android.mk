@@ -19,17 +19,18 @@ include $(CLEAR_VARS)
 
 LOCAL_MODULE := sound_trigger.primary.$(TARGET_BOARD_PLATFORM)
 LOCAL_MODULE_RELATIVE_PATH := hw
-LOCAL_SRC_FILES := sound_trigger_hw_iaxxx.c cvq_util.c
+LOCAL_SRC_FILES := sound_trigger_hw_iaxxx.c cvq_util.c lock_profile.c \
+			detection_trace.c mixer_route.c
 LOCAL_VENDOR_MODULE := true
-LOCAL_C_INCLUDES += external/tinyalsa/include \
-			$(call include-path-for, audio-route)
+LOCAL_C_INCLUDES += external/tinyalsa/include
 LOCAL_HEADER_LIBRARIES := libhardware_headers generated_kernel_headers
 LOCAL_SHARED_LIBRARIES := liblog \
 			libcutils \
 			libtinyalsa \
-			libaudioroute \
 			libodsp \
-			libhardware_legacy
+			libsthalmetrics \
+			libhardware_legacy \
+			libexpat
 LOCAL_MODULE_TAGS := optional
 ifneq (,$(findstring $(PLATFORM_VERSION), P))
 LOCAL_PROPRIETARY_MODULE := true
@@ -43,12 +44,14 @@ include $(CLEAR_VARS)
 LOCAL_MODULE := adnc_strm.primary.default
 LOCAL_MODULE_RELATIVE_PATH := hw
 LOCAL_VENDOR_MODULE := true
-LOCAL_SRC_FILES := adnc_strm.c
+LOCAL_SRC_FILES := adnc_strm.c \
+			adnc_strm_convert.c
 LOCAL_HEADER_LIBRARIES := generated_kernel_headers
 LOCAL_SHARED_LIBRARIES := liblog \
 			libcutils \
 			libtinyalsa \
-			libtunnel
+			libtunnel \
+			libsthalmetrics
 LOCAL_MODULE_TAGS := optional
 ifneq (,$(findstring $(PLATFORM_VERSION), P))
 LOCAL_PROPRIETARY_MODULE := true
@@ -63,7 +66,8 @@ LOCAL_VENDOR_MODULE := true
 LOCAL_SRC_FILES := tunnel.c
 LOCAL_HEADER_LIBRARIES := generated_kernel_headers
 LOCAL_SHARED_LIBRARIES := liblog \
-			libcutils
+			libcutils \
+			libsthalmetrics
 
 include $(BUILD_SHARED_LIBRARY)
 
@@ -74,7 +78,18 @@ LOCAL_VENDOR_MODULE := true
 LOCAL_SRC_FILES := iaxxx_odsp_hw.c
 LOCAL_HEADER_LIBRARIES := generated_kernel_headers
 LOCAL_SHARED_LIBRARIES := liblog \
-			libcutils
+			libcutils \
+			libsthalmetrics
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_SHARED_LIBRARY)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := libsthalmetrics
+LOCAL_VENDOR_MODULE := true
+LOCAL_SRC_FILES := sthal_metrics.c
+LOCAL_SHARED_LIBRARIES := liblog
 LOCAL_MODULE_TAGS := optional
 
 include $(BUILD_SHARED_LIBRARY)
@@ -116,8 +131,7 @@ include $(CLEAR_VARS)
 LOCAL_MODULE := libosloutils
 LOCAL_SRC_FILES := tests/oslo_sound_model_control.cpp \
 			tests/oslo_iaxxx_sensor_control.c
-LOCAL_C_INCLUDES += external/tinyalsa/include \
-			$(call include-path-for, audio-route)
+LOCAL_C_INCLUDES += external/tinyalsa/include
 LOCAL_HEADER_LIBRARIES := libhardware_headers generated_kernel_headers
 LOCAL_SHARED_LIBRARIES := liblog \
 			libutils \
@@ -287,5 +301,51 @@ LOCAL_32_BIT_ONLY := true
 LOCAL_HEADER_LIBRARIES := generated_kernel_headers
 LOCAL_SHARED_LIBRARIES := libcutils liblog
 
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := sthal_stress_adnc_strm
+LOCAL_MODULE_RELATIVE_PATH := hw
+LOCAL_VENDOR_MODULE := true
+LOCAL_SRC_FILES := tests/fake_adnc_strm.c \
+			adnc_strm_convert.c
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/ \
+			$(LOCAL_PATH)/tests
+LOCAL_32_BIT_ONLY := true
+LOCAL_SHARED_LIBRARIES := liblog
+
+include $(BUILD_SHARED_LIBRARY)
+
+include $(CLEAR_VARS)
+
+LOCAL_PRELINK_MODULE := false
+LOCAL_MODULE := sthal_stress
+LOCAL_VENDOR_MODULE := true
+LOCAL_SRC_FILES := tests/sthal_stress.c \
+			tests/fake_odsp_hw.c \
+			sound_trigger_hw_iaxxx.c \
+			cvq_util.c \
+			lock_profile.c \
+			detection_trace.c \
+			mixer_route.c \
+			sthal_metrics.c
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/ \
+			$(LOCAL_PATH)/tests \
+			external/tinyalsa/include
+LOCAL_32_BIT_ONLY := true
+LOCAL_HEADER_LIBRARIES := libhardware_headers generated_kernel_headers
+LOCAL_SHARED_LIBRARIES := liblog \
+			libcutils \
+			libtinyalsa \
+			libhardware_legacy \
+			libexpat
+LOCAL_REQUIRED_MODULES := sthal_stress_adnc_strm
+# Keep away from the state of the real HAL and stream float from fake tunnels
+LOCAL_CFLAGS += -DSTHAL_LOCK_PROFILE \
+			-DSTHAL_CAPTURE_FLOAT \
+			-DSTHAL_DATA_DIR=\"/data/local/tmp/sthal_stress\" \
+			-DADNC_STRM_LIBRARY_PATH=\"/vendor/lib/hw/sthal_stress_adnc_strm.so\"
+
 include $(BUILD_EXECUTABLE)
 endif
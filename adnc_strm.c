@@ -21,21 +21,28 @@
 #include <string.h>
 #include <math.h>
 #include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
 
 #define LOG_TAG "SoundTriggerHALAdnc"
 //#define LOG_NDEBUG 0
 //#define LOG_NDDEBUG 0
 
 #include <log/log.h>
+#include <cutils/properties.h>
 #include <linux/mfd/adnc/iaxxx-system-identifiers.h>
 #include "adnc_strm.h"
+#include "adnc_strm_convert.h"
 #include "tunnel.h"
+#include "sthal_metrics.h"
 
 #define MAX_TUNNELS         (32)
 #define BUF_SIZE            (8192)
 
 #define CVQ_TUNNEL_ID       (1)
 #define TNL_Q15             (0xF)
+#define TNL_AFLOAT          (0x1)
 
 #define UNPARSED_OUTPUT_FILE "/data/data/unparsed_output"
 // By defining this macros, dumps will be enabled at key points to help in debugging
@@ -43,6 +50,26 @@
 #define HOTWORD_MODEL (0)
 #define AMBIENT_MODEL (1)
 
+/*
+ * A closed tunnel keeps its source enabled for LINGER_MS so that the next
+ * capture from the same endpoint reuses it, 0 closes it right away.
+ */
+#define LINGER_MS_PROP          "vendor.adnc_strm.linger_ms"
+#define DEFAULT_LINGER_MS       (3000)
+#define MAX_LINGERING           (2)
+// PCM kept when a lingering tunnel is reused, the 2 s hotword history
+#define LINGER_HISTORY_SAMPLES  (2 * 16000)
+// Bounds the flush of a reused tunnel in case the source outruns us
+#define MAX_FLUSH_READS         (64)
+// How long a prefill waits for the tunnel before giving the caller a turn
+#define PREFILL_POLL_MS         (10)
+
+// Endpoints of a multi-channel capture, see adnc_strm_open_multi()
+#define MAX_CHANNELS            (4)
+// Longer gaps in a channel are a restart of its source, not lost frames
+#define MAX_GAP_FRAMES          (50)
+#define MAX_ALIGN_ROUNDS        (8)
+
 struct raf_format_type {
     uint16_t frameSizeInBytes;    // Frame length in bytes
     uint8_t encoding;             // Encoding
@@ -58,6 +85,14 @@ struct raf_frame_type {
                                        address for all the frames */
 };
 
+// How a tunnel frame is turned into the PCM handed out
+enum pcm_conversion {
+    PCM_COPY,
+    PCM_AFLOAT_TO_Q15,
+    PCM_AFLOAT_TO_FLOAT,
+    PCM_Q15_TO_FLOAT,
+};
+
 struct adnc_strm_device
 {
     struct ia_tunneling_hal *tun_hdl;
@@ -65,6 +100,7 @@ struct adnc_strm_device
     int idx;
     int mode;
     int encode;
+    enum adnc_strm_format format;
 
     bool enable_stripping;
     unsigned int kw_start_frame;
@@ -78,6 +114,28 @@ struct adnc_strm_device
     size_t unparsed_buf_size;
     size_t unparsed_avail_size;
 
+    // RAF timestamp of the first frame handed out, for latency tracing
+    uint64_t first_frame_ts;
+    bool has_first_frame;
+
+    /*
+     * seqNo of the frame after the last one parsed. The channels of a
+     * multi-channel capture fill lost frames with silence so that they stay
+     * aligned.
+     */
+    uint32_t next_seq_no;
+    bool has_seq_no;
+    bool fill_gaps;
+    size_t frame_pcm_size;
+
+    // A multi-channel capture, interleaves one device per endpoint
+    int channels;
+    struct adnc_strm_device *chans[MAX_CHANNELS];
+    bool is_aligned;
+
+    // CLOCK_MONOTONIC in ms, when a lingering tunnel is torn down
+    long long linger_deadline_ms;
+
 #ifdef DUMP_UNPARSED_OUTPUT
     FILE *dump_file;
 #endif
@@ -85,59 +143,119 @@ struct adnc_strm_device
     pthread_mutex_t lock;
 };
 
-static void kst_split_aft(uint32_t *pAfloat, int32_t *exp,
-                        int64_t *mant, int32_t *sign)
+static struct {
+    struct metric *frames;
+    struct metric *drops;
+    struct metric *resync_bytes;
+    struct metric *pcm_full;
+    struct metric *reuses;
+    struct metric *flushed_bytes;
+    struct metric *seq_gaps;
+    struct metric *realigns;
+} metrics;
+static pthread_once_t metrics_once = PTHREAD_ONCE_INIT;
+
+static void register_metrics(void)
 {
-    uint32_t uAft = *pAfloat;
+    metrics.frames = metrics_register("adnc.frames", METRIC_COUNTER);
+    metrics.drops = metrics_register("adnc.drops", METRIC_COUNTER);
+    metrics.resync_bytes = metrics_register("adnc.resync_bytes",
+                                            METRIC_COUNTER);
+    metrics.pcm_full = metrics_register("adnc.pcm_full", METRIC_COUNTER);
+    metrics.reuses = metrics_register("adnc.reuses", METRIC_COUNTER);
+    metrics.flushed_bytes = metrics_register("adnc.flushed_bytes",
+                                            METRIC_COUNTER);
+    metrics.seq_gaps = metrics_register("adnc.seq_gaps", METRIC_COUNTER);
+    metrics.realigns = metrics_register("adnc.realigns", METRIC_COUNTER);
+}
 
-    *exp = (uAft >> 25) & 0x3F;
-    *mant = uAft & 0x1FFFFFF;
-    *sign = uAft >> 31;
-    if (*exp || *mant) {
-        *mant |= 1 << 25;
-    }
+// Tunnels closed by their user that keep streaming until their deadline
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /*
+     * Tears the lingering tunnels down at their deadline, exits once idle.
+     * Only joined with pool.lock held, once it has signalled reaper_done.
+     */
+    pthread_t reaper;
+    pthread_cond_t reaper_done;
+    bool has_reaper;
+    bool is_reaper_running;
+    int linger_ms;
+    struct adnc_strm_device *devs[MAX_LINGERING];
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .reaper_done = PTHREAD_COND_INITIALIZER,
+};
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+static void init_pool(void)
+{
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&pool.cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    pool.linger_ms = property_get_int32(LINGER_MS_PROP, DEFAULT_LINGER_MS);
+    if (pool.linger_ms < 0)
+        pool.linger_ms = 0;
 }
 
-static void kst_aft_to_dbl(void *pDouble, void *pAfloat)
+static long long monotonic_ms(void)
 {
-    uint64_t uDbl;
-    int32_t exp;
-    int32_t sign;
-    int64_t mant;
+    struct timespec ts;
 
-    kst_split_aft((uint32_t *)pAfloat, &exp, &mant, &sign);
-    if (exp || mant) {
-        uDbl = ((uint64_t)sign << 63) |
-               ((uint64_t)(exp + (1023 - (1 << 5))) << 52) |
-               ((uint64_t)(mant & ((1 << 25) - 1)) << (52 - 25));
-    } else {
-        uDbl = (uint64_t)sign << 63;
-    }
-    *((uint64_t *)pDouble) = uDbl;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
 }
 
-void kst_float_to_q15_vector(void *pDst, void *pSrc, uint32_t elCnt)
+/*
+ * The tunnel buffers are faulted in and locked when they are allocated, so
+ * the reads that follow a detection never wait for a page fault. Falls back
+ * to plain pages if RLIMIT_MEMLOCK doesn't allow it.
+ */
+static void *alloc_locked_buf(size_t size)
 {
-    uint32_t *pSrcT;
-    int16_t *pDstT;
-    uint32_t idx;
-    double smp;
+    void *buf;
+
+    buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (buf == MAP_FAILED)
+        return NULL;
+
+    if (mlock(buf, size) != 0)
+        ALOGW("%s: Failed to lock %zu bytes: %s", __func__, size,
+            strerror(errno));
+
+    return buf;
+}
 
-    pSrcT = (uint32_t *)pSrc;
-    pDstT = (int16_t *)pDst;
-    for (idx = 0; idx < elCnt; idx++) {
-        kst_aft_to_dbl(&smp, &(pSrcT[idx]));
-        smp = smp * 32768.0;
-        pDstT[idx] = ((smp < 32767.0) ?
-                     ((smp > -32768.0) ?
-                     ((int16_t)smp) : -32768) : 32767);
+static void free_locked_buf(void *buf, size_t size)
+{
+    if (buf != NULL)
+        munmap(buf, size);
+}
+
+// PCM bytes a tunnel frame of frame_sz_in_bytes turns into
+static int pcm_frame_size(enum pcm_conversion conversion,
+                        int frame_sz_in_bytes)
+{
+    switch (conversion) {
+    case PCM_AFLOAT_TO_Q15:
+        return frame_sz_in_bytes / 2;
+    case PCM_Q15_TO_FLOAT:
+        return frame_sz_in_bytes * 2;
+    default:
+        return frame_sz_in_bytes;
     }
 }
 
 void parse_audio_tunnel_data(unsigned char *buf_itr,
                             unsigned char *pcm_buf_itr,
                             int frame_sz_in_bytes,
-                            bool is_q15_conversion_required)
+                            enum pcm_conversion conversion)
 {
     //char q16_buf[BUF_SIZE]; // This can be smaller but by how much?
     int frameSizeInWords = (frame_sz_in_bytes + 3) >> 2;
@@ -147,10 +265,21 @@ void parse_audio_tunnel_data(unsigned char *buf_itr,
         return;
     }
 
-    if (is_q15_conversion_required == true) {
+    switch (conversion) {
+    case PCM_AFLOAT_TO_Q15:
         kst_float_to_q15_vector(pcm_buf_itr, buf_itr, frameSizeInWords);
-    } else {
+        break;
+    case PCM_AFLOAT_TO_FLOAT:
+        kst_float_to_f32_vector((uint32_t *)pcm_buf_itr,
+                                (const uint32_t *)buf_itr, frameSizeInWords);
+        break;
+    case PCM_Q15_TO_FLOAT:
+        kst_q15_to_f32_vector((float *)pcm_buf_itr, (const int16_t *)buf_itr,
+                            frame_sz_in_bytes / sizeof(int16_t));
+        break;
+    default:
         memcpy(pcm_buf_itr, buf_itr, frame_sz_in_bytes);
+        break;
     }
 #ifdef ENABLE_DEBUG_DUMPS
     out_fp = fopen("/data/data/pcm_dump", "ab");
@@ -185,7 +314,9 @@ static int parse_tunnel_buf(struct adnc_strm_device *adnc_strm_dev)
     int bytes_avail = adnc_strm_dev->unparsed_avail_size;
     unsigned char *pcm_buf_itr = NULL;
     int curr_pcm_frame_size;
-    bool is_q15_conversion_required = false;
+    enum pcm_conversion conversion;
+    uint32_t gap_frames;
+    size_t gap_bytes, room;
 
     if (buf_itr == NULL) {
         ALOGE("Invalid input sent to parse_tunnel_buf");
@@ -198,6 +329,7 @@ static int parse_tunnel_buf(struct adnc_strm_device *adnc_strm_dev)
                 buf_itr[2] != magic_num[2] || buf_itr[3] != magic_num[3]) {
             buf_itr++;
             bytes_avail--;
+            metric_add(metrics.resync_bytes, 1);
             if (bytes_avail <= 0) {
                 ALOGE("Could not find the magic number, reading again");
                 ALOGE("buf_itr[0] %x buf_itr[1] %x buf_itr[2] %x buf_itr[3] %x",
@@ -229,6 +361,7 @@ static int parse_tunnel_buf(struct adnc_strm_device *adnc_strm_dev)
         if (tunnel_id > MAX_TUNNELS) {
             ALOGE("Invalid tunnel id %d\n", tunnel_id);
             valid_frame = false;
+            metric_add(metrics.drops, 1);
         }
 
         struct raf_frame_type rft;
@@ -244,13 +377,15 @@ static int parse_tunnel_buf(struct adnc_strm_device *adnc_strm_dev)
          * 1 indicates that it is afloat encoding and
          * F indicates it is in q15 encoding
          */
-        if (rft.format.encoding == 1) {
-            is_q15_conversion_required = true;
-            curr_pcm_frame_size = rft.format.frameSizeInBytes / 2;
+        if (adnc_strm_dev->format == ADNC_STRM_FORMAT_FLOAT) {
+            conversion = rft.format.encoding == TNL_AFLOAT ?
+                            PCM_AFLOAT_TO_FLOAT : PCM_Q15_TO_FLOAT;
         } else {
-            is_q15_conversion_required = false;
-            curr_pcm_frame_size = rft.format.frameSizeInBytes;
+            conversion = rft.format.encoding == TNL_AFLOAT ?
+                            PCM_AFLOAT_TO_Q15 : PCM_COPY;
         }
+        curr_pcm_frame_size = pcm_frame_size(conversion,
+                                            rft.format.frameSizeInBytes);
 
         // Skip the raf_frame_type
         buf_itr += sizeof(struct raf_frame_type);
@@ -263,22 +398,64 @@ static int parse_tunnel_buf(struct adnc_strm_device *adnc_strm_dev)
             break;
         }
 
+        gap_frames = 0;
+        if (adnc_strm_dev->has_seq_no)
+            gap_frames = rft.seqNo - adnc_strm_dev->next_seq_no;
         if (valid_frame == true && skip_extra_data == false) {
-            if ((adnc_strm_dev->pcm_avail_size + curr_pcm_frame_size) <
-                adnc_strm_dev->pcm_buf_size) {
+            gap_bytes = 0;
+            if (adnc_strm_dev->fill_gaps && gap_frames != 0) {
+                gap_bytes = gap_frames * curr_pcm_frame_size;
+                room = 0;
+                if (adnc_strm_dev->pcm_avail_size + curr_pcm_frame_size <
+                    adnc_strm_dev->pcm_buf_size)
+                    room = adnc_strm_dev->pcm_buf_size -
+                        adnc_strm_dev->pcm_avail_size - curr_pcm_frame_size - 1;
+                /*
+                 * Without the silence, the seqNo of what is buffered would
+                 * be wrong. Drop it instead, the reader realigns the
+                 * channels on the frames that follow.
+                 */
+                if (gap_frames > MAX_GAP_FRAMES || gap_bytes > room) {
+                    ALOGW("Gap of %u frames on endpoint %x, dropping %zu bytes",
+                        gap_frames, adnc_strm_dev->end_point,
+                        adnc_strm_dev->pcm_avail_size);
+                    adnc_strm_dev->pcm_avail_size = 0;
+                    gap_bytes = 0;
+                }
+            }
+
+            if ((adnc_strm_dev->pcm_avail_size + gap_bytes +
+                curr_pcm_frame_size) < adnc_strm_dev->pcm_buf_size) {
                 pcm_buf_itr = (unsigned char *)adnc_strm_dev->pcm_buf +
                                 adnc_strm_dev->pcm_avail_size;
+                memset(pcm_buf_itr, 0, gap_bytes);
+                pcm_buf_itr += gap_bytes;
+                adnc_strm_dev->pcm_avail_size += gap_bytes;
                 parse_audio_tunnel_data(buf_itr, pcm_buf_itr,
                                         rft.format.frameSizeInBytes,
-                                        is_q15_conversion_required);
+                                        conversion);
                 adnc_strm_dev->pcm_avail_size += curr_pcm_frame_size;
+                adnc_strm_dev->frame_pcm_size = curr_pcm_frame_size;
+                metric_add(metrics.frames, 1);
+                if (adnc_strm_dev->has_first_frame == false) {
+                    adnc_strm_dev->first_frame_ts = rft.timeStamp;
+                    adnc_strm_dev->has_first_frame = true;
+                }
             } else {
                 ALOGD("Not enough PCM buffer available break now");
+                metric_add(metrics.pcm_full, 1);
                 bytes_avail += min_bytes_req;
                 break;
             }
         }
 
+        if (valid_frame == true) {
+            if (gap_frames != 0 && gap_frames <= MAX_GAP_FRAMES)
+                metric_add(metrics.seq_gaps, gap_frames);
+            adnc_strm_dev->next_seq_no = rft.seqNo + 1;
+            adnc_strm_dev->has_seq_no = true;
+        }
+
         // Skip the data
         buf_itr += rft.format.frameSizeInBytes;
         bytes_avail -= rft.format.frameSizeInBytes;
@@ -288,92 +465,288 @@ static int parse_tunnel_buf(struct adnc_strm_device *adnc_strm_dev)
 }
 
 
-__attribute__ ((visibility ("default")))
-size_t adnc_strm_read(long handle, void *buffer, size_t bytes)
+/*
+ * Reads one buffer from the tunnel and parses it into the PCM buffer, the
+ * leftover of a partial frame is kept for the next read. Returns the bytes
+ * read from the tunnel. Called with adnc_strm_dev->lock held.
+ */
+static int read_tunnel_buf(struct adnc_strm_device *adnc_strm_dev)
 {
-    int ret = 0;
-    struct adnc_strm_device *adnc_strm_dev = (struct adnc_strm_device *) handle;
     int bytes_read, bytes_rem;
+    size_t room = adnc_strm_dev->unparsed_buf_size -
+                adnc_strm_dev->unparsed_avail_size;
 
-    if (adnc_strm_dev == NULL) {
-        ALOGE("Invalid handle");
-        ret = 0;
-        goto exit;
+    // Frames left unparsed because the PCM buffer is full pile up here
+    if (room == 0) {
+        ALOGE("Unparsed buffer is full");
+        return -ENOSPC;
     }
+    if (room > BUF_SIZE)
+        room = BUF_SIZE;
+
+    // Read data from the kernel, account for the leftover
+    // data from previous run
+    bytes_read = ia_read_tunnel_data(adnc_strm_dev->tun_hdl,
+                                    (void *)((unsigned char *)
+                                    adnc_strm_dev->unparsed_buf +
+                                    adnc_strm_dev->unparsed_avail_size),
+                                    room);
+    if (bytes_read <= 0)
+        return bytes_read;
+
+    // Parse the data to get PCM data
+    adnc_strm_dev->unparsed_avail_size += bytes_read;
+    bytes_rem = parse_tunnel_buf(adnc_strm_dev);
 
-    pthread_mutex_lock(&adnc_strm_dev->lock);
-
-    if (bytes > adnc_strm_dev->pcm_avail_size) {
-        /*
-         * We don't have enough PCM data, read more from the device.
-         * First copy the remainder of the PCM buffer to the front
-         * of the PCM buffer
-         */
-        if (adnc_strm_dev->pcm_avail_size != 0) {
-            ALOGD("Copying to the front of the buffer pcm_avail_size %zu"
-                  " pcm_read_offset %zu", adnc_strm_dev->pcm_avail_size,
-                    adnc_strm_dev->pcm_read_offset);
-            memcpy(adnc_strm_dev->pcm_buf,
-                   ((unsigned char *)adnc_strm_dev->pcm_buf +
-                    adnc_strm_dev->pcm_read_offset),
-                    adnc_strm_dev->pcm_avail_size);
+#ifdef ENABLE_DEBUG_DUMPS
+    if (adnc_strm_dev->pcm_avail_size != 0) {
+        FILE *out_fp = fopen("/data/data/pcm_dump2", "ab");
+        if (out_fp) {
+            ALOGE("Dumping to pcm_dump2");
+            fwrite(((unsigned char *)adnc_strm_dev->pcm_buf +
+                    adnc_strm_dev->pcm_avail_size),
+                    adnc_strm_dev->pcm_avail_size, 1, out_fp);
+            fflush(out_fp);
+            fclose(out_fp);
+        } else {
+            ALOGE("Failed to open the pcm_dump2 file %s", strerror(errno));
         }
-        // Always read from the start of the PCM buffer at this point of time
-        adnc_strm_dev->pcm_read_offset = 0;
-
-read_again:
-        // Read data from the kernel, account for the leftover
-        // data from previous run
-        bytes_read = ia_read_tunnel_data(adnc_strm_dev->tun_hdl,
-                                        (void *)((unsigned char *)
-                                        adnc_strm_dev->unparsed_buf +
-                                        adnc_strm_dev->unparsed_avail_size),
-                                        BUF_SIZE);
-        if (bytes_read <= 0) {
+    }
+#endif
+
+    // Copy the left over unparsed data to the front of the buffer
+    if (bytes_rem != 0) {
+        int offset = adnc_strm_dev->unparsed_avail_size - bytes_rem;
+        memcpy(adnc_strm_dev->unparsed_buf,
+               ((unsigned char *)adnc_strm_dev->unparsed_buf + offset),
+                bytes_rem);
+    }
+    adnc_strm_dev->unparsed_avail_size = bytes_rem;
+
+    return bytes_read;
+}
+
+/*
+ * Reads from the tunnel until there are bytes of PCM to hand out. Returns 0
+ * or -EIO. Called with adnc_strm_dev->lock, or the lock of its group, held.
+ */
+static int fill_pcm_buf(struct adnc_strm_device *adnc_strm_dev, size_t bytes)
+{
+    if (bytes <= adnc_strm_dev->pcm_avail_size)
+        return 0;
+
+    /*
+     * We don't have enough PCM data, read more from the device.
+     * First copy the remainder of the PCM buffer to the front
+     * of the PCM buffer
+     */
+    if (adnc_strm_dev->pcm_avail_size != 0) {
+        ALOGD("Copying to the front of the buffer pcm_avail_size %zu"
+              " pcm_read_offset %zu", adnc_strm_dev->pcm_avail_size,
+                adnc_strm_dev->pcm_read_offset);
+        memmove(adnc_strm_dev->pcm_buf,
+                ((unsigned char *)adnc_strm_dev->pcm_buf +
+                adnc_strm_dev->pcm_read_offset),
+                adnc_strm_dev->pcm_avail_size);
+    }
+    // Always read from the start of the PCM buffer at this point of time
+    adnc_strm_dev->pcm_read_offset = 0;
+
+    /*
+     * If stripping is enabled then we may not have read anything to the pcm
+     * buffer, so read again until we have enough bytes.
+     */
+    do {
+        if (read_tunnel_buf(adnc_strm_dev) <= 0) {
             ALOGE("Failed to read data from tunnel");
-            ret = 0; // TODO should we try to read a couple of times?
-            pthread_mutex_unlock(&adnc_strm_dev->lock);
-            goto exit;
+            return -EIO; // TODO should we try to read a couple of times?
         }
+    } while (adnc_strm_dev->pcm_avail_size < bytes);
 
-        // Parse the data to get PCM data
-        adnc_strm_dev->unparsed_avail_size += bytes_read;
-        bytes_rem = parse_tunnel_buf(adnc_strm_dev);
+    return 0;
+}
 
-#ifdef ENABLE_DEBUG_DUMPS
-        if (adnc_strm_dev->pcm_avail_size != 0) {
-            FILE *out_fp = fopen("/data/data/pcm_dump2", "ab");
-            if (out_fp) {
-                ALOGE("Dumping to pcm_dump2");
-                fwrite(((unsigned char *)adnc_strm_dev->pcm_buf +
-                        adnc_strm_dev->pcm_avail_size),
-                        adnc_strm_dev->pcm_avail_size, 1, out_fp);
-                fflush(out_fp);
-                fclose(out_fp);
-            } else {
-                ALOGE("Failed to open the pcm_dump2 file %s", strerror(errno));
+static void consume_pcm_buf(struct adnc_strm_device *adnc_strm_dev,
+                            size_t bytes)
+{
+    adnc_strm_dev->pcm_avail_size -= bytes;
+    adnc_strm_dev->pcm_read_offset += bytes;
+}
+
+// seqNo of the first frame left in the PCM buffer, which can't be empty
+static uint32_t head_seq_no(const struct adnc_strm_device *adnc_strm_dev)
+{
+    return adnc_strm_dev->next_seq_no - adnc_strm_dev->pcm_avail_size /
+                                        adnc_strm_dev->frame_pcm_size;
+}
+
+/*
+ * The channels' tunnels were started one after the other, drops the frames
+ * at the start of each until they all begin with the same seqNo. Called with
+ * group->lock held.
+ */
+static int align_channels(struct adnc_strm_device *group)
+{
+    struct adnc_strm_device *chan;
+    uint32_t target;
+    size_t drop;
+    bool is_aligned;
+    int c, round;
+
+    for (round = 0; round < MAX_ALIGN_ROUNDS; round++) {
+        // Where a channel is is only known once it has a frame
+        for (c = 0; c < group->channels; c++) {
+            if (fill_pcm_buf(group->chans[c], 1) != 0)
+                return -EIO;
+        }
+
+        target = head_seq_no(group->chans[0]);
+        for (c = 1; c < group->channels; c++) {
+            if ((int32_t)(head_seq_no(group->chans[c]) - target) > 0)
+                target = head_seq_no(group->chans[c]);
+        }
+
+        is_aligned = true;
+        for (c = 0; c < group->channels; c++) {
+            chan = group->chans[c];
+            drop = (target - head_seq_no(chan)) * chan->frame_pcm_size;
+            if (drop >= chan->pcm_avail_size) {
+                drop = chan->pcm_avail_size;
+                is_aligned = false;
             }
+            consume_pcm_buf(chan, drop);
         }
-#endif
 
-        // Copy the left over unparsed data to the front of the buffer
-        if (bytes_rem != 0) {
-            int offset = adnc_strm_dev->unparsed_avail_size - bytes_rem;
-            memcpy(adnc_strm_dev->unparsed_buf,
-                   ((unsigned char *)adnc_strm_dev->unparsed_buf + offset),
-                    bytes_rem);
+        if (is_aligned) {
+            ALOGD("%s: %d channels aligned at seqNo %u", __func__,
+                group->channels, target);
+            group->is_aligned = true;
+            return 0;
         }
-        adnc_strm_dev->unparsed_avail_size = bytes_rem;
+    }
 
-        /*
-         * If stripping is enabled then we didn't read anything to the pcm
-         * bufferso read again or if we still don't have enough bytes then
-         * read data again.
-         */
-        if (adnc_strm_dev->pcm_avail_size == 0 ||
-            adnc_strm_dev->pcm_avail_size < bytes) {
-            goto read_again;
+    ALOGE("%s: Failed to align %d channels", __func__, group->channels);
+    return -EIO;
+}
+
+// Whether the PCM buffers of all the channels start at the same seqNo
+static bool are_channels_aligned(const struct adnc_strm_device *group)
+{
+    uint32_t head = head_seq_no(group->chans[0]);
+
+    for (int c = 1; c < group->channels; c++) {
+        if (head_seq_no(group->chans[c]) != head)
+            return false;
+    }
+
+    return true;
+}
+
+/*
+ * Interleaves frames Q15 samples of each channel into dst. Kept to plain
+ * loops with fixed strides so that the compiler vectorizes them, stereo
+ * gets its own loop as it is by far the common case.
+ */
+static void interleave_q15(int16_t *dst, const int16_t *const *src,
+                        int channels, size_t frames)
+{
+    size_t i;
+    int c;
+
+    if (channels == 2) {
+        const int16_t *restrict left = src[0];
+        const int16_t *restrict right = src[1];
+
+        for (i = 0; i < frames; i++) {
+            dst[2 * i] = left[i];
+            dst[2 * i + 1] = right[i];
         }
+        return;
+    }
+
+    for (c = 0; c < channels; c++) {
+        const int16_t *restrict chan = src[c];
+
+        for (i = 0; i < frames; i++)
+            dst[i * channels + c] = chan[i];
+    }
+}
+
+// Returns 0 or -EIO, buffer is left unfilled on an error
+static int read_interleaved(struct adnc_strm_device *group, void *buffer,
+                            size_t bytes)
+{
+    size_t frames = bytes / (group->channels * sizeof(int16_t));
+    size_t chan_bytes = frames * sizeof(int16_t);
+    const int16_t *src[MAX_CHANNELS];
+    struct adnc_strm_device *chan;
+    int err = -EIO;
+    int c;
+
+    pthread_mutex_lock(&group->lock);
+
+    if (group->is_aligned == false && align_channels(group) != 0)
+        goto exit;
+
+    for (c = 0; c < group->channels; c++) {
+        if (fill_pcm_buf(group->chans[c], chan_bytes) != 0)
+            goto exit;
+    }
+
+    /*
+     * A gap too long to fill, or one that didn't fit, shifts a channel.
+     * Realign on the newest frames rather than stream them shifted.
+     */
+    if (!are_channels_aligned(group)) {
+        ALOGW("%s: channels drifted apart, realigning", __func__);
+        metric_add(metrics.realigns, 1);
+        if (align_channels(group) != 0)
+            goto exit;
+        for (c = 0; c < group->channels; c++) {
+            if (fill_pcm_buf(group->chans[c], chan_bytes) != 0)
+                goto exit;
+        }
+    }
+
+    for (c = 0; c < group->channels; c++) {
+        chan = group->chans[c];
+        src[c] = (const int16_t *)((unsigned char *)chan->pcm_buf +
+                                chan->pcm_read_offset);
+    }
+
+    interleave_q15((int16_t *)buffer, src, group->channels, frames);
+
+    for (c = 0; c < group->channels; c++)
+        consume_pcm_buf(group->chans[c], chan_bytes);
+    err = 0;
+
+exit:
+    pthread_mutex_unlock(&group->lock);
+    return err;
+}
+
+/*
+ * Returns bytes, or 0 if the tunnel couldn't be read, in which case nothing
+ * was written to buffer.
+ */
+__attribute__ ((visibility ("default")))
+size_t adnc_strm_read(long handle, void *buffer, size_t bytes)
+{
+    struct adnc_strm_device *adnc_strm_dev = (struct adnc_strm_device *) handle;
+
+    if (adnc_strm_dev == NULL) {
+        ALOGE("Invalid handle");
+        return 0;
+    }
+
+    if (adnc_strm_dev->channels > 1)
+        return read_interleaved(adnc_strm_dev, buffer, bytes) == 0 ? bytes : 0;
+
+    pthread_mutex_lock(&adnc_strm_dev->lock);
+
+    if (fill_pcm_buf(adnc_strm_dev, bytes) != 0) {
+        pthread_mutex_unlock(&adnc_strm_dev->lock);
+        return 0;
     }
 
     // Copy the PCM data to output buffer and return
@@ -400,24 +773,354 @@ read_again:
     }
 #endif
 
-    adnc_strm_dev->pcm_avail_size -= bytes;
-    adnc_strm_dev->pcm_read_offset += bytes;
+    consume_pcm_buf(adnc_strm_dev, bytes);
+
+    pthread_mutex_unlock(&adnc_strm_dev->lock);
+
+    return bytes;
+}
+
+
+/*
+ * PCM bytes one tunnel read of BUF_SIZE can turn into, Q15 tunnel data
+ * doubles in size when handed out as float.
+ */
+static size_t pcm_read_size(const struct adnc_strm_device *adnc_strm_dev)
+{
+    return adnc_strm_dev->format == ADNC_STRM_FORMAT_FLOAT ?
+            BUF_SIZE * 2 : BUF_SIZE;
+}
+
+/*
+ * Moves the unread PCM to the front of the PCM buffer and grows it, if
+ * needed, to hold bytes of PCM plus one more tunnel buffer. Returns 0 or
+ * -ENOMEM. Called with adnc_strm_dev->lock held.
+ */
+static int reserve_pcm_buf(struct adnc_strm_device *adnc_strm_dev, size_t bytes)
+{
+    size_t pcm_buf_size = bytes + pcm_read_size(adnc_strm_dev);
+    void *pcm_buf;
+
+    if (pcm_buf_size > adnc_strm_dev->pcm_buf_size) {
+        pcm_buf = alloc_locked_buf(pcm_buf_size);
+        if (pcm_buf == NULL) {
+            ALOGE("Failed to allocate memory for pcm buffer");
+            return -ENOMEM;
+        }
+        memcpy(pcm_buf, (unsigned char *)adnc_strm_dev->pcm_buf +
+                adnc_strm_dev->pcm_read_offset, adnc_strm_dev->pcm_avail_size);
+        free_locked_buf(adnc_strm_dev->pcm_buf, adnc_strm_dev->pcm_buf_size);
+        adnc_strm_dev->pcm_buf = pcm_buf;
+        adnc_strm_dev->pcm_buf_size = pcm_buf_size;
+    } else if (adnc_strm_dev->pcm_read_offset != 0) {
+        memmove(adnc_strm_dev->pcm_buf, (unsigned char *)adnc_strm_dev->pcm_buf +
+                adnc_strm_dev->pcm_read_offset, adnc_strm_dev->pcm_avail_size);
+    }
+    adnc_strm_dev->pcm_read_offset = 0;
+
+    return 0;
+}
+
+/*
+ * Optional, reads and parses one tunnel buffer ahead of the reader so that
+ * the first reads after a detection are served from memory. The PCM buffer
+ * grows to hold bytes of PCM and is never shrunk. The wait for the tunnel,
+ * up to PREFILL_POLL_MS, is done without the lock so that a reader never
+ * queues up behind a prefill blocked in the driver. Returns the PCM bytes
+ * buffered or -errno.
+ */
+__attribute__ ((visibility ("default")))
+int adnc_strm_prefill(long handle, size_t bytes)
+{
+    struct adnc_strm_device *adnc_strm_dev = (struct adnc_strm_device *) handle;
+    bool is_ready;
+    int ret;
+
+    if (adnc_strm_dev == NULL) {
+        ALOGE("Invalid handle");
+        return -EINVAL;
+    }
+    // The channels are aligned on the first read
+    if (adnc_strm_dev->channels > 1)
+        return -ENOSYS;
+
+    // tun_hdl doesn't change while the device is open
+    is_ready = ia_poll_tunnel_data(adnc_strm_dev->tun_hdl,
+                                PREFILL_POLL_MS) > 0;
+
+    pthread_mutex_lock(&adnc_strm_dev->lock);
+
+    ret = reserve_pcm_buf(adnc_strm_dev, bytes);
+    if (ret != 0)
+        goto exit;
+
+    // A reader may have drained the tunnel since, don't block under the lock
+    if (is_ready && adnc_strm_dev->pcm_avail_size < bytes &&
+        ia_poll_tunnel_data(adnc_strm_dev->tun_hdl, 0) > 0 &&
+        read_tunnel_buf(adnc_strm_dev) <= 0) {
+        ALOGE("Failed to read data from tunnel");
+        ret = -EIO;
+        goto exit;
+    }
+    ret = adnc_strm_dev->pcm_avail_size;
+
+exit:
+    pthread_mutex_unlock(&adnc_strm_dev->lock);
+
+    return ret;
+}
+
+/*
+ * Optional, returns the RAF timestamp of the first frame parsed from the
+ * tunnel, or -EAGAIN if there hasn't been any yet.
+ */
+__attribute__ ((visibility ("default")))
+int adnc_strm_get_first_frame_ts(long handle, uint64_t *timestamp)
+{
+    struct adnc_strm_device *adnc_strm_dev = (struct adnc_strm_device *) handle;
+    int ret = -EAGAIN;
+
+    if (adnc_strm_dev == NULL) {
+        ALOGE("Invalid handle");
+        return -EINVAL;
+    }
+    if (adnc_strm_dev->channels > 1)
+        adnc_strm_dev = adnc_strm_dev->chans[0];
+
+    pthread_mutex_lock(&adnc_strm_dev->lock);
+    if (adnc_strm_dev->has_first_frame) {
+        *timestamp = adnc_strm_dev->first_frame_ts;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&adnc_strm_dev->lock);
+
+    return ret;
+}
+
+static int destroy_strm_device(struct adnc_strm_device *adnc_strm_dev)
+{
+    int ret;
+
+    pthread_mutex_lock(&adnc_strm_dev->lock);
+
+    free_locked_buf(adnc_strm_dev->pcm_buf, adnc_strm_dev->pcm_buf_size);
+    free_locked_buf(adnc_strm_dev->unparsed_buf,
+                    adnc_strm_dev->unparsed_buf_size);
+
+    ret = ia_disable_tunneling_source(adnc_strm_dev->tun_hdl,
+                                    adnc_strm_dev->end_point,
+                                    adnc_strm_dev->mode,
+                                    adnc_strm_dev->encode);
+    if (ret != 0) {
+        ALOGE("Failed to disable the tunneling source");
+    }
+
+    ret = ia_stop_tunneling(adnc_strm_dev->tun_hdl);
+    if (ret != 0) {
+        ALOGE("Failed to stop tunneling");
+    }
 
     pthread_mutex_unlock(&adnc_strm_dev->lock);
 
+    free(adnc_strm_dev);
+
+    return ret;
+}
+
+static void *reaper_thread_loop(void *arg __unused)
+{
+    struct adnc_strm_device *expired[MAX_LINGERING];
+    struct timespec ts;
+    long long now, next;
+    int i, n;
+
+    pthread_mutex_lock(&pool.lock);
+    while (1) {
+        now = monotonic_ms();
+        next = -1;
+        n = 0;
+        for (i = 0; i < MAX_LINGERING; i++) {
+            if (pool.devs[i] == NULL)
+                continue;
+            if (pool.devs[i]->linger_deadline_ms <= now) {
+                expired[n++] = pool.devs[i];
+                pool.devs[i] = NULL;
+            } else if (next == -1 || pool.devs[i]->linger_deadline_ms < next) {
+                next = pool.devs[i]->linger_deadline_ms;
+            }
+        }
+
+        if (n > 0) {
+            pthread_mutex_unlock(&pool.lock);
+            for (i = 0; i < n; i++) {
+                ALOGD("%s: Closing the tunnel of endpoint %x", __func__,
+                    expired[i]->end_point);
+                destroy_strm_device(expired[i]);
+            }
+            pthread_mutex_lock(&pool.lock);
+            continue;
+        }
+        if (next == -1)
+            break;
+
+        ts.tv_sec = next / 1000;
+        ts.tv_nsec = (next % 1000) * 1000000;
+        pthread_cond_timedwait(&pool.cond, &pool.lock, &ts);
+    }
+    pool.is_reaper_running = false;
+    pthread_cond_broadcast(&pool.reaper_done);
+    pthread_mutex_unlock(&pool.lock);
+
+    return NULL;
+}
+
+/*
+ * Keeps a closed tunnel streaming for pool.linger_ms, so that a capture
+ * from the same endpoint that follows shortly skips the setup. Returns
+ * false if it has to be torn down now.
+ */
+static bool linger_strm_device(struct adnc_strm_device *adnc_strm_dev)
+{
+    bool is_lingering = false;
+    int i, err;
+
+    if (pool.linger_ms == 0)
+        return false;
+
+    pthread_mutex_lock(&pool.lock);
+    for (i = 0; i < MAX_LINGERING; i++) {
+        if (pool.devs[i] == NULL)
+            break;
+    }
+    if (i == MAX_LINGERING)
+        goto exit;
+
+    if (!pool.is_reaper_running) {
+        // The last one is done, it only has to be reaped
+        if (pool.has_reaper)
+            pthread_join(pool.reaper, NULL);
+        pool.has_reaper = false;
+        err = pthread_create(&pool.reaper, (const pthread_attr_t *) NULL,
+                            reaper_thread_loop, NULL);
+        if (err != 0) {
+            ALOGE("%s: Failed to create the reaper thread %d", __func__, err);
+            goto exit;
+        }
+        pool.has_reaper = true;
+        pool.is_reaper_running = true;
+    }
+
+    adnc_strm_dev->linger_deadline_ms = monotonic_ms() + pool.linger_ms;
+    pool.devs[i] = adnc_strm_dev;
+    pthread_cond_signal(&pool.cond);
+    is_lingering = true;
+
 exit:
+    pthread_mutex_unlock(&pool.lock);
 
-    return bytes;
+    return is_lingering;
 }
 
+static struct adnc_strm_device *take_lingering_device(int end_point, int mode,
+                                                    int encode)
+{
+    struct adnc_strm_device *adnc_strm_dev = NULL;
+
+    pthread_mutex_lock(&pool.lock);
+    for (int i = 0; i < MAX_LINGERING; i++) {
+        if (pool.devs[i] != NULL && pool.devs[i]->end_point == end_point &&
+            pool.devs[i]->mode == mode && pool.devs[i]->encode == encode) {
+            adnc_strm_dev = pool.devs[i];
+            pool.devs[i] = NULL;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    return adnc_strm_dev;
+}
+
+/*
+ * A reused tunnel has kept streaming since it was closed. Drops what was
+ * left of the previous capture and what has queued up since, except for
+ * the last LINGER_HISTORY_SAMPLES which a fresh tunnel would have started
+ * with. Called with adnc_strm_dev->lock held.
+ */
+static void flush_stale_data(struct adnc_strm_device *adnc_strm_dev)
+{
+    size_t keep = LINGER_HISTORY_SAMPLES *
+                    (adnc_strm_dev->format == ADNC_STRM_FORMAT_FLOAT ?
+                    sizeof(float) : sizeof(int16_t));
+    size_t flushed = adnc_strm_dev->pcm_avail_size +
+                    adnc_strm_dev->unparsed_avail_size;
+    size_t drop;
+    int i;
 
+    adnc_strm_dev->pcm_avail_size = 0;
+    adnc_strm_dev->pcm_read_offset = 0;
+    // A partial frame is found again from its magic number
+    adnc_strm_dev->unparsed_avail_size = 0;
+    if (reserve_pcm_buf(adnc_strm_dev, keep) != 0)
+        keep = adnc_strm_dev->pcm_buf_size - pcm_read_size(adnc_strm_dev);
+
+    for (i = 0; i < MAX_FLUSH_READS &&
+            ia_poll_tunnel_data(adnc_strm_dev->tun_hdl, 0) > 0; i++) {
+        if (read_tunnel_buf(adnc_strm_dev) <= 0)
+            break;
+        if (adnc_strm_dev->pcm_avail_size > keep) {
+            drop = adnc_strm_dev->pcm_avail_size - keep;
+            memmove(adnc_strm_dev->pcm_buf,
+                    (unsigned char *)adnc_strm_dev->pcm_buf + drop, keep);
+            adnc_strm_dev->pcm_avail_size = keep;
+            flushed += drop;
+        }
+    }
+    // The frame it was taken from may be gone, take it from the next one
+    adnc_strm_dev->has_first_frame = false;
+
+    metric_add(metrics.flushed_bytes, flushed);
+    ALOGD("%s: Flushed %zu bytes, kept %zu in %d reads", __func__, flushed,
+        adnc_strm_dev->pcm_avail_size, i);
+}
+
+/*
+ * Optional, adnc_strm_open() with the samples handed out in format. A float
+ * stream asks the source for afloat, which is converted without going
+ * through Q15.
+ */
 __attribute__ ((visibility ("default")))
-long adnc_strm_open(bool enable_stripping,
-                    unsigned int kw_start_frame,
-                    int stream_end_point)
+long adnc_strm_open_format(bool enable_stripping,
+                        unsigned int kw_start_frame,
+                        int stream_end_point,
+                        int format)
 {
     int ret = 0, err;
     struct adnc_strm_device *adnc_strm_dev = NULL;
+    int encode;
+
+    pthread_once(&metrics_once, register_metrics);
+    pthread_once(&pool_once, init_pool);
+
+    if (format == ADNC_STRM_FORMAT_Q15) {
+        encode = TNL_Q15;
+    } else if (format == ADNC_STRM_FORMAT_FLOAT) {
+        encode = TNL_AFLOAT;
+    } else {
+        ALOGE("%s: Unsupported format %d", __func__, format);
+        return 0;
+    }
+
+    adnc_strm_dev = take_lingering_device(stream_end_point, 0, encode);
+    if (adnc_strm_dev != NULL) {
+        pthread_mutex_lock(&adnc_strm_dev->lock);
+        adnc_strm_dev->enable_stripping = enable_stripping;
+        adnc_strm_dev->kw_start_frame = kw_start_frame;
+        adnc_strm_dev->fill_gaps = false;
+        flush_stale_data(adnc_strm_dev);
+        pthread_mutex_unlock(&adnc_strm_dev->lock);
+        metric_add(metrics.reuses, 1);
+        return (long)adnc_strm_dev;
+    }
 
     adnc_strm_dev = (struct adnc_strm_device *)
                         calloc(1, sizeof(struct adnc_strm_device));
@@ -434,7 +1137,8 @@ long adnc_strm_open(bool enable_stripping,
     adnc_strm_dev->end_point = stream_end_point;
     adnc_strm_dev->idx = 0;
     adnc_strm_dev->mode = 0;
-    adnc_strm_dev->encode = TNL_Q15;
+    adnc_strm_dev->encode = encode;
+    adnc_strm_dev->format = format;
     adnc_strm_dev->enable_stripping = enable_stripping;
     adnc_strm_dev->kw_start_frame = kw_start_frame;
     adnc_strm_dev->tun_hdl = NULL;
@@ -461,17 +1165,18 @@ long adnc_strm_open(bool enable_stripping,
 
     adnc_strm_dev->unparsed_buf_size = BUF_SIZE * 2;
     adnc_strm_dev->unparsed_avail_size = 0;
-    adnc_strm_dev->unparsed_buf = malloc(adnc_strm_dev->unparsed_buf_size);
+    adnc_strm_dev->unparsed_buf =
+                    alloc_locked_buf(adnc_strm_dev->unparsed_buf_size);
     if (adnc_strm_dev->unparsed_buf == NULL) {
         ret = 0;
         ALOGE("Failed to allocate memory for unparsed buffer");
         goto exit_on_error;
     }
 
-    adnc_strm_dev->pcm_buf_size = BUF_SIZE * 2;
+    adnc_strm_dev->pcm_buf_size = pcm_read_size(adnc_strm_dev) * 2;
     adnc_strm_dev->pcm_avail_size = 0;
     adnc_strm_dev->pcm_read_offset = 0;
-    adnc_strm_dev->pcm_buf = malloc(adnc_strm_dev->pcm_buf_size);
+    adnc_strm_dev->pcm_buf = alloc_locked_buf(adnc_strm_dev->pcm_buf_size);
     if (adnc_strm_dev->pcm_buf == NULL) {
         ret = 0;
         ALOGE("Failed to allocate memory for pcm buffer");
@@ -483,13 +1188,9 @@ long adnc_strm_open(bool enable_stripping,
     return (long)adnc_strm_dev;
 
 exit_on_error:
-    if (adnc_strm_dev->pcm_buf) {
-        free(adnc_strm_dev->pcm_buf);
-    }
-
-    if (adnc_strm_dev->unparsed_buf) {
-        free(adnc_strm_dev->unparsed_buf);
-    }
+    free_locked_buf(adnc_strm_dev->pcm_buf, adnc_strm_dev->pcm_buf_size);
+    free_locked_buf(adnc_strm_dev->unparsed_buf,
+                    adnc_strm_dev->unparsed_buf_size);
 
     err = ia_disable_tunneling_source(adnc_strm_dev->tun_hdl,
                                     adnc_strm_dev->end_point,
@@ -515,48 +1216,127 @@ exit_no_memory:
     return ret;
 }
 
+__attribute__ ((visibility ("default")))
+long adnc_strm_open(bool enable_stripping,
+                    unsigned int kw_start_frame,
+                    int stream_end_point)
+{
+    return adnc_strm_open_format(enable_stripping, kw_start_frame,
+                                stream_end_point, ADNC_STRM_FORMAT_Q15);
+}
+
 __attribute__ ((visibility ("default")))
 int adnc_strm_close(long handle)
 {
-    int ret = 0;
     struct adnc_strm_device *adnc_strm_dev = (struct adnc_strm_device *) handle;
+    int c;
 
     if (adnc_strm_dev == NULL) {
         ALOGE("Invalid handle");
-        ret = -1;
-        goto exit;
+        return -1;
     }
 
-    pthread_mutex_lock(&adnc_strm_dev->lock);
-
-    if (adnc_strm_dev->pcm_buf) {
-        free(adnc_strm_dev->pcm_buf);
+    if (adnc_strm_dev->channels > 1) {
+        // Each of the tunnels can linger on its own
+        for (c = 0; c < adnc_strm_dev->channels; c++)
+            adnc_strm_close((long)adnc_strm_dev->chans[c]);
+        free(adnc_strm_dev);
+        return 0;
     }
 
-    if (adnc_strm_dev->unparsed_buf) {
-        free(adnc_strm_dev->unparsed_buf);
-    }
+    pthread_once(&pool_once, init_pool);
+    if (linger_strm_device(adnc_strm_dev))
+        return 0;
 
-    ret = ia_disable_tunneling_source(adnc_strm_dev->tun_hdl,
-                                    adnc_strm_dev->end_point,
-                                    adnc_strm_dev->mode,
-                                    adnc_strm_dev->encode);
-    if (ret != 0) {
-        ALOGE("Failed to disable the tunneling source");
+    return destroy_strm_device(adnc_strm_dev);
+}
+
+/*
+ * Optional, opens one tunnel per endpoint and reads them as a single capture
+ * of channels interleaved Q15 channels, in the order of end_points. The
+ * channels are aligned by seqNo on the first read and frames lost by one of
+ * them are replaced with silence. Returns 0 on failure like adnc_strm_open.
+ */
+__attribute__ ((visibility ("default")))
+long adnc_strm_open_multi(bool enable_stripping,
+                        unsigned int kw_start_frame,
+                        const int *end_points,
+                        int channels)
+{
+    struct adnc_strm_device *group, *chan;
+    int c;
+
+    if (channels < 1 || channels > MAX_CHANNELS) {
+        ALOGE("%s: Unsupported channel count %d", __func__, channels);
+        return 0;
     }
+    if (channels == 1)
+        return adnc_strm_open(enable_stripping, kw_start_frame, end_points[0]);
 
-    ret = ia_stop_tunneling(adnc_strm_dev->tun_hdl);
-    if (ret != 0) {
-        ALOGE("Failed to stop tunneling");
+    group = (struct adnc_strm_device *)
+                calloc(1, sizeof(struct adnc_strm_device));
+    if (group == NULL) {
+        ALOGE("Failed to allocate memory for adnc_strm_dev");
+        return 0;
     }
+    pthread_mutex_init(&group->lock, (const pthread_mutexattr_t *) NULL);
+
+    for (c = 0; c < channels; c++) {
+        chan = (struct adnc_strm_device *)adnc_strm_open(enable_stripping,
+                                                    kw_start_frame,
+                                                    end_points[c]);
+        if (chan == NULL) {
+            ALOGE("%s: Failed to open channel %d, endpoint %x", __func__, c,
+                end_points[c]);
+            goto exit_on_error;
+        }
+        pthread_mutex_lock(&chan->lock);
+        chan->fill_gaps = true;
+        pthread_mutex_unlock(&chan->lock);
+        group->chans[c] = chan;
+    }
+    group->end_point = end_points[0];
+    group->channels = channels;
 
-    pthread_mutex_unlock(&adnc_strm_dev->lock);
+    return (long)group;
 
-    if (adnc_strm_dev) {
-        free(adnc_strm_dev);
-    }
+exit_on_error:
+    while (c-- > 0)
+        adnc_strm_close((long)group->chans[c]);
+    free(group);
 
-exit:
-    return ret;
+    return 0;
 }
 
+/*
+ * Optional, tears the lingering tunnels down now. Must be called before the
+ * library is unloaded, and once the firmware has crashed as their sources
+ * are gone.
+ */
+__attribute__ ((visibility ("default")))
+void adnc_strm_release_lingering(void)
+{
+    struct adnc_strm_device *devs[MAX_LINGERING];
+    int i;
+
+    pthread_mutex_lock(&pool.lock);
+    for (i = 0; i < MAX_LINGERING; i++) {
+        devs[i] = pool.devs[i];
+        pool.devs[i] = NULL;
+    }
+    if (pool.has_reaper) {
+        // With nothing left to wait for it exits, a tunnel closed meanwhile
+        // keeps it until its deadline
+        pthread_cond_signal(&pool.cond);
+        while (pool.is_reaper_running)
+            pthread_cond_wait(&pool.reaper_done, &pool.lock);
+        pthread_join(pool.reaper, NULL);
+        pool.has_reaper = false;
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    for (i = 0; i < MAX_LINGERING; i++) {
+        if (devs[i] != NULL)
+            destroy_strm_device(devs[i]);
+    }
+}
@@ -26,6 +26,15 @@ extern "C" {
 
 #define DUMP_UNPARSED_OUTPUT
 
+/*
+ * Samples handed out by adnc_strm_read(), picked with adnc_strm_open_format().
+ * adnc_strm_open() streams Q15.
+ */
+enum adnc_strm_format {
+    ADNC_STRM_FORMAT_Q15,       // int16_t
+    ADNC_STRM_FORMAT_FLOAT,     // IEEE float in [-1.0, 1.0)
+};
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2018 Knowles Electronics
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+
+#include "adnc_strm_convert.h"
+
+static void kst_split_aft(uint32_t *pAfloat, int32_t *exp,
+                        int64_t *mant, int32_t *sign)
+{
+    uint32_t uAft = *pAfloat;
+
+    *exp = (uAft >> 25) & 0x3F;
+    *mant = uAft & 0x1FFFFFF;
+    *sign = uAft >> 31;
+    if (*exp || *mant) {
+        *mant |= 1 << 25;
+    }
+}
+
+static void kst_aft_to_dbl(void *pDouble, void *pAfloat)
+{
+    uint64_t uDbl;
+    int32_t exp;
+    int32_t sign;
+    int64_t mant;
+
+    kst_split_aft((uint32_t *)pAfloat, &exp, &mant, &sign);
+    if (exp || mant) {
+        uDbl = ((uint64_t)sign << 63) |
+               ((uint64_t)(exp + (1023 - (1 << 5))) << 52) |
+               ((uint64_t)(mant & ((1 << 25) - 1)) << (52 - 25));
+    } else {
+        uDbl = (uint64_t)sign << 63;
+    }
+    *((uint64_t *)pDouble) = uDbl;
+}
+
+void kst_float_to_q15_vector(void *pDst, void *pSrc, uint32_t elCnt)
+{
+    uint32_t *pSrcT;
+    int16_t *pDstT;
+    uint32_t idx;
+    double smp;
+
+    pSrcT = (uint32_t *)pSrc;
+    pDstT = (int16_t *)pDst;
+    for (idx = 0; idx < elCnt; idx++) {
+        kst_aft_to_dbl(&smp, &(pSrcT[idx]));
+        smp = smp * 32768.0;
+        pDstT[idx] = ((smp < 32767.0) ?
+                     ((smp > -32768.0) ?
+                     ((int16_t)smp) : -32768) : 32767);
+    }
+}
+
+/*
+ * afloat has a sign bit, a 6 bit exponent biased by 32 and a 25 bit mantissa,
+ * so it maps on an IEEE float by rebiasing the exponent and rounding the
+ * mantissa, a carry into the exponent being what IEEE rounding does as well.
+ * Integer only and branchless, so that the compiler vectorizes it.
+ */
+void kst_float_to_f32_vector(uint32_t *pDst, const uint32_t *pSrc,
+                            uint32_t elCnt)
+{
+    uint32_t idx, uAft, exp, mant, sign, uFlt;
+
+    for (idx = 0; idx < elCnt; idx++) {
+        uAft = pSrc[idx];
+        exp = (uAft >> 25) & 0x3F;
+        mant = uAft & 0x1FFFFFF;
+        sign = uAft & 0x80000000;
+        uFlt = ((exp + 127 - 32) << 23) + ((mant + 2) >> 2);
+        pDst[idx] = sign | ((exp | mant) ? uFlt : 0);
+    }
+}
+
+void kst_q15_to_f32_vector(float *pDst, const int16_t *pSrc, uint32_t elCnt)
+{
+    uint32_t idx;
+
+    for (idx = 0; idx < elCnt; idx++)
+        pDst[idx] = pSrc[idx] * (1.0f / 32768.0f);
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2018 Knowles Electronics
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _ADNC_STRM_CONVERT_H_
+#define _ADNC_STRM_CONVERT_H_
+
+#include <stdint.h>
+
+#if __cplusplus
+extern "C"
+{
+#endif
+
+/*
+ * The sample conversions of the tunnel data, afloat being the encoding of
+ * the chip. Built into the streaming library and into the fake one the HAL
+ * stress test streams from, which checks them against each other.
+ */
+void kst_float_to_q15_vector(void *pDst, void *pSrc, uint32_t elCnt);
+void kst_float_to_f32_vector(uint32_t *pDst, const uint32_t *pSrc,
+                            uint32_t elCnt);
+void kst_q15_to_f32_vector(float *pDst, const int16_t *pSrc, uint32_t elCnt);
+
+#if __cplusplus
+} // extern "C"
+#endif
+
+#endif
@@ -18,9 +18,18 @@
 #define _CVQ_IOCTL_H
 
 #include "iaxxx_odsp_hw.h"
-#include <audio_route/audio_route.h>
+#include "mixer_route.h"
 #include <tinyalsa/asoundlib.h>
 
+// Can be overridden so test builds don't touch the HAL's own state
+#ifndef STHAL_DATA_DIR
+#define STHAL_DATA_DIR  "/data/vendor/sthal"
+#endif
+// Compiled mixer paths, see mixer_route_init()
+#define ROUTE_TABLE_FILE STHAL_DATA_DIR "/sound_trigger_route_table"
+// Chip state snapshot for warm attach, see warm_attach_fw()
+#define WARM_STATE_FILE STHAL_DATA_DIR "/warm_state"
+
 #define HOTWORD_MASK 0x1
 #define AMBIENT_MASK 0x2
 #define ENTITY_MASK  0x4
@@ -182,7 +191,8 @@ enum sthal_mode {
 
 typedef enum {
     TRANSIT_NONE,
-    TRANSIT_SETUP_AEC
+    TRANSIT_SETUP_AEC,
+    TRANSIT_TEARDOWN_AEC
 } transit_case_t;
 
 #define PLUGIN_DEF_CONFIG_ID    0
@@ -193,6 +203,7 @@ int get_model_state(struct iaxxx_odsp_hw *odsp_hdl, const uint32_t inst_id,
                     const uint32_t param_val);
 int get_event(struct iaxxx_odsp_hw *odsp_hdl,
             struct iaxxx_get_event_info *ge);
+int get_latest_ep_ts(struct iaxxx_odsp_hw *odsp_hdl, uint64_t *ts);
 int setup_chip(struct iaxxx_odsp_hw *odsp_hdl);
 int setup_buffer_package(struct iaxxx_odsp_hw *odsp_hdl);
 int destroy_buffer_package(struct iaxxx_odsp_hw *odsp_hdl);
@@ -217,28 +228,28 @@ int setup_howord_buffer(struct iaxxx_odsp_hw *odsp_hdl);
 int destroy_howord_buffer(struct iaxxx_odsp_hw *odsp_hdl);
 int setup_src_plugin(struct iaxxx_odsp_hw *odsp_hdl, enum src_type st);
 int destroy_src_plugin(struct iaxxx_odsp_hw *odsp_hdl, enum src_type st);
-int set_hotword_buffer_route(struct audio_route *route_hdl, bool bargein);
-int tear_hotword_buffer_route(struct audio_route *route_hdl, bool bargein);
-int enable_mic_route(struct audio_route *route_hdl, bool enable,
+int set_hotword_buffer_route(struct mixer_route *route_hdl, bool bargein);
+int tear_hotword_buffer_route(struct mixer_route *route_hdl, bool bargein);
+int enable_mic_route(struct mixer_route *route_hdl, bool enable,
                     enum clock_type ct);
-int enable_amp_ref_route(struct audio_route *route_hdl, bool enable,
+int enable_amp_ref_route(struct mixer_route *route_hdl, bool enable,
                          enum strm_type strmt);
-int enable_src_route(struct audio_route *route_hdl, bool enable, enum src_type st);
-int set_sensor_route(struct audio_route *route_hdl, bool enable);
+int enable_src_route(struct mixer_route *route_hdl, bool enable, enum src_type st);
+int set_sensor_route(struct mixer_route *route_hdl, bool enable);
 int set_ambient_state(struct iaxxx_odsp_hw *odsp_hdl, unsigned int current);
 int tear_ambient_state(struct iaxxx_odsp_hw *odsp_hdl, unsigned int current);
-int set_ambient_route(struct audio_route *route_hdl, bool bargein);
-int tear_ambient_route(struct audio_route *route_hdl, bool bargein);
+int set_ambient_route(struct mixer_route *route_hdl, bool bargein);
+int tear_ambient_route(struct mixer_route *route_hdl, bool bargein);
 int set_hotword_state(struct iaxxx_odsp_hw *odsp_hdl, unsigned int current);
 int tear_hotword_state(struct iaxxx_odsp_hw *odsp_hdl, unsigned int current);
-int set_hotword_route(struct audio_route *route_hdl, bool bargein);
-int tear_hotword_route(struct audio_route *route_hdl, bool bargein);
-int set_chre_audio_route(struct audio_route *route_hdl, bool bargein);
-int tear_chre_audio_route(struct audio_route *route_hdl, bool bargein);
+int set_hotword_route(struct mixer_route *route_hdl, bool bargein);
+int tear_hotword_route(struct mixer_route *route_hdl, bool bargein);
+int set_chre_audio_route(struct mixer_route *route_hdl, bool bargein);
+int tear_chre_audio_route(struct mixer_route *route_hdl, bool bargein);
 int reset_ambient_plugin(struct iaxxx_odsp_hw *odsp_hdl);
-int enable_bargein_route(struct audio_route *route_hdl, bool enable);
-int set_music_buffer_route(struct audio_route *route_hdl, bool downlink);
-int tear_music_buffer_route(struct audio_route *route_hdl, bool downlink);
+int enable_bargein_route(struct mixer_route *route_hdl, bool enable);
+int set_music_buffer_route(struct mixer_route *route_hdl, bool downlink);
+int tear_music_buffer_route(struct mixer_route *route_hdl, bool downlink);
 
 int flush_model(struct iaxxx_odsp_hw *odsp_hdl, int kw_type);
 int get_entity_param_blk(struct iaxxx_odsp_hw *odsp_hdl, void *payload, unsigned int payload_size);
@@ -246,7 +257,12 @@ int get_wakeup_param_blk(struct iaxxx_odsp_hw *odsp_hdl, void *payload, unsigned
 int set_default_apll_clk(struct mixer *mixer);
 int get_fw_status(struct iaxxx_odsp_hw *odsp_hdl, unsigned int *status);
 int reset_fw(struct iaxxx_odsp_hw *odsp_hdl);
-int reset_all_route(struct audio_route *route_hdl);
+int reset_all_route(struct mixer_route *route_hdl);
+int warm_attach_fw(struct iaxxx_odsp_hw *odsp_hdl);
+void reset_chip_snapshot(struct iaxxx_odsp_hw *odsp_hdl);
+void invalidate_chip_snapshot(void);
+void begin_route_update(struct mixer_route *route_hdl);
+int commit_route_update(struct mixer_route *route_hdl);
 int trigger_sensor_destroy_event(struct iaxxx_odsp_hw *odsp_hdl);
 int trigger_chre_destroy_event(struct iaxxx_odsp_hw *odsp_hdl);
 int setup_slpi_wakeup_event(struct iaxxx_odsp_hw *odsp_hdl, bool enabled);
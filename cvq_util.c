@@ -27,8 +27,12 @@
 #include <log/log.h>
 
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
 #include <linux/errno.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 
 #include "cvq_ioctl.h"
 
@@ -58,6 +62,464 @@ static const char * const route_table[ST_ROUTE_MAX] = {
     [ST_SENSOR_ROUTE] = "oslo-route",
 };
 
+/*
+ * What the HAL has set up on the chip, kept in WARM_STATE_FILE so it
+ * outlives the HAL process. The boot id goes with it, a snapshot of an
+ * earlier boot is ignored. A restarted HAL that finds the firmware still
+ * running compares it with the chip in warm_attach_fw().
+ * Resources are marked before they are set up and cleared once destroyed,
+ * so a half done setup shows up as a mismatch rather than being missed.
+ * Teardown runs in enum order, plugins before the packages they come from.
+ */
+enum chip_resource {
+    CHIP_RES_HOTWORD_BUF,
+    CHIP_RES_MUSIC_BUF,
+    CHIP_RES_SRC_MIC,
+    CHIP_RES_SRC_AMP,
+    CHIP_RES_AEC,
+    CHIP_RES_HOTWORD,
+    CHIP_RES_AMBIENT,
+    CHIP_RES_MIXER,
+    CHIP_RES_CHRE,
+    CHIP_RES_SENSOR,
+    CHIP_RES_SRC_PKG,
+    CHIP_RES_BUF_PKG,
+    CHIP_RES_MAX,
+};
+
+#define WARM_STATE_VERSION      (2)
+#define WARM_STATE_INVALID      "invalid"
+#define WARM_STATE_SIZE         (96)
+#define BOOT_ID_FILE            "/proc/sys/kernel/random/boot_id"
+#define BOOT_ID_SIZE            (40)
+#define MAX_WARM_SUBSCRIPTIONS  (32)
+// iaxxx_odsp_plugin_get_ep_timestamps() fills one per output endpoint
+#define MAX_EP_TIMESTAMPS       (16)
+
+static int destroy_src_mic_plugin(struct iaxxx_odsp_hw *odsp_hdl);
+static int destroy_src_amp_plugin(struct iaxxx_odsp_hw *odsp_hdl);
+
+static const struct {
+    const char *name;
+    // Plugin instance to check on the chip, -1 for a package only
+    int inst_id;
+    // NULL if it can't be torn down without a firmware reset
+    int (*teardown)(struct iaxxx_odsp_hw *odsp_hdl);
+} chip_resources_desc[CHIP_RES_MAX] = {
+    [CHIP_RES_HOTWORD_BUF] = { "hotword_buf", BUF_INSTANCE_ID,
+                            destroy_howord_buffer },
+    [CHIP_RES_MUSIC_BUF] = { "music_buf", DA_BUF_INSTANCE_ID,
+                            destroy_music_buffer },
+    [CHIP_RES_SRC_MIC] = { "src_mic", SRC_MIC_INSTANCE_ID,
+                            destroy_src_mic_plugin },
+    [CHIP_RES_SRC_AMP] = { "src_amp", SRC_AMP_INSTANCE_ID,
+                            destroy_src_amp_plugin },
+    [CHIP_RES_AEC] = { "aec", AEC_INSTANCE_ID, destroy_aec_package },
+    [CHIP_RES_HOTWORD] = { "hotword", HOTWORD_INSTANCE_ID,
+                            destroy_hotword_package },
+    [CHIP_RES_AMBIENT] = { "ambient", AMBIENT_INSTANCE_ID,
+                            destroy_ambient_package },
+    [CHIP_RES_MIXER] = { "mixer", MIXER_INSTANCE_ID, destroy_mixer_package },
+    // CHRE and the sensor are torn down through the SLPI, asynchronously
+    [CHIP_RES_CHRE] = { "chre", CHRE_INSTANCE_ID, NULL },
+    [CHIP_RES_SENSOR] = { "sensor", SENSOR_INSTANCE_ID, NULL },
+    [CHIP_RES_SRC_PKG] = { "src_pkg", -1, destroy_src_package },
+    [CHIP_RES_BUF_PKG] = { "buf_pkg", -1, destroy_buffer_package },
+};
+
+// The snapshot is updated from both lock domains of the HAL
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t chip_resources;
+static uint32_t active_routes;
+static uint32_t snapshot_fw_ver;
+static bool is_snapshot_valid;
+static int snapshot_fd = -1;
+
+// Empty if it can't be read, the chip checks still apply then
+static const char *get_boot_id(void)
+{
+    static char boot_id[BOOT_ID_SIZE];
+    static bool is_read;
+    FILE *fp;
+
+    if (is_read)
+        return boot_id;
+    is_read = true;
+
+    fp = fopen(BOOT_ID_FILE, "re");
+    if (fp == NULL)
+        return boot_id;
+    if (fgets(boot_id, sizeof(boot_id), fp) != NULL)
+        boot_id[strcspn(boot_id, "\n")] = '\0';
+    fclose(fp);
+
+    return boot_id;
+}
+
+/*
+ * Rewrites the record in place, a change is one pwrite() to a file that is
+ * kept open. Only the process has to be outlived, so there's no fsync().
+ * Called with snapshot_lock held.
+ */
+static void save_chip_snapshot(void)
+{
+    static char last[WARM_STATE_SIZE];
+    char value[WARM_STATE_SIZE];
+
+    if (is_snapshot_valid)
+        snprintf(value, sizeof(value), "%d %08x %08x %08x %s",
+                WARM_STATE_VERSION, snapshot_fw_ver, chip_resources,
+                active_routes, get_boot_id());
+    else
+        strlcpy(value, WARM_STATE_INVALID, sizeof(value));
+
+    if (!strcmp(value, last))
+        return;
+
+    if (snapshot_fd < 0) {
+        if (mkdir(STHAL_DATA_DIR, 0770) != 0 && errno != EEXIST)
+            goto error;
+        snapshot_fd = open(WARM_STATE_FILE, O_RDWR | O_CREAT | O_CLOEXEC,
+                        0600);
+        if (snapshot_fd < 0)
+            goto error;
+    }
+
+    // The terminator goes out too, what is left behind it is ignored
+    if (pwrite(snapshot_fd, value, strlen(value) + 1, 0) !=
+        (ssize_t)strlen(value) + 1)
+        goto error;
+    strlcpy(last, value, sizeof(last));
+    return;
+
+error:
+    ALOGW("%s: Failed to save %s %d(%s)", __func__, value, errno,
+        strerror(errno));
+}
+
+static void mark_chip_resource(enum chip_resource res, bool is_set)
+{
+    pthread_mutex_lock(&snapshot_lock);
+    if (is_set)
+        chip_resources |= 1u << res;
+    else
+        chip_resources &= ~(1u << res);
+    save_chip_snapshot();
+    pthread_mutex_unlock(&snapshot_lock);
+}
+
+static void mark_route(int route, bool is_set)
+{
+    pthread_mutex_lock(&snapshot_lock);
+    if (is_set)
+        active_routes |= 1u << route;
+    else
+        active_routes &= ~(1u << route);
+    save_chip_snapshot();
+    pthread_mutex_unlock(&snapshot_lock);
+}
+
+static void load_chip_snapshot(char *value, size_t len)
+{
+    ssize_t n = -1;
+    int fd;
+
+    fd = open(WARM_STATE_FILE, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        n = pread(fd, value, len - 1, 0);
+        close(fd);
+    }
+    value[n > 0 ? n : 0] = '\0';
+}
+
+static int get_fw_app_version(struct iaxxx_odsp_hw *odsp_hdl, uint32_t *ver,
+                            char *ver_str, uint32_t len)
+{
+    char rom_str[NAME_MAX_SIZE];
+    uint32_t rom_ver;
+    int err;
+
+    err = iaxxx_odsp_get_sys_versions(odsp_hdl, &rom_ver, rom_str,
+                                    sizeof(rom_str), ver, ver_str, len);
+    if (err != 0)
+        ALOGE("%s: ERROR: Failed to get the firmware version %d(%s)",
+            __func__, errno, strerror(errno));
+
+    return err;
+}
+
+/*
+ * Called whenever a fresh firmware is running, nothing of the HAL's is set
+ * up on it yet.
+ */
+void reset_chip_snapshot(struct iaxxx_odsp_hw *odsp_hdl)
+{
+    char ver_str[NAME_MAX_SIZE];
+    uint32_t fw_ver;
+    bool is_valid;
+
+    is_valid = get_fw_app_version(odsp_hdl, &fw_ver, ver_str,
+                                sizeof(ver_str)) == 0;
+
+    pthread_mutex_lock(&snapshot_lock);
+    chip_resources = 0;
+    active_routes = 0;
+    snapshot_fw_ver = fw_ver;
+    is_snapshot_valid = is_valid;
+    save_chip_snapshot();
+    pthread_mutex_unlock(&snapshot_lock);
+}
+
+// The firmware state is unknown until it has been redownloaded
+void invalidate_chip_snapshot(void)
+{
+    pthread_mutex_lock(&snapshot_lock);
+    is_snapshot_valid = false;
+    save_chip_snapshot();
+    pthread_mutex_unlock(&snapshot_lock);
+}
+
+static bool is_plugin_created(struct iaxxx_odsp_hw *odsp_hdl, int inst_id)
+{
+    struct iaxxx_plugin_status_data status;
+
+    if (iaxxx_odsp_plugin_get_status_info(odsp_hdl, inst_id, &status) != 0)
+        return false;
+
+    return status.create_status != 0;
+}
+
+static void log_plugin_versions(struct iaxxx_odsp_hw *odsp_hdl, int inst_id,
+                                const char *name)
+{
+    char pkg_ver[NAME_MAX_SIZE] = "?", plg_ver[NAME_MAX_SIZE] = "?";
+
+    iaxxx_odsp_plugin_get_package_version(odsp_hdl, inst_id, pkg_ver,
+                                        sizeof(pkg_ver));
+    iaxxx_odsp_plugin_get_plugin_version(odsp_hdl, inst_id, plg_ver,
+                                        sizeof(plg_ver));
+    ALOGD("%s: %s (instance %d) package %s plugin %s", __func__, name,
+        inst_id, pkg_ver, plg_ver);
+}
+
+/*
+ * Compares the running firmware with the snapshot left by the previous HAL
+ * instance: firmware version, which plugins are created and which events
+ * are subscribed. Called with no model loaded in this instance.
+ */
+static int check_chip_snapshot(struct iaxxx_odsp_hw *odsp_hdl,
+                            uint32_t fw_ver, uint32_t resources)
+{
+    char ver_str[NAME_MAX_SIZE];
+    uint16_t src_id, evt_id, dst_id;
+    uint32_t app_ver, dst_opaque, expected;
+    int i, j, inst_id;
+    bool is_created;
+
+    if (get_fw_app_version(odsp_hdl, &app_ver, ver_str, sizeof(ver_str)))
+        return -EIO;
+    if (app_ver != fw_ver) {
+        ALOGI("%s: firmware changed from %08x to %08x (%s)", __func__,
+            fw_ver, app_ver, ver_str);
+        return -ESTALE;
+    }
+
+    for (i = 0; i < CHIP_RES_MAX; i++) {
+        inst_id = chip_resources_desc[i].inst_id;
+        if (inst_id < 0)
+            continue;
+
+        // Some instances are shared by resources that never coexist
+        expected = 0;
+        for (j = 0; j < CHIP_RES_MAX; j++) {
+            if (chip_resources_desc[j].inst_id == inst_id)
+                expected |= resources & (1u << j);
+        }
+
+        is_created = is_plugin_created(odsp_hdl, inst_id);
+        if (is_created != (expected != 0)) {
+            ALOGI("%s: %s is %screated on the chip", __func__,
+                chip_resources_desc[i].name, is_created ? "" : "not ");
+            return -ESTALE;
+        }
+        if (is_created && (resources & (1u << i)))
+            log_plugin_versions(odsp_hdl, inst_id,
+                                chip_resources_desc[i].name);
+    }
+
+    // Keyword events are only subscribed while a model is active
+    if (iaxxx_odsp_evt_reset_read_index(odsp_hdl) != 0)
+        return -EIO;
+    for (i = 0; i < MAX_WARM_SUBSCRIPTIONS; i++) {
+        if (iaxxx_odsp_evt_read_subscription(odsp_hdl, &src_id, &evt_id,
+                                            &dst_id, &dst_opaque) != 0)
+            break;
+        if (src_id == HOTWORD_EVT_SRC_ID || src_id == AMBIENT_EVT_SRC_ID) {
+            ALOGI("%s: event %u of %04x is still subscribed", __func__,
+                evt_id, src_id);
+            return -ESTALE;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Reuses the firmware the previous HAL instance left running instead of
+ * having it redownloaded. Only done when the chip matches the snapshot and
+ * everything on it can be torn down here. That rules out an instance that
+ * went away with a route up, which is the case whenever a model was
+ * listening: the route table would take the route's values for the
+ * reset state, so the firmware is reset then. On success the chip is left as
+ * after a fresh download, otherwise the caller should reset the firmware.
+ */
+int warm_attach_fw(struct iaxxx_odsp_hw *odsp_hdl)
+{
+    char value[WARM_STATE_SIZE];
+    char boot_id[BOOT_ID_SIZE] = "";
+    unsigned int version, fw_ver, resources, routes;
+    int i, err, num_torn = 0;
+
+    ALOGD("+%s+", __func__);
+
+    load_chip_snapshot(value, sizeof(value));
+    if (sscanf(value, "%u %x %x %x %39s", &version, &fw_ver, &resources,
+               &routes, boot_id) < 4 || version != WARM_STATE_VERSION) {
+        ALOGI("%s: No usable snapshot (%s)", __func__, value);
+        err = -ENOENT;
+        goto exit;
+    }
+
+    if (strcmp(boot_id, get_boot_id()) != 0) {
+        ALOGI("%s: Snapshot is from boot %s", __func__, boot_id);
+        err = -ESTALE;
+        goto exit;
+    }
+
+    if (routes != 0) {
+        ALOGI("%s: Routes %08x were left active", __func__, routes);
+        err = -EBUSY;
+        goto exit;
+    }
+
+    for (i = 0; i < CHIP_RES_MAX; i++) {
+        if ((resources & (1u << i)) &&
+            chip_resources_desc[i].teardown == NULL) {
+            ALOGI("%s: %s was left set up", __func__,
+                chip_resources_desc[i].name);
+            err = -EBUSY;
+            goto exit;
+        }
+    }
+
+    err = check_chip_snapshot(odsp_hdl, fw_ver, resources);
+    if (err != 0)
+        goto exit;
+
+    pthread_mutex_lock(&snapshot_lock);
+    chip_resources = resources;
+    active_routes = 0;
+    snapshot_fw_ver = fw_ver;
+    is_snapshot_valid = true;
+    pthread_mutex_unlock(&snapshot_lock);
+    for (i = 0; i < CHIP_RES_MAX; i++) {
+        if (!(resources & (1u << i)))
+            continue;
+        err = chip_resources_desc[i].teardown(odsp_hdl);
+        if (err != 0) {
+            ALOGE("%s: Failed to tear down %s", __func__,
+                chip_resources_desc[i].name);
+            goto exit;
+        }
+        num_torn++;
+    }
+
+    // Subscribed again once the HAL is ready
+    setup_slpi_wakeup_event(odsp_hdl, false);
+
+    ALOGI("%s: attached to firmware %08x, tore down %d resources", __func__,
+        fw_ver, num_torn);
+
+exit:
+    ALOGD("-%s- %d", __func__, err);
+    return err;
+}
+
+/*
+ * Route update batching. Between begin_route_update() and the outermost
+ * commit_route_update() the paths are only staged in the route table, the
+ * mixer is then updated once and only the controls whose value differs from
+ * the last one written get written. Staging counts the paths sharing a
+ * control the same way an unbatched update does, so both can be mixed. All
+ * the callers hold stdev->lock.
+ */
+static unsigned int route_update_depth;
+static unsigned int route_update_staged;
+
+static int apply_route(struct mixer_route *route_hdl, int route)
+{
+    mark_route(route, true);
+
+    if (route_update_depth > 0) {
+        route_update_staged++;
+        return mixer_route_apply_path(route_hdl, route_table[route]);
+    }
+
+    return mixer_route_apply_and_update_path(route_hdl, route_table[route]);
+}
+
+static int reset_route(struct mixer_route *route_hdl, int route)
+{
+    int err;
+
+    if (route_update_depth > 0) {
+        route_update_staged++;
+        err = mixer_route_reset_path(route_hdl, route_table[route]);
+    } else {
+        err = mixer_route_reset_and_update_path(route_hdl,
+                                                route_table[route]);
+    }
+    if (err == 0)
+        mark_route(route, false);
+
+    return err;
+}
+
+/*
+ * A batched path reset is written in mixer control order rather than in
+ * reverse path order, so only batch sequences that don't depend on the
+ * order their controls are written in.
+ */
+void begin_route_update(struct mixer_route *route_hdl __unused)
+{
+    if (route_update_depth++ == 0)
+        route_update_staged = 0;
+}
+
+int commit_route_update(struct mixer_route *route_hdl)
+{
+    int err = 0;
+
+    if (route_update_depth == 0) {
+        ALOGE("%s: No route update in progress", __func__);
+        return -EINVAL;
+    }
+
+    if (--route_update_depth > 0)
+        return 0;
+
+    if (route_update_staged > 0) {
+        err = mixer_route_update_mixer(route_hdl);
+        if (err)
+            ALOGE("%s: mixer update fail %d", __func__, err);
+        ALOGV("%s: %u paths committed at once", __func__,
+            route_update_staged);
+    }
+    route_update_staged = 0;
+
+    return err;
+}
+
 int write_model(struct iaxxx_odsp_hw *odsp_hdl, unsigned char *data,
                 int length, int kw_type)
  {
@@ -133,14 +595,45 @@ int get_event(struct iaxxx_odsp_hw *odsp_hdl, struct iaxxx_get_event_info *ge)
     ALOGV("+%s+", __func__);
     err = iaxxx_odsp_evt_getevent(odsp_hdl, ge);
     if (err != 0) {
-        ALOGE("%s: ERROR Failed to get event with error %d(%s)",
-            __func__, errno, strerror(errno));
+        int saved_errno = errno;
+
+        if (!iaxxx_odsp_evt_is_queue_empty(saved_errno)) {
+            ALOGE("%s: ERROR Failed to get event with error %d(%s)",
+                __func__, saved_errno, strerror(saved_errno));
+        }
+        errno = saved_errno;
     }
 
     ALOGV("-%s-", __func__);
     return err;
 }
 
+/*
+ * Chip time of the latest frame produced on any output endpoint of the HMD
+ * processor, which is where the keyword plugins run, as of this call.
+ */
+int get_latest_ep_ts(struct iaxxx_odsp_hw *odsp_hdl, uint64_t *ts)
+{
+    uint64_t timestamps[MAX_EP_TIMESTAMPS];
+    int err, i;
+
+    err = iaxxx_odsp_plugin_get_ep_timestamps(odsp_hdl, timestamps,
+                                            IAXXX_HMD_BLOCK_ID);
+    if (err != 0) {
+        ALOGE("%s: ERROR: Failed to get the endpoint timestamps %d(%s)",
+            __func__, errno, strerror(errno));
+        return err;
+    }
+
+    *ts = 0;
+    for (i = 0; i < MAX_EP_TIMESTAMPS; i++) {
+        if (timestamps[i] > *ts)
+            *ts = timestamps[i];
+    }
+
+    return 0;
+}
+
 int reset_ambient_plugin(struct iaxxx_odsp_hw *odsp_hdl)
 {
     int err = 0;
@@ -160,15 +653,15 @@ int reset_ambient_plugin(struct iaxxx_odsp_hw *odsp_hdl)
     return err;
 }
 
-int set_sensor_route(struct audio_route *route_hdl, bool enable)
+int set_sensor_route(struct mixer_route *route_hdl, bool enable)
 {
     int err = 0;
 
     ALOGV("+%s+", __func__);
     if (enable)
-        err = audio_route_apply_and_update_path(route_hdl, route_table[ST_SENSOR_ROUTE]);
+        err = apply_route(route_hdl, ST_SENSOR_ROUTE);
     else
-        err = audio_route_reset_and_update_path(route_hdl, route_table[ST_SENSOR_ROUTE]);
+        err = reset_route(route_hdl, ST_SENSOR_ROUTE);
     if (err)
         ALOGE("%s: route fail %d", __func__, err);
 
@@ -267,18 +760,16 @@ exit:
     return err;
 }
 
-int set_ambient_route(struct audio_route *route_hdl, bool bargein)
+int set_ambient_route(struct mixer_route *route_hdl, bool bargein)
 {
     int err = 0;
 
     ALOGV("+%s bargein %d+", __func__, bargein);
 
     if (bargein == true)
-        err = audio_route_apply_and_update_path(route_hdl,
-                                        route_table[ST_AMBIENT_WITH_BARGEIN]);
+        err = apply_route(route_hdl, ST_AMBIENT_WITH_BARGEIN);
     else
-        err = audio_route_apply_and_update_path(route_hdl,
-                                        route_table[ST_AMBIENT_WITHOUT_BARGEIN]);
+        err = apply_route(route_hdl, ST_AMBIENT_WITHOUT_BARGEIN);
     if (err)
         ALOGE("%s: route apply fail %d", __func__, err);
 
@@ -286,18 +777,16 @@ int set_ambient_route(struct audio_route *route_hdl, bool bargein)
     return err;
 }
 
-int tear_ambient_route(struct audio_route *route_hdl, bool bargein)
+int tear_ambient_route(struct mixer_route *route_hdl, bool bargein)
 {
     int err = 0;
 
     ALOGV("+%s bargein %d+", __func__, bargein);
     /* check cvq node to send ioctl */
     if (bargein == true)
-        err = audio_route_reset_and_update_path(route_hdl,
-                                        route_table[ST_AMBIENT_WITH_BARGEIN]);
+        err = reset_route(route_hdl, ST_AMBIENT_WITH_BARGEIN);
     else
-        err = audio_route_reset_and_update_path(route_hdl,
-                                        route_table[ST_AMBIENT_WITHOUT_BARGEIN]);
+        err = reset_route(route_hdl, ST_AMBIENT_WITHOUT_BARGEIN);
     if (err)
         ALOGE("%s: route reset fail %d", __func__, err);
 
@@ -400,18 +889,16 @@ exit:
     return err;
 }
 
-int set_hotword_route(struct audio_route *route_hdl, bool bargein)
+int set_hotword_route(struct mixer_route *route_hdl, bool bargein)
 {
     int err = 0;
 
     ALOGV("+%s bargein %d+", __func__, bargein);
 
     if (bargein == true)
-        err = audio_route_apply_and_update_path(route_hdl,
-                                            route_table[ST_HOTWORD_WITH_BARGEIN]);
+        err = apply_route(route_hdl, ST_HOTWORD_WITH_BARGEIN);
     else
-        err = audio_route_apply_and_update_path(route_hdl,
-                                            route_table[ST_HOTWORD_WITHOUT_BARGEIN]);
+        err = apply_route(route_hdl, ST_HOTWORD_WITHOUT_BARGEIN);
     if (err)
         ALOGE("%s: route apply fail %d", __func__, err);
 
@@ -419,18 +906,16 @@ int set_hotword_route(struct audio_route *route_hdl, bool bargein)
     return err;
 }
 
-int tear_hotword_route(struct audio_route *route_hdl, bool bargein)
+int tear_hotword_route(struct mixer_route *route_hdl, bool bargein)
 {
     int err = 0;
 
     ALOGV("+%s bargein %d+", __func__, bargein);
     /* check cvq node to send ioctl */
     if (bargein == true)
-        err = audio_route_reset_and_update_path(route_hdl,
-                                            route_table[ST_HOTWORD_WITH_BARGEIN]);
+        err = reset_route(route_hdl, ST_HOTWORD_WITH_BARGEIN);
     else
-        err = audio_route_reset_and_update_path(route_hdl,
-                                            route_table[ST_HOTWORD_WITHOUT_BARGEIN]);
+        err = reset_route(route_hdl, ST_HOTWORD_WITHOUT_BARGEIN);
     if (err)
         ALOGE("%s: route reset fail %d", __func__, err);
 
@@ -438,17 +923,15 @@ int tear_hotword_route(struct audio_route *route_hdl, bool bargein)
     return err;
 }
 
-int set_chre_audio_route(struct audio_route *route_hdl, bool bargein)
+int set_chre_audio_route(struct mixer_route *route_hdl, bool bargein)
 {
     int err = 0;
 
     ALOGV("+%s+", __func__);
     if (bargein)
-        err = audio_route_apply_and_update_path(route_hdl,
-                                        route_table[ST_CHRE_WITH_BARGEIN]);
+        err = apply_route(route_hdl, ST_CHRE_WITH_BARGEIN);
     else
-        err = audio_route_apply_and_update_path(route_hdl,
-                                        route_table[ST_CHRE_WITHOUT_BARGEIN]);
+        err = apply_route(route_hdl, ST_CHRE_WITHOUT_BARGEIN);
     if (err)
         ALOGE("%s: route apply fail %d", __func__, err);
 
@@ -456,17 +939,15 @@ int set_chre_audio_route(struct audio_route *route_hdl, bool bargein)
     return err;
 }
 
-int tear_chre_audio_route(struct audio_route *route_hdl, bool bargein)
+int tear_chre_audio_route(struct mixer_route *route_hdl, bool bargein)
 {
     int err = 0;
 
     ALOGV("+%s+", __func__);
     if (bargein == true)
-        err = audio_route_reset_and_update_path(route_hdl,
-                                        route_table[ST_CHRE_WITH_BARGEIN]);
+        err = reset_route(route_hdl, ST_CHRE_WITH_BARGEIN);
     else
-        err = audio_route_reset_and_update_path(route_hdl,
-                                        route_table[ST_CHRE_WITHOUT_BARGEIN]);
+        err = reset_route(route_hdl, ST_CHRE_WITHOUT_BARGEIN);
     if (err)
         ALOGE("%s: route reset fail %d", __func__, err);
 
@@ -696,6 +1177,7 @@ int setup_buffer_package(struct iaxxx_odsp_hw *odsp_hdl)
     int err = 0;
 
     ALOGD("+%s+", __func__);
+    mark_chip_resource(CHIP_RES_BUF_PKG, true);
 
     err = iaxxx_odsp_package_load(odsp_hdl, BUFFER_PACKAGE, BUF_PKG_ID);
     if (err != 0) {
@@ -723,6 +1205,7 @@ int destroy_buffer_package(struct iaxxx_odsp_hw *odsp_hdl)
         goto exit;
     }
 
+    mark_chip_resource(CHIP_RES_BUF_PKG, false);
     ALOGD("-%s-", __func__);
 
 exit:
@@ -734,6 +1217,7 @@ int setup_hotword_package(struct iaxxx_odsp_hw *odsp_hdl)
     int err = 0;
 
     ALOGD("+%s+", __func__);
+    mark_chip_resource(CHIP_RES_HOTWORD, true);
 
     // Download packages for ok google
     err = iaxxx_odsp_package_load(odsp_hdl, AMBIENT_EC_PACKAGE,
@@ -790,6 +1274,7 @@ int destroy_hotword_package(struct iaxxx_odsp_hw *odsp_hdl)
         goto exit;
     }
 
+    mark_chip_resource(CHIP_RES_HOTWORD, false);
     ALOGD("-%s-", __func__);
 
 exit:
@@ -801,6 +1286,7 @@ int setup_ambient_package(struct iaxxx_odsp_hw *odsp_hdl)
     int err = 0;
 
     ALOGD("+%s+", __func__);
+    mark_chip_resource(CHIP_RES_AMBIENT, true);
 
     // Download packages for ambient
     err = iaxxx_odsp_package_load(odsp_hdl, AMBIENT_DA_PACKAGE,
@@ -857,6 +1343,7 @@ int destroy_ambient_package(struct iaxxx_odsp_hw *odsp_hdl)
         goto exit;
     }
 
+    mark_chip_resource(CHIP_RES_AMBIENT, false);
     ALOGD("-%s-", __func__);
 
 exit:
@@ -868,6 +1355,7 @@ int setup_aec_package(struct iaxxx_odsp_hw *odsp_hdl)
     int err = 0;
 
     ALOGD("+%s+", __func__);
+    mark_chip_resource(CHIP_RES_AEC, true);
 
     err = iaxxx_odsp_package_load(odsp_hdl, ECHOCANCELLER_PACKAGE,
                                 AEC_PKG_ID);
@@ -914,6 +1402,7 @@ int destroy_aec_package(struct iaxxx_odsp_hw *odsp_hdl)
         goto exit;
     }
 
+    mark_chip_resource(CHIP_RES_AEC, false);
     ALOGD("-%s-", __func__);
 
 exit:
@@ -926,6 +1415,7 @@ int setup_chre_package(struct iaxxx_odsp_hw *odsp_hdl)
     struct iaxxx_create_config_data cdata;
 
     ALOGD("+%s+", __func__);
+    mark_chip_resource(CHIP_RES_CHRE, true);
 
     /* Create CHRE plugins */
     cdata.type = CONFIG_FILE;
@@ -1066,6 +1556,7 @@ int destroy_chre_package(struct iaxxx_odsp_hw *odsp_hdl)
         goto exit;
     }
 
+    mark_chip_resource(CHIP_RES_CHRE, false);
     ALOGD("-%s-", __func__);
 
 exit:
@@ -1095,6 +1586,7 @@ int setup_sensor_package(struct iaxxx_odsp_hw *odsp_hdl)
     struct iaxxx_create_config_data cdata;
 
     ALOGD("+%s+", __func__);
+    mark_chip_resource(CHIP_RES_SENSOR, true);
 
     // Download sensor packages
     err = iaxxx_odsp_package_load(odsp_hdl, SENSOR_PACKAGE, SENSOR_PKG_ID);
@@ -1198,6 +1690,7 @@ int destroy_sensor_package(struct iaxxx_odsp_hw *odsp_hdl)
         goto exit;
     }
 
+    mark_chip_resource(CHIP_RES_SENSOR, false);
     ALOGD("-%s-", __func__);
 
 exit:
@@ -1224,6 +1717,7 @@ int setup_mixer_package(struct iaxxx_odsp_hw *odsp_hdl)
     int err = 0;
 
     ALOGD("+%s+", __func__);
+    mark_chip_resource(CHIP_RES_MIXER, true);
 
     // Load package for Mixer
     err = iaxxx_odsp_package_load(odsp_hdl, MIXER_PACKAGE, MIXER_PKG_ID);
@@ -1274,6 +1768,7 @@ int destroy_mixer_package(struct iaxxx_odsp_hw *odsp_hdl)
         goto exit;
     }
 
+    mark_chip_resource(CHIP_RES_MIXER, false);
     ALOGD("-%s-", __func__);
 
 exit:
@@ -1285,6 +1780,7 @@ int setup_src_package(struct iaxxx_odsp_hw *odsp_hdl)
     int err = 0;
 
     ALOGD("+%s+", __func__);
+    mark_chip_resource(CHIP_RES_SRC_PKG, true);
 
     err = iaxxx_odsp_package_load(odsp_hdl, SRC_PACKAGE, SRC_PKG_ID);
     if (err != 0) {
@@ -1313,6 +1809,7 @@ int destroy_src_package(struct iaxxx_odsp_hw *odsp_hdl)
         goto exit;
     }
 
+    mark_chip_resource(CHIP_RES_SRC_PKG, false);
     ALOGD("-%s-", __func__);
 
 exit:
@@ -1325,6 +1822,7 @@ int setup_music_buffer(struct iaxxx_odsp_hw *odsp_hdl)
     struct iaxxx_create_config_data cdata;
 
     ALOGD("+%s+", __func__);
+    mark_chip_resource(CHIP_RES_MUSIC_BUF, true);
 
     // Create the 8 seconds Buffer plugin for Downlink Audio
     cdata.type = CONFIG_FILE;
@@ -1371,6 +1869,7 @@ int destroy_music_buffer(struct iaxxx_odsp_hw *odsp_hdl)
         goto exit;
     }
 
+    mark_chip_resource(CHIP_RES_MUSIC_BUF, false);
     ALOGD("-%s-", __func__);
 
 exit:
@@ -1383,6 +1882,7 @@ int setup_howord_buffer(struct iaxxx_odsp_hw *odsp_hdl)
     int err = 0;
 
     ALOGD("+%s+", __func__);
+    mark_chip_resource(CHIP_RES_HOTWORD_BUF, true);
 
     cdata.type = CONFIG_FILE;
     cdata.data.fdata.filename = BUFFER_CONFIG_VAL_2_SEC;
@@ -1427,6 +1927,7 @@ int destroy_howord_buffer(struct iaxxx_odsp_hw *odsp_hdl)
         goto exit;
     }
 
+    mark_chip_resource(CHIP_RES_HOTWORD_BUF, false);
     ALOGD("-%s-", __func__);
 
 exit:
@@ -1450,6 +1951,8 @@ int setup_src_plugin(struct iaxxx_odsp_hw *odsp_hdl, enum src_type st)
     }
 
     ALOGD("+%s+ src type %d", __func__, st);
+    mark_chip_resource(st == SRC_MIC ? CHIP_RES_SRC_MIC : CHIP_RES_SRC_AMP,
+                    true);
 
     // set src config
     cdata.type = CONFIG_FILE;
@@ -1504,24 +2007,34 @@ int destroy_src_plugin(struct iaxxx_odsp_hw *odsp_hdl, enum src_type st)
         goto exit;
     }
 
+    mark_chip_resource(st == SRC_MIC ? CHIP_RES_SRC_MIC : CHIP_RES_SRC_AMP,
+                    false);
     ALOGD("-%s-", __func__);
 
 exit:
     return err;
 }
 
-int set_hotword_buffer_route(struct audio_route *route_hdl, bool bargein)
+static int destroy_src_mic_plugin(struct iaxxx_odsp_hw *odsp_hdl)
+{
+    return destroy_src_plugin(odsp_hdl, SRC_MIC);
+}
+
+static int destroy_src_amp_plugin(struct iaxxx_odsp_hw *odsp_hdl)
+{
+    return destroy_src_plugin(odsp_hdl, SRC_AMP_REF);
+}
+
+int set_hotword_buffer_route(struct mixer_route *route_hdl, bool bargein)
 {
     int err = 0;
 
     ALOGD("+%s %d+", __func__, bargein);
 
     if (bargein == true)
-        err = audio_route_apply_and_update_path(route_hdl,
-                                                route_table[ST_HOTWORD_BUFFER_WITH_BARGEIN]);
+        err = apply_route(route_hdl, ST_HOTWORD_BUFFER_WITH_BARGEIN);
     else
-        err = audio_route_apply_and_update_path(route_hdl,
-                                                route_table[ST_HOTWORD_BUFFER_WITHOUT_BARGEIN]);
+        err = apply_route(route_hdl, ST_HOTWORD_BUFFER_WITHOUT_BARGEIN);
     if (err)
         ALOGE("%s: route fail %d", __func__, err);
 
@@ -1529,18 +2042,16 @@ int set_hotword_buffer_route(struct audio_route *route_hdl, bool bargein)
     return err;
 }
 
-int tear_hotword_buffer_route(struct audio_route *route_hdl, bool bargein)
+int tear_hotword_buffer_route(struct mixer_route *route_hdl, bool bargein)
 {
     int err = 0;
 
     ALOGD("+%s %d+", __func__, bargein);
 
     if (bargein == true)
-        err = audio_route_reset_and_update_path(route_hdl,
-                                                route_table[ST_HOTWORD_BUFFER_WITH_BARGEIN]);
+        err = reset_route(route_hdl, ST_HOTWORD_BUFFER_WITH_BARGEIN);
     else
-        err = audio_route_reset_and_update_path(route_hdl,
-                                                route_table[ST_HOTWORD_BUFFER_WITHOUT_BARGEIN]);
+        err = reset_route(route_hdl, ST_HOTWORD_BUFFER_WITHOUT_BARGEIN);
     if (err)
         ALOGE("%s: route fail %d", __func__, err);
 
@@ -1548,15 +2059,15 @@ int tear_hotword_buffer_route(struct audio_route *route_hdl, bool bargein)
     return err;
 }
 
-int enable_bargein_route(struct audio_route *route_hdl, bool enable)
+int enable_bargein_route(struct mixer_route *route_hdl, bool enable)
 {
     int err = 0;
 
     ALOGV("+%s+ %d", __func__, enable);
     if (enable)
-        err = audio_route_apply_and_update_path(route_hdl, route_table[ST_BARGEIN_ROUTE]);
+        err = apply_route(route_hdl, ST_BARGEIN_ROUTE);
     else
-        err = audio_route_reset_and_update_path(route_hdl, route_table[ST_BARGEIN_ROUTE]);
+        err = reset_route(route_hdl, ST_BARGEIN_ROUTE);
     if (err)
         ALOGE("%s: route fail %d", __func__, err);
 
@@ -1564,7 +2075,7 @@ int enable_bargein_route(struct audio_route *route_hdl, bool enable)
     return err;
 }
 
-int enable_amp_ref_route(struct audio_route *route_hdl, bool enable,
+int enable_amp_ref_route(struct mixer_route *route_hdl, bool enable,
                          enum strm_type strmt)
 {
     int err = 0;
@@ -1572,14 +2083,14 @@ int enable_amp_ref_route(struct audio_route *route_hdl, bool enable,
     ALOGV("+%s+ %d strm type %d", __func__, enable, strmt);
     if (strmt == STRM_16K) {
         if (enable)
-            err = audio_route_apply_and_update_path(route_hdl, route_table[ST_BARGEIN_AMP_REF]);
+            err = apply_route(route_hdl, ST_BARGEIN_AMP_REF);
         else
-            err = audio_route_reset_and_update_path(route_hdl, route_table[ST_BARGEIN_AMP_REF]);
+            err = reset_route(route_hdl, ST_BARGEIN_AMP_REF);
     } else if (strmt == STRM_48K) {
         if (enable)
-            err = audio_route_apply_and_update_path(route_hdl, route_table[ST_BARGEIN_AMP_REF_48K]);
+            err = apply_route(route_hdl, ST_BARGEIN_AMP_REF_48K);
         else
-            err = audio_route_reset_and_update_path(route_hdl, route_table[ST_BARGEIN_AMP_REF_48K]);
+            err = reset_route(route_hdl, ST_BARGEIN_AMP_REF_48K);
     } else {
         ALOGE("%s: ERROR: Invalid strm type", __func__);
         err = -EINVAL;
@@ -1592,17 +2103,15 @@ int enable_amp_ref_route(struct audio_route *route_hdl, bool enable,
     return err;
 }
 
-int set_music_buffer_route(struct audio_route *route_hdl, bool downlink)
+int set_music_buffer_route(struct mixer_route *route_hdl, bool downlink)
 {
     int err = 0;
 
     ALOGD("+%s+ %d", __func__, downlink);
     if (downlink)
-        err = audio_route_apply_and_update_path(route_hdl,
-                                                route_table[ST_AMBIENT_BUFFER_WITHOUT_BARGEIN]);
+        err = apply_route(route_hdl, ST_AMBIENT_BUFFER_WITHOUT_BARGEIN);
     else
-        err = audio_route_apply_and_update_path(route_hdl,
-                                                route_table[ST_AMBIENT_BUFFER_WITH_BARGEIN]);
+        err = apply_route(route_hdl, ST_AMBIENT_BUFFER_WITH_BARGEIN);
     if (err)
         ALOGE("%s: route fail %d", __func__, err);
 
@@ -1610,17 +2119,15 @@ int set_music_buffer_route(struct audio_route *route_hdl, bool downlink)
     return err;
 }
 
-int tear_music_buffer_route(struct audio_route *route_hdl, bool downlink)
+int tear_music_buffer_route(struct mixer_route *route_hdl, bool downlink)
 {
     int err = 0;
 
     ALOGD("+%s+ %d", __func__, downlink);
     if (downlink)
-        err = audio_route_reset_and_update_path(route_hdl,
-                                                route_table[ST_AMBIENT_BUFFER_WITHOUT_BARGEIN]);
+        err = reset_route(route_hdl, ST_AMBIENT_BUFFER_WITHOUT_BARGEIN);
     else
-        err = audio_route_reset_and_update_path(route_hdl,
-                                                route_table[ST_AMBIENT_BUFFER_WITH_BARGEIN]);
+        err = reset_route(route_hdl, ST_AMBIENT_BUFFER_WITH_BARGEIN);
     if (err)
         ALOGE("%s: route fail %d", __func__, err);
 
@@ -1628,7 +2135,7 @@ int tear_music_buffer_route(struct audio_route *route_hdl, bool downlink)
     return err;
 }
 
-int enable_src_route(struct audio_route *route_hdl, bool enable, enum src_type st)
+int enable_src_route(struct mixer_route *route_hdl, bool enable, enum src_type st)
 {
     int err = 0;
 
@@ -1636,14 +2143,14 @@ int enable_src_route(struct audio_route *route_hdl, bool enable, enum src_type s
 
     if (st == SRC_MIC) {
         if (enable)
-            err = audio_route_apply_and_update_path(route_hdl, route_table[ST_SRC_ROUTE_MIC]);
+            err = apply_route(route_hdl, ST_SRC_ROUTE_MIC);
         else
-            err = audio_route_reset_and_update_path(route_hdl, route_table[ST_SRC_ROUTE_MIC]);
+            err = reset_route(route_hdl, ST_SRC_ROUTE_MIC);
     } else if (st == SRC_AMP_REF) {
         if (enable)
-            err = audio_route_apply_and_update_path(route_hdl, route_table[ST_SRC_ROUTE_AMP_REF]);
+            err = apply_route(route_hdl, ST_SRC_ROUTE_AMP_REF);
         else
-            err = audio_route_reset_and_update_path(route_hdl, route_table[ST_SRC_ROUTE_AMP_REF]);
+            err = reset_route(route_hdl, ST_SRC_ROUTE_AMP_REF);
 
     } else {
         ALOGE("%s: ERROR: Invalid src type", __func__);
@@ -1657,7 +2164,7 @@ int enable_src_route(struct audio_route *route_hdl, bool enable, enum src_type s
     return err;
 }
 
-int enable_mic_route(struct audio_route *route_hdl, bool enable,
+int enable_mic_route(struct mixer_route *route_hdl, bool enable,
                     enum clock_type ct)
 {
     int err = 0;
@@ -1666,19 +2173,15 @@ int enable_mic_route(struct audio_route *route_hdl, bool enable,
 
     if (ct == EXTERNAL_OSCILLATOR) {
         if (enable) {
-            err = audio_route_apply_and_update_path(route_hdl,
-                                                    route_table[ST_MIC_ROUTE_EXT_CLK]);
+            err = apply_route(route_hdl, ST_MIC_ROUTE_EXT_CLK);
         } else {
-            err = audio_route_reset_and_update_path(route_hdl,
-                                                    route_table[ST_MIC_ROUTE_EXT_CLK]);
+            err = reset_route(route_hdl, ST_MIC_ROUTE_EXT_CLK);
         }
     } else if (ct == INTERNAL_OSCILLATOR) {
         if (enable) {
-            err = audio_route_apply_and_update_path(route_hdl,
-                                                    route_table[ST_MIC_ROUTE_INT_CLK]);
+            err = apply_route(route_hdl, ST_MIC_ROUTE_INT_CLK);
         } else {
-            err = audio_route_reset_and_update_path(route_hdl,
-                                                    route_table[ST_MIC_ROUTE_INT_CLK]);
+            err = reset_route(route_hdl, ST_MIC_ROUTE_INT_CLK);
         }
     } else {
         ALOGE("%s: ERROR: Invalid clock type", __func__);
@@ -1726,6 +2229,12 @@ int get_wakeup_param_blk(struct iaxxx_odsp_hw *odsp_hdl, void *payload,
     return err;
 }
 
+/*
+ * Called once per firmware download. The control is looked up every time
+ * rather than kept, the mixer it belongs to may have been closed and
+ * reopened in the meantime. It is always written: its value is the driver's
+ * copy and says nothing about what the fresh firmware runs at.
+ */
 int set_default_apll_clk(struct mixer *mixer) {
 
     int ret = 0;
@@ -1790,17 +2299,19 @@ exit:
     return err;
 }
 
-int reset_all_route(struct audio_route *route_hdl)
+int reset_all_route(struct mixer_route *route_hdl)
 {
     int err = 0;
 
     ALOGD("+%s+", __func__);
+    begin_route_update(route_hdl);
     for (int i = ST_ROUTE_MIN; i < ST_ROUTE_MAX; i++) {
     /*[TODO] Need to use force_reset to clean the active count
-     *       inside libaudioroute
+     *       inside mixer_route
      */
-        audio_route_reset_and_update_path(route_hdl, route_table[i]);
+        reset_route(route_hdl, i);
     }
+    err = commit_route_update(route_hdl);
     ALOGD("-%s-", __func__);
     return err;
 }
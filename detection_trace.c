@@ -0,0 +1,232 @@
+/*
+ * Copyright (C) 2018 Knowles Electronics
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "SoundTriggerDetectionTrace"
+#define LOG_NDEBUG 0
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <log/log.h>
+
+#include "detection_trace.h"
+#include "sthal_util.h"
+
+#define ALL_POINTS      ((1u << TRACE_POINT_MAX) - 1)
+
+static const char * const point_names[TRACE_POINT_MAX] = {
+    [TRACE_UEVENT] = "uevent",
+    [TRACE_GET_EVENT] = "get_event",
+    [TRACE_PAYLOAD] = "payload",
+    [TRACE_CALLBACK_ENTRY] = "callback entry",
+    [TRACE_CALLBACK_EXIT] = "callback exit",
+    [TRACE_FIRST_READ] = "first read",
+    [TRACE_TUNNEL_OPEN] = "tunnel open",
+    [TRACE_FIRST_FRAME] = "first frame",
+};
+
+/*
+ * Values below 2^LATENCY_SUB_BITS get a bucket each, above that every power
+ * of two is split into 2^LATENCY_SUB_BITS buckets, so a bucket is never
+ * wider than 1/8 of its value.
+ */
+static int latency_bucket(long long us)
+{
+    int exp, idx;
+
+    if (us < (1 << LATENCY_SUB_BITS))
+        return us < 0 ? 0 : (int)us;
+
+    exp = 63 - __builtin_clzll((unsigned long long)us);
+    idx = ((exp - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS) |
+        (int)((us >> (exp - LATENCY_SUB_BITS)) &
+            ((1 << LATENCY_SUB_BITS) - 1));
+
+    return idx < LATENCY_BUCKETS ? idx : LATENCY_BUCKETS - 1;
+}
+
+// Middle of the bucket
+static long long latency_bucket_value(int idx)
+{
+    int exp;
+    long long low;
+
+    if (idx < (1 << LATENCY_SUB_BITS))
+        return idx;
+
+    exp = (idx >> LATENCY_SUB_BITS) + LATENCY_SUB_BITS - 1;
+    low = (long long)((1 << LATENCY_SUB_BITS) |
+                    (idx & ((1 << LATENCY_SUB_BITS) - 1))) <<
+        (exp - LATENCY_SUB_BITS);
+
+    return low + ((1LL << (exp - LATENCY_SUB_BITS)) >> 1);
+}
+
+static void add_latency(struct latency_histogram *h, long long us)
+{
+    h->buckets[latency_bucket(us)]++;
+    h->count++;
+    if (us > h->max_us)
+        h->max_us = us;
+}
+
+static long long latency_percentile(const struct latency_histogram *h,
+                                    unsigned int percent)
+{
+    unsigned int target, seen = 0;
+    long long value;
+    int i;
+
+    if (h->count == 0)
+        return 0;
+
+    target = (h->count * percent + 99) / 100;
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= target)
+            break;
+    }
+
+    value = latency_bucket_value(i < LATENCY_BUCKETS ? i : LATENCY_BUCKETS - 1);
+    return value < h->max_us ? value : h->max_us;
+}
+
+void detection_trace_init(struct detection_trace *dt, const char *name)
+{
+    memset(dt, 0, sizeof(*dt));
+    dt->name = name;
+    pthread_mutex_init(&dt->lock, (const pthread_mutexattr_t *) NULL);
+    atomic_init(&dt->pending, 0);
+}
+
+void detection_trace_begin(struct detection_trace *dt,
+                        const struct timespec *origin)
+{
+    int i;
+
+    pthread_mutex_lock(&dt->lock);
+    dt->origin = *origin;
+    for (i = 0; i < TRACE_POINT_MAX; i++)
+        dt->at_us[i] = -1;
+    dt->at_us[TRACE_UEVENT] = 0;
+    dt->has_open_ts = false;
+    dt->has_frame_ts = false;
+    dt->detections++;
+    atomic_store(&dt->pending, ALL_POINTS & ~(1u << TRACE_UEVENT));
+    pthread_mutex_unlock(&dt->lock);
+}
+
+bool detection_trace_is_pending(struct detection_trace *dt,
+                                enum trace_point point)
+{
+    return (atomic_load_explicit(&dt->pending, memory_order_relaxed) &
+            (1u << point)) != 0;
+}
+
+static void log_delivery(const struct detection_trace *dt)
+{
+    ALOGD("%s: %s detection %u, get_event %lld, payload %lld, "
+        "callback %lld-%lld us", __func__, dt->name, dt->detections,
+        dt->at_us[TRACE_GET_EVENT], dt->at_us[TRACE_PAYLOAD],
+        dt->at_us[TRACE_CALLBACK_ENTRY], dt->at_us[TRACE_CALLBACK_EXIT]);
+}
+
+static void log_stream(const struct detection_trace *dt)
+{
+    ALOGD("%s: %s detection %u, first read %lld, tunnel open %lld, "
+        "first frame %lld us", __func__, dt->name, dt->detections,
+        dt->at_us[TRACE_FIRST_READ], dt->at_us[TRACE_TUNNEL_OPEN],
+        dt->at_us[TRACE_FIRST_FRAME]);
+    if (dt->has_open_ts && dt->has_frame_ts) {
+        ALOGD("%s: %s chip time at tunnel open %llu, first frame %llu (%+lld)",
+            __func__, dt->name, (unsigned long long)dt->open_ts,
+            (unsigned long long)dt->frame_ts,
+            (long long)(dt->frame_ts - dt->open_ts));
+    }
+}
+
+void detection_trace_mark(struct detection_trace *dt, enum trace_point point)
+{
+    struct timespec now;
+    long long us;
+
+    if (!detection_trace_is_pending(dt, point))
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&dt->lock);
+    if ((atomic_load(&dt->pending) & (1u << point)) == 0)
+        goto exit;
+
+    us = timespec_diff_us(&now, &dt->origin);
+    if (us > DETECTION_TRACE_WINDOW_US) {
+        // Nothing left of this detection is worth measuring
+        atomic_store(&dt->pending, 0);
+        goto exit;
+    }
+
+    atomic_fetch_and(&dt->pending, ~(1u << point));
+    dt->at_us[point] = us;
+    add_latency(&dt->spans[point], us);
+
+    if (point == TRACE_CALLBACK_EXIT)
+        log_delivery(dt);
+    else if (point == TRACE_FIRST_FRAME)
+        log_stream(dt);
+
+exit:
+    pthread_mutex_unlock(&dt->lock);
+}
+
+void detection_trace_set_open_ts(struct detection_trace *dt, uint64_t ts)
+{
+    pthread_mutex_lock(&dt->lock);
+    dt->open_ts = ts;
+    dt->has_open_ts = true;
+    pthread_mutex_unlock(&dt->lock);
+}
+
+void detection_trace_set_frame_ts(struct detection_trace *dt, uint64_t ts)
+{
+    pthread_mutex_lock(&dt->lock);
+    dt->frame_ts = ts;
+    dt->has_frame_ts = true;
+    pthread_mutex_unlock(&dt->lock);
+}
+
+void detection_trace_dump(struct detection_trace *dt, int fd)
+{
+    struct latency_histogram spans[TRACE_POINT_MAX];
+    unsigned int detections;
+    int i;
+
+    pthread_mutex_lock(&dt->lock);
+    memcpy(spans, dt->spans, sizeof(spans));
+    detections = dt->detections;
+    pthread_mutex_unlock(&dt->lock);
+
+    DUMP(fd, "%s: %u detections\n", dt->name, detections);
+    for (i = TRACE_UEVENT + 1; i < TRACE_POINT_MAX; i++) {
+        const struct latency_histogram *h = &spans[i];
+
+        if (h->count == 0)
+            continue;
+        DUMP(fd, "  %-14s n %u p50 %lld p90 %lld p99 %lld max %lld us\n",
+            point_names[i], h->count, latency_percentile(h, 50),
+            latency_percentile(h, 90), latency_percentile(h, 99), h->max_us);
+    }
+}
@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2018 Knowles Electronics
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _DETECTION_TRACE_H_
+#define _DETECTION_TRACE_H_
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#if __cplusplus
+extern "C"
+{
+#endif
+
+/*
+ * Trace points of a detection, in the order they normally happen. Every
+ * point is measured from the uevent that reported the detection.
+ */
+enum trace_point {
+    TRACE_UEVENT,           // uevent received by the callback thread
+    TRACE_GET_EVENT,        // get_event() returned the detection
+    TRACE_PAYLOAD,          // event payload read from the plugin
+    TRACE_CALLBACK_ENTRY,   // recognition callback called
+    TRACE_CALLBACK_EXIT,    // recognition callback returned
+    TRACE_FIRST_READ,       // first READ_SAMPLES from the AHAL
+    TRACE_TUNNEL_OPEN,      // tunnel open for the capture
+    TRACE_FIRST_FRAME,      // first parsed PCM handed to the AHAL
+    TRACE_POINT_MAX
+};
+
+// Log-linear buckets, 8 per power of two, covers up to 2^26 us
+#define LATENCY_SUB_BITS        (3)
+#define LATENCY_BUCKETS         (200)
+// Points reached later than this belong to something else
+#define DETECTION_TRACE_WINDOW_US (10 * 1000 * 1000)
+
+struct latency_histogram {
+    unsigned int buckets[LATENCY_BUCKETS];
+    unsigned int count;
+    long long max_us;
+};
+
+/*
+ * Latency of the detections of one model type. A detection is started by
+ * the callback thread, the delivery thread and the AHAL's read threads then
+ * mark the points they reach. Each point is only taken once per detection,
+ * the pending check is lock free so it is cheap on the read path.
+ */
+struct detection_trace {
+    const char *name;
+    pthread_mutex_t lock;
+    // Points not reached yet by the current detection
+    atomic_uint pending;
+    struct timespec origin;
+    long long at_us[TRACE_POINT_MAX];
+    // Chip time of the endpoint head at tunnel open and of the first frame
+    uint64_t open_ts;
+    uint64_t frame_ts;
+    bool has_open_ts;
+    bool has_frame_ts;
+    unsigned int detections;
+    struct latency_histogram spans[TRACE_POINT_MAX];
+};
+
+void detection_trace_init(struct detection_trace *dt, const char *name);
+
+/**
+ * Starts a new detection at origin, the time its uevent was received.
+ * Whatever the previous detection didn't reach is dropped.
+ */
+void detection_trace_begin(struct detection_trace *dt,
+                        const struct timespec *origin);
+
+/**
+ * Records the point for the current detection if it hasn't been reached yet.
+ */
+void detection_trace_mark(struct detection_trace *dt, enum trace_point point);
+
+bool detection_trace_is_pending(struct detection_trace *dt,
+                                enum trace_point point);
+
+/**
+ * Chip timestamps to correlate the host side with: the latest endpoint
+ * timestamp when the tunnel was opened and the RAF timestamp of the first
+ * streamed frame. Their difference is how far behind the live audio the
+ * tunnel starts.
+ */
+void detection_trace_set_open_ts(struct detection_trace *dt, uint64_t ts);
+void detection_trace_set_frame_ts(struct detection_trace *dt, uint64_t ts);
+
+/**
+ * Writes p50/p90/p99/max of each point to fd, or to the log if fd is
+ * negative.
+ */
+void detection_trace_dump(struct detection_trace *dt, int fd);
+
+#if __cplusplus
+} // extern "C"
+#endif
+
+#endif
@@ -22,8 +22,11 @@
 #include <log/log.h>
 #include <sys/ioctl.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "iaxxx_odsp_hw.h"
+#include "sthal_metrics.h"
 
 #define DEV_NODE "/dev/iaxxx-odsp-celldrv"
 #define FUNCTION_ENTRY_LOG ALOGV("Entering %s", __func__);
@@ -38,6 +41,58 @@ struct iaxxx_odsp_hw {
     FILE *dev_node;
 };
 
+static struct {
+    struct metric *ioctls;
+    struct metric *ioctl_us;
+    struct metric *ioctl_failures;
+    struct metric *package_loads;
+    struct metric *package_load_us;
+} metrics;
+static pthread_once_t metrics_once = PTHREAD_ONCE_INIT;
+
+static void register_metrics(void)
+{
+    metrics.ioctls = metrics_register("odsp.ioctls", METRIC_COUNTER);
+    metrics.ioctl_us = metrics_register("odsp.ioctl_us", METRIC_HISTOGRAM);
+    metrics.ioctl_failures = metrics_register("odsp.ioctl_failures",
+                                            METRIC_COUNTER);
+    metrics.package_loads = metrics_register("odsp.package_loads",
+                                            METRIC_COUNTER);
+    metrics.package_load_us = metrics_register("odsp.package_load_us",
+                                            METRIC_HISTOGRAM);
+}
+
+static long long elapsed_us(const struct timespec *end,
+                            const struct timespec *start)
+{
+    return (long long)(end->tv_sec - start->tv_sec) * 1000000LL +
+            (end->tv_nsec - start->tv_nsec) / 1000;
+}
+
+/*
+ * All requests to the driver go through here so that they are counted and
+ * timed, errno is left as the ioctl set it.
+ */
+static int odsp_ioctl(struct iaxxx_odsp_hw *odsp_hw_hdl,
+                    unsigned long request, unsigned long arg)
+{
+    struct timespec start, end;
+    int err, saved_errno;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    err = ioctl(fileno(odsp_hw_hdl->dev_node), request, arg);
+    saved_errno = errno;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    metric_add(metrics.ioctls, 1);
+    metric_record(metrics.ioctl_us, elapsed_us(&end, &start));
+    if (err < 0)
+        metric_add(metrics.ioctl_failures, 1);
+
+    errno = saved_errno;
+    return err;
+}
+
 /**
  * Initialize the ODSP HAL
  *
@@ -57,6 +112,8 @@ struct iaxxx_odsp_hw* iaxxx_odsp_init()
         goto func_exit;
     }
 
+    pthread_once(&metrics_once, register_metrics);
+
     ioh->dev_node = fopen(DEV_NODE, "rw");
     if (ioh->dev_node == NULL) {
         ALOGE("%s: ERROR: Failed to open %s", __func__, DEV_NODE);
@@ -111,6 +168,7 @@ int iaxxx_odsp_package_load(struct iaxxx_odsp_hw *odsp_hw_hdl,
 {
     int err = 0;
     struct iaxxx_pkg_mgmt_info pkg_info;
+    struct timespec start, end;
 
     FUNCTION_ENTRY_LOG;
 
@@ -131,10 +189,15 @@ int iaxxx_odsp_package_load(struct iaxxx_odsp_hw *odsp_hw_hdl,
 
     strlcpy(pkg_info.pkg_name, pkg_name, NAME_MAX_SIZE);
     pkg_info.pkg_id = pkg_id;
-    err = ioctl(fileno(odsp_hw_hdl->dev_node),
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    err = odsp_ioctl(odsp_hw_hdl,
                 ODSP_LOAD_PACKAGE, (unsigned long)&pkg_info);
     if (err < 0) {
         ALOGE("%s: ERROR: Failed with error %s", __func__, strerror(errno));
+    } else {
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        metric_add(metrics.package_loads, 1);
+        metric_record(metrics.package_load_us, elapsed_us(&end, &start));
     }
 
 func_exit:
@@ -168,7 +231,7 @@ int iaxxx_odsp_package_unload(struct iaxxx_odsp_hw *odsp_hw_hdl,
     ALOGV("%s: package id %u", __func__, pkg_id);
 
     pkg_info.pkg_id = pkg_id;
-    err = ioctl(fileno(odsp_hw_hdl->dev_node),
+    err = odsp_ioctl(odsp_hw_hdl,
                 ODSP_UNLOAD_PACKAGE, (unsigned long)&pkg_info);
     if (err < 0) {
         ALOGE("%s: ERROR: Failed with error %s", __func__, strerror(errno));
@@ -214,7 +277,7 @@ int iaxxx_odsp_plugin_get_package_version(struct iaxxx_odsp_hw *odsp_hw_hdl,
 
     v.inst_id = inst_id;
     v.len = len;
-    err = ioctl(fileno(odsp_hw_hdl->dev_node),
+    err = odsp_ioctl(odsp_hw_hdl,
                 ODSP_PLG_GET_PACKAGE_VERSION, (unsigned long)&v);
     if (err < 0) {
         ALOGE("%s: ERROR: Failed with error %s", __func__, strerror(errno));
@@ -262,7 +325,7 @@ int iaxxx_odsp_plugin_get_plugin_version(struct iaxxx_odsp_hw *odsp_hw_hdl,
 
     v.inst_id = inst_id;
     v.len = len;
-    err = ioctl(fileno(odsp_hw_hdl->dev_node),
+    err = odsp_ioctl(odsp_hw_hdl,
                 ODSP_PLG_GET_PLUGIN_VERSION, (unsigned long)&v);
     if (err < 0) {
         ALOGE("%s: ERROR: Failed with error %s", __func__, strerror(errno));
@@ -316,7 +379,7 @@ int iaxxx_odsp_plugin_create(struct iaxxx_odsp_hw *odsp_hw_hdl,
     pi.inst_id = inst_id;
     pi.priority = priority;
     pi.config_id = config_id;
-    err = ioctl(fileno(odsp_hw_hdl->dev_node),
+    err = odsp_ioctl(odsp_hw_hdl,
                 ODSP_PLG_CREATE, (unsigned long)&pi);
     if (err < 0) {
         ALOGE("%s: ERROR: Failed with error %s", __func__, strerror(errno));
@@ -374,7 +437,7 @@ int iaxxx_odsp_plugin_set_creation_config(struct iaxxx_odsp_hw *odsp_hw_hdl,
 
     ALOGV("%s: Instance id %u, block id %u", __func__, inst_id, block_id);
 
-    err = ioctl(fileno(odsp_hw_hdl->dev_node),
+    err = odsp_ioctl(odsp_hw_hdl,
                 ODSP_PLG_SET_CREATE_CFG, (unsigned long)&pcc);
     if (err < 0) {
         ALOGE("%s: ERROR: Failed with error %s", __func__, strerror(errno));
@@ -413,7 +476,7 @@ int iaxxx_odsp_plugin_destroy(struct iaxxx_odsp_hw *odsp_hw_hdl,
 
     pi.block_id = block_id;
     pi.inst_id = inst_id;
-    err = ioctl(fileno(odsp_hw_hdl->dev_node),
+    err = odsp_ioctl(odsp_hw_hdl,
                 ODSP_PLG_DESTROY, (unsigned long) &pi);
     if (err < 0) {
         ALOGE("%s: ERROR: Failed with error %s", __func__, strerror(errno));
@@ -451,7 +514,7 @@ int iaxxx_odsp_plugin_enable(struct iaxxx_odsp_hw *odsp_hw_hdl,
 
     pi.block_id = block_id;
     pi.inst_id = inst_id;
-    err = ioctl(fileno(odsp_hw_hdl->dev_node),
+    err = odsp_ioctl(odsp_hw_hdl,
                 ODSP_PLG_ENABLE, (unsigned long)&pi);
     if (err < 0) {
         ALOGE("%s: ERROR: Failed with error %s", __func__, strerror(errno));
@@ -489,7 +552,7 @@ int iaxxx_odsp_plugin_disable(struct iaxxx_odsp_hw *odsp_hw_hdl,
 
     pi.block_id = block_id;
     pi.inst_id = inst_id;
-    err = ioctl(fileno(odsp_hw_hdl->dev_node),
+    err = odsp_ioctl(odsp_hw_hdl,
                 ODSP_PLG_DISABLE, (unsigned long)&pi);
     if (err < 0) {
         ALOGE("%s: ERROR: Failed with error %s", __func__, strerror(errno));
@@ -527,7 +590,7 @@ int iaxxx_odsp_plugin_reset(struct iaxxx_odsp_hw *odsp_hw_hdl,
 
     pi.block_id = block_id;
     pi.inst_id = inst_id;
-    err = ioctl(fileno(odsp_hw_hdl->dev_node),
+    err = odsp_ioctl(odsp_hw_hdl,
                 ODSP_PLG_RESET, (unsigned long)&pi);
     if (err < 0) {
         ALOGE("%s: ERROR: Failed with error %s", __func__, strerror(errno));
@@ -572,7 +635,7 @@ int iaxxx_odsp_plugin_set_parameter(struct iaxxx_odsp_hw *odsp_hw_hdl,
     pp.block_id = block_id;
     pp.param_id = param_id;
     pp.param_val = param_val;
-    err = ioctl(fileno(odsp_hw_hdl->dev_node),
+    err = odsp_ioctl(odsp_hw_hdl,
                 ODSP_PLG_SET_PARAM, (unsigned long)&pp);
     if (err < 0) {
         ALOGE("%s: ERROR: Failed with error %s", __func__, strerror(errno));
@@ -614,7 +677,7 @@ int iaxxx_odsp_plugin_get_parameter(struct iaxxx_odsp_hw *odsp_hw_hdl,
     pp.block_id = block_id;
     pp.param_id = param_id;
     pp.param_val = 0;
-    err = ioctl(fileno(odsp_hw_hdl->dev_node),
+    err = odsp_ioctl(odsp_hw_hdl,
                 ODSP_PLG_GET_PARAM, (unsigned long)&pp);
     if (err < 0) {
         ALOGE("%s: ERROR: Failed with error %s", __func__, strerror(errno));
@@ -669,7 +732,7 @@ int iaxxx_odsp_plugin_set_parameter_blk(struct iaxxx_odsp_hw *odsp_hw_hdl,
     ppb.param_blk = (uintptr_t)param_buf;
     ppb.id = param_blk_id;
     ppb.file_name[0] = '\0';
-    err = ioctl(fileno(odsp_hw_hdl->dev_node),
+    err = odsp_ioctl(odsp_hw_hdl,
                 ODSP_PLG_SET_PARAM_BLK, (unsigned long)&ppb);
     if (err < 0) {
         ALOGE("%s: ERROR: Failed with error %s", __func__, strerror(errno));
@@ -718,7 +781,7 @@ int iaxxx_odsp_plugin_set_parameter_blk_from_file(
     ppb.block_id = block_id;
     ppb.id = param_blk_id;
     strlcpy(ppb.file_name, file_name, NAME_MAX_SIZE);
-    err = ioctl(fileno(odsp_hw_hdl->dev_node),
+    err = odsp_ioctl(odsp_hw_hdl,
                 ODSP_PLG_SET_PARAM_BLK, (unsigned long)&ppb);
     if (err < 0) {
         ALOGE("%s: ERROR: Failed with error %s", __func__, strerror(errno));
@@ -771,7 +834,7 @@ int iaxxx_odsp_plugin_set_custom_cfg(struct iaxxx_odsp_hw *odsp_hw_hdl,
     pcc.param_blk_id = param_blk_id;
     pcc.custom_config_id = custom_config_id;
 
-    err = ioctl(fileno(odsp_hw_hdl->dev_node),
+    err = odsp_ioctl(odsp_hw_hdl,
                 ODSP_PLG_SET_CUSTOM_CFG, (unsigned long)&pcc);
     if (err < 0) {
         ALOGE("%s: ERROR: Failed with error %s", __func__, strerror(errno));
@@ -818,7 +881,7 @@ int iaxxx_odsp_evt_subscribe(struct iaxxx_odsp_hw *odsp_hw_hdl,
     ei.dst_id = dst_id;
     ei.dst_opaque = dst_opaque;
 
-    err = ioctl(fileno(odsp_hw_hdl->dev_node),
+    err = odsp_ioctl(odsp_hw_hdl,
                 ODSP_EVENT_SUBSCRIBE, (unsigned long)&ei);
     if (err < 0) {
         ALOGE("%s: ERROR: Failed with error %s", __func__, strerror(errno));
@@ -862,7 +925,7 @@ int iaxxx_odsp_evt_unsubscribe(struct iaxxx_odsp_hw *odsp_hw_hdl,
     ei.event_id = event_id;
     ei.dst_id = dst_id;
 
-    err = ioctl(fileno(odsp_hw_hdl->dev_node),
+    err = odsp_ioctl(odsp_hw_hdl,
                 ODSP_EVENT_UNSUBSCRIBE, (unsigned long)&ei);
     if (err < 0) {
         ALOGE("%s: ERROR: Failed with error %s", __func__, strerror(errno));
@@ -895,10 +958,20 @@ int iaxxx_odsp_evt_getevent(struct iaxxx_odsp_hw *odsp_hw_hdl,
         goto func_exit;
     }
 
-    err = ioctl(fileno(odsp_hw_hdl->dev_node),
+    err = odsp_ioctl(odsp_hw_hdl,
                 ODSP_GET_EVENT, (unsigned long) &ei);
     if (err < 0) {
-        ALOGE("%s: ERROR: Failed with error %s", __func__, strerror(errno));
+        int saved_errno = errno;
+
+        // An empty event queue is expected when the caller drains it
+        if (iaxxx_odsp_evt_is_queue_empty(saved_errno)) {
+            ALOGV("%s: No pending event %s", __func__, strerror(saved_errno));
+        } else {
+            ALOGE("%s: ERROR: Failed with error %s",
+                __func__, strerror(saved_errno));
+        }
+        errno = saved_errno;
+        goto func_exit;
     }
 
     ALOGV("%s: event id %u, data %u",
@@ -953,7 +1026,7 @@ int iaxxx_odsp_plugin_create_static_package(struct iaxxx_odsp_hw *odsp_hw_hdl,
     pi.inst_id = inst_id;
     pi.priority = priority;
     pi.config_id = config_id;
-    err = ioctl(fileno(odsp_hw_hdl->dev_node),
+    err = odsp_ioctl(odsp_hw_hdl,
                 ODSP_PLG_CREATE_STATIC_PACKAGE, (unsigned long)&pi);
     if (err < 0) {
         ALOGE("%s: ERROR: Failed with error %s", __func__, strerror(errno));
@@ -1003,7 +1076,7 @@ int iaxxx_odsp_plugin_get_parameter_blk(struct iaxxx_odsp_hw *odsp_hw_hdl,
     ppb.param_size = param_buf_sz;
     ppb.param_blk = (uintptr_t)param_buf;
 
-    err = ioctl(fileno(odsp_hw_hdl->dev_node),
+    err = odsp_ioctl(odsp_hw_hdl,
                 ODSP_PLG_GET_PARAM_BLK, (unsigned long)&ppb);
     if (err < 0) {
         ALOGE("%s: ERROR: Failed with error %s", __func__, strerror(errno));
@@ -1046,7 +1119,7 @@ int iaxxx_odsp_plugin_setevent(struct iaxxx_odsp_hw *odsp_hw_hdl,
     se.block_id = block_id;
     se.event_enable_mask = eventEnableMask;
     se.inst_id = inst_id;
-    err = ioctl(fileno(odsp_hw_hdl->dev_node),
+    err = odsp_ioctl(odsp_hw_hdl,
                 ODSP_PLG_SET_EVENT, (unsigned long)&se);
     if (err == -1) {
         ALOGE("%s: ERROR: Failed with error %s", __func__, strerror(errno));
@@ -1092,7 +1165,7 @@ int iaxxx_odsp_evt_trigger(struct iaxxx_odsp_hw *odsp_hw_hdl,
     et.src_id = src_id;
     et.evt_id = evt_id;
     et.src_opaque = src_opaque;
-    err = ioctl(fileno(odsp_hw_hdl->dev_node), ODSP_EVENT_TRIGGER,
+    err = odsp_ioctl(odsp_hw_hdl, ODSP_EVENT_TRIGGER,
             (unsigned long)&et);
     if (err == -1) {
         ALOGE("%s: ERROR: Failed with error %s", __func__, strerror(errno));
@@ -1131,7 +1204,7 @@ int iaxxx_odsp_evt_read_subscription(struct iaxxx_odsp_hw *odsp_hw_hdl,
         goto func_exit;
     }
 
-    err = ioctl(fileno(odsp_hw_hdl->dev_node), ODSP_EVENT_READ_SUBSCRIPTION,
+    err = odsp_ioctl(odsp_hw_hdl, ODSP_EVENT_READ_SUBSCRIPTION,
                 (unsigned long) &ers);
     if (err == -1) {
         ALOGE("%s: ERROR: Failed with error %s", __func__, strerror(errno));
@@ -1169,8 +1242,7 @@ int iaxxx_odsp_evt_reset_read_index(struct iaxxx_odsp_hw *odsp_hw_hdl)
         goto func_exit;
     }
 
-    err = ioctl(fileno(odsp_hw_hdl->dev_node), ODSP_EVENT_RESET_READ_INDEX,
-                NULL);
+    err = odsp_ioctl(odsp_hw_hdl, ODSP_EVENT_RESET_READ_INDEX, 0);
     if (err == -1) {
         ALOGE("%s: ERROR: Failed with error %s", __func__, strerror(errno));
     }
@@ -1212,7 +1284,7 @@ int iaxxx_odsp_evt_retrieve_notification(struct iaxxx_odsp_hw *odsp_hw_hdl,
         goto func_exit;
     }
 
-    err = ioctl(fileno(odsp_hw_hdl->dev_node),
+    err = odsp_ioctl(odsp_hw_hdl,
                 ODSP_EVENT_RETRIEVE_NOTIFICATION, (unsigned long)&ern);
     if (err == -1) {
         ALOGE("%s: ERROR: Failed with error %s", __func__, strerror(errno));
@@ -1260,7 +1332,7 @@ int iaxxx_odsp_plugin_read_error(struct iaxxx_odsp_hw *odsp_hw_hdl,
 
     pei.block_id = block_id;
 
-    err = ioctl(fileno(odsp_hw_hdl->dev_node),
+    err = odsp_ioctl(odsp_hw_hdl,
                 ODSP_PLG_READ_PLUGIN_ERROR, (unsigned long)&pei);
     if (err < 0) {
         ALOGE("%s: ERROR: Failed with error %s", __func__, strerror(errno));
@@ -1302,7 +1374,7 @@ int iaxxx_odsp_plugin_get_ep_timestamps(struct iaxxx_odsp_hw *odsp_hw_hdl,
 
     ALOGV("%s: Proc id %u", __func__, proc_id);
 
-    err = ioctl(fileno(odsp_hw_hdl->dev_node),
+    err = odsp_ioctl(odsp_hw_hdl,
                 ODSP_PLG_GET_ENDPOINT_TIMESTAMPS, (unsigned long)&pet);
     if (err < 0) {
         ALOGE("%s: ERROR: Failed with error %s", __func__, strerror(errno));
@@ -1367,7 +1439,7 @@ int iaxxx_odsp_plugin_set_parameter_blk_with_ack(
     pspbwa.response_buf_size = response_data_sz;
     pspbwa.max_retries = max_no_retries;
 
-    err = ioctl(fileno(odsp_hw_hdl->dev_node),
+    err = odsp_ioctl(odsp_hw_hdl,
                 ODSP_PLG_SET_PARAM_BLK_WITH_ACK, (unsigned long)&pspbwa);
     if (err < 0) {
         ALOGE("%s: ERROR: Failed with error %s", __func__, strerror(errno));
@@ -1407,7 +1479,7 @@ int iaxxx_odsp_plugin_get_status_info(struct iaxxx_odsp_hw *odsp_hw_hdl,
 
     psi.inst_id = inst_id;
 
-    err = ioctl(fileno(odsp_hw_hdl->dev_node),
+    err = odsp_ioctl(odsp_hw_hdl,
             ODSP_PLG_GET_STATUS_INFO, (unsigned long) &psi);
     if (err < 0) {
         ALOGE("%s: ERROR: Failed with error %s", __func__, strerror(errno));
@@ -1477,7 +1549,7 @@ int iaxxx_odsp_plugin_get_endpoint_status(struct iaxxx_odsp_hw *odsp_hw_hdl,
     plugin_ep_status_info.ep_index = ep_index;
     plugin_ep_status_info.direction = direction;
 
-    err = ioctl(fileno(odsp_hw_hdl->dev_node),
+    err = odsp_ioctl(odsp_hw_hdl,
             ODSP_PLG_GET_ENDPOINT_STATUS,
             (unsigned long) &plugin_ep_status_info);
     if (err < 0) {
@@ -1557,7 +1629,7 @@ int iaxxx_odsp_get_proc_execution_status(struct iaxxx_odsp_hw *odsp_hw_hdl,
 
     ALOGV("%s: Proc id %u", __func__, proc_id);
 
-    err = ioctl(fileno(odsp_hw_hdl->dev_node),
+    err = odsp_ioctl(odsp_hw_hdl,
                 ODSP_GET_PROC_EXECUTION_STATUS, (unsigned long)&s);
     if (err < 0) {
         ALOGE("%s: ERROR: Failed with error %s", __func__, strerror(errno));
@@ -1635,7 +1707,7 @@ int iaxxx_odsp_get_sys_versions(struct iaxxx_odsp_hw *odsp_hw_hdl,
         goto func_exit;
     }
 
-    err = ioctl(fileno(odsp_hw_hdl->dev_node),
+    err = odsp_ioctl(odsp_hw_hdl,
                 ODSP_GET_SYS_VERSIONS, (unsigned long)&v);
     if (err < 0) {
         ALOGE("%s: ERROR: Failed with error %s", __func__, strerror(errno));
@@ -1676,7 +1748,7 @@ int iaxxx_odsp_get_device_id(struct iaxxx_odsp_hw *odsp_hw_hdl,
         goto func_exit;
     }
 
-    err = ioctl(fileno(odsp_hw_hdl->dev_node),
+    err = odsp_ioctl(odsp_hw_hdl,
                     ODSP_GET_SYS_DEVICE_ID, (unsigned long)device_id);
     if (err < 0) {
         ALOGE("%s: ERROR: Failed with error %s", __func__, strerror(errno));
@@ -1711,7 +1783,7 @@ int iaxxx_odsp_get_sys_mode(struct iaxxx_odsp_hw *odsp_hw_hdl,
         goto func_exit;
     }
 
-    err = ioctl(fileno(odsp_hw_hdl->dev_node),
+    err = odsp_ioctl(odsp_hw_hdl,
                     ODSP_GET_SYS_MODE, (unsigned long)mode);
     if (err < 0) {
         ALOGE("%s: ERROR: Failed with error %s", __func__, strerror(errno));
@@ -1746,7 +1818,7 @@ int iaxxx_odsp_get_fw_status(struct iaxxx_odsp_hw *odsp_hw_hdl,
         goto func_exit;
     }
 
-    err = ioctl(fileno(odsp_hw_hdl->dev_node),
+    err = odsp_ioctl(odsp_hw_hdl,
                     ODSP_GET_FW_STATUS, (unsigned long)status);
     if (err < 0) {
         ALOGE("%s: ERROR: Failed with error %s", __func__, strerror(errno));
@@ -1776,7 +1848,7 @@ int iaxxx_odsp_reset_fw(struct iaxxx_odsp_hw *odsp_hw_hdl)
         goto func_exit;
     }
 
-    err = ioctl(fileno(odsp_hw_hdl->dev_node), ODSP_RESET_FW);
+    err = odsp_ioctl(odsp_hw_hdl, ODSP_RESET_FW, 0);
     if (err < 0) {
         ALOGE("%s: ERROR: Failed with error %s", __func__, strerror(errno));
     }
@@ -22,6 +22,8 @@ extern "C"
 {
 #endif
 
+#include <errno.h>
+#include <stdbool.h>
 #include <linux/mfd/adnc/iaxxx-odsp.h>
 #include <linux/mfd/adnc/iaxxx-system-identifiers.h>
 
@@ -432,6 +434,27 @@ int iaxxx_odsp_evt_retrieve_notification(struct iaxxx_odsp_hw *odsp_hw_hdl,
 int iaxxx_odsp_evt_getevent(struct iaxxx_odsp_hw *odsp_hw_hdl,
                             struct iaxxx_get_event_info *event_info);
 
+/**
+ * Tells whether iaxxx_odsp_evt_getevent() failed only because there was no
+ * event left to read
+ *
+ * ODSP_GET_EVENT has no status of its own for an empty event queue, the
+ * ioctl just fails once the driver has nothing to hand out. ENOENT is what
+ * the driver model in tests/fake_odsp_hw.c uses, ENODATA and EAGAIN are the
+ * other conventions for "nothing to read". Only the log level depends on
+ * this: a drain stops at the first failed read whatever the errno, and an
+ * errno not listed here is logged as an error with its value, so a driver
+ * reporting an empty queue differently shows up in the log.
+ *
+ * Input  - err_no - errno left by iaxxx_odsp_evt_getevent()
+ *
+ * Output - true if the event queue is empty
+ */
+static inline bool iaxxx_odsp_evt_is_queue_empty(int err_no)
+{
+    return err_no == ENOENT || err_no == ENODATA || err_no == EAGAIN;
+}
+
 /**
  * Create a plugin for a statically loaded package
  *
@@ -0,0 +1,239 @@
+/*
+ * Copyright (C) 2018 Knowles Electronics
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "SoundTriggerLockProfile"
+#define LOG_NDEBUG 0
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <log/log.h>
+
+#include <errno.h>
+
+#include "lock_profile.h"
+#include "sthal_util.h"
+
+static void add_sample(struct lock_histogram *h, long long us)
+{
+    int bucket = 0;
+
+    while (bucket < LOCK_PROFILE_BUCKETS - 1 && us >= (1LL << bucket))
+        bucket++;
+    h->buckets[bucket]++;
+    h->total_us += us;
+    if (us > h->max_us)
+        h->max_us = us;
+}
+
+// Called with lp->mutex held, the last slot collects the overflow
+static int find_site(struct lock_profile *lp, const char *name)
+{
+    int i;
+
+    for (i = 0; i < lp->num_sites; i++) {
+        if (lp->sites[i].name == name)
+            return i;
+    }
+
+    if (lp->num_sites == LOCK_PROFILE_MAX_SITES - 1) {
+        lp->sites[lp->num_sites].name = "(other)";
+        return lp->num_sites++;
+    } else if (lp->num_sites == LOCK_PROFILE_MAX_SITES) {
+        return LOCK_PROFILE_MAX_SITES - 1;
+    }
+
+    lp->sites[lp->num_sites].name = name;
+    return lp->num_sites++;
+}
+
+static void begin_hold(struct lock_profile *lp, const char *site,
+                    long long wait_us, bool is_contended)
+{
+    struct lock_site *s;
+
+    lp->holder = find_site(lp, site);
+    s = &lp->sites[lp->holder];
+    s->count++;
+    if (is_contended)
+        s->contended++;
+    add_sample(&s->wait, wait_us);
+    clock_gettime(CLOCK_MONOTONIC, &lp->acquired);
+}
+
+static void end_hold(struct lock_profile *lp)
+{
+    struct lock_site *s;
+    struct timespec now;
+    long long hold_us;
+
+    if (lp->holder < 0)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    hold_us = timespec_diff_us(&now, &lp->acquired);
+    s = &lp->sites[lp->holder];
+    add_sample(&s->hold, hold_us);
+    if (hold_us > LOCK_PROFILE_SLOW_HOLD_US)
+        ALOGW("%s: %s held by %s for %lld us", __func__, lp->name, s->name,
+            hold_us);
+    lp->holder = -1;
+}
+
+void lock_profile_enable(struct lock_profile *lp, bool is_enabled)
+{
+    lp->is_enabled = is_enabled;
+}
+
+void lock_profile_lock(struct lock_profile *lp, const char *site)
+{
+    struct timespec start, end;
+
+    if (!lp->is_enabled) {
+        pthread_mutex_lock(lp->mutex);
+        lp->holder = -1;
+        return;
+    }
+
+    // Only a contended acquire pays for the clock reads
+    if (pthread_mutex_trylock(lp->mutex) == 0) {
+        begin_hold(lp, site, 0, false);
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_mutex_lock(lp->mutex);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    begin_hold(lp, site, timespec_diff_us(&end, &start), true);
+}
+
+void lock_profile_unlock(struct lock_profile *lp)
+{
+    end_hold(lp);
+    pthread_mutex_unlock(lp->mutex);
+}
+
+/*
+ * The time spent waiting for the condition isn't lock wait, the hold ends
+ * when the mutex is released and a new one starts once it's back.
+ */
+int lock_profile_cond_wait(struct lock_profile *lp, pthread_cond_t *cond,
+                        const char *site)
+{
+    int err;
+
+    end_hold(lp);
+    err = pthread_cond_wait(cond, lp->mutex);
+    if (lp->is_enabled)
+        begin_hold(lp, site, 0, false);
+
+    return err;
+}
+
+int lock_profile_cond_timedwait(struct lock_profile *lp, pthread_cond_t *cond,
+                                const struct timespec *abstime,
+                                const char *site)
+{
+    int err;
+
+    end_hold(lp);
+    err = pthread_cond_timedwait(cond, lp->mutex, abstime);
+    if (lp->is_enabled)
+        begin_hold(lp, site, 0, false);
+
+    return err;
+}
+
+static void format_histogram(const struct lock_histogram *h, char *buf,
+                            size_t len)
+{
+    size_t n = 0;
+    int i;
+
+    buf[0] = '\0';
+    for (i = 0; i < LOCK_PROFILE_BUCKETS && n < len; i++) {
+        if (h->buckets[i] == 0)
+            continue;
+        // Bucket i holds samples below 2^i us
+        n += snprintf(buf + n, len - n, " %s%lld:%u",
+                    i == LOCK_PROFILE_BUCKETS - 1 ? ">=" : "<",
+                    i == LOCK_PROFILE_BUCKETS - 1 ? 1LL << (i - 1) : 1LL << i,
+                    h->buckets[i]);
+    }
+}
+
+void lock_profile_dump(struct lock_profile *lp, int fd)
+{
+    struct lock_site sites[LOCK_PROFILE_MAX_SITES];
+    int order[LOCK_PROFILE_MAX_SITES];
+    char wait_buf[256], hold_buf[256];
+    long long total_hold_us = 0;
+    int i, j, tmp, num_sites;
+    bool is_enabled;
+
+    pthread_mutex_lock(lp->mutex);
+    is_enabled = lp->is_enabled;
+    num_sites = lp->num_sites;
+    memcpy(sites, lp->sites, sizeof(sites[0]) * num_sites);
+    pthread_mutex_unlock(lp->mutex);
+
+    DUMP(fd, "lock %s: profiling %s, %d sites\n", lp->name,
+        is_enabled ? "on" : "off", num_sites);
+    for (i = 0; i < num_sites; i++) {
+        struct lock_site *s = &sites[i];
+
+        total_hold_us += s->hold.total_us;
+        format_histogram(&s->wait, wait_buf, sizeof(wait_buf));
+        format_histogram(&s->hold, hold_buf, sizeof(hold_buf));
+        DUMP(fd, "  %s: %u acquires, %u contended\n"
+            "    wait avg %lld max %lld us:%s\n"
+            "    hold avg %lld max %lld us:%s\n",
+            s->name, s->count, s->contended,
+            s->count ? s->wait.total_us / s->count : 0, s->wait.max_us,
+            wait_buf,
+            s->count ? s->hold.total_us / s->count : 0, s->hold.max_us,
+            hold_buf);
+    }
+
+    for (i = 0; i < num_sites; i++)
+        order[i] = i;
+    for (i = 1; i < num_sites; i++) {
+        for (j = i; j > 0 && sites[order[j]].hold.total_us >
+                            sites[order[j - 1]].hold.total_us; j--) {
+            tmp = order[j];
+            order[j] = order[j - 1];
+            order[j - 1] = tmp;
+        }
+    }
+
+    DUMP(fd, "  top holders of %lld us:\n", total_hold_us);
+    for (i = 0; i < num_sites && i < LOCK_PROFILE_TOP_HOLDERS; i++) {
+        struct lock_site *s = &sites[order[i]];
+
+        DUMP(fd, "    %s %lld us (%lld%%)\n", s->name, s->hold.total_us,
+            total_hold_us ? s->hold.total_us * 100 / total_hold_us : 0);
+    }
+}
+
+void lock_profile_reset(struct lock_profile *lp)
+{
+    pthread_mutex_lock(lp->mutex);
+    memset(lp->sites, 0, sizeof(lp->sites));
+    lp->num_sites = 0;
+    lp->holder = -1;
+    pthread_mutex_unlock(lp->mutex);
+}
@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2018 Knowles Electronics
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LOCK_PROFILE_H_
+#define _LOCK_PROFILE_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <time.h>
+
+#if __cplusplus
+extern "C"
+{
+#endif
+
+#define LOCK_PROFILE_MAX_SITES      (48)
+// Log2 buckets in us, the last one takes everything from 2^14 us up
+#define LOCK_PROFILE_BUCKETS        (16)
+#define LOCK_PROFILE_TOP_HOLDERS    (5)
+// Holds longer than this are logged as they happen
+#define LOCK_PROFILE_SLOW_HOLD_US   (100 * 1000)
+
+struct lock_histogram {
+    unsigned int buckets[LOCK_PROFILE_BUCKETS];
+    long long total_us;
+    long long max_us;
+};
+
+struct lock_site {
+    // The function that took the lock
+    const char *name;
+    unsigned int count;
+    unsigned int contended;
+    struct lock_histogram wait;
+    struct lock_histogram hold;
+};
+
+/*
+ * Wait and hold times of one mutex, per call site. Everything below mutex is
+ * only written by the thread holding it, so the profile needs no lock of its
+ * own. When disabled the wrappers are a plain lock/unlock.
+ */
+struct lock_profile {
+    const char *name;
+    pthread_mutex_t *mutex;
+    bool is_enabled;
+    int num_sites;
+    struct lock_site sites[LOCK_PROFILE_MAX_SITES];
+    // Site of the current holder, -1 if not profiled
+    int holder;
+    struct timespec acquired;
+};
+
+/**
+ * Profiling can be switched on or off at any time, a hold that started
+ * while it was off is not accounted.
+ */
+void lock_profile_enable(struct lock_profile *lp, bool is_enabled);
+
+/**
+ * Drop-in replacements for pthread_mutex_lock/unlock and pthread_cond_wait/
+ * timedwait on lp->mutex. site has to be a string with static storage,
+ * __func__ usually.
+ */
+void lock_profile_lock(struct lock_profile *lp, const char *site);
+void lock_profile_unlock(struct lock_profile *lp);
+int lock_profile_cond_wait(struct lock_profile *lp, pthread_cond_t *cond,
+                        const char *site);
+int lock_profile_cond_timedwait(struct lock_profile *lp, pthread_cond_t *cond,
+                                const struct timespec *abstime,
+                                const char *site);
+
+/**
+ * Writes the per site histograms and the top holders to fd, or to the log
+ * if fd is negative. Takes lp->mutex, must not be called with it held.
+ */
+void lock_profile_dump(struct lock_profile *lp, int fd);
+
+/**
+ * Clears the counters, takes lp->mutex.
+ */
+void lock_profile_reset(struct lock_profile *lp);
+
+#if __cplusplus
+} // extern "C"
+#endif
+
+#endif
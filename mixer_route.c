@@ -0,0 +1,1037 @@
+/*
+ * Copyright (C) 2018 Knowles Electronics
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "SoundTriggerMixerRoute"
+#define LOG_NDEBUG 0
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <log/log.h>
+#include <expat.h>
+#include <tinyalsa/asoundlib.h>
+
+#include "mixer_route.h"
+#include "sthal_util.h"
+
+#define ROUTE_TABLE_MAGIC   (0x54525453) // "STRT"
+#define ROUTE_TABLE_VERSION (1)
+// Far more than any mixer paths file needs, keeps the size checks simple
+#define ROUTE_TABLE_MAX_SIZE (1 << 20)
+
+/*
+ * The table is a header followed by the ctls, paths, settings, values and
+ * string arrays, in that order. Names are offsets into the strings. paths[0]
+ * has no name and holds the initial control values, included paths are
+ * expanded into the paths that include them.
+ */
+struct route_table_header {
+    uint32_t magic;
+    uint32_t version;
+    // The XML the table was compiled from
+    int64_t src_mtime_sec;
+    int64_t src_mtime_nsec;
+    int64_t src_size;
+    // Control ids are only valid on a card with the same controls
+    uint32_t num_mixer_ctls;
+    uint32_t num_ctls;
+    uint32_t num_paths;
+    uint32_t num_settings;
+    uint32_t num_values;
+    uint32_t strings_size;
+};
+
+struct route_table_ctl {
+    uint32_t id;
+    uint32_t name;
+    uint32_t num_values;
+    uint32_t is_byte;
+};
+
+struct route_table_path {
+    uint32_t name;
+    uint32_t first_setting;
+    uint32_t num_settings;
+};
+
+// Sets num_values values of a control, from index on
+struct route_table_setting {
+    uint32_t ctl;
+    uint32_t index;
+    uint32_t num_values;
+    uint32_t first_value;
+};
+
+struct route_ctl_state {
+    struct mixer_ctl *ctl;
+    // Last written, staged and initial values
+    int *old_value;
+    int *new_value;
+    int *reset_value;
+    // Paths applied and not reset yet using it, batched or not
+    unsigned int active_count;
+};
+
+struct mixer_route {
+    struct mixer *mixer;
+    void *table;
+    size_t table_size;
+    bool is_mapped;
+    const struct route_table_header *hdr;
+    const struct route_table_ctl *ctls;
+    const struct route_table_path *paths;
+    const struct route_table_setting *settings;
+    const int32_t *values;
+    const char *strings;
+    struct route_ctl_state *state;
+    int *state_values;
+};
+
+// Appends only, a failed one sticks and drops the ones after it
+struct table_buf {
+    char *data;
+    size_t len;
+    size_t size;
+    int err;
+};
+
+struct route_compiler {
+    struct mixer *mixer;
+    struct table_buf ctls;
+    struct table_buf paths;
+    // The initial values are kept apart, they may come after paths
+    struct table_buf defaults;
+    struct table_buf settings;
+    struct table_buf values;
+    struct table_buf strings;
+    // Index of the path being parsed, or -1 at the top level
+    int cur_path;
+    int depth;
+    int err;
+};
+
+// Returns the offset of n zeroed bytes at the end of the buffer, or -1
+static long table_buf_add(struct table_buf *b, size_t n)
+{
+    size_t size;
+    char *data;
+    long offset;
+
+    if (b->err)
+        return -1;
+
+    if (b->len + n > b->size) {
+        size = b->size ? b->size : 256;
+        while (b->len + n > size)
+            size *= 2;
+        data = realloc(b->data, size);
+        if (data == NULL) {
+            b->err = -ENOMEM;
+            return -1;
+        }
+        b->data = data;
+        b->size = size;
+    }
+    offset = b->len;
+    memset(b->data + offset, 0, n);
+    b->len += n;
+
+    return offset;
+}
+
+#define TABLE_COUNT(b, type) ((b)->len / sizeof(type))
+#define TABLE_AT(b, type, i) (&((type *)(b)->data)[i])
+
+static long add_string(struct route_compiler *rc, const char *s)
+{
+    size_t n = strlen(s) + 1;
+    long offset = table_buf_add(&rc->strings, n);
+
+    if (offset >= 0)
+        memcpy(rc->strings.data + offset, s, n);
+
+    return offset;
+}
+
+static const char *get_xml_attr(const XML_Char **attr, const char *name)
+{
+    for (int i = 0; attr[i] != NULL; i += 2) {
+        if (!strcmp(attr[i], name))
+            return attr[i + 1];
+    }
+
+    return NULL;
+}
+
+// Index of the table control for name, added on first use, or -1
+static int find_table_ctl(struct route_compiler *rc, const char *name)
+{
+    struct route_table_ctl *tctl;
+    struct mixer_ctl *ctl;
+    unsigned int i, num = TABLE_COUNT(&rc->ctls, struct route_table_ctl);
+    long offset;
+
+    for (i = 0; i < num; i++) {
+        tctl = TABLE_AT(&rc->ctls, struct route_table_ctl, i);
+        if (!strcmp(rc->strings.data + tctl->name, name))
+            return i;
+    }
+
+    // Resolved by hand, the id is what goes into the table
+    for (i = 0; i < mixer_get_num_ctls(rc->mixer); i++) {
+        ctl = mixer_get_ctl(rc->mixer, i);
+        if (ctl != NULL && !strcmp(mixer_ctl_get_name(ctl), name))
+            break;
+    }
+    if (i == mixer_get_num_ctls(rc->mixer)) {
+        ALOGW("%s: Control '%s' doesn't exist, skipping", __func__, name);
+        return -1;
+    }
+
+    offset = table_buf_add(&rc->ctls, sizeof(*tctl));
+    if (offset < 0)
+        return -1;
+    tctl = (struct route_table_ctl *)(rc->ctls.data + offset);
+    tctl->id = i;
+    tctl->num_values = mixer_ctl_get_num_values(ctl);
+    tctl->is_byte = mixer_ctl_get_type(ctl) == MIXER_CTL_TYPE_BYTE;
+    offset = add_string(rc, name);
+    if (offset < 0)
+        return -1;
+    tctl->name = offset;
+
+    return num;
+}
+
+static int parse_ctl_value(struct mixer_ctl *ctl, const char *value)
+{
+    unsigned int i;
+
+    if (mixer_ctl_get_type(ctl) != MIXER_CTL_TYPE_ENUM)
+        return strtol(value, NULL, 0);
+
+    for (i = 0; i < mixer_ctl_get_num_enums(ctl); i++) {
+        if (!strcmp(mixer_ctl_get_enum_string(ctl, i), value))
+            return i;
+    }
+    ALOGE("%s: '%s' isn't a value of %s", __func__, value,
+        mixer_ctl_get_name(ctl));
+
+    return -1;
+}
+
+/*
+ * A byte control takes a list of bytes, any other control takes one value
+ * for every index, or only for the index given by id.
+ */
+static void add_ctl_setting(struct route_compiler *rc, const XML_Char **attr)
+{
+    const char *name = get_xml_attr(attr, "name");
+    const char *value = get_xml_attr(attr, "value");
+    const char *id = get_xml_attr(attr, "id");
+    struct table_buf *out = rc->cur_path > 0 ? &rc->settings : &rc->defaults;
+    struct route_table_setting *s;
+    struct route_table_ctl *tctl;
+    struct mixer_ctl *ctl;
+    unsigned int index = 0, n, i;
+    long first, offset;
+    char *end;
+    int c, v;
+
+    if (name == NULL || value == NULL) {
+        ALOGE("%s: ctl without a name or value", __func__);
+        rc->err = -EINVAL;
+        return;
+    }
+
+    c = find_table_ctl(rc, name);
+    if (c < 0)
+        return;
+    tctl = TABLE_AT(&rc->ctls, struct route_table_ctl, c);
+    ctl = mixer_get_ctl(rc->mixer, tctl->id);
+
+    if (id != NULL)
+        index = strtoul(id, NULL, 0);
+    if (index >= tctl->num_values) {
+        ALOGE("%s: %s has no index %u", __func__, name, index);
+        rc->err = -EINVAL;
+        return;
+    }
+
+    first = TABLE_COUNT(&rc->values, int32_t);
+    if (tctl->is_byte) {
+        for (n = 0; index + n < tctl->num_values; n++) {
+            v = strtol(value, &end, 0);
+            if (end == value)
+                break;
+            offset = table_buf_add(&rc->values, sizeof(int32_t));
+            if (offset < 0)
+                return;
+            *(int32_t *)(rc->values.data + offset) = v;
+            value = end + strspn(end, " ,");
+        }
+    } else {
+        v = parse_ctl_value(ctl, value);
+        if (v < 0 && mixer_ctl_get_type(ctl) == MIXER_CTL_TYPE_ENUM) {
+            rc->err = -EINVAL;
+            return;
+        }
+        n = id != NULL ? 1 : tctl->num_values;
+        for (i = 0; i < n; i++) {
+            offset = table_buf_add(&rc->values, sizeof(int32_t));
+            if (offset < 0)
+                return;
+            *(int32_t *)(rc->values.data + offset) = v;
+        }
+    }
+
+    offset = table_buf_add(out, sizeof(*s));
+    if (offset < 0)
+        return;
+    s = (struct route_table_setting *)(out->data + offset);
+    s->ctl = c;
+    s->index = index;
+    s->num_values = n;
+    s->first_value = first;
+    if (rc->cur_path > 0)
+        TABLE_AT(&rc->paths, struct route_table_path, rc->cur_path)->
+            num_settings++;
+}
+
+static int find_compiled_path(struct route_compiler *rc, const char *name)
+{
+    unsigned int i, num = TABLE_COUNT(&rc->paths, struct route_table_path);
+    struct route_table_path *p;
+
+    for (i = 1; i < num; i++) {
+        p = TABLE_AT(&rc->paths, struct route_table_path, i);
+        if (!strcmp(rc->strings.data + p->name, name))
+            return i;
+    }
+
+    return -1;
+}
+
+// Included paths have to be defined before, as with libaudioroute
+static void add_included_path(struct route_compiler *rc, const char *name)
+{
+    struct route_table_path *inc, *cur;
+    size_t len;
+    long offset;
+    int i = find_compiled_path(rc, name);
+
+    if (i < 0 || i == rc->cur_path) {
+        ALOGE("%s: path '%s' isn't defined", __func__, name);
+        rc->err = -EINVAL;
+        return;
+    }
+
+    inc = TABLE_AT(&rc->paths, struct route_table_path, i);
+    len = inc->num_settings * sizeof(struct route_table_setting);
+    offset = table_buf_add(&rc->settings, len);
+    if (offset < 0)
+        return;
+    memcpy(rc->settings.data + offset, TABLE_AT(&rc->settings,
+        struct route_table_setting, inc->first_setting), len);
+    cur = TABLE_AT(&rc->paths, struct route_table_path, rc->cur_path);
+    cur->num_settings += inc->num_settings;
+}
+
+static void add_path(struct route_compiler *rc, const char *name)
+{
+    struct route_table_path *p;
+    long offset, name_offset;
+
+    if (name == NULL) {
+        ALOGE("%s: path without a name", __func__);
+        rc->err = -EINVAL;
+        return;
+    }
+
+    name_offset = add_string(rc, name);
+    offset = table_buf_add(&rc->paths, sizeof(*p));
+    if (name_offset < 0 || offset < 0)
+        return;
+    p = (struct route_table_path *)(rc->paths.data + offset);
+    p->name = name_offset;
+    p->first_setting = TABLE_COUNT(&rc->settings, struct route_table_setting);
+    rc->cur_path = TABLE_COUNT(&rc->paths, struct route_table_path) - 1;
+}
+
+static void route_start_tag(void *data, const XML_Char *tag,
+                            const XML_Char **attr)
+{
+    struct route_compiler *rc = data;
+
+    // <mixer> is depth 1, its children depth 2
+    if (rc->depth++ == 0 || rc->err)
+        return;
+
+    if (!strcmp(tag, "path")) {
+        if (rc->depth == 2)
+            add_path(rc, get_xml_attr(attr, "name"));
+        else if (rc->cur_path > 0)
+            add_included_path(rc, get_xml_attr(attr, "name"));
+    } else if (!strcmp(tag, "ctl")) {
+        add_ctl_setting(rc, attr);
+    }
+}
+
+static void route_end_tag(void *data, const XML_Char *tag)
+{
+    struct route_compiler *rc = data;
+
+    if (--rc->depth == 1 && !strcmp(tag, "path"))
+        rc->cur_path = -1;
+}
+
+static void free_route_compiler(struct route_compiler *rc)
+{
+    free(rc->ctls.data);
+    free(rc->paths.data);
+    free(rc->defaults.data);
+    free(rc->settings.data);
+    free(rc->values.data);
+    free(rc->strings.data);
+}
+
+static size_t route_table_size(const struct route_table_header *hdr)
+{
+    return sizeof(*hdr) +
+        hdr->num_ctls * sizeof(struct route_table_ctl) +
+        hdr->num_paths * sizeof(struct route_table_path) +
+        hdr->num_settings * sizeof(struct route_table_setting) +
+        hdr->num_values * sizeof(int32_t) +
+        hdr->strings_size;
+}
+
+static void set_table(struct mixer_route *mr, void *table, size_t size)
+{
+    const char *p = table;
+
+    mr->table = table;
+    mr->table_size = size;
+    mr->hdr = table;
+    p += sizeof(*mr->hdr);
+    mr->ctls = (const struct route_table_ctl *)p;
+    p += mr->hdr->num_ctls * sizeof(*mr->ctls);
+    mr->paths = (const struct route_table_path *)p;
+    p += mr->hdr->num_paths * sizeof(*mr->paths);
+    mr->settings = (const struct route_table_setting *)p;
+    p += mr->hdr->num_settings * sizeof(*mr->settings);
+    mr->values = (const int32_t *)p;
+    p += mr->hdr->num_values * sizeof(*mr->values);
+    mr->strings = p;
+}
+
+/*
+ * Lays out what the compiler collected as a table, the initial values go
+ * first as paths[0].
+ */
+static int build_table(struct mixer_route *mr, struct route_compiler *rc,
+                    const struct stat *src)
+{
+    struct route_table_header hdr;
+    struct route_table_path *paths;
+    struct route_table_path *defaults;
+    unsigned int num_defaults, i;
+    size_t size;
+    char *table, *p;
+
+    num_defaults = TABLE_COUNT(&rc->defaults, struct route_table_setting);
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = ROUTE_TABLE_MAGIC;
+    hdr.version = ROUTE_TABLE_VERSION;
+    hdr.src_mtime_sec = src->st_mtim.tv_sec;
+    hdr.src_mtime_nsec = src->st_mtim.tv_nsec;
+    hdr.src_size = src->st_size;
+    hdr.num_mixer_ctls = mixer_get_num_ctls(rc->mixer);
+    hdr.num_ctls = TABLE_COUNT(&rc->ctls, struct route_table_ctl);
+    hdr.num_paths = TABLE_COUNT(&rc->paths, struct route_table_path);
+    hdr.num_settings = num_defaults +
+        TABLE_COUNT(&rc->settings, struct route_table_setting);
+    hdr.num_values = TABLE_COUNT(&rc->values, int32_t);
+    hdr.strings_size = rc->strings.len;
+
+    size = route_table_size(&hdr);
+    table = malloc(size);
+    if (table == NULL)
+        return -ENOMEM;
+
+    p = table;
+    memcpy(p, &hdr, sizeof(hdr));
+    p += sizeof(hdr);
+    memcpy(p, rc->ctls.data, rc->ctls.len);
+    p += rc->ctls.len;
+    paths = (struct route_table_path *)p;
+    memcpy(p, rc->paths.data, rc->paths.len);
+    p += rc->paths.len;
+    memcpy(p, rc->defaults.data, rc->defaults.len);
+    p += rc->defaults.len;
+    memcpy(p, rc->settings.data, rc->settings.len);
+    p += rc->settings.len;
+    memcpy(p, rc->values.data, rc->values.len);
+    p += rc->values.len;
+    memcpy(p, rc->strings.data, rc->strings.len);
+
+    defaults = &paths[0];
+    defaults->first_setting = 0;
+    defaults->num_settings = num_defaults;
+    for (i = 1; i < hdr.num_paths; i++)
+        paths[i].first_setting += num_defaults;
+
+    set_table(mr, table, size);
+    mr->is_mapped = false;
+
+    return 0;
+}
+
+static int compile_table(struct mixer_route *mr, const char *xml_path,
+                        const void *xml, const struct stat *src)
+{
+    struct route_compiler rc;
+    XML_Parser parser;
+    int err = 0;
+
+    memset(&rc, 0, sizeof(rc));
+    rc.mixer = mr->mixer;
+    rc.cur_path = -1;
+    // paths[0] and string offset 0, both unnamed
+    if (add_string(&rc, "") < 0 ||
+        table_buf_add(&rc.paths, sizeof(struct route_table_path)) < 0) {
+        err = -ENOMEM;
+        goto exit;
+    }
+
+    parser = XML_ParserCreate(NULL);
+    if (parser == NULL) {
+        err = -ENOMEM;
+        goto exit;
+    }
+    XML_SetUserData(parser, &rc);
+    XML_SetElementHandler(parser, route_start_tag, route_end_tag);
+    if (XML_Parse(parser, xml, src->st_size, 1) == XML_STATUS_ERROR) {
+        ALOGE("%s: Parse error in %s at line %lu: %s", __func__, xml_path,
+            (unsigned long)XML_GetCurrentLineNumber(parser),
+            XML_ErrorString(XML_GetErrorCode(parser)));
+        err = -EINVAL;
+    }
+    XML_ParserFree(parser);
+    if (err)
+        goto exit;
+
+    err = rc.err;
+    if (err == 0)
+        err = rc.ctls.err ? rc.ctls.err : rc.paths.err;
+    if (err == 0)
+        err = rc.defaults.err ? rc.defaults.err : rc.settings.err;
+    if (err == 0)
+        err = rc.values.err ? rc.values.err : rc.strings.err;
+    if (err == 0)
+        err = build_table(mr, &rc, src);
+
+exit:
+    free_route_compiler(&rc);
+    return err;
+}
+
+static int write_table(struct mixer_route *mr, const char *table_path)
+{
+    char tmp_file[PATH_MAX];
+    const char *p = mr->table;
+    size_t left = mr->table_size;
+    ssize_t n;
+    int fd, err = 0;
+
+    snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", table_path);
+    fd = open(tmp_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        err = -errno;
+        ALOGE("%s: Can't create %s %d(%s)", __func__, tmp_file, errno,
+            strerror(errno));
+        return err;
+    }
+
+    while (left > 0) {
+        n = write(fd, p, left);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            err = n < 0 ? -errno : -EIO;
+            break;
+        }
+        p += n;
+        left -= n;
+    }
+    if (err == 0 && fsync(fd) != 0)
+        err = -errno;
+    close(fd);
+
+    if (err == 0 && rename(tmp_file, table_path) != 0)
+        err = -errno;
+    if (err != 0) {
+        ALOGE("%s: Failed to write %s %d", __func__, table_path, err);
+        unlink(tmp_file);
+    }
+
+    return err;
+}
+
+// Everything in the file is checked, it's mapped without being copied
+static bool is_table_valid(const struct route_table_header *hdr, size_t size,
+                        const struct stat *src, unsigned int num_mixer_ctls)
+{
+    const struct route_table_ctl *ctls;
+    const struct route_table_path *paths;
+    const struct route_table_setting *settings;
+    const char *strings;
+    unsigned int i;
+
+    if (size < sizeof(*hdr) || size > ROUTE_TABLE_MAX_SIZE ||
+        hdr->magic != ROUTE_TABLE_MAGIC ||
+        hdr->version != ROUTE_TABLE_VERSION)
+        return false;
+
+    if (hdr->src_mtime_sec != (int64_t)src->st_mtim.tv_sec ||
+        hdr->src_mtime_nsec != (int64_t)src->st_mtim.tv_nsec ||
+        hdr->src_size != (int64_t)src->st_size ||
+        hdr->num_mixer_ctls != num_mixer_ctls)
+        return false;
+
+    // With each count bounded by the file size the sum can't overflow
+    if (hdr->num_ctls > size || hdr->num_paths > size ||
+        hdr->num_settings > size || hdr->num_values > size ||
+        hdr->strings_size > size || route_table_size(hdr) != size ||
+        hdr->num_paths == 0 || hdr->strings_size == 0)
+        return false;
+
+    ctls = (const struct route_table_ctl *)(hdr + 1);
+    paths = (const struct route_table_path *)(ctls + hdr->num_ctls);
+    settings = (const struct route_table_setting *)(paths + hdr->num_paths);
+    strings = (const char *)((const int32_t *)(settings + hdr->num_settings) +
+                            hdr->num_values);
+    if (strings[hdr->strings_size - 1] != '\0')
+        return false;
+
+    for (i = 0; i < hdr->num_ctls; i++) {
+        if (ctls[i].id >= num_mixer_ctls ||
+            ctls[i].name >= hdr->strings_size)
+            return false;
+    }
+    for (i = 0; i < hdr->num_paths; i++) {
+        if (paths[i].name >= hdr->strings_size ||
+            paths[i].first_setting > hdr->num_settings ||
+            paths[i].num_settings > hdr->num_settings - paths[i].first_setting)
+            return false;
+    }
+    for (i = 0; i < hdr->num_settings; i++) {
+        const struct route_table_setting *s = &settings[i];
+
+        if (s->ctl >= hdr->num_ctls ||
+            s->index > ctls[s->ctl].num_values ||
+            s->num_values > ctls[s->ctl].num_values - s->index ||
+            s->first_value > hdr->num_values ||
+            s->num_values > hdr->num_values - s->first_value)
+            return false;
+    }
+
+    return true;
+}
+
+static int map_table(struct mixer_route *mr, const char *table_path,
+                    const struct stat *src)
+{
+    struct stat st;
+    void *map;
+    int fd, err = 0;
+
+    fd = open(table_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -errno;
+
+    if (fstat(fd, &st) != 0) {
+        err = -errno;
+        goto exit;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        err = -errno;
+        goto exit;
+    }
+
+    if (!is_table_valid(map, st.st_size, src,
+                        mixer_get_num_ctls(mr->mixer))) {
+        ALOGD("%s: %s is stale", __func__, table_path);
+        munmap(map, st.st_size);
+        err = -ESTALE;
+        goto exit;
+    }
+
+    set_table(mr, map, st.st_size);
+    mr->is_mapped = true;
+
+exit:
+    close(fd);
+    return err;
+}
+
+static void free_table(struct mixer_route *mr)
+{
+    if (mr->table == NULL)
+        return;
+
+    if (mr->is_mapped)
+        munmap(mr->table, mr->table_size);
+    else
+        free(mr->table);
+    mr->table = NULL;
+    free(mr->state);
+    mr->state = NULL;
+    free(mr->state_values);
+    mr->state_values = NULL;
+}
+
+/*
+ * Reads the current values of the controls in the table, a control that
+ * isn't what the table was compiled against makes it stale.
+ */
+static int init_state(struct mixer_route *mr)
+{
+    const struct route_table_ctl *tctl;
+    struct route_ctl_state *st;
+    unsigned int i, j, total = 0;
+    unsigned char *bytes;
+    int *v;
+
+    for (i = 0; i < mr->hdr->num_ctls; i++)
+        total += mr->ctls[i].num_values;
+
+    mr->state = calloc(mr->hdr->num_ctls, sizeof(*mr->state));
+    mr->state_values = calloc(total * 3, sizeof(int));
+    if ((mr->hdr->num_ctls > 0 && mr->state == NULL) ||
+        (total > 0 && mr->state_values == NULL))
+        return -ENOMEM;
+
+    v = mr->state_values;
+    for (i = 0; i < mr->hdr->num_ctls; i++) {
+        tctl = &mr->ctls[i];
+        st = &mr->state[i];
+        st->ctl = mixer_get_ctl(mr->mixer, tctl->id);
+        if (st->ctl == NULL ||
+            strcmp(mixer_ctl_get_name(st->ctl), mr->strings + tctl->name) ||
+            mixer_ctl_get_num_values(st->ctl) != tctl->num_values)
+            return -ESTALE;
+
+        st->old_value = v;
+        st->new_value = v + tctl->num_values;
+        st->reset_value = v + tctl->num_values * 2;
+        v += tctl->num_values * 3;
+
+        if (tctl->is_byte) {
+            bytes = malloc(tctl->num_values);
+            if (bytes == NULL)
+                return -ENOMEM;
+            if (mixer_ctl_get_array(st->ctl, bytes, tctl->num_values) == 0) {
+                for (j = 0; j < tctl->num_values; j++)
+                    st->old_value[j] = bytes[j];
+            }
+            free(bytes);
+        } else {
+            for (j = 0; j < tctl->num_values; j++)
+                st->old_value[j] = mixer_ctl_get_value(st->ctl, j);
+        }
+        memcpy(st->new_value, st->old_value,
+            tctl->num_values * sizeof(int));
+    }
+
+    return 0;
+}
+
+static int write_ctl(struct mixer_route *mr, unsigned int c)
+{
+    const struct route_table_ctl *tctl = &mr->ctls[c];
+    struct route_ctl_state *st = &mr->state[c];
+    unsigned char *bytes;
+    unsigned int j;
+    int err = 0;
+
+    if (!memcmp(st->old_value, st->new_value, tctl->num_values * sizeof(int)))
+        return 0;
+
+    if (tctl->is_byte) {
+        bytes = malloc(tctl->num_values);
+        if (bytes == NULL)
+            return -ENOMEM;
+        for (j = 0; j < tctl->num_values; j++)
+            bytes[j] = st->new_value[j];
+        err = mixer_ctl_set_array(st->ctl, bytes, tctl->num_values);
+        free(bytes);
+    } else {
+        for (j = 0; j < tctl->num_values && err == 0; j++) {
+            if (st->old_value[j] != st->new_value[j])
+                err = mixer_ctl_set_value(st->ctl, j, st->new_value[j]);
+        }
+    }
+
+    if (err != 0) {
+        ALOGE("%s: Failed to set %s %d", __func__,
+            mr->strings + tctl->name, err);
+        return err;
+    }
+    memcpy(st->old_value, st->new_value, tctl->num_values * sizeof(int));
+
+    return 0;
+}
+
+static const struct route_table_path *find_path(struct mixer_route *mr,
+                                                const char *name)
+{
+    for (unsigned int i = 1; i < mr->hdr->num_paths; i++) {
+        if (!strcmp(mr->strings + mr->paths[i].name, name))
+            return &mr->paths[i];
+    }
+    ALOGE("%s: unable to find path '%s'", __func__, name);
+
+    return NULL;
+}
+
+/*
+ * The paths using a control are counted when they are staged, whether the
+ * mixer is updated right away or with the rest of a batch.
+ */
+static void stage_path(struct mixer_route *mr,
+                    const struct route_table_path *path)
+{
+    for (unsigned int i = 0; i < path->num_settings; i++) {
+        const struct route_table_setting *s =
+            &mr->settings[path->first_setting + i];
+        struct route_ctl_state *st = &mr->state[s->ctl];
+
+        st->active_count++;
+        memcpy(&st->new_value[s->index], &mr->values[s->first_value],
+            s->num_values * sizeof(int));
+    }
+}
+
+/*
+ * As libaudioroute does, a control shared with another path that is still
+ * set up keeps its value when a path is reset.
+ */
+static void unstage_path(struct mixer_route *mr,
+                        const struct route_table_path *path)
+{
+    for (unsigned int i = 0; i < path->num_settings; i++) {
+        const struct route_table_setting *s =
+            &mr->settings[path->first_setting + i];
+        struct route_ctl_state *st = &mr->state[s->ctl];
+
+        if (st->active_count > 0 && --st->active_count > 0)
+            continue;
+        memcpy(&st->new_value[s->index], &st->reset_value[s->index],
+            s->num_values * sizeof(int));
+    }
+}
+
+// Writes the controls of a staged path, a reset goes in reverse
+static int update_path(struct mixer_route *mr,
+                    const struct route_table_path *path, bool reverse)
+{
+    unsigned int i, n = path->num_settings;
+    int err = 0, ret;
+
+    for (i = 0; i < n; i++) {
+        const struct route_table_setting *s =
+            &mr->settings[path->first_setting + (reverse ? n - 1 - i : i)];
+
+        ret = write_ctl(mr, s->ctl);
+        if (err == 0)
+            err = ret;
+    }
+
+    return err;
+}
+
+int mixer_route_apply_path(struct mixer_route *mr, const char *name)
+{
+    const struct route_table_path *path = find_path(mr, name);
+
+    if (path == NULL)
+        return -EINVAL;
+    stage_path(mr, path);
+
+    return 0;
+}
+
+int mixer_route_reset_path(struct mixer_route *mr, const char *name)
+{
+    const struct route_table_path *path = find_path(mr, name);
+
+    if (path == NULL)
+        return -EINVAL;
+    unstage_path(mr, path);
+
+    return 0;
+}
+
+int mixer_route_apply_and_update_path(struct mixer_route *mr,
+                                    const char *name)
+{
+    const struct route_table_path *path = find_path(mr, name);
+
+    if (path == NULL)
+        return -EINVAL;
+    stage_path(mr, path);
+
+    return update_path(mr, path, false);
+}
+
+int mixer_route_reset_and_update_path(struct mixer_route *mr,
+                                    const char *name)
+{
+    const struct route_table_path *path = find_path(mr, name);
+
+    if (path == NULL)
+        return -EINVAL;
+    unstage_path(mr, path);
+
+    return update_path(mr, path, true);
+}
+
+int mixer_route_update_mixer(struct mixer_route *mr)
+{
+    int err = 0, ret;
+
+    for (unsigned int i = 0; i < mr->hdr->num_ctls; i++) {
+        ret = write_ctl(mr, i);
+        if (err == 0)
+            err = ret;
+    }
+
+    return err;
+}
+
+bool mixer_route_is_cached(const struct mixer_route *mr)
+{
+    return mr->is_mapped;
+}
+
+/*
+ * Maps the table if it's up to date, otherwise compiles it from the XML and
+ * saves it for the next start. The initial values are then applied and kept
+ * as what a reset returns to.
+ */
+struct mixer_route *mixer_route_init(unsigned int card, const char *xml_path,
+                                    const char *table_path)
+{
+    struct mixer_route *mr;
+    struct timespec start, loaded, end;
+    struct stat src;
+    void *xml = MAP_FAILED;
+    unsigned int i;
+    int fd = -1, err;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    mr = calloc(1, sizeof(*mr));
+    if (mr == NULL)
+        return NULL;
+
+    mr->mixer = mixer_open(card);
+    if (mr->mixer == NULL) {
+        ALOGE("%s: Unable to open the mixer of card %u", __func__, card);
+        goto error;
+    }
+
+    fd = open(xml_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &src) != 0) {
+        ALOGE("%s: Can't open %s %d(%s)", __func__, xml_path, errno,
+            strerror(errno));
+        goto error;
+    }
+
+    err = map_table(mr, table_path, &src);
+    if (err == 0) {
+        err = init_state(mr);
+        if (err != 0)
+            free_table(mr);
+    }
+    if (err != 0) {
+        ALOGD("%s: compiling %s from %s", __func__, table_path, xml_path);
+        xml = mmap(NULL, src.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (xml == MAP_FAILED) {
+            ALOGE("%s: Can't map %s %d(%s)", __func__, xml_path, errno,
+                strerror(errno));
+            goto error;
+        }
+        err = compile_table(mr, xml_path, xml, &src);
+        if (err == 0)
+            err = init_state(mr);
+        if (err != 0) {
+            ALOGE("%s: Failed to compile %s %d", __func__, xml_path, err);
+            goto error;
+        }
+        // Still usable from memory if it can't be saved
+        write_table(mr, table_path);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &loaded);
+
+    // paths[0] has the initial values, it isn't a path that can be reset
+    stage_path(mr, &mr->paths[0]);
+    mixer_route_update_mixer(mr);
+    for (i = 0; i < mr->hdr->num_ctls; i++) {
+        memcpy(mr->state[i].reset_value, mr->state[i].new_value,
+            mr->ctls[i].num_values * sizeof(int));
+        mr->state[i].active_count = 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    ALOGD("%s: %s %u paths, %u controls in %lld us, initial values in %lld us",
+        __func__, mr->is_mapped ? "mapped" : "compiled",
+        mr->hdr->num_paths - 1, mr->hdr->num_ctls,
+        timespec_diff_us(&loaded, &start), timespec_diff_us(&end, &loaded));
+
+    if (xml != MAP_FAILED)
+        munmap(xml, src.st_size);
+    close(fd);
+    return mr;
+
+error:
+    if (xml != MAP_FAILED)
+        munmap(xml, src.st_size);
+    if (fd >= 0)
+        close(fd);
+    mixer_route_free(mr);
+    return NULL;
+}
+
+void mixer_route_free(struct mixer_route *mr)
+{
+    if (mr == NULL)
+        return;
+
+    free_table(mr);
+    if (mr->mixer != NULL)
+        mixer_close(mr->mixer);
+    free(mr);
+}
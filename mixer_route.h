@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2018 Knowles Electronics
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MIXER_ROUTE_H_
+#define _MIXER_ROUTE_H_
+
+#include <stdbool.h>
+
+/*
+ * The sound trigger mixer paths as a table of resolved control ids and
+ * values. It is compiled from the mixer paths XML once, saved to table_path
+ * and mapped from there on later starts as long as the XML's mtime and size
+ * haven't changed. The calls follow libaudioroute, which this replaces.
+ */
+struct mixer_route;
+
+struct mixer_route *mixer_route_init(unsigned int card, const char *xml_path,
+                                    const char *table_path);
+void mixer_route_free(struct mixer_route *mr);
+// False if the table had to be compiled from the XML
+bool mixer_route_is_cached(const struct mixer_route *mr);
+
+int mixer_route_apply_path(struct mixer_route *mr, const char *name);
+int mixer_route_reset_path(struct mixer_route *mr, const char *name);
+int mixer_route_apply_and_update_path(struct mixer_route *mr,
+                                    const char *name);
+int mixer_route_reset_and_update_path(struct mixer_route *mr,
+                                    const char *name);
+int mixer_route_update_mixer(struct mixer_route *mr);
+
+#endif
@@ -19,25 +19,42 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <malloc.h>
-#include <poll.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdlib.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/prctl.h>
 #include <log/log.h>
 #include <cutils/uevent.h>
 #include <cutils/properties.h>
 #include <math.h>
 #include <dlfcn.h>
+#include <poll.h>
+#include <sys/inotify.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <sys/timerfd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/memfd.h>
+#include <linux/filter.h>
 
 #include <hardware/hardware.h>
 #include <hardware_legacy/power.h>
 
+#include "adnc_strm.h"
 #include "cvq_ioctl.h"
+#include "lock_profile.h"
+#include "detection_trace.h"
+#include "sthal_metrics.h"
+#include "sthal_util.h"
 #include "sound_trigger_hw_iaxxx.h"
 #include "sound_trigger_intf.h"
 
@@ -51,6 +68,11 @@
 #define ST_HAL_VERSION              (1)
 
 #define UEVENT_MSG_LEN              (1024)
+#define MAX_PENDING_EVENTS          (16)
+#define MAX_EVENT_PAYLOAD_SIZE      (4096)
+// Bigger payloads get an event of their own up to this size
+#define MAX_HEAP_PAYLOAD_SIZE       (64 * 1024)
+#define MAX_EVENTS_PER_WAKEUP       (16)
 
 #define OK_GOOGLE_KW_ID             (0)
 #define AMBIENT_KW_ID               (1)
@@ -66,6 +88,34 @@
 #define IAXXX_FW_DWNLD_SUCCESS_STR  "IAXXX_FW_DWNLD_SUCCESS"
 #define IAXXX_FW_CRASH_EVENT_STR    "IAXXX_CRASH_EVENT"
 
+#define UEVENT_FILTER_PROP          "vendor.sthal.uevent_filter"
+// Lock profiling is always on in builds with STHAL_LOCK_PROFILE defined
+#define LOCK_PROFILE_PROP           "vendor.sthal.lock_profile"
+// Open the tunnel when a detection is delivered instead of on the first read
+#define CAPTURE_PREOPEN_PROP        "vendor.sthal.capture_preopen"
+// Hand single channel captures out as float, always on with STHAL_CAPTURE_FLOAT
+#define CAPTURE_FLOAT_PROP          "vendor.sthal.capture_float"
+// Comma separated endpoints of the channels a capture can have after its first
+#define CAPTURE_CHANNEL_EPS_PROP    "vendor.sthal.capture_channel_eps"
+
+#define REACTOR_STATS_LOG_INTERVAL  (64)
+
+#define MODEL_CACHE_FILE            STHAL_DATA_DIR "/sound_models.cache"
+#define METRICS_SNAPSHOT_FILE       STHAL_DATA_DIR "/metrics.snapshot"
+#define MODEL_CACHE_MAGIC           (0x4b534d43)
+#define MODEL_CACHE_VERSION         (2)
+#define MODEL_CACHE_ALIGN           (8)
+#define MODEL_CACHE_SYNC_DELAY_MS   (500)
+// How long restored models wait for the framework to load them again
+#define MODEL_CACHE_CLAIM_TIMEOUT_MS (60 * 1000)
+// A held detection is only worth delivering while its audio is in the history
+#define HELD_DETECTION_MAX_AGE_MS   (2000)
+
+// Playback start/stop is debounced before barge-in is set up/torn down, the
+// longer teardown window keeps AEC loaded across short notification sounds
+#define AEC_SETUP_DEBOUNCE_MS       (50)
+#define AEC_TEARDOWN_DEBOUNCE_MS    (1000)
+
 #define WAKE_LOCK_NAME "sthal_wake_lock"
 
 #define CARD_NAME                          "iaxxx"
@@ -75,7 +125,21 @@
 #define MAX_SND_CARD    (8)
 #define RETRY_NUMBER    (10)
 #define RETRY_US        (500000)
+// Sound card device nodes, watched while waiting for the iaxxx card
+#define SND_DEV_DIR     "/dev/snd"
 #define TUNNEL_TIMEOUT  5
+#define NO_CAPTURE_HANDLE       (-1)
+// The 2 s history of the hotword buffer
+#define CAPTURE_PREFILL_SAMPLES (2 * SOUND_TRIGGER_SAMPLING_RATE * \
+                                SOUND_TRIGGER_CHANNEL)
+#define CAPTURE_PREFILL_TIMEOUT_MS  (500)
+#define MAX_CAPTURE_CHANNELS        (4)
+// Rings of AUDIO_EVENT_GET_CAPTURE_RING are filled a period at a time
+#define CAPTURE_RING_PERIOD_SAMPLES ((SOUND_TRIGGER_PERIOD_SIZE) * \
+                                    SOUND_TRIGGER_CHANNEL)
+#define CAPTURE_RING_PERIODS        (200)
+// A reader that has left its ring full for this long is gone
+#define CAPTURE_RING_STALL_MS       (TUNNEL_TIMEOUT * 1000)
 
 #define SENSOR_CREATE_WAIT_TIME_IN_S   (1)
 #define SENSOR_CREATE_WAIT_MAX_COUNT   (5)
@@ -85,11 +149,13 @@
 
 #define ST_DEVICE_HANDSET_MIC 1
 
+#ifndef ADNC_STRM_LIBRARY_PATH
 #ifdef __LP64__
 #define ADNC_STRM_LIBRARY_PATH "/vendor/lib64/hw/adnc_strm.primary.default.so"
 #else
 #define ADNC_STRM_LIBRARY_PATH "/vendor/lib/hw/adnc_strm.primary.default.so"
 #endif
+#endif
 
 static const struct sound_trigger_properties hw_properties = {
     "Knowles Electronics",      // implementor
@@ -109,6 +175,182 @@ static const struct sound_trigger_properties hw_properties = {
     POWER_CONSUMPTION           // power_consumption_mw
 };
 
+#define MODEL_REGISTRY_BUCKETS      (16)
+#define MODEL_EVENT_MAP_SIZE        (WAKEUP_KW_ID + 1)
+
+enum model_type {
+    ST_MODEL_HOTWORD,
+    ST_MODEL_WAKEUP,
+    ST_MODEL_AMBIENT,
+    ST_MODEL_ENTITY,
+    ST_MODEL_SENSOR,
+    ST_MODEL_CHRE,
+    ST_MODEL_TYPE_MAX
+};
+
+enum model_kind {
+    MODEL_KIND_KEYWORD,     // detection model written to a plugin slot
+    MODEL_KIND_SENSOR,      // Oslo, only sets up the sensor package/route
+    MODEL_KIND_CHRE         // CHRE, only sets up the CHRE package/route
+};
+
+/*
+ * Chip resources shared by all the keyword models that are hosted by the
+ * same plugin instance, hotword/wakeup live in plugin 1 and ambient/entity
+ * in plugin 2.
+ */
+struct plugin_desc {
+    unsigned int mask;
+    uint32_t inst_id;
+    int strm_end_point;
+    // Model masks that decide if the buffer route needs to be (re)applied
+    unsigned int primary_mask;
+    unsigned int secondary_mask;
+    // Plugin has to be torn down before a new model can be written
+    bool tear_before_write;
+
+    int (*setup_package)(struct iaxxx_odsp_hw *odsp_hdl);
+    int (*destroy_package)(struct iaxxx_odsp_hw *odsp_hdl);
+    int (*set_state)(struct iaxxx_odsp_hw *odsp_hdl, unsigned int current);
+    int (*tear_state)(struct iaxxx_odsp_hw *odsp_hdl, unsigned int current);
+    int (*set_route)(struct mixer_route *route_hdl, bool bargein);
+    int (*tear_route)(struct mixer_route *route_hdl, bool bargein);
+    int (*setup_buffer)(struct iaxxx_odsp_hw *odsp_hdl);
+    int (*destroy_buffer)(struct iaxxx_odsp_hw *odsp_hdl);
+    int (*set_buffer_route)(struct mixer_route *route_hdl, bool bargein);
+    int (*tear_buffer_route)(struct mixer_route *route_hdl, bool bargein);
+    int (*get_param_blk)(struct iaxxx_odsp_hw *odsp_hdl, void *payload,
+                        unsigned int payload_size);
+};
+
+/*
+ * Everything the HAL needs to know about a model type, looked up once by
+ * UUID when the model is loaded and by event id when a detection arrives.
+ */
+struct model_desc {
+    enum model_type type;
+    enum model_kind kind;
+    const char *name;
+    const char *uuid_str;
+    sound_trigger_uuid_t uuid;
+    int kw_id;
+    uint32_t slot_id;
+    unsigned int enable_mask;
+    unsigned int recover_mask;
+    // Called after a detection of this model has been fetched
+    int (*on_detect)(struct iaxxx_odsp_hw *odsp_hdl);
+    const struct plugin_desc *plugin;
+};
+
+static const struct plugin_desc hotword_plugin = {
+    .mask = PLUGIN1_MASK,
+    .inst_id = HOTWORD_INSTANCE_ID,
+    .strm_end_point = CVQ_ENDPOINT,
+    .primary_mask = HOTWORD_MASK,
+    .secondary_mask = WAKEUP_MASK,
+    .tear_before_write = false,
+    .setup_package = setup_hotword_package,
+    .destroy_package = destroy_hotword_package,
+    .set_state = set_hotword_state,
+    .tear_state = tear_hotword_state,
+    .set_route = set_hotword_route,
+    .tear_route = tear_hotword_route,
+    .setup_buffer = setup_howord_buffer,
+    .destroy_buffer = destroy_howord_buffer,
+    .set_buffer_route = set_hotword_buffer_route,
+    .tear_buffer_route = tear_hotword_buffer_route,
+    .get_param_blk = get_wakeup_param_blk,
+};
+
+static const struct plugin_desc ambient_plugin = {
+    .mask = PLUGIN2_MASK,
+    .inst_id = AMBIENT_INSTANCE_ID,
+    .strm_end_point = MUSIC_BUF_ENDPOINT,
+    .primary_mask = AMBIENT_MASK,
+    .secondary_mask = ENTITY_MASK,
+    .tear_before_write = true,
+    .setup_package = setup_ambient_package,
+    .destroy_package = destroy_ambient_package,
+    .set_state = set_ambient_state,
+    .tear_state = tear_ambient_state,
+    .set_route = set_ambient_route,
+    .tear_route = tear_ambient_route,
+    .setup_buffer = setup_music_buffer,
+    .destroy_buffer = destroy_music_buffer,
+    .set_buffer_route = set_music_buffer_route,
+    .tear_buffer_route = tear_music_buffer_route,
+    .get_param_blk = get_entity_param_blk,
+};
+
+/* The UUIDs are parsed and hashed once in stdev_open */
+static struct model_desc model_registry[ST_MODEL_TYPE_MAX] = {
+    [ST_MODEL_HOTWORD] = {
+        .type = ST_MODEL_HOTWORD,
+        .kind = MODEL_KIND_KEYWORD,
+        .name = "Hotword",
+        .uuid_str = HOTWORD_AUDIO_MODEL,
+        .kw_id = OK_GOOGLE_KW_ID,
+        .slot_id = HOTWORD_SLOT_ID,
+        .enable_mask = HOTWORD_MASK,
+        .recover_mask = PLUGIN1_MASK,
+        .plugin = &hotword_plugin,
+    },
+    [ST_MODEL_WAKEUP] = {
+        .type = ST_MODEL_WAKEUP,
+        .kind = MODEL_KIND_KEYWORD,
+        .name = "Wakeup",
+        .uuid_str = WAKEUP_MODEL,
+        .kw_id = WAKEUP_KW_ID,
+        .slot_id = WAKEUP_SLOT_ID,
+        .enable_mask = WAKEUP_MASK,
+        .recover_mask = PLUGIN1_MASK,
+        .plugin = &hotword_plugin,
+    },
+    [ST_MODEL_AMBIENT] = {
+        .type = ST_MODEL_AMBIENT,
+        .kind = MODEL_KIND_KEYWORD,
+        .name = "Ambient",
+        .uuid_str = AMBIENT_AUDIO_MODEL,
+        .kw_id = AMBIENT_KW_ID,
+        .slot_id = AMBIENT_SLOT_ID,
+        .enable_mask = AMBIENT_MASK,
+        .recover_mask = PLUGIN2_MASK,
+        .on_detect = reset_ambient_plugin,
+        .plugin = &ambient_plugin,
+    },
+    [ST_MODEL_ENTITY] = {
+        .type = ST_MODEL_ENTITY,
+        .kind = MODEL_KIND_KEYWORD,
+        .name = "Entity",
+        .uuid_str = ENTITY_AUDIO_MODEL,
+        .kw_id = ENTITY_KW_ID,
+        .slot_id = ENTITY_SLOT_ID,
+        .enable_mask = ENTITY_MASK,
+        .recover_mask = PLUGIN2_MASK,
+        .plugin = &ambient_plugin,
+    },
+    [ST_MODEL_SENSOR] = {
+        .type = ST_MODEL_SENSOR,
+        .kind = MODEL_KIND_SENSOR,
+        .name = "Sensor",
+        .uuid_str = SENSOR_MANAGER_MODEL,
+        .kw_id = USELESS_KW_ID,
+        .enable_mask = OSLO_MASK,
+        .recover_mask = 0,
+        .plugin = NULL,
+    },
+    [ST_MODEL_CHRE] = {
+        .type = ST_MODEL_CHRE,
+        .kind = MODEL_KIND_CHRE,
+        .name = "CHRE",
+        .uuid_str = CHRE_AUDIO_MODEL,
+        .kw_id = USELESS_KW_ID,
+        .enable_mask = CHRE_MASK,
+        .recover_mask = CHRE_MASK,
+        .plugin = NULL,
+    },
+};
+
 struct model_info {
     void *recognition_cookie;
     void *sound_model_cookie;
@@ -117,14 +359,335 @@ struct model_info {
     recognition_callback_t recognition_callback;
     sound_model_callback_t sound_model_callback;
     struct sound_trigger_recognition_config *config;
+    // config points here while recognition is active
+    struct sound_trigger_recognition_config config_storage;
     int kw_id;
     sound_trigger_sound_model_type_t type;
+    const struct model_desc *desc;
 
     void *data;
     int data_sz;
     bool is_loaded;
     bool is_active;
     bool is_state_query;
+    // Restored from the model cache and not loaded again by the framework yet
+    bool is_restored;
+    // Latest detection of a restored model that has no callback yet, it is
+    // delivered once the framework starts the model, see hold_detection()
+    bool has_held_detection;
+    void *held_payload;
+    unsigned int held_payload_size;
+    struct timespec held_time;
+    // Bumped when recognition stops, queued events of an older session are
+    // dropped by the delivery thread
+    atomic_uint session_gen;
+};
+
+/*
+ * A detection that has been fetched from the chip and is waiting to be
+ * delivered, it carries everything the delivery thread needs so that the
+ * callback can be made without holding stdev->lock.
+ */
+struct pending_event {
+    recognition_callback_t callback;
+    void *cookie;
+    struct sound_trigger_recognition_event *event;
+    // Set if the event didn't fit the slot's buffer, freed once delivered
+    void *heap_event;
+    atomic_uint *session_gen;
+    unsigned int gen;
+    int kw_id;
+    struct timespec detect_time;
+    struct detection_trace *trace;
+    // Fetched while a barge-in transition was in flight
+    bool is_during_transition;
+    // Tunnel to open once the event is delivered, or NO_CAPTURE_HANDLE
+    int preopen_capture_handle;
+};
+
+// Which first read of a tunnel is still to come, see note_first_read()
+enum first_read {
+    FIRST_READ_DONE,
+    FIRST_READ_ON_OPEN,
+    FIRST_READ_PREOPENED,
+};
+
+/*
+ * Preallocated recognition event, the generic event payload is read from the
+ * chip straight into data[] right behind the event header. An event with a
+ * bigger payload is allocated with the payload behind it the same way.
+ */
+union event_buf {
+    struct sound_trigger_recognition_event common;
+    struct sound_trigger_phrase_recognition_event phrase;
+    struct sound_trigger_generic_recognition_event generic;
+    char data[sizeof(struct sound_trigger_generic_recognition_event) +
+            MAX_EVENT_PAYLOAD_SIZE];
+};
+
+/*
+ * Single producer (callback thread), single consumer (delivery thread) ring,
+ * head is only written by the consumer and tail only by the producer. Each
+ * slot owns one event buffer which is reused once the slot is consumed.
+ */
+struct event_queue {
+    struct pending_event slots[MAX_PENDING_EVENTS];
+    union event_buf bufs[MAX_PENDING_EVENTS];
+    atomic_uint head;
+    atomic_uint tail;
+    sem_t avail;
+    atomic_bool exit;
+    // Guards in_delivery, see wait_for_delivery()
+    pthread_mutex_t delivery_lock;
+    pthread_cond_t delivery_done;
+    // session_gen of the model whose callback is running, or NULL
+    atomic_uint *in_delivery;
+};
+
+/*
+ * Preopened tunnels waiting to be prefilled by prefill_thread_loop(), posted
+ * by the delivery thread.
+ */
+struct prefill_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    // Capture handle to prefill per tunnel index, or NO_CAPTURE_HANDLE
+    int capture_handles[MAX_MODELS];
+    atomic_bool exit;
+};
+
+enum iaxxx_uevent {
+    IAXXX_UEVENT_NONE,
+    IAXXX_UEVENT_VQ,
+    IAXXX_UEVENT_RECOVERY,
+    IAXXX_UEVENT_FW_DWNLD_SUCCESS,
+    IAXXX_UEVENT_FW_CRASH
+};
+
+static const struct {
+    const char *name;
+    enum iaxxx_uevent type;
+} iaxxx_uevents[] = {
+    { IAXXX_VQ_EVENT_STR, IAXXX_UEVENT_VQ },
+    { IAXXX_RECOVERY_EVENT_STR, IAXXX_UEVENT_RECOVERY },
+    { IAXXX_FW_DWNLD_SUCCESS_STR, IAXXX_UEVENT_FW_DWNLD_SUCCESS },
+    { IAXXX_FW_CRASH_EVENT_STR, IAXXX_UEVENT_FW_CRASH },
+};
+
+/*
+ * The iaxxx driver raises all its uevents with KOBJ_CHANGE, so let the
+ * kernel drop every other action ("add@", "remove@", "bind@", ...) before
+ * it wakes up the callback thread. Only the fixed "change@" prefix of the
+ * header can be checked here, the rest is done by parse_uevent().
+ */
+static struct sock_filter uevent_filter_code[] = {
+    BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 0),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x6368616e, 0, 5),   // "chan"
+    BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 4),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x6765, 0, 3),       // "ge"
+    BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 6),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x40, 0, 1),         // "@"
+    BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+    BPF_STMT(BPF_RET | BPF_K, 0),
+};
+
+enum reactor_source {
+    REACTOR_UEVENT,
+    REACTOR_TERM,
+    REACTOR_TRANSIT,
+    REACTOR_STEP,
+    REACTOR_STRM_TIMER,
+    REACTOR_SENSOR_TIMER,
+    REACTOR_CHRE_TIMER,
+    REACTOR_CACHE_SYNC,
+    REACTOR_CLAIM_TIMER,
+    REACTOR_RECOVERY,
+    REACTOR_SOURCE_MAX
+};
+
+#define MAX_TRANSITION_STEPS        (MAX_MODELS + 16)
+
+enum transition_step_kind {
+    STEP_MIC_ROUTE,
+    STEP_SRC_PACKAGE,
+    STEP_SRC_PLUGIN,
+    STEP_SRC_ROUTE,
+    STEP_AEC_PACKAGE,
+    STEP_BARGEIN_ROUTE,
+    STEP_AMP_REF_ROUTE,
+    STEP_HOTWORD_BUF_ROUTE,
+    STEP_MUSIC_BUF_ROUTE,
+    STEP_MODEL_ROUTE
+};
+
+struct transition_step {
+    enum transition_step_kind kind;
+    bool enable;
+    int param;  // clock/stream/SRC type or model index, depending on kind
+};
+
+struct transition_plan {
+    struct transition_step steps[MAX_TRANSITION_STEPS];
+    int num_steps;
+    int next;
+    bool target;    // barge-in state once every step has run
+    bool in_flight;
+    unsigned int gen;
+    struct timespec start;
+};
+
+struct transition_stats {
+    unsigned int requested;
+    unsigned int applied;
+};
+
+enum startup_stage {
+    STARTUP_CARD,
+    STARTUP_AHAL,
+    STARTUP_ODSP,
+    STARTUP_MIXER,
+    STARTUP_THREADS,
+    STARTUP_FW_STATUS,
+    STARTUP_ATTACH,
+    STARTUP_ROUTE,
+    STARTUP_STAGE_MAX,
+};
+
+static const char * const startup_stage_names[STARTUP_STAGE_MAX] = {
+    [STARTUP_CARD] = "card",
+    [STARTUP_AHAL] = "ahal",
+    [STARTUP_ODSP] = "odsp",
+    [STARTUP_MIXER] = "mixer",
+    [STARTUP_THREADS] = "threads",
+    [STARTUP_FW_STATUS] = "fw_status",
+    [STARTUP_ATTACH] = "attach",
+    [STARTUP_ROUTE] = "route",
+};
+
+// Bring-up stages relative to stdev_open(), logged once the HAL is ready
+struct startup_timeline {
+    struct timespec origin;
+    long long begin_us[STARTUP_STAGE_MAX];
+    long long end_us[STARTUP_STAGE_MAX];
+    bool is_logged;
+};
+
+/*
+ * Crash recovery brings the hotword back first, the HAL is marked ready
+ * after RECOVERY_HOTWORD and the later stages run from the reactor.
+ */
+enum recovery_stage {
+    RECOVERY_BASE,
+    RECOVERY_HOTWORD,
+    RECOVERY_MODELS,
+    RECOVERY_OSLO,
+    RECOVERY_DONE,
+};
+
+static const char * const recovery_stage_names[RECOVERY_DONE] = {
+    [RECOVERY_BASE] = "base",
+    [RECOVERY_HOTWORD] = "hotword",
+    [RECOVERY_MODELS] = "models",
+    [RECOVERY_OSLO] = "oslo",
+};
+
+// Stages relative to the crash, or to the redownload if no crash was seen
+struct recovery_timeline {
+    struct timespec origin;
+    bool is_crash_seen;
+    long long redownload_us;
+    long long begin_us[RECOVERY_DONE];
+    long long end_us[RECOVERY_DONE];
+    enum recovery_stage next;
+};
+
+// What the streaming domain knows of a model, mirrored by update_capture_map()
+struct capture_slot {
+    bool is_active;
+    int capture_handle;
+};
+
+/*
+ * A capture handed to the AHAL in shared memory, see
+ * AUDIO_EVENT_GET_CAPTURE_RING. Set up and torn down under strm_lock, and
+ * filled by its own thread through the lock-free read path. The AHAL can
+ * write anywhere in the header, so what the writer relies on is kept here
+ * and only published to it.
+ */
+struct capture_ring {
+    int fd;
+    size_t map_size;
+    struct capture_ring_header *hdr;
+    uint8_t *data;
+    size_t data_size;
+    uint64_t write_index;
+    uint32_t ts_seq;
+    size_t period_bytes;
+    int capture_handle;
+    pthread_t thread;
+    bool is_thread_created;
+    // Set while the ring owns the tunnel, AUDIO_EVENT_READ_SAMPLES is refused
+    atomic_bool is_active;
+    atomic_bool exit;
+};
+
+/*
+ * AUDIO_EVENT_READ_SAMPLES, the locked counters and lock wait are only
+ * updated with stdev->strm_lock held.
+ */
+struct read_path_stats {
+    atomic_uint lock_free_reads;
+    unsigned int locked_reads;
+    long long lock_wait_us;
+    long long max_lock_wait_us;
+};
+
+struct reactor_stats {
+    unsigned int wakeups;
+    unsigned int by_source[REACTOR_SOURCE_MAX];
+    unsigned int wake_locks;
+    struct timespec start;
+};
+
+struct uevent_stats {
+    unsigned int received;
+    unsigned int relevant;
+    bool is_filter_attached;
+};
+
+struct event_drain_stats {
+    unsigned int wakeups;
+    unsigned int events;
+    // Wakeups that found nothing, their events went out with an earlier one
+    unsigned int coalesced;
+    unsigned int max_depth;
+};
+
+struct delivery_stats {
+    unsigned int count;
+    // Bumped by the callback thread, read by the delivery thread
+    atomic_uint dropped;
+    long long total_us;
+    long long min_us;
+    long long max_us;
+    long long max_transition_us;
+};
+
+// The HAL's share of the metrics registry, see sthal_metrics.h
+struct hal_metrics {
+    struct metric *detections[ST_MODEL_TYPE_MAX];
+    struct metric *events_dropped;
+    struct metric *fw_crashes;
+    struct metric *recoveries;
+    struct metric *recovery_failures;
+    struct metric *recovery_us;
+    struct metric *transitions;
+    struct metric *transition_us;
+    struct metric *capture_preopens;
+    // Duration of the first AUDIO_EVENT_READ_SAMPLES of a tunnel
+    struct metric *first_read_us;
+    struct metric *first_read_preopened_us;
+    struct metric *capture_ring_overruns;
 };
 
 struct knowles_sound_trigger_device {
@@ -132,45 +695,118 @@ struct knowles_sound_trigger_device {
     struct model_info models[MAX_MODELS];
     sound_trigger_uuid_t authkw_model_uuid;
     pthread_t callback_thread;
-    pthread_t monitor_thread;
-    pthread_t transitions_thread;
+    pthread_t delivery_thread;
+    /*
+     * Locking, always taken in this order:
+     *
+     * lock       the model table, chip and route control, the concurrency
+     *            flags and the sensor/CHRE lifecycle. The chip is a single
+     *            resource serialized by the driver. The waits for the SLPI
+     *            and barge-in transitions drop the lock (sensor_create,
+     *            chre_create, transition_done). The Oslo package download
+     *            runs without it, claimed by is_sensor_setup_in_prog, so a
+     *            hotword start doesn't wait behind it (start_sensor_model).
+     * strm_lock  the tunnels: adnc_strm_*, is_streaming, capture_map, the
+     *            stream timer and the streaming library. A tunnel is opened
+     *            and closed under it without stdev->lock, so
+     *            AUDIO_EVENT_READ_SAMPLES never waits for chip operations.
+     *            Never take lock while holding strm_lock.
+     *
+     * The following take no lock:
+     *   - reads of open tunnels (read_capture_stream,
+     *     prefill_capture_stream);
+     *   - the model registry, which is fixed once stdev_open() is done;
+     *   - the delivery queue, which has a single producer and a single
+     *     consumer.
+     */
     pthread_mutex_t lock;
-    pthread_cond_t transition_cond;
-    pthread_cond_t tunnel_create;
+    pthread_mutex_t strm_lock;
+    // Taken and released through lock_stdev()/lock_strm() and friends
+    struct lock_profile lock_prof;
+    struct lock_profile strm_lock_prof;
     pthread_cond_t sensor_create;
     pthread_cond_t chre_create;
     int opened;
-    int send_sock;
-    int recv_sock;
+    // stdev_close() joins the HAL threads without the lock in between
+    bool is_closing;
+
+    // Event sources of the reactor run by callback_thread_loop
+    int term_fd;
+    int transit_fd;
+    int step_fd;
+    int strm_timer_fd;
+    struct reactor_stats reactor_stats;
     struct sound_trigger_recognition_config *last_keyword_detected_config;
 
     // Information about streaming
     int is_streaming;
+    // The streaming library is loaded in the background after open
+    bool is_strm_lib_probed;
+    pthread_t strm_lib_thread;
+    bool is_strm_lib_loading;
     void *adnc_cvq_strm_lib;
     int (*adnc_strm_open)(bool, int, int);
     size_t (*adnc_strm_read)(long, void *, size_t);
     int (*adnc_strm_close)(long);
+    // Optional, only used for latency tracing
+    int (*adnc_strm_get_first_frame_ts)(long, uint64_t *);
+    // Optional, only used for tunnels opened on detection
+    int (*adnc_strm_prefill)(long, size_t);
+    // Optional, closed tunnels may keep streaming for a while
+    void (*adnc_strm_release_lingering)(void);
+    // Optional, only used for captures of more than one channel
+    long (*adnc_strm_open_multi)(bool, unsigned int, const int *, int);
+    // Optional, only used with CAPTURE_FLOAT_PROP set
+    long (*adnc_strm_open_format)(bool, unsigned int, int, int);
+    bool is_capture_preopen_enabled;
+    bool is_capture_float_enabled;
+    int capture_channel_eps[MAX_CAPTURE_CHANNELS - 1];
+    int num_capture_channel_eps;
     long adnc_strm_handle[MAX_MODELS];
-    struct timespec adnc_strm_last_read[MAX_MODELS];
-
-    sound_trigger_uuid_t hotword_model_uuid;
-    sound_trigger_uuid_t sensor_model_uuid;
-    sound_trigger_uuid_t ambient_model_uuid;
-    sound_trigger_uuid_t chre_model_uuid;
-    sound_trigger_uuid_t entity_model_uuid;
-    sound_trigger_uuid_t wakeup_model_uuid;
-
-    int last_detected_model_type;
+    int strm_channels[MAX_MODELS];
+    enum pcm_format strm_formats[MAX_MODELS];
+    // Whether the AHAL was told the format, see report_capture_format()
+    atomic_bool strm_format_reported[MAX_MODELS];
+    // CLOCK_MONOTONIC_COARSE in ms, 0 while the tunnel is closed
+    atomic_llong adnc_strm_last_read_ms[MAX_MODELS];
+    // Published tunnels, see read_capture_stream()
+    atomic_int strm_capture_handle[MAX_MODELS];
+    atomic_int strm_readers[MAX_MODELS];
+    // Set while close_capture_stream() waits for the readers to leave, the
+    // last one out signals strm_readers_gone, see put_strm_reader()
+    atomic_bool strm_closing[MAX_MODELS];
+    pthread_mutex_t strm_reader_lock;
+    pthread_cond_t strm_readers_gone;
+    atomic_int strm_first_read[MAX_MODELS];
+    struct capture_ring capture_rings[MAX_MODELS];
+    struct read_path_stats read_stats;
+    struct capture_slot capture_map[MAX_MODELS];
+
+    // Model type registry, see model_registry[]
+    struct model_desc *desc_by_uuid[MODEL_REGISTRY_BUCKETS];
+    struct model_desc *desc_by_event[MODEL_EVENT_MAP_SIZE];
+
+    // Written on detection, read when a tunnel is opened
+    atomic_int last_detected_model_type;
+    // Latency of the detections per model type, see detection_trace.h
+    struct detection_trace detection_traces[ST_MODEL_TYPE_MAX];
+    // Trace of the last detection, the next capture is accounted to it
+    _Atomic(struct detection_trace *) strm_trace;
     bool is_mic_route_enabled;
     bool is_bargein_route_enabled;
     bool is_chre_loaded;
     bool is_buffer_package_loaded;
     bool is_sensor_route_enabled;
     bool is_src_package_loaded;
+    // Written through set_hal_ready() only
     bool is_st_hal_ready;
+    // Bumped each time the chip goes away, see set_hal_ready()
+    unsigned int fw_gen;
     int hotword_buffer_enable;
     int music_buffer_enable;
     bool is_sensor_destroy_in_prog;
+    // The sensor package is being downloaded without stdev->lock
+    bool is_sensor_setup_in_prog;
     bool is_chre_destroy_in_prog;
 
     // conditions indicate AHAL and mic concurrency status
@@ -185,8 +821,13 @@ struct knowles_sound_trigger_device {
     unsigned int recover_model_list;
     unsigned int rx_active_count;
     transit_case_t transit_case;
+    struct transition_stats transition_stats;
+    struct transition_plan transition;
+    pthread_cond_t transition_done;
+    // Bumped by the reactor whenever it changes the routing itself
+    unsigned int state_gen;
 
-    struct audio_route *route_hdl;
+    struct mixer_route *route_hdl;
     struct mixer *mixer;
     struct iaxxx_odsp_hw *odsp_hdl;
 
@@ -198,13 +839,36 @@ struct knowles_sound_trigger_device {
     char mixer_path_xml[NAME_MAX_SIZE];
     bool fw_reset_done_by_hal;
 
+    struct startup_timeline startup;
+    struct recovery_timeline recovery;
+    int recovery_fd;
+
     // sensor stop signal event
-    timer_t ss_timer;
-    bool ss_timer_created;
+    int ss_timer_fd;
+    bool ss_timer_armed;
 
     // Chre stop signal event
-    timer_t chre_timer;
-    bool chre_timer_created;
+    int chre_timer_fd;
+    bool chre_timer_armed;
+
+    // Model cache, see restore_model_cache
+    int cache_sync_fd;
+    bool is_cache_sync_pending;
+    int claim_timer_fd;
+    bool claim_timer_armed;
+    bool is_model_cache_restored;
+
+    // Recognition events waiting to be delivered, see delivery_thread_loop
+    struct event_queue event_queue;
+    struct delivery_stats delivery_stats;
+    // Only started with CAPTURE_PREOPEN_PROP set
+    struct prefill_queue prefill_queue;
+    pthread_t prefill_thread;
+    bool is_prefill_thread_created;
+    struct hal_metrics metrics;
+    struct event_drain_stats drain_stats;
+    struct uevent_stats uevent_stats;
+    bool is_delivery_thread_created;
 };
 
 /*
@@ -215,12 +879,101 @@ struct knowles_sound_trigger_device {
 static struct knowles_sound_trigger_device g_stdev =
 {
     .lock = PTHREAD_MUTEX_INITIALIZER,
-    .tunnel_create = PTHREAD_COND_INITIALIZER,
+    .strm_lock = PTHREAD_MUTEX_INITIALIZER,
+    .lock_prof = { .name = "lock", .mutex = &g_stdev.lock, .holder = -1 },
+    .strm_lock_prof = {
+        .name = "strm_lock",
+        .mutex = &g_stdev.strm_lock,
+        .holder = -1
+    },
+    .transition_done = PTHREAD_COND_INITIALIZER,
+    .strm_reader_lock = PTHREAD_MUTEX_INITIALIZER,
+    .strm_readers_gone = PTHREAD_COND_INITIALIZER,
+    .step_fd = -1,
+    .term_fd = -1,
+    .transit_fd = -1,
+    .strm_timer_fd = -1,
+    .ss_timer_fd = -1,
+    .chre_timer_fd = -1,
+    .cache_sync_fd = -1,
+    .claim_timer_fd = -1,
+    .recovery_fd = -1,
+    .recovery = { .next = RECOVERY_DONE },
     .sensor_create = PTHREAD_COND_INITIALIZER,
     .chre_create = PTHREAD_COND_INITIALIZER
 };
 
-static struct timespec reset_time = {0};
+/*
+ * All acquires of lock and strm_lock go through these so that the wait and
+ * hold times can be attributed to the calling function, see lock_profile.h.
+ */
+#define lock_stdev(stdev) lock_profile_lock(&(stdev)->lock_prof, __func__)
+#define unlock_stdev(stdev) lock_profile_unlock(&(stdev)->lock_prof)
+#define stdev_cond_wait(stdev, cond) \
+    lock_profile_cond_wait(&(stdev)->lock_prof, (cond), __func__)
+#define stdev_cond_timedwait(stdev, cond, ts) \
+    lock_profile_cond_timedwait(&(stdev)->lock_prof, (cond), (ts), __func__)
+#define lock_strm(stdev) lock_profile_lock(&(stdev)->strm_lock_prof, __func__)
+#define unlock_strm(stdev) lock_profile_unlock(&(stdev)->strm_lock_prof)
+
+static void reset_startup_timeline(struct startup_timeline *tl)
+{
+    clock_gettime(CLOCK_MONOTONIC, &tl->origin);
+    for (int i = 0; i < STARTUP_STAGE_MAX; i++) {
+        tl->begin_us[i] = -1;
+        tl->end_us[i] = -1;
+    }
+    tl->is_logged = false;
+}
+
+static void startup_stage_begin(struct startup_timeline *tl,
+                                enum startup_stage stage)
+{
+    struct timespec now;
+
+    if (tl->is_logged)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    tl->begin_us[stage] = timespec_diff_us(&now, &tl->origin);
+}
+
+static void startup_stage_end(struct startup_timeline *tl,
+                            enum startup_stage stage)
+{
+    struct timespec now;
+
+    if (tl->is_logged)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    tl->end_us[stage] = timespec_diff_us(&now, &tl->origin);
+}
+
+/*
+ * Logs each stage as name@start+duration in us, the total is how long the
+ * HAL answered -EAGAIN for. Only the first call after stdev_open() logs.
+ */
+static void log_startup_timeline(struct startup_timeline *tl,
+                                const char *result)
+{
+    char buf[512];
+    struct timespec now;
+    int len = 0;
+
+    if (tl->is_logged)
+        return;
+    tl->is_logged = true;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (int i = 0; i < STARTUP_STAGE_MAX && len < (int)sizeof(buf); i++) {
+        if (tl->begin_us[i] < 0 || tl->end_us[i] < 0)
+            continue;
+        len += snprintf(buf + len, sizeof(buf) - len, " %s@%lld+%lld",
+                        startup_stage_names[i], tl->begin_us[i],
+                        tl->end_us[i] - tl->begin_us[i]);
+    }
+    ALOGI("%s: %s after %lld us:%s", __func__, result,
+        timespec_diff_us(&now, &tl->origin), len > 0 ? buf : " -");
+}
 
 static enum sthal_mode get_sthal_mode(struct knowles_sound_trigger_device *stdev)
 {
@@ -332,6 +1085,124 @@ bool str_to_uuid(char* uuid_str, sound_trigger_uuid_t* uuid)
     return true;
 }
 
+static unsigned int uuid_hash(sound_trigger_uuid_t uuid)
+{
+    unsigned int h = uuid.timeLow ^ uuid.timeMid ^ uuid.clockSeq;
+
+    for (int i = 0; i < 6; i++)
+        h = (h * 31) ^ uuid.node[i];
+
+    return h & (MODEL_REGISTRY_BUCKETS - 1);
+}
+
+static void init_model_registry(struct knowles_sound_trigger_device *stdev)
+{
+    memset(stdev->desc_by_uuid, 0, sizeof(stdev->desc_by_uuid));
+    memset(stdev->desc_by_event, 0, sizeof(stdev->desc_by_event));
+
+    for (int i = 0; i < ST_MODEL_TYPE_MAX; i++) {
+        struct model_desc *desc = &model_registry[i];
+        unsigned int b;
+
+        detection_trace_init(&stdev->detection_traces[i], desc->name);
+        if (desc->kind == MODEL_KIND_KEYWORD) {
+            char name[METRIC_NAME_MAX];
+
+            snprintf(name, sizeof(name), "hal.detections.%s", desc->name);
+            stdev->metrics.detections[i] = metrics_register(name,
+                                                            METRIC_COUNTER);
+        }
+        if (!str_to_uuid((char *)desc->uuid_str, &desc->uuid)) {
+            ALOGE("%s: Invalid UUID for %s model", __func__, desc->name);
+            continue;
+        }
+
+        // Open addressing, the table is always bigger than the registry
+        b = uuid_hash(desc->uuid);
+        while (stdev->desc_by_uuid[b] != NULL)
+            b = (b + 1) & (MODEL_REGISTRY_BUCKETS - 1);
+        stdev->desc_by_uuid[b] = desc;
+
+        if (desc->kind == MODEL_KIND_KEYWORD &&
+            desc->kw_id >= 0 && desc->kw_id < MODEL_EVENT_MAP_SIZE)
+            stdev->desc_by_event[desc->kw_id] = desc;
+    }
+}
+
+// The per model detection counters are registered by init_model_registry()
+static void init_hal_metrics(struct knowles_sound_trigger_device *stdev)
+{
+    struct hal_metrics *m = &stdev->metrics;
+
+    m->events_dropped = metrics_register("hal.events_dropped",
+                                        METRIC_COUNTER);
+    m->fw_crashes = metrics_register("hal.fw_crashes", METRIC_COUNTER);
+    m->recoveries = metrics_register("hal.recoveries", METRIC_COUNTER);
+    m->recovery_failures = metrics_register("hal.recovery_failures",
+                                            METRIC_COUNTER);
+    m->recovery_us = metrics_register("hal.recovery_us", METRIC_HISTOGRAM);
+    m->transitions = metrics_register("hal.transitions", METRIC_COUNTER);
+    m->transition_us = metrics_register("hal.transition_us",
+                                        METRIC_HISTOGRAM);
+    m->capture_preopens = metrics_register("hal.capture_preopens",
+                                        METRIC_COUNTER);
+    m->first_read_us = metrics_register("hal.first_read_us",
+                                        METRIC_HISTOGRAM);
+    m->first_read_preopened_us = metrics_register(
+                                        "hal.first_read_preopened_us",
+                                        METRIC_HISTOGRAM);
+    m->capture_ring_overruns = metrics_register("hal.capture_ring_overruns",
+                                                METRIC_COUNTER);
+}
+
+static const struct model_desc *find_model_desc(
+                                    struct knowles_sound_trigger_device *stdev,
+                                    sound_trigger_uuid_t uuid)
+{
+    unsigned int b = uuid_hash(uuid);
+
+    for (int i = 0; i < MODEL_REGISTRY_BUCKETS; i++) {
+        const struct model_desc *desc = stdev->desc_by_uuid[b];
+
+        if (desc == NULL)
+            break;
+        if (check_uuid_equality(desc->uuid, uuid))
+            return desc;
+        b = (b + 1) & (MODEL_REGISTRY_BUCKETS - 1);
+    }
+
+    return NULL;
+}
+
+static const struct model_desc *find_model_desc_by_event(
+                                    struct knowles_sound_trigger_device *stdev,
+                                    int event_id)
+{
+    if (event_id < 0 || event_id >= MODEL_EVENT_MAP_SIZE)
+        return NULL;
+
+    return stdev->desc_by_event[event_id];
+}
+
+static inline bool is_model_type(const struct model_info *model,
+                                enum model_type type)
+{
+    return model->desc != NULL && model->desc->type == type;
+}
+
+static inline bool is_model_kind(const struct model_info *model,
+                                enum model_kind kind)
+{
+    return model->desc != NULL && model->desc->kind == kind;
+}
+
+static void clear_model_desc(struct model_info *model)
+{
+    memset(&model->uuid, 0, sizeof(sound_trigger_uuid_t));
+    model->desc = NULL;
+    model->is_loaded = false;
+}
+
 static int find_empty_model_slot(struct knowles_sound_trigger_device *st_dev)
 {
     int i = -1;
@@ -445,17 +1316,13 @@ static void dereg_hal_event_session(
 }
 
 
-static char *stdev_keyphrase_event_alloc(sound_model_handle_t handle,
+static void stdev_keyphrase_event_init(
+                                struct sound_trigger_phrase_recognition_event *event,
+                                sound_model_handle_t handle,
                                 struct sound_trigger_recognition_config *config,
                                 int recognition_status)
 {
-    char *data;
-    struct sound_trigger_phrase_recognition_event *event;
-    data = (char *)calloc(1,
-                        sizeof(struct sound_trigger_phrase_recognition_event));
-    if (!data)
-        return NULL;
-    event = (struct sound_trigger_phrase_recognition_event *)data;
+    memset(event, 0, sizeof(*event));
     event->common.status = recognition_status;
     event->common.type = SOUND_MODEL_TYPE_KEYPHRASE;
     event->common.model = handle;
@@ -489,26 +1356,19 @@ static char *stdev_keyphrase_event_alloc(sound_model_handle_t handle,
     event->common.audio_config.sample_rate = 16000;
     event->common.audio_config.channel_mask = AUDIO_CHANNEL_IN_MONO;
     event->common.audio_config.format = AUDIO_FORMAT_PCM_16_BIT;
-
-    return data;
 }
 
-static char *stdev_generic_event_alloc(int model_handle, void *payload,
-                                    unsigned int payload_size,
-                                    int recognition_status)
+/*
+ * The payload, if any, has already been read into the bytes that follow the
+ * event header, only the header is (re)initialized here.
+ */
+static void stdev_generic_event_init(
+                                struct sound_trigger_generic_recognition_event *event,
+                                int model_handle,
+                                unsigned int payload_size,
+                                int recognition_status)
 {
-    char *data;
-    struct sound_trigger_generic_recognition_event *event;
-
-    data = (char *)calloc(1,
-                        sizeof(struct sound_trigger_generic_recognition_event) +
-                        payload_size);
-    if (!data) {
-        ALOGE("%s: Failed to allocate memory for recog event", __func__);
-        return NULL;
-    }
-
-    event = (struct sound_trigger_generic_recognition_event *)data;
+    memset(event, 0, sizeof(*event));
     event->common.status = recognition_status;
     event->common.type = SOUND_MODEL_TYPE_GENERIC;
     event->common.model = model_handle;
@@ -523,829 +1383,1534 @@ static char *stdev_generic_event_alloc(int model_handle, void *payload,
     event->common.audio_config.channel_mask = AUDIO_CHANNEL_IN_MONO;
     event->common.audio_config.format = AUDIO_FORMAT_PCM_16_BIT;
 
-    if (payload && payload_size > 0) {
+    if (payload_size > 0) {
         ALOGD("%s: Attach payload in the event", __func__);
         event->common.data_size = payload_size;
         event->common.data_offset =
                         sizeof(struct sound_trigger_generic_recognition_event);
-
-        memcpy((data + event->common.data_offset), payload, payload_size);
     }
-
-    return data;
 }
 
-static void stdev_close_term_sock(struct knowles_sound_trigger_device *stdev)
+static void close_fd(int *fd)
 {
-    if (stdev->send_sock >= 0) {
-        close(stdev->send_sock);
-        stdev->send_sock = -1;
+    if (*fd >= 0) {
+        close(*fd);
+        *fd = -1;
     }
+}
 
-    if (stdev->recv_sock >= 0) {
-        close(stdev->recv_sock);
-        stdev->recv_sock = -1;
-    }
+static void stdev_close_reactor_fds(struct knowles_sound_trigger_device *stdev)
+{
+    close_fd(&stdev->term_fd);
+    close_fd(&stdev->transit_fd);
+    close_fd(&stdev->step_fd);
+    close_fd(&stdev->strm_timer_fd);
+    close_fd(&stdev->ss_timer_fd);
+    close_fd(&stdev->chre_timer_fd);
+    close_fd(&stdev->cache_sync_fd);
+    close_fd(&stdev->claim_timer_fd);
+    close_fd(&stdev->recovery_fd);
 }
 
-static bool is_uuid_in_recover_list(struct knowles_sound_trigger_device *stdev,
-                                    sound_model_handle_t handle)
+/*
+ * All the fds are created up front so that the rest of the HAL can signal
+ * the reactor, or arm its timers, before the callback thread is running.
+ */
+static int stdev_open_reactor_fds(struct knowles_sound_trigger_device *stdev)
 {
-    int mask = 0;
-    sound_trigger_uuid_t target_uuid = stdev->models[handle].uuid;
-
-    if (check_uuid_equality(target_uuid, stdev->chre_model_uuid)) {
-        mask = CHRE_MASK;
-    } else if (check_uuid_equality(target_uuid, stdev->hotword_model_uuid) ||
-               check_uuid_equality(target_uuid, stdev->wakeup_model_uuid)) {
-        mask = PLUGIN1_MASK;
-    } else if (check_uuid_equality(target_uuid, stdev->ambient_model_uuid) ||
-               check_uuid_equality(target_uuid, stdev->entity_model_uuid)) {
-        mask = PLUGIN2_MASK;
-    } else {
-       //ALOGV("%s: Invalid uuid.", __func__);
+    stdev->term_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    stdev->step_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    stdev->recovery_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    stdev->transit_fd = timerfd_create(CLOCK_MONOTONIC,
+                                        TFD_NONBLOCK | TFD_CLOEXEC);
+    stdev->strm_timer_fd = timerfd_create(CLOCK_MONOTONIC,
+                                        TFD_NONBLOCK | TFD_CLOEXEC);
+    stdev->ss_timer_fd = timerfd_create(CLOCK_MONOTONIC,
+                                        TFD_NONBLOCK | TFD_CLOEXEC);
+    stdev->chre_timer_fd = timerfd_create(CLOCK_MONOTONIC,
+                                        TFD_NONBLOCK | TFD_CLOEXEC);
+    stdev->cache_sync_fd = timerfd_create(CLOCK_MONOTONIC,
+                                        TFD_NONBLOCK | TFD_CLOEXEC);
+    stdev->claim_timer_fd = timerfd_create(CLOCK_MONOTONIC,
+                                        TFD_NONBLOCK | TFD_CLOEXEC);
+
+    if (stdev->term_fd < 0 || stdev->transit_fd < 0 || stdev->step_fd < 0 ||
+        stdev->strm_timer_fd < 0 || stdev->ss_timer_fd < 0 ||
+        stdev->chre_timer_fd < 0 || stdev->cache_sync_fd < 0 ||
+        stdev->claim_timer_fd < 0 || stdev->recovery_fd < 0) {
+        ALOGE("%s: Failed to create reactor fds %d(%s)",
+            __func__, errno, strerror(errno));
+        stdev_close_reactor_fds(stdev);
+        return -EIO;
     }
 
-    return (stdev->recover_model_list & mask) ? true : false;
+    return 0;
 }
 
-static void update_recover_list(struct knowles_sound_trigger_device *stdev,
-                                sound_model_handle_t handle,
-                                bool enable)
+/* One shot timer, a timeout of 0 disarms it */
+static int arm_timer_ms(int fd, long timeout_ms)
 {
-    int mask = 0;
+    struct itimerspec spec;
 
-    sound_trigger_uuid_t target_uuid = stdev->models[handle].uuid;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = timeout_ms / 1000;
+    spec.it_value.tv_nsec = (timeout_ms % 1000) * 1000000;
 
-    ALOGD("%s: handle %d enable %d", __func__, handle, enable);
-    if (check_uuid_equality(target_uuid, stdev->chre_model_uuid)) {
-        mask = CHRE_MASK;
-    } else if (check_uuid_equality(target_uuid, stdev->hotword_model_uuid) ||
-               check_uuid_equality(target_uuid, stdev->wakeup_model_uuid)) {
-        mask = PLUGIN1_MASK;
-    } else if (check_uuid_equality(target_uuid, stdev->ambient_model_uuid) ||
-               check_uuid_equality(target_uuid, stdev->entity_model_uuid)) {
-        mask = PLUGIN2_MASK;
-    } else {
-       //ALOGV("%s: Invalid uuid.", __func__);
+    if (timerfd_settime(fd, 0, &spec, NULL) == -1) {
+        ALOGE("%s: Timer Set Failed %d(%s)", __func__, errno, strerror(errno));
+        return -errno;
     }
 
-    if (enable)
-        stdev->recover_model_list |= mask;
-    else
-        stdev->recover_model_list &= ~mask;
-
-    return;
+    return 0;
 }
 
-static int check_and_setup_src_package(
-                                    struct knowles_sound_trigger_device *stdev)
+/*
+ * Returns true if the timer or eventfd really fired, it may have been
+ * disarmed by an earlier event handled in the same reactor wakeup.
+ */
+static bool consume_fd(int fd)
 {
-    int err = 0;
-
-    if (stdev->is_src_package_loaded == false) {
-        err = setup_src_package(stdev->odsp_hdl);
-        if (err != 0) {
-            ALOGE("%s: Failed to load SRC package", __func__);
-            goto exit;
-        } else {
-            ALOGD("%s: SRC package loaded", __func__);
-            stdev->is_src_package_loaded = true;
-        }
-    } else {
-        ALOGD("%s: SRC package is already loaded", __func__);
-    }
+    uint64_t count = 0;
 
-exit:
-    return err;
+    return read(fd, &count, sizeof(count)) == sizeof(count) && count > 0;
 }
 
-static int check_and_destroy_src_package(
-                                    struct knowles_sound_trigger_device *stdev)
+static void signal_reactor(int fd)
 {
-    int err = 0;
-
-    if (!is_any_model_active(stdev) && stdev->is_src_package_loaded == true) {
-        err = destroy_src_package(stdev->odsp_hdl);
-        if (err != 0) {
-            ALOGE("%s: Failed to destroy SRC package", __func__);
-            goto exit;
-        } else {
-            ALOGD("%s: SRC package destroy", __func__);
-            stdev->is_src_package_loaded = false;
-        }
-    }
+    uint64_t one = 1;
 
-exit:
-    return err;
+    if (write(fd, &one, sizeof(one)) != sizeof(one))
+        ALOGE("%s: Failed to signal %d(%s)", __func__, errno, strerror(errno));
 }
 
-static int check_and_setup_buffer_package(
-                                    struct knowles_sound_trigger_device *stdev)
+static long long coarse_monotonic_ms(void)
 {
-    int err = 0;
+    struct timespec now;
 
-    if (stdev->is_buffer_package_loaded == false) {
-        err = setup_buffer_package(stdev->odsp_hdl);
-        if (err != 0) {
-            ALOGE("%s: Failed to load Buffer package", __func__);
-            goto exit;
-        } else {
-            ALOGD("%s: Buffer package loaded", __func__);
-            stdev->is_buffer_package_loaded = true;
-        }
-    } else {
-        ALOGD("%s: Buffer package is already loaded", __func__);
-    }
-
-exit:
-    return err;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (long long)now.tv_sec * 1000LL + now.tv_nsec / 1000000;
 }
 
-static int check_and_destroy_buffer_package(
-                                    struct knowles_sound_trigger_device *stdev)
+/*
+ * An open tunnel is published with the capture handle it's read for, so
+ * that AUDIO_EVENT_READ_SAMPLES can find it without any lock. Only the
+ * open and the close of a tunnel take strm_lock. Called with
+ * stdev->strm_lock held.
+ */
+static void publish_capture_stream(struct knowles_sound_trigger_device *stdev,
+                                int index, int capture_handle)
 {
-    int err = 0;
+    if (atomic_load(&stdev->strm_capture_handle[index]) != capture_handle)
+        atomic_store(&stdev->strm_capture_handle[index], capture_handle);
+}
 
-    if (!is_any_model_active(stdev) &&
-        stdev->is_buffer_package_loaded &&
-        (!stdev->is_sensor_destroy_in_prog &&
-        !stdev->is_sensor_route_enabled) &&
-        (!stdev->is_chre_destroy_in_prog &&
-        !stdev->is_chre_loaded)) {
+// Bytes of one sample of the tunnel at index, see open_capture_stream()
+static size_t capture_sample_size(struct knowles_sound_trigger_device *stdev,
+                                int index)
+{
+    return stdev->strm_formats[index] == PCM_FORMAT_FLOAT_LE ?
+            sizeof(float) : sizeof(int16_t);
+}
 
-        err = destroy_buffer_package(stdev->odsp_hdl);
-        if (err != 0) {
-            ALOGE("%s: Failed to destroy Buffer package", __func__);
-            goto exit;
-        } else {
-            ALOGD("%s: Buffer package destroy", __func__);
-            stdev->is_buffer_package_loaded = false;
-        }
-    }
+static void trace_stream_point(struct knowles_sound_trigger_device *stdev,
+                            enum trace_point point)
+{
+    struct detection_trace *trace = atomic_load(&stdev->strm_trace);
 
-exit:
-    return err;
+    if (trace != NULL)
+        detection_trace_mark(trace, point);
 }
 
-static int setup_package(struct knowles_sound_trigger_device *stdev,
-                        struct model_info *model)
+// Samples the endpoint head the first frame is compared against
+static void trace_tunnel_open(struct knowles_sound_trigger_device *stdev)
 {
-    int err = 0;
-
-    if (check_uuid_equality(model->uuid, stdev->chre_model_uuid)) {
-        if (!(stdev->current_enable & CHRE_MASK)) {
-            err = setup_chre_package(stdev->odsp_hdl);
-            if (err != 0) {
-                ALOGE("Failed to load CHRE package");
-                goto exit;
-            }
-        }
-        stdev->current_enable = stdev->current_enable | CHRE_MASK;
-    } else if (check_uuid_equality(model->uuid, stdev->hotword_model_uuid)) {
-        if (!(stdev->current_enable & PLUGIN1_MASK)) {
-            err = setup_hotword_package(stdev->odsp_hdl);
-            if (err != 0) {
-                ALOGE("Failed to load Hotword package");
-                goto exit;
-            }
-        }
-        err = write_model(stdev->odsp_hdl, model->data, model->data_sz,
-                        model->kw_id);
-        if (err != 0) {
-            ALOGE("Failed to write Hotword model");
-            goto exit;
-        }
+    struct detection_trace *trace = atomic_load(&stdev->strm_trace);
+    uint64_t open_ts;
 
-        //setup model state.
-        stdev->current_enable = stdev->current_enable | HOTWORD_MASK;
-        err = set_hotword_state(stdev->odsp_hdl, stdev->current_enable);
-        if (err != 0) {
-            ALOGE("Failed to set Hotword state");
-            goto exit;
-        }
-    } else if (check_uuid_equality(model->uuid, stdev->wakeup_model_uuid)) {
-        if (!(stdev->current_enable & PLUGIN1_MASK)) {
-            err = setup_hotword_package(stdev->odsp_hdl);
-            if (err != 0) {
-                ALOGE("Failed to load Hotword package");
-                goto exit;
-            }
-        }
-        err = write_model(stdev->odsp_hdl, model->data, model->data_sz,
-                        model->kw_id);
-        if (err != 0) {
-            ALOGE("Failed to write Wakeup model");
-            goto exit;
-        }
+    if (trace == NULL || !detection_trace_is_pending(trace, TRACE_TUNNEL_OPEN))
+        return;
 
-        //setup model state.
-        stdev->current_enable = stdev->current_enable | WAKEUP_MASK;
-        err = set_hotword_state(stdev->odsp_hdl, stdev->current_enable);
-        if (err != 0) {
-            ALOGE("Failed to set Wakeup state");
-            goto exit;
-        }
-    } else if (check_uuid_equality(model->uuid, stdev->ambient_model_uuid)) {
-        if (!(stdev->current_enable & PLUGIN2_MASK)) {
-            err = setup_ambient_package(stdev->odsp_hdl);
-            if (err != 0) {
-                ALOGE("Failed to load Ambient package");
-                goto exit;
-            }
-        } else {
-            // tear down plugin2 for writing new model data.
-            err = tear_ambient_state(stdev->odsp_hdl,
-                                    stdev->current_enable);
-        }
-        err = write_model(stdev->odsp_hdl, model->data,
-                        model->data_sz, model->kw_id);
-        if (err != 0) {
-            ALOGE("Failed to write Ambient model");
-            goto exit;
-        }
+    if (get_latest_ep_ts(stdev->odsp_hdl, &open_ts) == 0)
+        detection_trace_set_open_ts(trace, open_ts);
+    detection_trace_mark(trace, TRACE_TUNNEL_OPEN);
+}
 
-        //setup model state.
-        stdev->current_enable = stdev->current_enable | AMBIENT_MASK;
-        err = set_ambient_state(stdev->odsp_hdl, stdev->current_enable);
-        if (err != 0) {
-            ALOGE("Failed to set Ambient state");
-            goto exit;
-        }
+// Called after every tunnel read, only does work for the first one
+static void trace_first_frame(struct knowles_sound_trigger_device *stdev,
+                            long strm_handle)
+{
+    struct detection_trace *trace = atomic_load(&stdev->strm_trace);
+    uint64_t frame_ts;
 
-    } else if (check_uuid_equality(model->uuid, stdev->entity_model_uuid)) {
-        if (!(stdev->current_enable & PLUGIN2_MASK)) {
-            err = setup_ambient_package(stdev->odsp_hdl);
-            if (err != 0) {
-                ALOGE("Failed to load Ambient package");
-                goto exit;
-            }
-        } else {
-            // tear down plugin2 for writing new model data.
-            err = tear_ambient_state(stdev->odsp_hdl,
-                                    stdev->current_enable);
-        }
-        err = write_model(stdev->odsp_hdl, model->data,
-                        model->data_sz, model->kw_id);
-        if (err != 0) {
-            ALOGE("Failed to write Entity model");
-            goto exit;
-        }
+    if (trace == NULL || !detection_trace_is_pending(trace, TRACE_FIRST_FRAME))
+        return;
 
-        //setup model state.
-        stdev->current_enable = stdev->current_enable | ENTITY_MASK;
-        err = set_ambient_state(stdev->odsp_hdl, stdev->current_enable);
-        if (err != 0) {
-            ALOGE("Failed to set Entity state");
-            goto exit;
-        }
+    if (stdev->adnc_strm_get_first_frame_ts != NULL) {
+        // No frame parsed yet, the read came back empty
+        if (stdev->adnc_strm_get_first_frame_ts(strm_handle, &frame_ts) != 0)
+            return;
+        detection_trace_set_frame_ts(trace, frame_ts);
     }
+    detection_trace_mark(trace, TRACE_FIRST_FRAME);
+}
 
-exit:
-    return err;
+// Splits the first read latency by how the tunnel was opened
+static void note_first_read(struct knowles_sound_trigger_device *stdev,
+                            int index, const struct timespec *start)
+{
+    struct timespec now;
+    int first_read;
+
+    if (atomic_load_explicit(&stdev->strm_first_read[index],
+                            memory_order_relaxed) == FIRST_READ_DONE)
+        return;
+    first_read = atomic_exchange(&stdev->strm_first_read[index],
+                                FIRST_READ_DONE);
+    if (first_read == FIRST_READ_DONE)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    metric_record(first_read == FIRST_READ_PREOPENED ?
+                    stdev->metrics.first_read_preopened_us :
+                    stdev->metrics.first_read_us,
+                timespec_diff_us(&now, start));
 }
 
-static int setup_buffer(struct knowles_sound_trigger_device *stdev,
-                        struct model_info *model,
-                        bool enabled)
+/*
+ * Leaves a tunnel marked in strm_readers[]. Only the last reader out of a
+ * tunnel that is being closed takes strm_reader_lock, reads otherwise stay
+ * lock-free.
+ */
+static void put_strm_reader(struct knowles_sound_trigger_device *stdev,
+                            int index)
 {
-    int err = 0;
-    if (enabled) {
-        if ((check_uuid_equality(model->uuid, stdev->hotword_model_uuid))
-            || (check_uuid_equality(model->uuid, stdev->wakeup_model_uuid))) {
+    if (atomic_fetch_sub(&stdev->strm_readers[index], 1) != 1 ||
+        !atomic_load(&stdev->strm_closing[index]))
+        return;
 
-            stdev->hotword_buffer_enable++;
-            if (stdev->hotword_buffer_enable > 1)
-                goto exit;
+    pthread_mutex_lock(&stdev->strm_reader_lock);
+    pthread_cond_broadcast(&stdev->strm_readers_gone);
+    pthread_mutex_unlock(&stdev->strm_reader_lock);
+}
 
-            err = setup_howord_buffer(stdev->odsp_hdl);
-            if (err != 0) {
-                stdev->hotword_buffer_enable--;
-                ALOGE("Failed to create the buffer plugin");
-                goto exit;
-            }
-        } else if ((check_uuid_equality(model->uuid, stdev->ambient_model_uuid))
-            || (check_uuid_equality(model->uuid, stdev->entity_model_uuid))) {
+/*
+ * The steady state of AUDIO_EVENT_READ_SAMPLES, takes no lock. Returns
+ * -ENOENT if no tunnel is published for the capture handle, the caller then
+ * goes through the locked path which opens it, or -EIO if the tunnel
+ * couldn't fill buf. start is when the AHAL asked
+ * for the samples, or NULL to take it here if this is the first read of the
+ * tunnel. Marking itself a reader stops a prefill of the tunnel.
+ */
+static int read_capture_stream(struct knowles_sound_trigger_device *stdev,
+                            int capture_handle, void *buf, size_t bytes,
+                            const struct timespec *start)
+{
+    struct timespec now;
+    size_t read;
+    int i;
 
-            stdev->music_buffer_enable++;
-            if (stdev->music_buffer_enable > 1)
-                goto exit;
+    for (i = 0; i < MAX_MODELS; i++) {
+        if (atomic_load_explicit(&stdev->strm_capture_handle[i],
+                                memory_order_acquire) != capture_handle)
+            continue;
 
-            err = setup_music_buffer(stdev->odsp_hdl);
-            if (err != 0) {
-                stdev->music_buffer_enable--;
-                ALOGE("Failed to load music buffer package");
-                goto exit;
-            }
+        atomic_fetch_add(&stdev->strm_readers[i], 1);
+        // Unpublished between the lookup and the mark
+        if (atomic_load(&stdev->strm_capture_handle[i]) != capture_handle) {
+            put_strm_reader(stdev, i);
+            continue;
         }
-    } else {
-        if ((check_uuid_equality(model->uuid, stdev->hotword_model_uuid))
-           || (check_uuid_equality(model->uuid, stdev->wakeup_model_uuid))) {
-            if (stdev->hotword_buffer_enable == 0) {
-                ALOGW("Invalid call for setup buffer");
-                goto exit;
-            }
-            stdev->hotword_buffer_enable--;
-            if (stdev->hotword_buffer_enable != 0)
-                goto exit;
 
-            err = destroy_howord_buffer(stdev->odsp_hdl);
+        if (start == NULL &&
+            atomic_load_explicit(&stdev->strm_first_read[i],
+                                memory_order_relaxed) != FIRST_READ_DONE) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            start = &now;
+        }
+        atomic_store_explicit(&stdev->adnc_strm_last_read_ms[i],
+                            coarse_monotonic_ms(), memory_order_relaxed);
+        read = stdev->adnc_strm_read(stdev->adnc_strm_handle[i], buf, bytes);
+        if (read != bytes) {
+            put_strm_reader(stdev, i);
+            ALOGE("%s: Read %zu of %zu bytes of capture handle %d", __func__,
+                read, bytes, capture_handle);
+            return -EIO;
+        }
+        note_first_read(stdev, i, start);
+        trace_first_frame(stdev, stdev->adnc_strm_handle[i]);
+        put_strm_reader(stdev, i);
+        return 0;
+    }
 
-            if (err != 0) {
-                ALOGE("Failed to unload hotword buffer package");
-                goto exit;
-            }
+    return -ENOENT;
+}
 
-        } else if ((check_uuid_equality(model->uuid, stdev->ambient_model_uuid))
-           || (check_uuid_equality(model->uuid, stdev->entity_model_uuid))) {
-            if (stdev->music_buffer_enable == 0) {
-                ALOGW("Invalid call for setup buffer");
-                goto exit;
-            }
-            stdev->music_buffer_enable--;
-            if (stdev->music_buffer_enable != 0)
-                goto exit;
+/*
+ * The STHAL side of a capture_ring_header. The memfd is sealed against
+ * resizing so that the AHAL can't pull the mapping from under us.
+ */
+static int capture_ring_create(struct capture_ring *ring,
+                            const struct pcm_config *config,
+                            size_t data_size)
+{
+    size_t header_size = (sizeof(struct capture_ring_header) + 63) & ~63;
+    long page_size = sysconf(_SC_PAGESIZE);
+    void *map;
+    int err;
+
+    ring->map_size = (header_size + data_size + page_size - 1) &
+                    ~(page_size - 1);
+    ring->fd = syscall(__NR_memfd_create, "sthal_capture_ring",
+                    MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (ring->fd < 0) {
+        err = -errno;
+        ALOGE("%s: memfd_create failed %d(%s)", __func__, errno,
+            strerror(errno));
+        return err;
+    }
+    if (ftruncate(ring->fd, ring->map_size) != 0) {
+        err = -errno;
+        ALOGE("%s: ftruncate failed %d(%s)", __func__, errno, strerror(errno));
+        goto error;
+    }
+#ifdef F_ADD_SEALS
+    if (fcntl(ring->fd, F_ADD_SEALS,
+            F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0)
+        ALOGW("%s: Failed to seal the ring %d(%s)", __func__, errno,
+            strerror(errno));
+#endif
 
-            err = destroy_music_buffer(stdev->odsp_hdl);
-            if (err != 0) {
-                ALOGE("Failed to unload music buffer package");
-                goto exit;
-            }
-       }
+    map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, 0);
+    if (map == MAP_FAILED) {
+        err = -errno;
+        ALOGE("%s: mmap failed %d(%s)", __func__, errno, strerror(errno));
+        goto error;
     }
+    // Like the tunnel buffers, so that filling it never page faults
+    mlock(map, ring->map_size);
+
+    ring->hdr = map;
+    ring->data = (uint8_t *)map + header_size;
+    ring->data_size = data_size;
+    ring->write_index = 0;
+    ring->ts_seq = 0;
+    memset(ring->hdr, 0, header_size);
+    ring->hdr->magic = CAPTURE_RING_MAGIC;
+    ring->hdr->version = CAPTURE_RING_VERSION;
+    ring->hdr->header_size = header_size;
+    ring->hdr->data_size = data_size;
+    ring->hdr->sample_rate = config->rate;
+    ring->hdr->channels = config->channels;
+    ring->hdr->format = config->format;
+    ring->hdr->frame_size = config->channels *
+                        (config->format == PCM_FORMAT_FLOAT_LE ?
+                        sizeof(float) : sizeof(int16_t));
 
-exit:
+    return 0;
+
+error:
+    close(ring->fd);
+    ring->fd = -1;
     return err;
 }
 
-static int destroy_package(struct knowles_sound_trigger_device *stdev,
-                        struct model_info *model)
+static void capture_ring_destroy(struct capture_ring *ring)
 {
-    int err = 0;
-
-    if (check_uuid_equality(model->uuid, stdev->chre_model_uuid)) {
-        stdev->current_enable = stdev->current_enable & ~CHRE_MASK;
-        if (!(stdev->current_enable & CHRE_MASK)) {
-            err = destroy_chre_package(stdev->odsp_hdl);
-            if (err != 0) {
-                ALOGE("Failed to destroy CHRE package");
-                goto exit;
-            }
-        }
-    } else if (check_uuid_equality(model->uuid, stdev->hotword_model_uuid)) {
-        err = tear_hotword_state(stdev->odsp_hdl, HOTWORD_MASK);
-        if (err != 0) {
-            ALOGE("Failed to tear Hotword state");
-            goto exit;
-        }
+    munmap(ring->hdr, ring->map_size);
+    close(ring->fd);
+    ring->hdr = NULL;
+    ring->data = NULL;
+    ring->fd = -1;
+}
 
-        err = flush_model(stdev->odsp_hdl, model->kw_id);
-        if (err != 0) {
-            ALOGE("Failed to flush Hotword model");
-            goto exit;
-        }
-        stdev->current_enable = stdev->current_enable & ~HOTWORD_MASK;
+/*
+ * bytes divides the data size, so a write never wraps. The read index is
+ * the only thing taken from the shared header, and it is kept within what
+ * was written.
+ */
+static void *capture_ring_begin_write(struct capture_ring *ring, size_t bytes)
+{
+    uint64_t read_index = __atomic_load_n(&ring->hdr->read_index,
+                                        __ATOMIC_ACQUIRE);
 
-        if (!(stdev->current_enable & PLUGIN1_MASK)) {
-            err = destroy_hotword_package(stdev->odsp_hdl);
-            if (err != 0) {
-                ALOGE("Failed to destroy Hotword package");
-                goto exit;
-            }
-        }
+    if ((int64_t)(ring->write_index - read_index) < 0)
+        read_index = ring->write_index;
+    else if (ring->write_index - read_index > ring->data_size)
+        read_index = ring->write_index - ring->data_size;
 
-    } else if (check_uuid_equality(model->uuid, stdev->wakeup_model_uuid)) {
-        err = tear_hotword_state(stdev->odsp_hdl, WAKEUP_MASK);
-        if (err != 0) {
-            ALOGE("Failed to tear Wakeup state");
-            goto exit;
-        }
+    if (ring->write_index + bytes - read_index > ring->data_size)
+        return NULL;
 
-        err = flush_model(stdev->odsp_hdl, model->kw_id);
-        if (err != 0) {
-            ALOGE("Failed to flush Wakeup model");
-            goto exit;
-        }
-        stdev->current_enable = stdev->current_enable & ~WAKEUP_MASK;
+    return ring->data + ring->write_index % ring->data_size;
+}
 
-        if (!(stdev->current_enable & PLUGIN1_MASK)) {
-            err = destroy_hotword_package(stdev->odsp_hdl);
-            if (err != 0) {
-                ALOGE("Failed to destroy Hotword package");
-                goto exit;
-            }
-        }
+static void capture_ring_end_write(struct capture_ring *ring, size_t bytes,
+                                const struct timespec *ts)
+{
+    struct capture_ring_header *hdr = ring->hdr;
 
-    } else if (check_uuid_equality(model->uuid, stdev->ambient_model_uuid)) {
-        err = tear_ambient_state(stdev->odsp_hdl, AMBIENT_MASK);
-        if (err != 0) {
-            ALOGE("Failed to tear Ambient state");
-            goto exit;
-        }
+    ring->write_index += bytes;
+    __atomic_store_n(&hdr->write_index, ring->write_index, __ATOMIC_RELEASE);
 
-        err = flush_model(stdev->odsp_hdl, model->kw_id);
-        if (err != 0) {
-            ALOGE("Failed to flush Ambient model");
-            goto exit;
-        }
-        stdev->current_enable = stdev->current_enable & ~AMBIENT_MASK;
+    __atomic_store_n(&hdr->ts_seq, ++ring->ts_seq, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&hdr->ts_index, ring->write_index, __ATOMIC_RELAXED);
+    __atomic_store_n(&hdr->ts_ns, ts->tv_sec * 1000000000ULL + ts->tv_nsec,
+                    __ATOMIC_RELAXED);
+    __atomic_store_n(&hdr->ts_seq, ++ring->ts_seq, __ATOMIC_RELEASE);
+}
 
-        if (!(stdev->current_enable & PLUGIN2_MASK)) {
-            err = destroy_ambient_package(stdev->odsp_hdl);
-            if (err != 0) {
-                ALOGE("Failed to destroy Ambient package");
-                goto exit;
+/*
+ * Fills the ring from the tunnel a period at a time, reading straight into
+ * the shared memory. A full ring drops the period so that the tunnel
+ * doesn't back up, and a reader that leaves it full for
+ * CAPTURE_RING_STALL_MS is given up on; the tunnel then times out. A failed
+ * read stops the ring, nothing is published for a period that wasn't read.
+ * A stopped ring no longer owns the tunnel.
+ */
+static void *capture_ring_thread_loop(void *context)
+{
+    struct knowles_sound_trigger_device *stdev = &g_stdev;
+    struct capture_ring *ring = (struct capture_ring *)context;
+    uint8_t scratch[CAPTURE_RING_PERIOD_SAMPLES * MAX_CAPTURE_CHANNELS *
+                    sizeof(float)];
+    long long stall_start_ms = 0;
+    struct timespec start, end;
+    void *ptr;
+
+    prctl(PR_SET_NAME, (unsigned long)"sthal capture ring", 0, 0, 0);
+
+    while (!atomic_load(&ring->exit)) {
+        ptr = capture_ring_begin_write(ring, ring->period_bytes);
+        if (ptr == NULL) {
+            if (stall_start_ms == 0) {
+                stall_start_ms = coarse_monotonic_ms();
+            } else if (coarse_monotonic_ms() - stall_start_ms >
+                    CAPTURE_RING_STALL_MS) {
+                ALOGE("%s: Reader of capture handle %d is gone", __func__,
+                    ring->capture_handle);
+                break;
             }
-        }
-    } else if (check_uuid_equality(model->uuid, stdev->entity_model_uuid)) {
-        err = tear_ambient_state(stdev->odsp_hdl, ENTITY_MASK);
-        if (err != 0) {
-            ALOGE("Failed to tear Entity state");
-            goto exit;
+            ptr = scratch;
+        } else {
+            stall_start_ms = 0;
         }
 
-        err = flush_model(stdev->odsp_hdl, model->kw_id);
-        if (err != 0) {
-            ALOGE("Failed to flush Entity model");
-            goto exit;
-        }
-        stdev->current_enable = stdev->current_enable & ~ENTITY_MASK;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (read_capture_stream(stdev, ring->capture_handle, ptr,
+                                ring->period_bytes, &start) != 0)
+            break;
+        clock_gettime(CLOCK_MONOTONIC, &end);
 
-        if (!(stdev->current_enable & PLUGIN2_MASK)) {
-            err = destroy_ambient_package(stdev->odsp_hdl);
-            if (err != 0) {
-                ALOGE("Failed to destroy Ambient package");
-                goto exit;
-            }
+        if (ptr == scratch) {
+            __atomic_fetch_add(&ring->hdr->overruns, ring->period_bytes,
+                            __ATOMIC_RELAXED);
+            metric_add(stdev->metrics.capture_ring_overruns, 1);
+        } else {
+            capture_ring_end_write(ring, ring->period_bytes, &end);
         }
     }
-exit:
-    return err;
+
+    __atomic_fetch_or(&ring->hdr->flags, CAPTURE_RING_STOPPED,
+                    __ATOMIC_RELEASE);
+    atomic_store(&ring->is_active, false);
+
+    return NULL;
 }
 
-static int set_package_route(struct knowles_sound_trigger_device *stdev,
-                            sound_trigger_uuid_t uuid,
-                            bool bargein)
+// Called with stdev->strm_lock held, once the tunnel has been published
+static int start_capture_ring(struct knowles_sound_trigger_device *stdev,
+                            int index, int capture_handle)
 {
-    int ret = 0;
-    /*
-     *[TODO] Add correct error return value for package route
-     * b/119390722 for tracing.
-     */
-    if (check_uuid_equality(uuid, stdev->chre_model_uuid)) {
-        if (stdev->is_chre_loaded == true) {
-            set_chre_audio_route(stdev->route_hdl, bargein);
-        }
-    } else if (check_uuid_equality(uuid, stdev->hotword_model_uuid)) {
-        if (!((stdev->current_enable & PLUGIN1_MASK) & ~HOTWORD_MASK)) {
-            set_hotword_route(stdev->route_hdl, bargein);
-        }
-    } else if (check_uuid_equality(uuid, stdev->wakeup_model_uuid)) {
-        if (!((stdev->current_enable & PLUGIN1_MASK) & ~WAKEUP_MASK)) {
-            set_hotword_route(stdev->route_hdl, bargein);
-        }
-    } else if (check_uuid_equality(uuid, stdev->ambient_model_uuid)) {
-        if (!((stdev->current_enable & PLUGIN2_MASK) & ~AMBIENT_MASK)) {
-            set_ambient_route(stdev->route_hdl, bargein);
-        }
-    } else if (check_uuid_equality(uuid, stdev->entity_model_uuid)) {
-        if (!((stdev->current_enable & PLUGIN2_MASK) & ~ENTITY_MASK)) {
-            set_ambient_route(stdev->route_hdl, bargein);
-        }
+    struct capture_ring *ring = &stdev->capture_rings[index];
+    struct pcm_config config = stdev_hotword_pcm_config;
+    int err;
+
+    config.channels = stdev->strm_channels[index];
+    config.format = stdev->strm_formats[index];
+    ring->period_bytes = CAPTURE_RING_PERIOD_SAMPLES * config.channels *
+                        capture_sample_size(stdev, index);
+    err = capture_ring_create(ring, &config,
+                            CAPTURE_RING_PERIODS * ring->period_bytes);
+    if (err != 0)
+        return err;
+
+    ring->capture_handle = capture_handle;
+    atomic_store(&ring->exit, false);
+    // Before the thread starts, it clears it if it stops on its own
+    atomic_store(&ring->is_active, true);
+    err = pthread_create(&ring->thread, (const pthread_attr_t *) NULL,
+                        capture_ring_thread_loop, ring);
+    if (err != 0) {
+        ALOGE("%s: Failed to create the ring thread %d", __func__, err);
+        atomic_store(&ring->is_active, false);
+        capture_ring_destroy(ring);
+        return -err;
     }
+    ring->is_thread_created = true;
 
-    return ret;
+    return 0;
 }
 
-static int tear_package_route(struct knowles_sound_trigger_device *stdev,
-                            sound_trigger_uuid_t uuid,
-                            bool bargein)
+/*
+ * The thread reads through the lock-free path, so it is stopped with
+ * strm_lock held. The AHAL's mapping stays valid, it sees
+ * CAPTURE_RING_STOPPED. Called with stdev->strm_lock held.
+ */
+static void stop_capture_ring(struct knowles_sound_trigger_device *stdev,
+                            int index)
 {
-    int ret = 0;
-    /*
-     *[TODO] Add correct error return value for package route
-     * b/119390722 for tracing.
-     */
-    if (check_uuid_equality(uuid, stdev->chre_model_uuid)) {
-        if (stdev->is_chre_loaded == true) {
-            tear_chre_audio_route(stdev->route_hdl, bargein);
-        }
-    } else if (check_uuid_equality(uuid, stdev->hotword_model_uuid)) {
-        if (!((stdev->current_enable & PLUGIN1_MASK) & ~HOTWORD_MASK))
-            tear_hotword_route(stdev->route_hdl, bargein);
-    } else if (check_uuid_equality(uuid, stdev->wakeup_model_uuid)) {
-        if (!((stdev->current_enable & PLUGIN1_MASK) & ~WAKEUP_MASK))
-            tear_hotword_route(stdev->route_hdl, bargein);
-    } else if (check_uuid_equality(uuid, stdev->ambient_model_uuid)) {
-        if (!((stdev->current_enable & PLUGIN2_MASK) & ~AMBIENT_MASK))
-            tear_ambient_route(stdev->route_hdl, bargein);
-    } else if (check_uuid_equality(uuid, stdev->entity_model_uuid)) {
-        if (!((stdev->current_enable & PLUGIN2_MASK) & ~ENTITY_MASK))
-            tear_ambient_route(stdev->route_hdl, bargein);
+    struct capture_ring *ring = &stdev->capture_rings[index];
+
+    if (ring->hdr == NULL)
+        return;
+
+    atomic_store(&ring->exit, true);
+    if (ring->is_thread_created)
+        pthread_join(ring->thread, (void **)NULL);
+    ring->is_thread_created = false;
+    atomic_store(&ring->is_active, false);
+    capture_ring_destroy(ring);
+}
+
+/*
+ * Readers mark themselves in strm_readers[] and then check the capture
+ * handle again. So once the tunnel is unpublished, only a read that was
+ * already in progress can be using it, and we wait for that read to finish.
+ * strm_closing[] is set before the readers are counted under
+ * strm_reader_lock, so the last reader either sees it and signals, or left
+ * before the count. Called with stdev->strm_lock held.
+ */
+static void close_capture_stream(struct knowles_sound_trigger_device *stdev,
+                                int index)
+{
+    struct read_path_stats *rs = &stdev->read_stats;
+
+    atomic_store(&stdev->capture_rings[index].exit, true);
+    atomic_store(&stdev->strm_capture_handle[index], NO_CAPTURE_HANDLE);
+    atomic_store(&stdev->strm_closing[index], true);
+    pthread_mutex_lock(&stdev->strm_reader_lock);
+    while (atomic_load(&stdev->strm_readers[index]) > 0)
+        pthread_cond_wait(&stdev->strm_readers_gone,
+                        &stdev->strm_reader_lock);
+    pthread_mutex_unlock(&stdev->strm_reader_lock);
+    atomic_store(&stdev->strm_closing[index], false);
+    stop_capture_ring(stdev, index);
+
+    stdev->adnc_strm_close(stdev->adnc_strm_handle[index]);
+    stdev->adnc_strm_handle[index] = 0;
+    atomic_store(&stdev->adnc_strm_last_read_ms[index], 0);
+
+    ALOGD("%s: index %d, reads %u lock-free %u locked, lock wait %lld us max"
+        " %lld us", __func__, index, atomic_load(&rs->lock_free_reads),
+        rs->locked_reads, rs->lock_wait_us, rs->max_lock_wait_us);
+}
+
+/*
+ * Called with stdev->lock held whenever a model's active state or config
+ * changes, tunnels are looked up against this copy under strm_lock only.
+ */
+static void update_capture_map(struct knowles_sound_trigger_device *stdev,
+                            int index)
+{
+    const struct model_info *model = &stdev->models[index];
+
+    lock_strm(stdev);
+    stdev->capture_map[index].is_active = model->is_active;
+    stdev->capture_map[index].capture_handle = model->config != NULL ?
+        model->config->capture_handle : NO_CAPTURE_HANDLE;
+    unlock_strm(stdev);
+}
+
+// Index of the active model the capture handle streams for, or -1
+static int find_capture_slot(struct knowles_sound_trigger_device *stdev,
+                            int capture_handle)
+{
+    for (int i = 0; i < MAX_MODELS; i++) {
+        if (stdev->capture_map[i].is_active &&
+            stdev->capture_map[i].capture_handle == capture_handle)
+            return i;
     }
 
-    return ret;
+    return -1;
 }
 
-static int async_setup_aec(struct knowles_sound_trigger_device *stdev)
+/*
+ * Called with stdev->lock held. The streaming domain reads the flag without
+ * it, and work done with the lock dropped compares fw_gen to find out if the
+ * chip it set up went away in the meantime.
+ */
+static void set_hal_ready(struct knowles_sound_trigger_device *stdev,
+                        bool is_ready)
 {
-    int ret = 0;
-    if (stdev->rx_active_count > 0 &&
-        stdev->is_bargein_route_enabled != true &&
-        stdev->is_mic_route_enabled != false) {
-        ALOGD("%s: Bargein enabling", __func__);
-        if (is_mic_controlled_by_ahal(stdev) == false) {
-            ret = enable_mic_route(stdev->route_hdl, false,
-                                INTERNAL_OSCILLATOR);
-            if (ret != 0) {
-                ALOGE("Failed to disable mic route with INT OSC");
-                goto exit;
-            }
-        }
-        ret = setup_src_plugin(stdev->odsp_hdl, SRC_AMP_REF);
-        if (ret != 0) {
-            ALOGE("Failed to load SRC-amp package");
-            goto exit;
-        }
-        ret = enable_src_route(stdev->route_hdl, true, SRC_AMP_REF);
-        if (ret != 0) {
-            ALOGE("Failed to enable SRC-amp route");
-            goto exit;
-        }
+    if (!is_ready)
+        stdev->fw_gen++;
+    __atomic_store_n(&stdev->is_st_hal_ready, is_ready, __ATOMIC_RELAXED);
+}
 
-        ret = setup_aec_package(stdev->odsp_hdl);
-        if (ret != 0) {
-            ALOGE("Failed to load AEC package");
-            goto exit;
-        }
-        ret = enable_bargein_route(stdev->route_hdl, true);
-        if (ret != 0) {
-            ALOGE("Failed to enable buffer route");
-            goto exit;
-        }
+/*
+ * The streaming domain only needs a recent value as the tunnel calls fail on
+ * a chip that isn't ready.
+ */
+static bool is_hal_ready_for_strm(struct knowles_sound_trigger_device *stdev)
+{
+    return __atomic_load_n(&stdev->is_st_hal_ready, __ATOMIC_RELAXED);
+}
 
-        if (is_mic_controlled_by_ahal(stdev) == false) {
-            ret = enable_amp_ref_route(stdev->route_hdl, true, STRM_16K);
-            if (ret != 0) {
-                ALOGE("Failed to enable amp-ref route");
-                goto exit;
-            }
-            ret = enable_mic_route(stdev->route_hdl, true,
-                                EXTERNAL_OSCILLATOR);
-            if (ret != 0) {
-                ALOGE("Failed to enable mic route with EXT OSC");
-                goto exit;
-            }
+static int open_streaming_lib(struct knowles_sound_trigger_device *stdev) {
+    int ret = 0;
+
+    if (access(ADNC_STRM_LIBRARY_PATH, R_OK) == 0) {
+        stdev->adnc_cvq_strm_lib = dlopen(ADNC_STRM_LIBRARY_PATH, RTLD_NOW);
+        if (stdev->adnc_cvq_strm_lib == NULL) {
+            char const *err_str = dlerror();
+            ALOGE("%s: module = %s error = %s", __func__,
+                ADNC_STRM_LIBRARY_PATH, err_str ? err_str : "unknown");
+            ALOGE("%s: DLOPEN failed for %s", __func__, ADNC_STRM_LIBRARY_PATH);
         } else {
-            // main mic is turned by media recording
-            ret = enable_amp_ref_route(stdev->route_hdl, true, STRM_48K);
-            if (ret != 0) {
-                ALOGE("Failed to enable amp-ref route");
-                goto exit;
+            ALOGV("%s: DLOPEN successful for %s",
+                __func__, ADNC_STRM_LIBRARY_PATH);
+            stdev->adnc_strm_open =
+                (int (*)(bool, int, int))dlsym(stdev->adnc_cvq_strm_lib,
+                "adnc_strm_open");
+            stdev->adnc_strm_read =
+               (size_t (*)(long, void *, size_t))dlsym(stdev->adnc_cvq_strm_lib,
+                "adnc_strm_read");
+            stdev->adnc_strm_close =
+                (int (*)(long))dlsym(stdev->adnc_cvq_strm_lib,
+                "adnc_strm_close");
+            if (!stdev->adnc_strm_open || !stdev->adnc_strm_read ||
+                !stdev->adnc_strm_close) {
+                ALOGE("%s: Error grabbing functions in %s", __func__,
+                    ADNC_STRM_LIBRARY_PATH);
+                stdev->adnc_strm_open = 0;
+                stdev->adnc_strm_read = 0;
+                stdev->adnc_strm_close = 0;
             }
+            stdev->adnc_strm_get_first_frame_ts =
+                (int (*)(long, uint64_t *))dlsym(stdev->adnc_cvq_strm_lib,
+                "adnc_strm_get_first_frame_ts");
+            stdev->adnc_strm_prefill =
+                (int (*)(long, size_t))dlsym(stdev->adnc_cvq_strm_lib,
+                "adnc_strm_prefill");
+            stdev->adnc_strm_release_lingering =
+                (void (*)(void))dlsym(stdev->adnc_cvq_strm_lib,
+                "adnc_strm_release_lingering");
+            stdev->adnc_strm_open_multi =
+                (long (*)(bool, unsigned int, const int *, int))dlsym(
+                stdev->adnc_cvq_strm_lib, "adnc_strm_open_multi");
+            stdev->adnc_strm_open_format =
+                (long (*)(bool, unsigned int, int, int))dlsym(
+                stdev->adnc_cvq_strm_lib, "adnc_strm_open_format");
         }
-        stdev->is_bargein_route_enabled = true;
+    }
 
-        if (stdev->hotword_buffer_enable) {
-            ret = tear_hotword_buffer_route(stdev->route_hdl,
-                                !stdev->is_bargein_route_enabled);
-            if (ret != 0) {
-                ALOGE("Failed to tear old buffer route");
-                goto exit;
-            }
-            ret = set_hotword_buffer_route(stdev->route_hdl,
-                                stdev->is_bargein_route_enabled);
-            if (ret != 0) {
-                ALOGE("Failed to enable buffer route");
-                goto exit;
-            }
-        }
+    return ret;
+}
 
-        if (stdev->music_buffer_enable) {
-            ret = tear_music_buffer_route(stdev->route_hdl,
-                                !stdev->is_bargein_route_enabled);
-            if (ret != 0) {
-                ALOGE("Failed to tear old music buffer route");
-                goto exit;
-            }
-            ret = set_music_buffer_route(stdev->route_hdl,
-                                stdev->is_bargein_route_enabled);
-            if (ret != 0) {
-                ALOGE("Failed to enable buffer route");
-                goto exit;
-            }
-        }
+/*
+ * The streaming library keeps closed tunnels streaming for a short while,
+ * so that back to back captures reuse them. Tears them down when their
+ * source is gone: a firmware crash, or a package or route torn down behind
+ * them. Also when the HAL is done. Called with stdev->strm_lock held.
+ */
+static void release_lingering_tunnels(struct knowles_sound_trigger_device *stdev)
+{
+    if (stdev->adnc_strm_release_lingering != NULL)
+        stdev->adnc_strm_release_lingering();
+}
 
-        // Check each model, if it is active then update it's route
-        for (int i = 0; i < MAX_MODELS; i++) {
-            if (stdev->models[i].is_active == true) {
-                // teardown the package route without bargein
-                ret = tear_package_route(stdev,
-                                        stdev->models[i].uuid,
-                                        !stdev->is_bargein_route_enabled);
-                if (ret != 0) {
-                    ALOGE("Failed to tear old package route");
-                    goto exit;
-                }
-                // resetup the package route with bargein
-                ret = set_package_route(stdev,
-                                        stdev->models[i].uuid,
-                                        stdev->is_bargein_route_enabled);
-                if (ret != 0) {
-                    ALOGE("Failed to enable package route");
-                    goto exit;
-                }
-            }
-        }
+/*
+ * Loads the streaming library if it isn't yet. Called with
+ * stdev->strm_lock held.
+ */
+static void probe_streaming_lib(struct knowles_sound_trigger_device *stdev)
+{
+    struct timespec start, end;
+
+    if (stdev->is_strm_lib_probed)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    open_streaming_lib(stdev);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stdev->is_strm_lib_probed = true;
+    ALOGD("%s: streaming library loaded in %lld us", __func__,
+        timespec_diff_us(&end, &start));
+}
+
+static void *load_streaming_lib_thread(void *context)
+{
+    struct knowles_sound_trigger_device *stdev =
+        (struct knowles_sound_trigger_device *)context;
+
+    lock_strm(stdev);
+    probe_streaming_lib(stdev);
+    unlock_strm(stdev);
+
+    return NULL;
+}
+
+/*
+ * Opens the tunnel of the model at index, loading the streaming library
+ * if a read beats the background load to it. first_read tells which first
+ * read latency it is accounted to. A capture gets up to channels channels,
+ * the model's endpoint followed by those of CAPTURE_CHANNEL_EPS_PROP.
+ * Multi-channel captures are always S16, a single channel is float with
+ * CAPTURE_FLOAT_PROP set. Called with stdev->strm_lock held.
+ */
+static int open_capture_stream(struct knowles_sound_trigger_device *stdev,
+                            int index, enum first_read first_read,
+                            int channels)
+{
+    bool keyword_stripping_enabled = false;
+    int stream_end_point = CVQ_ENDPOINT;
+    int end_points[MAX_CAPTURE_CHANNELS];
+    enum pcm_format format = PCM_FORMAT_S16_LE;
+    const struct model_desc *desc;
+    int i;
+
+    probe_streaming_lib(stdev);
+    if (stdev->adnc_strm_open == NULL) {
+        ALOGE("%s: Error adnc streaming not supported", __func__);
+        return -ENOSYS;
+    }
+
+    desc = find_model_desc_by_event(stdev,
+                                    atomic_load(&stdev->last_detected_model_type));
+    if (desc != NULL)
+        stream_end_point = desc->plugin->strm_end_point;
+
+    if (channels > stdev->num_capture_channel_eps + 1)
+        channels = stdev->num_capture_channel_eps + 1;
+    if (stdev->adnc_strm_open_multi == NULL)
+        channels = 1;
+
+    if (channels > 1) {
+        end_points[0] = stream_end_point;
+        for (i = 1; i < channels; i++)
+            end_points[i] = stdev->capture_channel_eps[i - 1];
+        stdev->adnc_strm_handle[index] = stdev->adnc_strm_open_multi(
+                                    keyword_stripping_enabled, 0,
+                                    end_points, channels);
+    } else if (stdev->is_capture_float_enabled &&
+            stdev->adnc_strm_open_format != NULL) {
+        stdev->adnc_strm_handle[index] = stdev->adnc_strm_open_format(
+                                    keyword_stripping_enabled, 0,
+                                    stream_end_point, ADNC_STRM_FORMAT_FLOAT);
+        format = PCM_FORMAT_FLOAT_LE;
     } else {
-        ALOGD("%s: Bargein is already enabled", __func__);
+        stdev->adnc_strm_handle[index] = stdev->adnc_strm_open(
+                                    keyword_stripping_enabled, 0,
+                                    stream_end_point);
     }
+    if (stdev->adnc_strm_handle[index] == 0) {
+        ALOGE("%s: DSP is currently not streaming", __func__);
+        return -EIO;
+    }
+    stdev->strm_channels[index] = channels;
+    stdev->strm_formats[index] = format;
+    atomic_store(&stdev->strm_format_reported[index], false);
 
-exit:
-    return ret;
+    ALOGD("Successfully opened adnc strm! index %d handle %d channels %d",
+          index, stdev->capture_map[index].capture_handle, channels);
+    trace_tunnel_open(stdev);
+    stdev->is_streaming++;
+    atomic_store(&stdev->strm_first_read[index], first_read);
+
+    atomic_store(&stdev->adnc_strm_last_read_ms[index],
+                coarse_monotonic_ms());
+    if (stdev->is_streaming == 1)
+        arm_timer_ms(stdev->strm_timer_fd, TUNNEL_TIMEOUT * 1000);
+
+    return 0;
 }
 
-static int handle_input_source(struct knowles_sound_trigger_device *stdev,
-                            bool enable)
+/*
+ * Parses the history of a tunnel opened on detection into memory until the
+ * AHAL's first read comes in. Marks itself as a reader, so the tunnel can't
+ * be closed under it, and stops as soon as the tunnel is unpublished or
+ * another reader shows up. Each adnc_strm_prefill() call waits for the
+ * tunnel without the library's lock, so the first read doesn't queue up
+ * behind it.
+ */
+static void prefill_capture_stream(struct knowles_sound_trigger_device *stdev,
+                                int index, int capture_handle)
 {
-    int err = 0;
-    enum clock_type ct = INTERNAL_OSCILLATOR;
-    enum strm_type strmt = STRM_16K;
+    size_t bytes = CAPTURE_PREFILL_SAMPLES * capture_sample_size(stdev, index);
+    struct timespec start, now;
+    long long elapsed_ms = 0;
+    int ret = 0;
 
-    if (stdev->rx_active_count > 0) {
-        ct = EXTERNAL_OSCILLATOR;
+    if (stdev->adnc_strm_prefill == NULL)
+        return;
+
+    atomic_fetch_add(&stdev->strm_readers[index], 1);
+    // Closed again before the prefill thread got to it
+    if (atomic_load(&stdev->strm_capture_handle[index]) != capture_handle) {
+        put_strm_reader(stdev, index);
+        return;
     }
 
-    if (is_mic_controlled_by_ahal(stdev) == true) {
-        strmt = STRM_48K;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (atomic_load(&stdev->strm_capture_handle[index]) == capture_handle &&
+           atomic_load(&stdev->strm_first_read[index]) ==
+                FIRST_READ_PREOPENED &&
+           atomic_load(&stdev->strm_readers[index]) == 1 &&
+           !atomic_load(&stdev->prefill_queue.exit)) {
+        ret = stdev->adnc_strm_prefill(stdev->adnc_strm_handle[index], bytes);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed_ms = timespec_diff_us(&now, &start) / 1000;
+        if (ret < 0 || ret >= (int)bytes ||
+            elapsed_ms >= CAPTURE_PREFILL_TIMEOUT_MS)
+            break;
     }
+    put_strm_reader(stdev, index);
 
-    /*
-     *[TODO] Add correct error return value for input source route
-     * b/119390722 for tracing.
-     */
-    if (enable) {
-        if (stdev->is_mic_route_enabled == false) {
-            err = check_and_setup_src_package(stdev);
-            if (err != 0) {
-                ALOGE("Fail to setup src Package");
-                goto exit;
-            }
-            err = setup_src_plugin(stdev->odsp_hdl, SRC_MIC);
-            if (err != 0) {
-                ALOGE("Failed to load SRC package");
-                goto exit;
-            }
-            err = enable_src_route(stdev->route_hdl, true, SRC_MIC);
-            if (err != 0) {
-                ALOGE("Failed to enable SRC-mic route");
-                goto exit;
-            }
-        }
-        if (stdev->rx_active_count > 0 &&
-            stdev->is_bargein_route_enabled == false) {
-            err = setup_src_plugin(stdev->odsp_hdl, SRC_AMP_REF);
-            if (err != 0) {
-                ALOGE("Failed to load SRC-amp package");
-                goto exit;
-            }
-            err = enable_src_route(stdev->route_hdl, true, SRC_AMP_REF);
-            if (err != 0) {
-                ALOGE("Failed to enable SRC-amp route");
-                goto exit;
-            }
+    ALOGD("%s: index %d, %d bytes buffered in %lld ms", __func__, index, ret,
+        elapsed_ms);
+}
 
-            err = setup_aec_package(stdev->odsp_hdl);
-            if (err != 0) {
-                ALOGE("Failed to load AEC package");
-                // We didn't load AEC package so don't setup the routes
-                goto exit;
-            }
+/*
+ * Prefills the tunnels posted by request_prefill(), one at a time. Kept off
+ * the delivery thread so that detections queued behind a preopen aren't held
+ * up for CAPTURE_PREFILL_TIMEOUT_MS.
+ */
+static void *prefill_thread_loop(void *context)
+{
+    struct knowles_sound_trigger_device *stdev =
+        (struct knowles_sound_trigger_device *)context;
+    struct prefill_queue *pq = &stdev->prefill_queue;
+    int capture_handle;
+    int i;
 
-            // Enable the bargein route if not enabled
-            err = enable_bargein_route(stdev->route_hdl, true);
-            if (err != 0) {
-                ALOGE("Failed to enable buffer route");
-                goto exit;
-            }
-            err = enable_amp_ref_route(stdev->route_hdl, true, strmt);
-            if (err != 0) {
-                ALOGE("Failed to amp-ref route");
-                goto exit;
-            }
-            stdev->is_bargein_route_enabled = true;
+    ALOGI("%s", __func__);
+    prctl(PR_SET_NAME, (unsigned long)"sound trigger prefill", 0, 0, 0);
+
+    pthread_mutex_lock(&pq->lock);
+    while (!atomic_load(&pq->exit)) {
+        for (i = 0; i < MAX_MODELS; i++) {
+            if (pq->capture_handles[i] != NO_CAPTURE_HANDLE)
+                break;
         }
-        if (stdev->is_mic_route_enabled == false) {
-            if (is_mic_controlled_by_ahal(stdev) == false) {
-                err = enable_mic_route(stdev->route_hdl, true, ct);
-                if (err != 0) {
-                    ALOGE("Failed to enable mic route");
-                    goto exit;
-                }
-            }
-            stdev->is_mic_route_enabled = true;
+        if (i == MAX_MODELS) {
+            pthread_cond_wait(&pq->cond, &pq->lock);
+            continue;
         }
-    } else {
-        if (!is_any_model_active(stdev)) {
-            ALOGD("None of keywords are active");
-            if (stdev->rx_active_count > 0 &&
-                stdev->is_bargein_route_enabled == true) {
-                // Just disable the route and update the route status but retain
-                // bargein status
-                err = enable_bargein_route(stdev->route_hdl, false);
-                if (err != 0) {
-                    ALOGE("Failed to disable bargein route");
-                    goto exit;
-                }
-                err = destroy_aec_package(stdev->odsp_hdl);
-                if (err != 0) {
-                    ALOGE("Failed to unload AEC package");
-                    goto exit;
-                }
-                err = enable_src_route(stdev->route_hdl, false, SRC_AMP_REF);
-                if (err != 0) {
-                    ALOGE("Failed to disable SRC-amp route");
-                    goto exit;
-                }
-                err = destroy_src_plugin(stdev->odsp_hdl, SRC_AMP_REF);
-                if (err != 0) {
-                    ALOGE("Failed to unload SRC-amp package");
-                    goto exit;
-                }
-                err = enable_amp_ref_route(stdev->route_hdl, false, strmt);
-                if (err != 0) {
-                    ALOGE("Failed to amp-ref route");
-                    goto exit;
-                }
-                stdev->is_bargein_route_enabled = false;
-           }
-           if (stdev->is_mic_route_enabled == true) {
-               // Close SRC package
-               err = enable_src_route(stdev->route_hdl, false, SRC_MIC);
-               if (err != 0) {
-                   ALOGE("Failed to disable SRC-mic route");
-                   goto exit;
-               }
-               err = destroy_src_plugin(stdev->odsp_hdl, SRC_MIC);
-               if (err != 0) {
-                   ALOGE("Failed to unload SRC-mic package");
-                   goto exit;
-               }
-               if (is_mic_controlled_by_ahal(stdev) == false) {
-                   err = enable_mic_route(stdev->route_hdl, false, ct);
-                   if (err != 0) {
-                       ALOGE("Failed to disable mic route");
-                       goto exit;
-                   }
-               }
-               stdev->is_mic_route_enabled = false;
-               err = check_and_destroy_src_package(stdev);
-               if (err != 0) {
-                   ALOGE("Fail to destroy src Package");
-                   goto exit;
-               }
-           }
-       }
+
+        capture_handle = pq->capture_handles[i];
+        pq->capture_handles[i] = NO_CAPTURE_HANDLE;
+        pthread_mutex_unlock(&pq->lock);
+        prefill_capture_stream(stdev, i, capture_handle);
+        pthread_mutex_lock(&pq->lock);
     }
+    pthread_mutex_unlock(&pq->lock);
 
-exit:
-    return err;
+    return NULL;
 }
 
-static void update_rx_conditions(struct knowles_sound_trigger_device *stdev,
-                                 audio_event_type_t event,
-                                 struct audio_event_info *config)
+static void request_prefill(struct knowles_sound_trigger_device *stdev,
+                            int index, int capture_handle)
 {
-    if (event == AUDIO_EVENT_PLAYBACK_STREAM_INACTIVE) {
-        if (stdev->rx_active_count > 0) {
-            stdev->rx_active_count--;
-        } else {
-            ALOGW("%s: unexpected rx inactive event", __func__);
-        }
-    } else if (event == AUDIO_EVENT_PLAYBACK_STREAM_ACTIVE) {
-        if (!(config->device_info.device & AUDIO_DEVICE_OUT_SPEAKER)) {
-            ALOGD("%s: Playback device doesn't include SPEAKER.",
-                  __func__);
-        } else {
-            stdev->rx_active_count++;
-        }
-    } else {
-        ALOGW("%s: invalid event %d", __func__, event);
-    }
-    ALOGD("%s: updated rx_concurrency as %d", __func__,
-          stdev->rx_active_count);
+    struct prefill_queue *pq = &stdev->prefill_queue;
+
+    if (!stdev->is_prefill_thread_created)
+        return;
+
+    pthread_mutex_lock(&pq->lock);
+    pq->capture_handles[index] = capture_handle;
+    pthread_cond_signal(&pq->cond);
+    pthread_mutex_unlock(&pq->lock);
 }
 
+static int start_prefill_thread(struct knowles_sound_trigger_device *stdev)
+{
+    struct prefill_queue *pq = &stdev->prefill_queue;
+    int err;
+    int i;
+
+    for (i = 0; i < MAX_MODELS; i++)
+        pq->capture_handles[i] = NO_CAPTURE_HANDLE;
+    atomic_store(&pq->exit, false);
+    pthread_mutex_init(&pq->lock, (const pthread_mutexattr_t *) NULL);
+    pthread_cond_init(&pq->cond, (const pthread_condattr_t *) NULL);
 
-static void update_sthal_conditions(struct knowles_sound_trigger_device *stdev,
-                                    audio_event_type_t event,
-                                    struct audio_event_info *config)
+    err = pthread_create(&stdev->prefill_thread,
+                        (const pthread_attr_t *) NULL,
+                        prefill_thread_loop, stdev);
+    if (err != 0) {
+        ALOGE("%s: Failed to create prefill thread %d", __func__, err);
+        pthread_cond_destroy(&pq->cond);
+        pthread_mutex_destroy(&pq->lock);
+        return -err;
+    }
+
+    stdev->is_prefill_thread_created = true;
+    return 0;
+}
+
+static void stop_prefill_thread(struct knowles_sound_trigger_device *stdev)
 {
-    if (event == AUDIO_EVENT_CAPTURE_DEVICE_INACTIVE) {
-        // get correct voice/voip mode in sthal
-        if (stdev->is_ahal_in_voice_voip_mode == false &&
-            stdev->is_ahal_voice_voip_stop == true &&
-            stdev->is_ahal_media_recording == true) {
+    struct prefill_queue *pq = &stdev->prefill_queue;
+
+    if (!stdev->is_prefill_thread_created)
+        return;
+
+    pthread_mutex_lock(&pq->lock);
+    atomic_store(&pq->exit, true);
+    pthread_cond_signal(&pq->cond);
+    pthread_mutex_unlock(&pq->lock);
+    pthread_join(stdev->prefill_thread, (void **)NULL);
+    pthread_cond_destroy(&pq->cond);
+    pthread_mutex_destroy(&pq->lock);
+    stdev->is_prefill_thread_created = false;
+}
+
+/*
+ * Opens the tunnel of a detection that asked for capture as soon as it has
+ * been delivered, so that the AHAL's first read is served from memory
+ * rather than waiting for the tunnel to be set up. Called from the delivery
+ * thread, nothing is done if the AHAL got there first.
+ */
+static void preopen_capture_stream(struct knowles_sound_trigger_device *stdev,
+                                int capture_handle)
+{
+    int index = -1;
+    int err = -ENOENT;
+
+    lock_strm(stdev);
+    if (!is_hal_ready_for_strm(stdev))
+        goto exit;
+
+    index = find_capture_slot(stdev, capture_handle);
+    if (index == -1 || stdev->adnc_strm_handle[index] != 0)
+        goto exit;
+
+    err = open_capture_stream(stdev, index, FIRST_READ_PREOPENED,
+                            SOUND_TRIGGER_CHANNEL);
+    if (err == 0) {
+        publish_capture_stream(stdev, index, capture_handle);
+        metric_add(stdev->metrics.capture_preopens, 1);
+    }
+
+exit:
+    unlock_strm(stdev);
+
+    if (err == 0)
+        request_prefill(stdev, index, capture_handle);
+}
+
+static bool is_uuid_in_recover_list(struct knowles_sound_trigger_device *stdev,
+                                    sound_model_handle_t handle)
+{
+    int mask = 0;
+    const struct model_desc *desc = stdev->models[handle].desc;
+
+    if (desc != NULL)
+        mask = desc->recover_mask;
+
+    return (stdev->recover_model_list & mask) ? true : false;
+}
+
+static void update_recover_list(struct knowles_sound_trigger_device *stdev,
+                                sound_model_handle_t handle,
+                                bool enable)
+{
+    int mask = 0;
+    const struct model_desc *desc = stdev->models[handle].desc;
+
+    ALOGD("%s: handle %d enable %d", __func__, handle, enable);
+    if (desc != NULL)
+        mask = desc->recover_mask;
+
+    if (enable)
+        stdev->recover_model_list |= mask;
+    else
+        stdev->recover_model_list &= ~mask;
+
+    return;
+}
+
+static int check_and_setup_src_package(
+                                    struct knowles_sound_trigger_device *stdev)
+{
+    int err = 0;
+
+    if (stdev->is_src_package_loaded == false) {
+        err = setup_src_package(stdev->odsp_hdl);
+        if (err != 0) {
+            ALOGE("%s: Failed to load SRC package", __func__);
+            goto exit;
+        } else {
+            ALOGD("%s: SRC package loaded", __func__);
+            stdev->is_src_package_loaded = true;
+        }
+    } else {
+        ALOGD("%s: SRC package is already loaded", __func__);
+    }
+
+exit:
+    return err;
+}
+
+static int check_and_destroy_src_package(
+                                    struct knowles_sound_trigger_device *stdev)
+{
+    int err = 0;
+
+    if (!is_any_model_active(stdev) && stdev->is_src_package_loaded == true) {
+        err = destroy_src_package(stdev->odsp_hdl);
+        if (err != 0) {
+            ALOGE("%s: Failed to destroy SRC package", __func__);
+            goto exit;
+        } else {
+            ALOGD("%s: SRC package destroy", __func__);
+            stdev->is_src_package_loaded = false;
+        }
+    }
+
+exit:
+    return err;
+}
+
+static int check_and_setup_buffer_package(
+                                    struct knowles_sound_trigger_device *stdev)
+{
+    int err = 0;
+
+    if (stdev->is_buffer_package_loaded == false) {
+        err = setup_buffer_package(stdev->odsp_hdl);
+        if (err != 0) {
+            ALOGE("%s: Failed to load Buffer package", __func__);
+            goto exit;
+        } else {
+            ALOGD("%s: Buffer package loaded", __func__);
+            stdev->is_buffer_package_loaded = true;
+        }
+    } else {
+        ALOGD("%s: Buffer package is already loaded", __func__);
+    }
+
+exit:
+    return err;
+}
+
+static int check_and_destroy_buffer_package(
+                                    struct knowles_sound_trigger_device *stdev)
+{
+    int err = 0;
+
+    if (!is_any_model_active(stdev) &&
+        stdev->is_buffer_package_loaded &&
+        (!stdev->is_sensor_destroy_in_prog &&
+        !stdev->is_sensor_setup_in_prog &&
+        !stdev->is_sensor_route_enabled) &&
+        (!stdev->is_chre_destroy_in_prog &&
+        !stdev->is_chre_loaded)) {
+
+        err = destroy_buffer_package(stdev->odsp_hdl);
+        if (err != 0) {
+            ALOGE("%s: Failed to destroy Buffer package", __func__);
+            goto exit;
+        } else {
+            ALOGD("%s: Buffer package destroy", __func__);
+            stdev->is_buffer_package_loaded = false;
+        }
+    }
+
+exit:
+    return err;
+}
+
+static int *buffer_enable_count(struct knowles_sound_trigger_device *stdev,
+                                const struct plugin_desc *plugin)
+{
+    if (plugin == &hotword_plugin)
+        return &stdev->hotword_buffer_enable;
+    else
+        return &stdev->music_buffer_enable;
+}
+
+static int setup_package(struct knowles_sound_trigger_device *stdev,
+                        struct model_info *model)
+{
+    int err = 0;
+    const struct model_desc *desc = model->desc;
+    const struct plugin_desc *plugin;
+
+    if (desc == NULL)
+        goto exit;
+
+    if (desc->kind == MODEL_KIND_CHRE) {
+        if (!(stdev->current_enable & CHRE_MASK)) {
+            err = setup_chre_package(stdev->odsp_hdl);
+            if (err != 0) {
+                ALOGE("Failed to load CHRE package");
+                goto exit;
+            }
+        }
+        stdev->current_enable = stdev->current_enable | CHRE_MASK;
+        goto exit;
+    }
+
+    if (desc->kind != MODEL_KIND_KEYWORD)
+        goto exit;
+
+    plugin = desc->plugin;
+    if (!(stdev->current_enable & plugin->mask)) {
+        err = plugin->setup_package(stdev->odsp_hdl);
+        if (err != 0) {
+            ALOGE("Failed to load %s package", desc->name);
+            goto exit;
+        }
+    } else if (plugin->tear_before_write) {
+        // tear down the plugin for writing new model data.
+        err = plugin->tear_state(stdev->odsp_hdl, stdev->current_enable);
+    }
+    err = write_model(stdev->odsp_hdl, model->data, model->data_sz,
+                    model->kw_id);
+    if (err != 0) {
+        ALOGE("Failed to write %s model", desc->name);
+        goto exit;
+    }
+
+    //setup model state.
+    stdev->current_enable = stdev->current_enable | desc->enable_mask;
+    err = plugin->set_state(stdev->odsp_hdl, stdev->current_enable);
+    if (err != 0) {
+        ALOGE("Failed to set %s state", desc->name);
+        goto exit;
+    }
+
+exit:
+    return err;
+}
+
+static int setup_buffer(struct knowles_sound_trigger_device *stdev,
+                        struct model_info *model,
+                        bool enabled)
+{
+    int err = 0;
+    const struct plugin_desc *plugin;
+    int *buffer_enable;
+
+    if (!is_model_kind(model, MODEL_KIND_KEYWORD))
+        goto exit;
+
+    plugin = model->desc->plugin;
+    buffer_enable = buffer_enable_count(stdev, plugin);
+
+    if (enabled) {
+        (*buffer_enable)++;
+        if (*buffer_enable > 1)
+            goto exit;
+
+        err = plugin->setup_buffer(stdev->odsp_hdl);
+        if (err != 0) {
+            (*buffer_enable)--;
+            ALOGE("Failed to setup the %s buffer", model->desc->name);
+            goto exit;
+        }
+    } else {
+        if (*buffer_enable == 0) {
+            ALOGW("Invalid call for setup buffer");
+            goto exit;
+        }
+        (*buffer_enable)--;
+        if (*buffer_enable != 0)
+            goto exit;
+
+        err = plugin->destroy_buffer(stdev->odsp_hdl);
+        if (err != 0) {
+            ALOGE("Failed to unload %s buffer", model->desc->name);
+            goto exit;
+        }
+    }
+
+exit:
+    return err;
+}
+
+static void set_model_buffer_route(struct knowles_sound_trigger_device *stdev,
+                                struct model_info *model)
+{
+    const struct plugin_desc *plugin;
+
+    if (!is_model_kind(model, MODEL_KIND_KEYWORD))
+        return;
+
+    plugin = model->desc->plugin;
+    if (*buffer_enable_count(stdev, plugin) &&
+        (!(stdev->current_enable & plugin->primary_mask) ||
+          (stdev->current_enable & plugin->secondary_mask))) {
+        plugin->set_buffer_route(stdev->route_hdl,
+                                stdev->is_bargein_route_enabled);
+    }
+}
+
+static void tear_model_buffer_route(struct knowles_sound_trigger_device *stdev,
+                                    struct model_info *model)
+{
+    const struct plugin_desc *plugin;
+
+    if (!is_model_kind(model, MODEL_KIND_KEYWORD))
+        return;
+
+    plugin = model->desc->plugin;
+    if (*buffer_enable_count(stdev, plugin) &&
+        !(stdev->current_enable & plugin->mask)) {
+        plugin->tear_buffer_route(stdev->route_hdl,
+                                stdev->is_bargein_route_enabled);
+    }
+}
+
+static int destroy_package(struct knowles_sound_trigger_device *stdev,
+                        struct model_info *model)
+{
+    int err = 0;
+    const struct model_desc *desc = model->desc;
+    const struct plugin_desc *plugin;
+
+    if (desc == NULL)
+        goto exit;
+
+    if (desc->kind == MODEL_KIND_CHRE) {
+        stdev->current_enable = stdev->current_enable & ~CHRE_MASK;
+        if (!(stdev->current_enable & CHRE_MASK)) {
+            err = destroy_chre_package(stdev->odsp_hdl);
+            if (err != 0) {
+                ALOGE("Failed to destroy CHRE package");
+                goto exit;
+            }
+        }
+        goto exit;
+    }
+
+    if (desc->kind != MODEL_KIND_KEYWORD)
+        goto exit;
+
+    plugin = desc->plugin;
+    err = plugin->tear_state(stdev->odsp_hdl, desc->enable_mask);
+    if (err != 0) {
+        ALOGE("Failed to tear %s state", desc->name);
+        goto exit;
+    }
+
+    err = flush_model(stdev->odsp_hdl, model->kw_id);
+    if (err != 0) {
+        ALOGE("Failed to flush %s model", desc->name);
+        goto exit;
+    }
+    stdev->current_enable = stdev->current_enable & ~desc->enable_mask;
+
+    if (!(stdev->current_enable & plugin->mask)) {
+        err = plugin->destroy_package(stdev->odsp_hdl);
+        if (err != 0) {
+            ALOGE("Failed to destroy %s package", desc->name);
+            goto exit;
+        }
+    }
+
+exit:
+    return err;
+}
+
+static int set_package_route(struct knowles_sound_trigger_device *stdev,
+                            struct model_info *model,
+                            bool bargein)
+{
+    int ret = 0;
+    const struct model_desc *desc = model->desc;
+    /*
+     *[TODO] Add correct error return value for package route
+     * b/119390722 for tracing.
+     */
+    if (desc == NULL)
+        return ret;
+
+    if (desc->kind == MODEL_KIND_CHRE) {
+        if (stdev->is_chre_loaded == true) {
+            set_chre_audio_route(stdev->route_hdl, bargein);
+        }
+    } else if (desc->kind == MODEL_KIND_KEYWORD) {
+        // The plugin route is shared, only set it up for the first model
+        if (!(stdev->current_enable & desc->plugin->mask & ~desc->enable_mask))
+            desc->plugin->set_route(stdev->route_hdl, bargein);
+    }
+
+    return ret;
+}
+
+static int tear_package_route(struct knowles_sound_trigger_device *stdev,
+                            struct model_info *model,
+                            bool bargein)
+{
+    int ret = 0;
+    const struct model_desc *desc = model->desc;
+    /*
+     *[TODO] Add correct error return value for package route
+     * b/119390722 for tracing.
+     */
+    if (desc == NULL)
+        return ret;
+
+    if (desc->kind == MODEL_KIND_CHRE) {
+        if (stdev->is_chre_loaded == true) {
+            tear_chre_audio_route(stdev->route_hdl, bargein);
+        }
+    } else if (desc->kind == MODEL_KIND_KEYWORD) {
+        // The plugin route is shared, only tear it down for the last model
+        if (!(stdev->current_enable & desc->plugin->mask & ~desc->enable_mask))
+            desc->plugin->tear_route(stdev->route_hdl, bargein);
+    }
+
+    return ret;
+}
+
+static void add_transition_step(struct transition_plan *tp,
+                                enum transition_step_kind kind,
+                                bool enable, int param)
+{
+    if (tp->num_steps >= MAX_TRANSITION_STEPS) {
+        ALOGE("%s: Too many steps, dropping step %d", __func__, kind);
+        return;
+    }
+
+    tp->steps[tp->num_steps].kind = kind;
+    tp->steps[tp->num_steps].enable = enable;
+    tp->steps[tp->num_steps].param = param;
+    tp->num_steps++;
+}
+
+static int run_transition_step(struct knowles_sound_trigger_device *stdev,
+                            const struct transition_step *step, bool undo)
+{
+    bool enable = undo ? !step->enable : step->enable;
+    struct model_info *model;
+    int ret = 0, commit_ret = 0;
+
+    switch (step->kind) {
+    case STEP_MIC_ROUTE:
+        ret = enable_mic_route(stdev->route_hdl, enable, step->param);
+        break;
+    case STEP_SRC_PACKAGE:
+        if (enable)
+            ret = check_and_setup_src_package(stdev);
+        else
+            ret = check_and_destroy_src_package(stdev);
+        break;
+    case STEP_SRC_PLUGIN:
+        if (enable)
+            ret = setup_src_plugin(stdev->odsp_hdl, step->param);
+        else
+            ret = destroy_src_plugin(stdev->odsp_hdl, step->param);
+        break;
+    case STEP_SRC_ROUTE:
+        ret = enable_src_route(stdev->route_hdl, enable, step->param);
+        break;
+    case STEP_AEC_PACKAGE:
+        if (enable)
+            ret = setup_aec_package(stdev->odsp_hdl);
+        else
+            ret = destroy_aec_package(stdev->odsp_hdl);
+        break;
+    case STEP_BARGEIN_ROUTE:
+        ret = enable_bargein_route(stdev->route_hdl, enable);
+        break;
+    case STEP_AMP_REF_ROUTE:
+        ret = enable_amp_ref_route(stdev->route_hdl, enable, step->param);
+        break;
+    /*
+     * The plugin routes are swapped between their barge-in variants, which
+     * share most of their controls. Committing both halves at once only
+     * writes the controls that actually differ.
+     */
+    case STEP_HOTWORD_BUF_ROUTE:
+        begin_route_update(stdev->route_hdl);
+        ret = tear_hotword_buffer_route(stdev->route_hdl, !enable);
+        if (ret == 0)
+            ret = set_hotword_buffer_route(stdev->route_hdl, enable);
+        commit_ret = commit_route_update(stdev->route_hdl);
+        break;
+    case STEP_MUSIC_BUF_ROUTE:
+        begin_route_update(stdev->route_hdl);
+        ret = tear_music_buffer_route(stdev->route_hdl, !enable);
+        if (ret == 0)
+            ret = set_music_buffer_route(stdev->route_hdl, enable);
+        commit_ret = commit_route_update(stdev->route_hdl);
+        break;
+    case STEP_MODEL_ROUTE:
+        model = &stdev->models[step->param];
+        begin_route_update(stdev->route_hdl);
+        ret = tear_package_route(stdev, model, !enable);
+        // A model stopped meanwhile only needs its old route removed
+        if (ret == 0 && (!undo || model->is_active == true))
+            ret = set_package_route(stdev, model, enable);
+        commit_ret = commit_route_update(stdev->route_hdl);
+        break;
+    }
+
+    if (ret == 0)
+        ret = commit_ret;
+
+    if (ret != 0) {
+        ALOGE("%s: %s of step %d (enable %d) failed", __func__,
+            undo ? "Undo" : "Run", step->kind, enable);
+    }
+
+    return ret;
+}
+
+// Undoes the steps of tp that have run, last one first
+static void rollback_plan(struct knowles_sound_trigger_device *stdev,
+                        struct transition_plan *tp)
+{
+    int i;
+
+    for (i = tp->next - 1; i >= 0; i--)
+        run_transition_step(stdev, &tp->steps[i], true);
+}
+
+/*
+ * Runs every step of tp in a row, undoing the ones done if one fails.
+ * Called with stdev->lock held.
+ */
+static int run_plan(struct knowles_sound_trigger_device *stdev,
+                    struct transition_plan *tp)
+{
+    int err;
+
+    for (tp->next = 0; tp->next < tp->num_steps; tp->next++) {
+        err = run_transition_step(stdev, &tp->steps[tp->next], false);
+        if (err != 0) {
+            rollback_plan(stdev, tp);
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Builds the mic and barge-in routing as a plan of the same steps the
+ * barge-in transitions use, and runs it right away. A failed step undoes
+ * the ones before it, so the route flags always match the chip. Unlike a
+ * barge-in transition it isn't left to the reactor: its callers carry on
+ * with routes that depend on it, and some of them run on the reactor.
+ */
+static int handle_input_source(struct knowles_sound_trigger_device *stdev,
+                            bool enable)
+{
+    struct transition_plan tp;
+    bool is_mic_by_ahal = is_mic_controlled_by_ahal(stdev);
+    bool mic_target = stdev->is_mic_route_enabled;
+    bool bargein_target = stdev->is_bargein_route_enabled;
+    enum clock_type ct = INTERNAL_OSCILLATOR;
+    enum strm_type strmt = STRM_16K;
+    int err;
+
+    if (stdev->rx_active_count > 0) {
+        ct = EXTERNAL_OSCILLATOR;
+    }
+
+    if (is_mic_by_ahal == true) {
+        strmt = STRM_48K;
+    }
+
+    tp.num_steps = 0;
+    tp.next = 0;
+    if (enable) {
+        if (stdev->is_mic_route_enabled == false) {
+            add_transition_step(&tp, STEP_SRC_PACKAGE, true, 0);
+            add_transition_step(&tp, STEP_SRC_PLUGIN, true, SRC_MIC);
+            add_transition_step(&tp, STEP_SRC_ROUTE, true, SRC_MIC);
+        }
+        if (stdev->rx_active_count > 0 &&
+            stdev->is_bargein_route_enabled == false) {
+            add_transition_step(&tp, STEP_SRC_PLUGIN, true, SRC_AMP_REF);
+            add_transition_step(&tp, STEP_SRC_ROUTE, true, SRC_AMP_REF);
+            add_transition_step(&tp, STEP_AEC_PACKAGE, true, 0);
+            add_transition_step(&tp, STEP_BARGEIN_ROUTE, true, 0);
+            add_transition_step(&tp, STEP_AMP_REF_ROUTE, true, strmt);
+            bargein_target = true;
+        }
+        if (stdev->is_mic_route_enabled == false) {
+            if (is_mic_by_ahal == false)
+                add_transition_step(&tp, STEP_MIC_ROUTE, true, ct);
+            mic_target = true;
+        }
+    } else if (!is_any_model_active(stdev)) {
+        ALOGD("None of keywords are active");
+        if (stdev->rx_active_count > 0 &&
+            stdev->is_bargein_route_enabled == true) {
+            // Just disable the route and update the route status but retain
+            // bargein status
+            add_transition_step(&tp, STEP_BARGEIN_ROUTE, false, 0);
+            add_transition_step(&tp, STEP_AEC_PACKAGE, false, 0);
+            add_transition_step(&tp, STEP_SRC_ROUTE, false, SRC_AMP_REF);
+            add_transition_step(&tp, STEP_SRC_PLUGIN, false, SRC_AMP_REF);
+            add_transition_step(&tp, STEP_AMP_REF_ROUTE, false, strmt);
+            bargein_target = false;
+        }
+        if (stdev->is_mic_route_enabled == true) {
+            // Close SRC package
+            add_transition_step(&tp, STEP_SRC_ROUTE, false, SRC_MIC);
+            add_transition_step(&tp, STEP_SRC_PLUGIN, false, SRC_MIC);
+            if (is_mic_by_ahal == false)
+                add_transition_step(&tp, STEP_MIC_ROUTE, false, ct);
+            add_transition_step(&tp, STEP_SRC_PACKAGE, false, 0);
+            mic_target = false;
+        }
+    }
+
+    err = run_plan(stdev, &tp);
+    if (err != 0) {
+        ALOGE("%s: Failed to %s the input source, %d/%d steps rolled back",
+            __func__, enable ? "enable" : "disable", tp.next, tp.num_steps);
+        return err;
+    }
+
+    stdev->is_mic_route_enabled = mic_target;
+    stdev->is_bargein_route_enabled = bargein_target;
+
+    return 0;
+}
+
+static void update_rx_conditions(struct knowles_sound_trigger_device *stdev,
+                                 audio_event_type_t event,
+                                 struct audio_event_info *config)
+{
+    if (event == AUDIO_EVENT_PLAYBACK_STREAM_INACTIVE) {
+        if (stdev->rx_active_count > 0) {
+            stdev->rx_active_count--;
+        } else {
+            ALOGW("%s: unexpected rx inactive event", __func__);
+        }
+    } else if (event == AUDIO_EVENT_PLAYBACK_STREAM_ACTIVE) {
+        if (!(config->device_info.device & AUDIO_DEVICE_OUT_SPEAKER)) {
+            ALOGD("%s: Playback device doesn't include SPEAKER.",
+                  __func__);
+        } else {
+            stdev->rx_active_count++;
+        }
+    } else {
+        ALOGW("%s: invalid event %d", __func__, event);
+    }
+    ALOGD("%s: updated rx_concurrency as %d", __func__,
+          stdev->rx_active_count);
+}
+
+
+static void update_sthal_conditions(struct knowles_sound_trigger_device *stdev,
+                                    audio_event_type_t event,
+                                    struct audio_event_info *config)
+{
+    if (event == AUDIO_EVENT_CAPTURE_DEVICE_INACTIVE) {
+        // get correct voice/voip mode in sthal
+        if (stdev->is_ahal_in_voice_voip_mode == false &&
+            stdev->is_ahal_voice_voip_stop == true &&
+            stdev->is_ahal_media_recording == true) {
             ALOGD("%s: voice/voip didn't start, treat it as media recording inactive",
                   __func__);
             stdev->is_ahal_voice_voip_stop = false;
@@ -1362,897 +2927,2661 @@ static void update_sthal_conditions(struct knowles_sound_trigger_device *stdev,
             stdev->is_ahal_in_voice_voip_mode = false;
         }
 
-        if (stdev->is_concurrent_capture == true &&
-            stdev->is_ahal_in_voice_voip_mode == false) {
-            if (stdev->is_ahal_media_recording == true)
-                stdev->is_con_mic_route_enabled = true;
-            else
-                stdev->is_con_mic_route_enabled = false;
-            ALOGD("%s: update mic con %d", __func__,
-                  stdev->is_con_mic_route_enabled);
+        if (stdev->is_concurrent_capture == true &&
+            stdev->is_ahal_in_voice_voip_mode == false) {
+            if (stdev->is_ahal_media_recording == true)
+                stdev->is_con_mic_route_enabled = true;
+            else
+                stdev->is_con_mic_route_enabled = false;
+            ALOGD("%s: update mic con %d", __func__,
+                  stdev->is_con_mic_route_enabled);
+        }
+    } else if (event == AUDIO_EVENT_CAPTURE_DEVICE_ACTIVE) {
+        if (stdev->is_ahal_in_voice_voip_mode == false &&
+                (config->u.usecase.type == USECASE_TYPE_VOICE_CALL ||
+                 config->u.usecase.type == USECASE_TYPE_VOIP_CALL)) {
+            ALOGD("%s: voice/voip is actvie, close ST mic and don't use mic concurrently",
+                  __func__);
+            stdev->is_ahal_in_voice_voip_mode = true;
+        }
+        if (config->u.usecase.type == USECASE_TYPE_PCM_CAPTURE) {
+            stdev->is_ahal_media_recording = true;
+        }
+        if (stdev->is_concurrent_capture == true &&
+            stdev->is_ahal_in_voice_voip_mode == false &&
+            stdev->is_con_mic_route_enabled == false &&
+            config->device_info.device == ST_DEVICE_HANDSET_MIC) {
+            ALOGD("%s: enable mic concurrency", __func__);
+                  stdev->is_con_mic_route_enabled = true;
+        }
+    } else if (event == AUDIO_EVENT_CAPTURE_STREAM_INACTIVE) {
+        if (stdev->is_ahal_voice_voip_start == true &&
+                (config->u.usecase.type == USECASE_TYPE_VOICE_CALL ||
+                 config->u.usecase.type == USECASE_TYPE_VOIP_CALL)) {
+            stdev->is_ahal_voice_voip_stop = true;
+            stdev->is_ahal_voice_voip_start = false;
+        } else if (config->u.usecase.type == USECASE_TYPE_PCM_CAPTURE)
+            stdev->is_ahal_media_recording = false;
+    } else if (event == AUDIO_EVENT_CAPTURE_STREAM_ACTIVE) {
+        if (config->u.usecase.type == USECASE_TYPE_VOICE_CALL ||
+            config->u.usecase.type == USECASE_TYPE_VOIP_CALL) {
+            stdev->is_ahal_voice_voip_start = true;
+        }
+    }
+}
+
+static bool do_handle_functions(struct knowles_sound_trigger_device *stdev,
+                                enum sthal_mode pre_mode,
+                                enum sthal_mode cur_mode,
+                                audio_event_type_t event)
+{
+    int ret = 0;
+    int i = 0;
+
+    ALOGD("+%s+: pre %d, cur %d, event %d", __func__, pre_mode, cur_mode, event);
+
+    // handle event AUDIO_EVENT_CAPTURE_DEVICE_ACTIVE
+    if (event == AUDIO_EVENT_CAPTURE_DEVICE_ACTIVE) {
+        if ((pre_mode == CON_DISABLED_ST && cur_mode == CON_DISABLED_CAPTURE) ||
+            (pre_mode == CON_DISABLED_ST && cur_mode == IN_CALL) ||
+            (pre_mode == CON_DISABLED_CAPTURE && cur_mode == IN_CALL) ||
+            (pre_mode == CON_ENABLED_CAPTURE_ST && cur_mode == IN_CALL) ||
+            (pre_mode == CON_ENABLED_ST && cur_mode == IN_CALL)) {
+            // disable all ST
+            // if tunnel is active, close it first
+            lock_strm(stdev);
+            for (i = 0; i < MAX_MODELS; i++) {
+                if (stdev->adnc_strm_handle[i] != 0) {
+                    ALOGD("%s: stop tunnling for index:%d", __func__, i);
+                    close_capture_stream(stdev, i);
+                }
+            }
+            stdev->is_streaming = 0;
+            release_lingering_tunnels(stdev);
+            unlock_strm(stdev);
+
+            for (i = 0; i < MAX_MODELS; i++) {
+                if (stdev->models[i].is_active == true) {
+                    update_recover_list(stdev, i, true);
+                    tear_package_route(stdev, &stdev->models[i],
+                                       stdev->is_bargein_route_enabled);
+                    stdev->models[i].is_active = false;
+                    update_capture_map(stdev, i);
+                    if (!is_model_type(&stdev->models[i], ST_MODEL_CHRE))
+                        destroy_package(stdev, &stdev->models[i]);
+
+                    if ((stdev->hotword_buffer_enable) &&
+                        !(stdev->current_enable & PLUGIN1_MASK)) {
+                        tear_hotword_buffer_route(stdev->route_hdl,
+                                                  stdev->is_bargein_route_enabled);
+                    }
+
+                    if ((stdev->music_buffer_enable) &&
+                        !(stdev->current_enable & PLUGIN2_MASK)) {
+                        tear_music_buffer_route(stdev->route_hdl,
+                                                stdev->is_bargein_route_enabled);
+                    }
+
+                    setup_buffer(stdev, &stdev->models[i], false);
+                }
+            }
+            handle_input_source(stdev, false);
+            check_and_destroy_buffer_package(stdev);
+        } else if (pre_mode == CON_ENABLED_ST && cur_mode == CON_ENABLED_CAPTURE_ST) {
+            //reconfig mic
+            if (stdev->is_mic_route_enabled == true) {
+                if (stdev->is_bargein_route_enabled == true) {
+                    // close amp-ref first and reconfig it again with 48K after
+                    // main mic is turned on by media recording
+                    ret = enable_amp_ref_route(stdev->route_hdl, false, STRM_16K);
+                    if (ret != 0) {
+                        ALOGE("Failed to disable amp-ref route");
+                        goto exit;
+                    }
+                    ret = enable_mic_route(stdev->route_hdl, false,
+                                           EXTERNAL_OSCILLATOR);
+                    if (ret != 0) {
+                        ALOGE("Failed to disable mic route with EXT OSC");
+                        goto exit;
+                    }
+
+                    ret = enable_amp_ref_route(stdev->route_hdl, true, STRM_48K);
+                    if (ret != 0) {
+                        ALOGE("Failed to enable amp-ref route");
+                        goto exit;
+                    }
+                } else {
+                    ret = enable_mic_route(stdev->route_hdl, false,
+                                           INTERNAL_OSCILLATOR);
+                    if (ret != 0) {
+                        ALOGE("Failed to disable mic route with INT OSC");
+                        goto exit;
+                    }
+                }
+            } else {
+                ALOGD("%s: ST mic isn't enabled, recording mic is turned on",
+                       __func__);
+            }
+        }
+    }
+
+    // handle event AUDIO_EVENT_CAPTURE_DEVICE_INACTIVE
+    if (event == AUDIO_EVENT_CAPTURE_DEVICE_INACTIVE) {
+        if ((pre_mode == IN_CALL && cur_mode == CON_DISABLED_ST) ||
+            (pre_mode == IN_CALL && cur_mode == CON_DISABLED_CAPTURE) ||
+            (pre_mode == IN_CALL && cur_mode == CON_ENABLED_ST) ||
+            (pre_mode == IN_CALL && cur_mode == CON_ENABLED_CAPTURE_ST) ||
+            (pre_mode == CON_DISABLED_CAPTURE && cur_mode == CON_DISABLED_ST)) {
+            //recover all STs
+            for (i = 0; i < MAX_MODELS; i++) {
+                // recover all models from list
+                if (is_uuid_in_recover_list(stdev, i)) {
+                    if (stdev->models[i].is_active == false) {
+                        check_and_setup_buffer_package(stdev);
+                        stdev->models[i].is_active = true;
+                        update_capture_map(stdev, i);
+                        handle_input_source(stdev, true);
+
+                        setup_buffer(stdev, &stdev->models[i], true);
+                        if (stdev->hotword_buffer_enable &&
+                            !(stdev->current_enable & PLUGIN1_MASK)) {
+                            set_hotword_buffer_route(stdev->route_hdl,
+                                                     stdev->is_bargein_route_enabled);
+                        }
+                        if (stdev->music_buffer_enable &&
+                            !(stdev->current_enable & PLUGIN2_MASK)) {
+                            set_music_buffer_route(stdev->route_hdl,
+                                                   stdev->is_bargein_route_enabled);
+                        }
+
+                        if (!is_model_type(&stdev->models[i], ST_MODEL_CHRE))
+                            setup_package(stdev, &stdev->models[i]);
+                        set_package_route(stdev, &stdev->models[i],
+                                          stdev->is_bargein_route_enabled);
+                    }
+                }
+            }
+            stdev->recover_model_list = 0;
+        } else if (pre_mode == CON_ENABLED_CAPTURE_ST && cur_mode == CON_ENABLED_ST) {
+            // reconfig mic
+            if (stdev->is_mic_route_enabled == true) {
+                if (stdev->is_bargein_route_enabled == true) {
+                    ret = enable_amp_ref_route(stdev->route_hdl, false, STRM_48K);
+                    if (ret != 0) {
+                        ALOGE("Failed to disable amp-ref route");
+                        goto exit;
+                    }
+                    ret = enable_mic_route(stdev->route_hdl, true,
+                                           EXTERNAL_OSCILLATOR);
+                    if (ret != 0) {
+                        ALOGE("Failed to enable mic route with EXT OSC");
+                        goto exit;
+                    }
+                    // turn on amp-ref with 16khz
+                    ret = enable_amp_ref_route(stdev->route_hdl, true, STRM_16K);
+                    if (ret != 0) {
+                        ALOGE("Failed to enable amp-ref route");
+                        goto exit;
+                    }
+                } else {
+                    ret = enable_mic_route(stdev->route_hdl, true,
+                                           INTERNAL_OSCILLATOR);
+                    if (ret != 0) {
+                        ALOGE("Failed to enable mic route with INT OSC");
+                        goto exit;
+                    }
+                }
+            } else {
+                ALOGD("%s: ST mic isn't enabled, recording mic is turned off",
+                      __func__);
+            }
+        }
+    }
+
+exit:
+    ALOGD("-%s-: pre %d, cur %d, event %d", __func__, pre_mode, cur_mode, event);
+    return ret;
+}
+
+// stdev needs to be locked before calling this function
+static int recover_base(struct knowles_sound_trigger_device *stdev)
+{
+    struct transition_plan tp;
+    int err = 0;
+    int i = 0;
+    enum strm_type strmt = STRM_16K;
+    enum clock_type ct = INTERNAL_OSCILLATOR;
+    /*
+     * The mixer routes don't set the mixer controls if previously
+     * applied values are the same or the active_count > 0, so we need to
+     * teardown the route so that it can clear up the value and active_count.
+     * Then we could setup the routes again.
+     */
+
+    stdev->current_enable = 0;
+    stdev->hotword_buffer_enable = 0;
+    stdev->music_buffer_enable = 0;
+
+    if (stdev->rx_active_count == 0 &&
+        stdev->is_bargein_route_enabled == true) {
+        /* rx stream is disabled during codec recovery.
+         * Need to reset the enabled flag
+         */
+        stdev->is_bargein_route_enabled = false;
+    }
+
+    if (stdev->is_buffer_package_loaded == true) {
+        err = setup_buffer_package(stdev->odsp_hdl);
+        if (err != 0) {
+            ALOGE("%s: Failed to restart Buffer package", __func__);
+        }
+    }
+
+    if (stdev->is_src_package_loaded == true) {
+        err = setup_src_package(stdev->odsp_hdl);
+        if (err != 0) {
+            ALOGE("%s: Failed to restart SRC package", __func__);
+        }
+    }
+
+    /*
+     * If ST mode is IN_CALL, make sure mic route as false,
+     * that would be reloaded after ending the call
+     */
+    if (get_sthal_mode(stdev) == IN_CALL) {
+        ALOGD("%s: ST mode is in_call, reset all routes", __func__);
+
+        stdev->is_mic_route_enabled = false;
+        stdev->is_bargein_route_enabled = false;
+        for (i = 0; i < MAX_MODELS; i++) {
+            if (stdev->models[i].is_active == true) {
+                update_recover_list(stdev, i, true);
+                stdev->models[i].is_active = false;
+                update_capture_map(stdev, i);
+            }
+        }
+
+        // if chre enabled before crash during call, need to setup package for SLPI.
+        if (stdev->is_chre_loaded == true) {
+            err = setup_chre_package(stdev->odsp_hdl);
+            if (err != 0) {
+                ALOGE("Failed to load CHRE package");
+            }
+            stdev->current_enable = stdev->current_enable | CHRE_MASK;
+        }
+        // No model to restore until the call ends
+        stdev->recovery.next = RECOVERY_OSLO;
+        goto exit;
+    }
+
+
+    /*
+     * Reset mic and src package if sound trigger recording is active
+     * The src-mic, src-amp must be enable before AEC enable, because
+     * the endpoint sequence control. The routing is the same plan of steps
+     * handle_input_source() runs, a failed step rolls back the ones before
+     * it and leaves the input source to the next start_recognition().
+     */
+    if (stdev->is_mic_route_enabled == true) {
+        tp.num_steps = 0;
+        tp.next = 0;
+        // recover src package if sound trigger recording is active
+        add_transition_step(&tp, STEP_SRC_PLUGIN, true, SRC_MIC);
+        add_transition_step(&tp, STEP_SRC_ROUTE, true, SRC_MIC);
+        /*
+         * RX stream was enabled during codec recovery.
+         * Need to setup the barge-in package and routing.
+         */
+        if (stdev->rx_active_count > 0) {
+            ct = EXTERNAL_OSCILLATOR;
+            if (is_mic_controlled_by_ahal(stdev) == true) {
+                strmt = STRM_48K;
+            }
+            add_transition_step(&tp, STEP_SRC_PLUGIN, true, SRC_AMP_REF);
+            add_transition_step(&tp, STEP_SRC_ROUTE, true, SRC_AMP_REF);
+            add_transition_step(&tp, STEP_AEC_PACKAGE, true, 0);
+            add_transition_step(&tp, STEP_BARGEIN_ROUTE, true, 0);
+            add_transition_step(&tp, STEP_AMP_REF_ROUTE, true, strmt);
+        }
+        // The stream 0 should be enable at last moment for the data alignment.
+        if (is_mic_controlled_by_ahal(stdev) == false)
+            add_transition_step(&tp, STEP_MIC_ROUTE, true, ct);
+
+        err = run_plan(stdev, &tp);
+        if (err != 0) {
+            ALOGE("%s: Failed to restart the input source, %d/%d steps "
+                "rolled back", __func__, tp.next, tp.num_steps);
+            stdev->is_mic_route_enabled = false;
+            stdev->is_bargein_route_enabled = false;
+        } else {
+            stdev->is_bargein_route_enabled = stdev->rx_active_count > 0;
+        }
+    }
+
+exit:
+    return err;
+}
+
+static bool is_hotword_path_model(const struct model_info *model)
+{
+    return is_model_kind(model, MODEL_KIND_KEYWORD) &&
+        model->desc->plugin == &hotword_plugin;
+}
+
+// Download the model files that were previously active
+static void recover_models(struct knowles_sound_trigger_device *stdev,
+                        bool is_hotword_path)
+{
+    int i;
+
+    for (i = 0; i < MAX_MODELS; i++) {
+        if (stdev->models[i].is_active == false ||
+            is_hotword_path_model(&stdev->models[i]) != is_hotword_path)
+            continue;
+
+        if (stdev->is_buffer_package_loaded == true) {
+            setup_buffer(stdev, &stdev->models[i], true);
+        }
+        set_model_buffer_route(stdev, &stdev->models[i]);
+        setup_package(stdev, &stdev->models[i]);
+        set_package_route(stdev, &stdev->models[i],
+                        stdev->is_bargein_route_enabled);
+    }
+}
+
+static int recover_oslo(struct knowles_sound_trigger_device *stdev)
+{
+    int err = 0;
+    int i = 0;
+
+    // reload Oslo part after every package loaded to avoid HMD memory overlap
+    // issue, b/128914464
+    for (i = 0; i < MAX_MODELS; i++) {
+        if (stdev->models[i].is_loaded == true) {
+            if (is_model_type(&stdev->models[i], ST_MODEL_SENSOR)) {
+                // setup the sensor route
+                err = setup_sensor_package(stdev->odsp_hdl);
+                if (err != 0) {
+                    ALOGE("%s: setup Sensor package failed", __func__);
+                    goto exit;
+                }
+
+                err = set_sensor_route(stdev->route_hdl, true);
+                if (err != 0) {
+                    ALOGE("%s: Sensor route fail", __func__);
+                    goto exit;
+                }
+                stdev->is_sensor_route_enabled = true;
+            }
+        }
+    }
+
+exit:
+    return err;
+}
+
+static long long recovery_elapsed_us(struct recovery_timeline *rt)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return timespec_diff_us(&now, &rt->origin);
+}
+
+// Logs each stage as name@start+duration in us, relative to the crash
+static void log_recovery_timeline(struct recovery_timeline *rt,
+                                const char *result)
+{
+    char buf[256];
+    int len = 0;
+
+    for (int i = 0; i < RECOVERY_DONE && len < (int)sizeof(buf); i++) {
+        if (rt->begin_us[i] < 0 || rt->end_us[i] < 0)
+            continue;
+        len += snprintf(buf + len, sizeof(buf) - len, " %s@%lld+%lld",
+                        recovery_stage_names[i], rt->begin_us[i],
+                        rt->end_us[i] - rt->begin_us[i]);
+    }
+    ALOGI("%s: %s after %lld us (%s, redownload %lld us):%s", __func__,
+        result, recovery_elapsed_us(rt),
+        rt->is_crash_seen ? "from crash" : "from redownload",
+        rt->redownload_us, len > 0 ? buf : " -");
+}
+
+static void begin_recovery(struct knowles_sound_trigger_device *stdev)
+{
+    struct recovery_timeline *rt = &stdev->recovery;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (rt->is_crash_seen) {
+        rt->redownload_us = timespec_diff_us(&now, &rt->origin);
+    } else {
+        rt->origin = now;
+        rt->redownload_us = 0;
+    }
+    for (int i = 0; i < RECOVERY_DONE; i++) {
+        rt->begin_us[i] = -1;
+        rt->end_us[i] = -1;
+    }
+    rt->next = RECOVERY_BASE;
+}
+
+// Called on a firmware crash, any stage still to run is dropped
+static void cancel_recovery(struct knowles_sound_trigger_device *stdev)
+{
+    struct recovery_timeline *rt = &stdev->recovery;
+
+    if (rt->next != RECOVERY_DONE)
+        log_recovery_timeline(rt, "interrupted");
+    clock_gettime(CLOCK_MONOTONIC, &rt->origin);
+    rt->is_crash_seen = true;
+    rt->next = RECOVERY_DONE;
+}
+
+static int run_recovery_stage(struct knowles_sound_trigger_device *stdev)
+{
+    struct recovery_timeline *rt = &stdev->recovery;
+    enum recovery_stage stage = rt->next;
+    int err = 0;
+
+    rt->begin_us[stage] = recovery_elapsed_us(rt);
+    switch (stage) {
+    case RECOVERY_BASE:
+        err = recover_base(stdev);
+        break;
+    case RECOVERY_HOTWORD:
+        recover_models(stdev, true);
+        break;
+    case RECOVERY_MODELS:
+        recover_models(stdev, false);
+        break;
+    case RECOVERY_OSLO:
+        err = recover_oslo(stdev);
+        break;
+    default:
+        return 0;
+    }
+    rt->end_us[stage] = recovery_elapsed_us(rt);
+
+    // The base stage skips the models while in a call
+    if (rt->next == stage)
+        rt->next = stage + 1;
+    if (rt->next == RECOVERY_DONE) {
+        log_recovery_timeline(rt, err ? "failed" : "done");
+        rt->is_crash_seen = false;
+        metric_add(err ? stdev->metrics.recovery_failures :
+                        stdev->metrics.recoveries, 1);
+        metric_record(stdev->metrics.recovery_us, rt->end_us[stage]);
+    }
+
+    return err;
+}
+
+// Called from the reactor with stdev->lock held, one stage per wakeup
+static void handle_recovery_stage(struct knowles_sound_trigger_device *stdev)
+{
+    if (stdev->recovery.next == RECOVERY_DONE ||
+        stdev->is_st_hal_ready == false)
+        return;
+
+    if (run_recovery_stage(stdev) != 0)
+        ALOGE("%s: ERROR: %s recovery failed", __func__,
+            recovery_stage_names[stdev->recovery.next - 1]);
+    if (stdev->recovery.next != RECOVERY_DONE)
+        signal_reactor(stdev->recovery_fd);
+}
+
+/*
+ * Anything that changes the chip state runs the stages left up to the last
+ * one that sets up what it touches, so that it doesn't see that part of the
+ * chip half recovered. Later stages stay with the reactor.
+ */
+static void finish_recovery(struct knowles_sound_trigger_device *stdev,
+                            enum recovery_stage last)
+{
+    if (stdev->recovery.next > last ||
+        stdev->is_st_hal_ready == false)
+        return;
+
+    ALOGD("%s: running the %s to %s stages now", __func__,
+        recovery_stage_names[stdev->recovery.next],
+        recovery_stage_names[last]);
+    while (stdev->recovery.next <= last)
+        run_recovery_stage(stdev);
+}
+
+// The last recovery stage an entry point for a model of desc has to wait for
+static enum recovery_stage recovery_stage_for(const struct model_desc *desc)
+{
+    if (desc == NULL || desc->kind != MODEL_KIND_KEYWORD)
+        return RECOVERY_OSLO;
+
+    return desc->plugin == &hotword_plugin ? RECOVERY_HOTWORD :
+                                            RECOVERY_MODELS;
+}
+
+// stdev needs to be locked before calling this function
+static int crash_recovery(struct knowles_sound_trigger_device *stdev)
+{
+    int err = 0;
+
+    stdev->state_gen++;
+
+    set_default_apll_clk(stdev->mixer);
+    setup_slpi_wakeup_event(stdev->odsp_hdl, true);
+
+    // Bring back the hotword path, the rest follows from the reactor
+    begin_recovery(stdev);
+    err = run_recovery_stage(stdev);
+    if (err != 0) {
+        ALOGE("%s: ERROR: Failed to restore the packages and routes",
+            __func__);
+        stdev->recovery.next = RECOVERY_DONE;
+        goto exit;
+    }
+    if (stdev->recovery.next == RECOVERY_HOTWORD)
+        run_recovery_stage(stdev);
+
+    // Reset the flag only after successful recovery
+    set_hal_ready(stdev, true);
+    log_startup_timeline(&stdev->startup, "ready after recovery");
+    log_recovery_timeline(&stdev->recovery, "hotword ready");
+    if (stdev->recovery.next != RECOVERY_DONE)
+        signal_reactor(stdev->recovery_fd);
+
+exit:
+    return err;
+}
+
+static void sensor_crash_handler(struct knowles_sound_trigger_device *stdev)
+{
+    int i;
+
+    if (stdev->is_sensor_destroy_in_prog == false)
+        return;
+
+    if (stdev->ss_timer_armed) {
+        arm_timer_ms(stdev->ss_timer_fd, 0);
+        stdev->ss_timer_armed = false;
+    }
+
+    if (stdev->is_sensor_route_enabled == true) {
+        for (i = 0; i < MAX_MODELS; i++) {
+            if (is_model_type(&stdev->models[i], ST_MODEL_SENSOR) &&
+                stdev->models[i].is_loaded == true) {
+                clear_model_desc(&stdev->models[i]);
+                break;
+            }
+        }
+        stdev->is_sensor_route_enabled = false;
+        stdev->current_enable &= ~OSLO_MASK;
+    }
+    stdev->is_sensor_destroy_in_prog = false;
+
+    // There could be another thread waiting for us to destroy
+    // so signal that thread, if no one is waiting then this signal
+    // will have no effect
+    pthread_cond_signal(&stdev->sensor_create);
+}
+
+static void destroy_sensor_model(struct knowles_sound_trigger_device *stdev)
+{
+    int ret, i;
+    ALOGD("+%s+", __func__);
+
+    stdev->state_gen++;
+
+    if (stdev->is_sensor_route_enabled == true) {
+        ret = set_sensor_route(stdev->route_hdl, false);
+        if (ret != 0) {
+            ALOGE("%s: tear Sensor route fail", __func__);
+        }
+        stdev->is_sensor_route_enabled = false;
+
+        ret = destroy_sensor_package(stdev->odsp_hdl);
+        if (ret != 0) {
+            ALOGE("%s: destroy Sensor package failed %d",
+                  __func__, ret);
+        }
+        stdev->current_enable = stdev->current_enable & ~OSLO_MASK;
+    }
+
+    // now we can change the flag
+    for (i = 0 ; i < MAX_MODELS ; i++) {
+        if (is_model_type(&stdev->models[i], ST_MODEL_SENSOR) &&
+            stdev->models[i].is_loaded == true) {
+            clear_model_desc(&stdev->models[i]);
+            break;
+        }
+    }
+
+    stdev->is_sensor_destroy_in_prog = false;
+    check_and_destroy_buffer_package(stdev);
+
+    // There could be another thread waiting for us to destroy so signal that
+    // thread, if no one is waiting then this signal will have no effect
+    pthread_cond_signal(&stdev->sensor_create);
+
+    ALOGD("-%s-", __func__);
+}
+
+/* Called from the reactor with stdev->lock held */
+static void sensor_timeout_recover(struct knowles_sound_trigger_device *stdev)
+{
+    int err = 0;
+    ALOGD("+%s+", __func__);
+
+    // We are here because we timed out so check if we still need to destroy
+    // the sensor package, if yes then reset the firmware
+    if (stdev->is_sensor_destroy_in_prog == true) {
+        if (stdev->is_st_hal_ready) {
+            set_hal_ready(stdev, false);
+            // reset the firmware and wait for firmware download complete
+            err = reset_fw(stdev->odsp_hdl);
+            if (err == -1) {
+                ALOGE("%s: ERROR: Failed to reset the firmware %d(%s)",
+                      __func__, errno, strerror(errno));
+            }
+            reset_all_route(stdev->route_hdl);
+            sensor_crash_handler(stdev);
+        }
+    }
+    ALOGD("-%s-", __func__);
+}
+
+/*
+ * HAL entry points that change the routing must not interleave with the
+ * steps of an in-flight transition. Called with stdev->lock held, the
+ * caller then finishes the recovery stages it depends on.
+ */
+static void wait_for_transition(struct knowles_sound_trigger_device *stdev)
+{
+    while (stdev->transition.in_flight)
+        stdev_cond_wait(stdev, &stdev->transition_done);
+}
+
+/*
+ * Called with stdev->lock held. Downloading the sensor package takes the
+ * longest part of an Oslo load, so it runs with the lock dropped and a
+ * hotword start or stop can go on meanwhile. The chip serializes the
+ * package and plugin calls itself. is_sensor_setup_in_prog keeps the buffer
+ * package loaded and other sensor loads waiting until the route is set up
+ * back under the lock.
+ */
+static int start_sensor_model(struct knowles_sound_trigger_device * stdev)
+{
+    struct timespec ts;
+    int wait_counter = 0, err = 0;
+    unsigned int fw_gen;
+
+    while ((stdev->is_sensor_destroy_in_prog == true ||
+            stdev->is_sensor_setup_in_prog == true) &&
+           wait_counter < SENSOR_CREATE_WAIT_MAX_COUNT) {
+        // We wait for 1sec * MAX_COUNT times for the HOST 1 to respond, if
+        // within that time we don't get any response, we will go ahead with the
+        // sensor model creation. Note this might result in an error which would
+        // be better than blocking the thread indefinitely.
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += SENSOR_CREATE_WAIT_TIME_IN_S;
+        err = stdev_cond_timedwait(stdev, &stdev->sensor_create, &ts);
+        if (err == ETIMEDOUT) {
+            ALOGE("%s: WARNING: Sensor create timed out after %ds",
+                  __func__, SENSOR_CREATE_WAIT_TIME_IN_S);
+            wait_counter++;
+        }
+    }
+
+    // If firmware crashed when we are waiting
+    if (stdev->is_st_hal_ready == false) {
+        err = -EAGAIN;
+        goto exit;
+    }
+
+    if (stdev->is_sensor_destroy_in_prog == true ||
+        stdev->is_sensor_setup_in_prog == true) {
+        ALOGE("%s: ERROR: Waited for %ds but we didn't get the event from "
+              "Host 1, and fw reset is not yet complete", __func__,
+              SENSOR_CREATE_WAIT_TIME_IN_S * SENSOR_CREATE_WAIT_MAX_COUNT);
+        err = -EAGAIN;
+        goto exit;
+    }
+
+    // setup the sensor route
+    err = check_and_setup_buffer_package(stdev);
+    if (err != 0) {
+        ALOGE("%s: ERROR: Failed to load the buffer package", __func__);
+        goto exit;
+    }
+
+    if(stdev->is_sensor_route_enabled == false) {
+        stdev->is_sensor_setup_in_prog = true;
+        fw_gen = stdev->fw_gen;
+        unlock_stdev(stdev);
+        err = setup_sensor_package(stdev->odsp_hdl);
+        lock_stdev(stdev);
+        stdev->is_sensor_setup_in_prog = false;
+        // Another sensor load waiting for us tries again on its own
+        pthread_cond_broadcast(&stdev->sensor_create);
+        // The route goes in between transitions like any other
+        wait_for_transition(stdev);
+
+        if (fw_gen != stdev->fw_gen || stdev->is_st_hal_ready == false) {
+            ALOGE("%s: Firmware went away during the sensor setup", __func__);
+            err = -EAGAIN;
+            goto exit;
+        }
+        if (err) {
+            ALOGE("%s: Failed to setup sensor package", __func__);
+            goto exit;
+        }
+        // Don't download the keyword model file, just setup the
+        // sensor route
+        err = set_sensor_route(stdev->route_hdl, true);
+        if (err) {
+            ALOGE("%s: Sensor route fail", __func__);
+            goto exit;
+        }
+        stdev->is_sensor_route_enabled = true;
+        stdev->current_enable = stdev->current_enable | OSLO_MASK;
+    }
+
+exit:
+    return err;
+}
+
+static void chre_crash_handler(struct knowles_sound_trigger_device *stdev)
+{
+    int i;
+
+    if (stdev->is_chre_destroy_in_prog == false)
+        return;
+
+    if (stdev->chre_timer_armed) {
+        arm_timer_ms(stdev->chre_timer_fd, 0);
+        stdev->chre_timer_armed = false;
+    }
+
+    if (stdev->is_chre_loaded == true) {
+        for (i = 0; i < MAX_MODELS; i++) {
+            if (is_model_type(&stdev->models[i], ST_MODEL_CHRE)) {
+                stdev->models[i].is_active = false;
+                update_capture_map(stdev, i);
+                clear_model_desc(&stdev->models[i]);
+                break;
+            }
+        }
+        stdev->is_chre_loaded = false;
+        stdev->current_enable &= ~CHRE_MASK;
+    }
+    stdev->is_chre_destroy_in_prog = false;
+
+    // There could be another thread waiting for us to destroy
+    // so signal that thread, if no one is waiting then this signal
+    // will have no effect
+    pthread_cond_signal(&stdev->chre_create);
+}
+
+static int start_chre_model(struct knowles_sound_trigger_device *stdev,
+                            int model_id)
+{
+    struct timespec ts;
+    int wait_counter = 0, err = 0;
+
+    while (stdev->is_chre_destroy_in_prog == true &&
+           wait_counter < CHRE_CREATE_WAIT_MAX_COUNT) {
+        // We wait for 1sec * MAX_COUNT times for the HOST 1 to respond, if
+        // within that time we don't get any response, we will go ahead with the
+        // sensor model creation. Note this might result in an error which would
+        // be better than blocking the thread indefinitely.
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += CHRE_CREATE_WAIT_TIME_IN_S;
+        err = stdev_cond_timedwait(stdev, &stdev->chre_create, &ts);
+        if (err == ETIMEDOUT) {
+            ALOGE("%s: WARNING: CHRE create timed out after %ds",
+                    __func__, CHRE_CREATE_WAIT_TIME_IN_S);
+            wait_counter++;
+        }
+    }
+
+    // If firmware crashed when we are waiting
+    if (stdev->is_st_hal_ready == false) {
+        err = -EAGAIN;
+        goto exit;
+    }
+
+    if (stdev->is_chre_destroy_in_prog == true) {
+        ALOGE("%s: ERROR: Waited for %ds but we didn't get the event from "
+              "Host 1, and fw reset is not yet complete", __func__,
+              CHRE_CREATE_WAIT_TIME_IN_S * CHRE_CREATE_WAIT_MAX_COUNT);
+        err = -EAGAIN;
+        goto exit;
+    }
+
+    err = check_and_setup_buffer_package(stdev);
+    if (err != 0) {
+        ALOGE("%s: ERROR: Failed to load the buffer package", __func__);
+        goto exit;
+    }
+
+    // add chre to recover list
+    if (can_enable_chre(stdev)) {
+        if(stdev->is_chre_loaded == false) {
+            stdev->models[model_id].is_active = true;
+            update_capture_map(stdev, model_id);
+            handle_input_source(stdev, true);
+            setup_chre_package(stdev->odsp_hdl);
+            set_chre_audio_route(stdev->route_hdl,
+                               stdev->is_bargein_route_enabled);
+            stdev->is_chre_loaded = true;
+            stdev->current_enable = stdev->current_enable | CHRE_MASK;
+        }
+    } else {
+        ALOGW("%s: device is in call, setup CHRE for SLPI",
+              __func__);
+        //Setup CHRE package and allow SLPI connect
+        //during in-call mode.
+        if (stdev->is_chre_loaded == false) {
+            setup_chre_package(stdev->odsp_hdl);
+            stdev->models[model_id].desc = &model_registry[ST_MODEL_CHRE];
+            stdev->models[model_id].uuid = model_registry[ST_MODEL_CHRE].uuid;
+            stdev->is_chre_loaded = true;
+            stdev->current_enable = stdev->current_enable | CHRE_MASK;
+            if (can_update_recover_list(stdev) == true)
+                update_recover_list(stdev, model_id, true);
+        }
+    }
+
+exit:
+    return err;
+}
+
+static void destroy_chre_model(struct knowles_sound_trigger_device *stdev)
+{
+    int err = 0;
+    ALOGD("+%s+", __func__);
+
+    stdev->state_gen++;
+
+    if (stdev->is_chre_loaded == true) {
+        int i;
+        tear_chre_audio_route(stdev->route_hdl,
+                              stdev->is_bargein_route_enabled);
+        err = destroy_chre_package(stdev->odsp_hdl);
+        if (err != 0) {
+            ALOGE("%s: ERROR: Failed to destroy chre package", __func__);
+        }
+
+        //Need force reset the flag for chre due to in-call state
+        //The model is inactive, but need to clean if user disable it
+        //during call.
+        for (i = 0; i < MAX_MODELS; i++) {
+            if (is_model_type(&stdev->models[i], ST_MODEL_CHRE)) {
+                stdev->models[i].is_active = false;
+                update_capture_map(stdev, i);
+                clear_model_desc(&stdev->models[i]);
+                break;
+            }
+        }
+        handle_input_source(stdev, false);
+        stdev->is_chre_loaded = false;
+        stdev->current_enable = stdev->current_enable & ~CHRE_MASK;
+    }
+
+    stdev->is_chre_destroy_in_prog = false;
+
+    // setup the sensor route
+    err = check_and_destroy_buffer_package(stdev);
+    if (err != 0) {
+        ALOGE("%s: ERROR: Failed to destroy buffer package", __func__);
+    }
+
+    // There could be another thread waiting for us to destroy so signal that
+    // thread, if no one is waiting then this signal will have no effect
+    pthread_cond_signal(&stdev->chre_create);
+
+    ALOGD("-%s-", __func__);
+}
+
+/* Called from the reactor with stdev->lock held */
+static void chre_timeout_recover(struct knowles_sound_trigger_device *stdev)
+{
+    int err = 0;
+    ALOGD("+%s+", __func__);
+
+    // We are here because we timed out so check if we still need to destroy
+    // the chre package, if yes then reset the firmware
+    if (stdev->is_chre_destroy_in_prog == true) {
+        if (stdev->is_st_hal_ready) {
+            set_hal_ready(stdev, false);
+            // reset the firmware and wait for firmware download complete
+            err = reset_fw(stdev->odsp_hdl);
+            if (err == -1) {
+                ALOGE("%s: ERROR: Failed to reset the firmware %d(%s)",
+                      __func__, errno, strerror(errno));
+            }
+            reset_all_route(stdev->route_hdl);
+            chre_crash_handler(stdev);
+        }
+    }
+    ALOGD("-%s-", __func__);
+}
+
+/*
+ * Record the latest requested transition and (re)start its debounce window,
+ * an opposite request that arrives within the window simply replaces it.
+ */
+static void queue_transition(struct knowles_sound_trigger_device *stdev,
+                            transit_case_t transit_case)
+{
+    long delay_ms = AEC_SETUP_DEBOUNCE_MS;
+
+    if (transit_case == TRANSIT_TEARDOWN_AEC)
+        delay_ms = AEC_TEARDOWN_DEBOUNCE_MS;
+
+    if (stdev->transit_case != TRANSIT_NONE &&
+        stdev->transit_case != transit_case) {
+        ALOGD("%s: transition %d replaces pending %d",
+            __func__, transit_case, stdev->transit_case);
+    }
+
+    stdev->transition_stats.requested++;
+    stdev->transit_case = transit_case;
+    arm_timer_ms(stdev->transit_fd, delay_ms);
+}
+
+/*
+ * Barge-in setup and teardown as a list of single chip operations, in the
+ * same order the old synchronous sequences used. Every step can be undone by
+ * running it again with the opposite enable.
+ */
+static void build_aec_plan(struct knowles_sound_trigger_device *stdev,
+                        struct transition_plan *tp, bool enable)
+{
+    bool is_mic_by_ahal = is_mic_controlled_by_ahal(stdev);
+    int i;
+
+    tp->num_steps = 0;
+    tp->next = 0;
+    tp->target = enable;
+
+    if (enable) {
+        if (!is_mic_by_ahal)
+            add_transition_step(tp, STEP_MIC_ROUTE, false,
+                                INTERNAL_OSCILLATOR);
+        add_transition_step(tp, STEP_SRC_PLUGIN, true, SRC_AMP_REF);
+        add_transition_step(tp, STEP_SRC_ROUTE, true, SRC_AMP_REF);
+        add_transition_step(tp, STEP_AEC_PACKAGE, true, 0);
+        add_transition_step(tp, STEP_BARGEIN_ROUTE, true, 0);
+        if (!is_mic_by_ahal) {
+            add_transition_step(tp, STEP_AMP_REF_ROUTE, true, STRM_16K);
+            add_transition_step(tp, STEP_MIC_ROUTE, true,
+                                EXTERNAL_OSCILLATOR);
+        } else {
+            // main mic is turned by media recording
+            add_transition_step(tp, STEP_AMP_REF_ROUTE, true, STRM_48K);
+        }
+        if (stdev->hotword_buffer_enable)
+            add_transition_step(tp, STEP_HOTWORD_BUF_ROUTE, true, 0);
+        if (stdev->music_buffer_enable)
+            add_transition_step(tp, STEP_MUSIC_BUF_ROUTE, true, 0);
+        for (i = 0; i < MAX_MODELS; i++) {
+            if (stdev->models[i].is_active == true)
+                add_transition_step(tp, STEP_MODEL_ROUTE, true, i);
+        }
+    } else {
+        for (i = 0; i < MAX_MODELS; i++) {
+            if (stdev->models[i].is_active == true)
+                add_transition_step(tp, STEP_MODEL_ROUTE, false, i);
+        }
+        if (stdev->hotword_buffer_enable)
+            add_transition_step(tp, STEP_HOTWORD_BUF_ROUTE, false, 0);
+        if (stdev->music_buffer_enable)
+            add_transition_step(tp, STEP_MUSIC_BUF_ROUTE, false, 0);
+        add_transition_step(tp, STEP_BARGEIN_ROUTE, false, 0);
+        add_transition_step(tp, STEP_AEC_PACKAGE, false, 0);
+        add_transition_step(tp, STEP_SRC_ROUTE, false, SRC_AMP_REF);
+        add_transition_step(tp, STEP_SRC_PLUGIN, false, SRC_AMP_REF);
+        if (!is_mic_by_ahal) {
+            add_transition_step(tp, STEP_AMP_REF_ROUTE, false, STRM_16K);
+            add_transition_step(tp, STEP_MIC_ROUTE, false,
+                                EXTERNAL_OSCILLATOR);
+            add_transition_step(tp, STEP_MIC_ROUTE, true,
+                                INTERNAL_OSCILLATOR);
+        } else {
+            // main mic is turned by media record, close it by 48khz
+            add_transition_step(tp, STEP_AMP_REF_ROUTE, false, STRM_48K);
+        }
+    }
+}
+
+static void end_transition(struct knowles_sound_trigger_device *stdev,
+                        const char *how)
+{
+    struct transition_plan *tp = &stdev->transition;
+    struct timespec now;
+    long long elapsed_us;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed_us = timespec_diff_us(&now, &tp->start);
+    ALOGD("%s: barge-in %s %s after %d/%d steps in %lld us", __func__,
+        tp->target ? "setup" : "teardown", how, tp->next, tp->num_steps,
+        elapsed_us);
+    metric_add(stdev->metrics.transitions, 1);
+    metric_record(stdev->metrics.transition_us, elapsed_us);
+
+    tp->in_flight = false;
+    release_wake_lock(WAKE_LOCK_NAME);
+    pthread_cond_broadcast(&stdev->transition_done);
+}
+
+/*
+ * Firmware is gone, there's nothing left to roll back on the chip. Called
+ * with stdev->lock held.
+ */
+static void abort_transition(struct knowles_sound_trigger_device *stdev)
+{
+    if (stdev->transition.in_flight)
+        end_transition(stdev, "aborted");
+}
+
+static void rollback_transition(struct knowles_sound_trigger_device *stdev)
+{
+    rollback_plan(stdev, &stdev->transition);
+}
+
+static void start_transition(struct knowles_sound_trigger_device *stdev,
+                            bool enable)
+{
+    struct transition_plan *tp = &stdev->transition;
+
+    acquire_wake_lock(PARTIAL_WAKE_LOCK, WAKE_LOCK_NAME);
+    stdev->reactor_stats.wake_locks++;
+
+    build_aec_plan(stdev, tp, enable);
+    tp->gen = stdev->state_gen;
+    tp->in_flight = true;
+    clock_gettime(CLOCK_MONOTONIC, &tp->start);
+    ALOGD("%s: barge-in %s in %d steps", __func__,
+        enable ? "setup" : "teardown", tp->num_steps);
+
+    signal_reactor(stdev->step_fd);
+}
+
+/*
+ * Runs one step of the in-flight transition per reactor wakeup, stdev->lock
+ * is dropped in between so detections and AHAL reads get through. HAL entry
+ * points that reroute wait in wait_for_transition(), anything else that
+ * changes the routing bumps state_gen; the steps done so far are then undone
+ * and the transition is re-evaluated from the new state. Called from the
+ * reactor with stdev->lock held.
+ */
+static void handle_transition_step(struct knowles_sound_trigger_device *stdev)
+{
+    struct transition_plan *tp = &stdev->transition;
+
+    if (!tp->in_flight)
+        return;
+
+    if (stdev->is_st_hal_ready == false) {
+        abort_transition(stdev);
+        return;
+    }
+
+    if (tp->gen != stdev->state_gen) {
+        ALOGW("%s: Routing changed under the transition, rolling back",
+            __func__);
+        rollback_transition(stdev);
+        end_transition(stdev, "rolled back");
+        queue_transition(stdev, tp->target ? TRANSIT_SETUP_AEC :
+                                            TRANSIT_TEARDOWN_AEC);
+        return;
+    }
+
+    if (tp->next < tp->num_steps) {
+        if (run_transition_step(stdev, &tp->steps[tp->next], false) != 0) {
+            rollback_transition(stdev);
+            end_transition(stdev, "failed");
+            return;
+        }
+        tp->next++;
+    }
+
+    if (tp->next == tp->num_steps) {
+        stdev->is_bargein_route_enabled = tp->target;
+        end_transition(stdev, "done");
+    } else {
+        signal_reactor(stdev->step_fd);
+    }
+}
+
+/*
+ * Only the net change is applied once the debounce window has expired,
+ * whatever the last request was, barge-in has to end up enabled exactly
+ * when playback is active. Called from the reactor with stdev->lock held.
+ */
+static void handle_transition(struct knowles_sound_trigger_device *stdev)
+{
+    struct transition_stats *ts = &stdev->transition_stats;
+    bool need_setup, need_teardown;
+
+    if (stdev->transit_case == TRANSIT_NONE)
+        return;
+
+    // The barge-in state is part of what recovery restores, for every
+    // keyword model
+    finish_recovery(stdev, RECOVERY_MODELS);
+
+    // Look again once the current one has finished or rolled back
+    if (stdev->transition.in_flight) {
+        arm_timer_ms(stdev->transit_fd, AEC_SETUP_DEBOUNCE_MS);
+        return;
+    }
+    stdev->transit_case = TRANSIT_NONE;
+
+    need_setup = stdev->rx_active_count > 0 &&
+                stdev->is_bargein_route_enabled == false &&
+                stdev->is_mic_route_enabled == true;
+    need_teardown = stdev->rx_active_count == 0 &&
+                stdev->is_bargein_route_enabled == true &&
+                stdev->is_mic_route_enabled == true;
+
+    if (need_setup || need_teardown) {
+        start_transition(stdev, need_setup);
+        ts->applied++;
+    }
+
+    ALOGD("%s: %u transitions requested, %u applied, %u avoided", __func__,
+        ts->requested, ts->applied, ts->requested - ts->applied);
+}
+
+/*
+ * Close the tunnels that have not been read for TUNNEL_TIMEOUT seconds and
+ * re-arm the stream timer for the next deadline of the ones still open. The
+ * wake lock is only taken when there's something to close. Called from the
+ * reactor with stdev->lock held.
+ */
+static void check_stream_timeout(struct knowles_sound_trigger_device *stdev)
+{
+    long long now = coarse_monotonic_ms();
+    long long idle_ms, next_ms = TUNNEL_TIMEOUT * 1000;
+    bool is_wake_locked = false;
+
+    lock_strm(stdev);
+    for (int i = 0; i < MAX_MODELS; i++) {
+        if (stdev->adnc_strm_handle[i] != 0) {
+            // Lock-free readers keep updating it
+            idle_ms = now - atomic_load_explicit(
+                                &stdev->adnc_strm_last_read_ms[i],
+                                memory_order_relaxed);
+
+            if (idle_ms > TUNNEL_TIMEOUT * 1000) {
+                if (!is_wake_locked) {
+                    acquire_wake_lock(PARTIAL_WAKE_LOCK, WAKE_LOCK_NAME);
+                    stdev->reactor_stats.wake_locks++;
+                    is_wake_locked = true;
+                }
+                ALOGE("%s: Waiting timeout for %lld ms", __func__, idle_ms);
+                close_capture_stream(stdev, i);
+                stdev->is_streaming--;
+            } else if (TUNNEL_TIMEOUT * 1000 - idle_ms < next_ms) {
+                next_ms = TUNNEL_TIMEOUT * 1000 - idle_ms;
+            }
+        }
+    }
+
+    // Round up so that the tunnel is past its deadline when we wake up
+    if (stdev->is_streaming > 0)
+        arm_timer_ms(stdev->strm_timer_fd, (long)next_ms + 1);
+    unlock_strm(stdev);
+
+    if (is_wake_locked)
+        release_wake_lock(WAKE_LOCK_NAME);
+}
+
+static void log_reactor_stats(struct knowles_sound_trigger_device *stdev)
+{
+    struct reactor_stats *rs = &stdev->reactor_stats;
+    struct timespec now;
+    double hours;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    hours = (now.tv_sec - rs->start.tv_sec) / 3600.0;
+    ALOGD("%s: %u wakeups (%.1f/h), uevent %u, transit %u, stream timer %u, "
+        "sensor timer %u, chre timer %u, wake locks %u", __func__,
+        rs->wakeups, hours > 0 ? rs->wakeups / hours : 0.0,
+        rs->by_source[REACTOR_UEVENT], rs->by_source[REACTOR_TRANSIT],
+        rs->by_source[REACTOR_STRM_TIMER], rs->by_source[REACTOR_SENSOR_TIMER],
+        rs->by_source[REACTOR_CHRE_TIMER], rs->wake_locks);
+}
+
+/*
+ * Returns an event buffer for the next free queue slot with room for
+ * *payload_size bytes of payload, or NULL if the delivery thread has fallen
+ * MAX_PENDING_EVENTS events behind. A payload that doesn't fit the slot's
+ * buffer gets one from the heap, if that fails or the payload is beyond
+ * MAX_HEAP_PAYLOAD_SIZE the event goes without it and *payload_size is 0.
+ * Called from the callback thread with stdev->lock held.
+ */
+static union event_buf *get_free_event_buf(
+                                struct knowles_sound_trigger_device *stdev,
+                                unsigned int *payload_size)
+{
+    struct event_queue *q = &stdev->event_queue;
+    unsigned int tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&q->head, memory_order_acquire);
+    union event_buf *ebuf;
+    size_t size;
+
+    if (!stdev->is_delivery_thread_created)
+        return NULL;
+
+    if (tail - head >= MAX_PENDING_EVENTS) {
+        ALOGE("%s: Event queue is full", __func__);
+        atomic_fetch_add_explicit(&stdev->delivery_stats.dropped, 1,
+                                memory_order_relaxed);
+        metric_add(stdev->metrics.events_dropped, 1);
+        return NULL;
+    }
+
+    if (*payload_size <= MAX_EVENT_PAYLOAD_SIZE)
+        return &q->bufs[tail % MAX_PENDING_EVENTS];
+
+    if (*payload_size > MAX_HEAP_PAYLOAD_SIZE) {
+        ALOGE("%s: Payload size %u exceeds %d, dropping payload", __func__,
+            *payload_size, MAX_HEAP_PAYLOAD_SIZE);
+        *payload_size = 0;
+        return &q->bufs[tail % MAX_PENDING_EVENTS];
+    }
+
+    size = sizeof(ebuf->generic) + *payload_size;
+    if (size < sizeof(*ebuf))
+        size = sizeof(*ebuf);
+    ebuf = malloc(size);
+    if (ebuf == NULL) {
+        ALOGE("%s: Failed to allocate a %zu byte event, dropping payload",
+            __func__, size);
+        *payload_size = 0;
+        return &q->bufs[tail % MAX_PENDING_EVENTS];
+    }
+
+    return ebuf;
+}
+
+// Releases an event buffer that wasn't queued after all
+static void put_event_buf(struct knowles_sound_trigger_device *stdev,
+                        union event_buf *ebuf)
+{
+    struct event_queue *q = &stdev->event_queue;
+    unsigned int tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+    if (ebuf != &q->bufs[tail % MAX_PENDING_EVENTS])
+        free(ebuf);
+}
+
+/*
+ * Hand the event built in the buffer of get_free_event_buf() over to the
+ * delivery thread. If it returns false the buffer is still the caller's.
+ * Called from the callback thread with stdev->lock held.
+ */
+static bool queue_recognition_event(struct knowles_sound_trigger_device *stdev,
+                                    struct model_info *model,
+                                    union event_buf *ebuf,
+                                    const struct timespec *detect_time,
+                                    struct detection_trace *trace)
+{
+    struct event_queue *q = &stdev->event_queue;
+    struct pending_event *pe;
+    unsigned int tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+    if (model->recognition_callback == NULL)
+        return false;
+
+    pe = &q->slots[tail % MAX_PENDING_EVENTS];
+    pe->callback = model->recognition_callback;
+    pe->cookie = model->recognition_cookie;
+    pe->event = &ebuf->common;
+    pe->heap_event = ebuf != &q->bufs[tail % MAX_PENDING_EVENTS] ? ebuf : NULL;
+    pe->session_gen = &model->session_gen;
+    pe->gen = atomic_load_explicit(&model->session_gen, memory_order_relaxed);
+    pe->kw_id = model->kw_id;
+    pe->detect_time = *detect_time;
+    pe->trace = trace;
+    pe->is_during_transition = stdev->transition.in_flight;
+    pe->preopen_capture_handle = NO_CAPTURE_HANDLE;
+    if (stdev->is_capture_preopen_enabled && model->config != NULL &&
+        model->config->capture_requested)
+        pe->preopen_capture_handle = model->config->capture_handle;
+
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    sem_post(&q->avail);
+
+    return true;
+}
+
+static void update_delivery_stats(struct delivery_stats *ds, int kw_id,
+                                long long queue_us, long long total_us,
+                                bool is_during_transition)
+{
+    ds->count++;
+    ds->total_us += total_us;
+    if (ds->count == 1 || total_us < ds->min_us)
+        ds->min_us = total_us;
+    if (total_us > ds->max_us)
+        ds->max_us = total_us;
+    if (is_during_transition && total_us > ds->max_transition_us)
+        ds->max_transition_us = total_us;
+
+    ALOGD("%s: id %d delivered in %lld us (queued %lld us%s), "
+        "min %lld avg %lld max %lld us (%lld us in transition) "
+        "over %u events, %u dropped",
+        __func__, kw_id, total_us, queue_us,
+        is_during_transition ? ", in transition" : "", ds->min_us,
+        ds->total_us / ds->count, ds->max_us, ds->max_transition_us,
+        ds->count,
+        atomic_load_explicit(&ds->dropped, memory_order_relaxed));
+}
+
+/*
+ * Delivers the recognition events queued by the callback thread. The
+ * framework callback can take a while and may call back into the HAL, so it
+ * is made without stdev->lock, from the callback and cookie that were
+ * snapshotted when the event was fetched. With CAPTURE_PREOPEN_PROP set the
+ * tunnel of a detection that asked for capture is opened right after.
+ */
+static void *delivery_thread_loop(void *context)
+{
+    struct knowles_sound_trigger_device *stdev =
+        (struct knowles_sound_trigger_device *)context;
+    struct event_queue *q = &stdev->event_queue;
+    struct pending_event *pe;
+    struct timespec start, end;
+    unsigned int head, tail;
+    bool is_current;
+
+    ALOGI("%s", __func__);
+    prctl(PR_SET_NAME, (unsigned long)"sound trigger delivery", 0, 0, 0);
+
+    while (1) {
+        if (sem_wait(&q->avail) != 0) {
+            if (errno == EINTR)
+                continue;
+            ALOGE("%s: sem_wait failed %d(%s)",
+                __func__, errno, strerror(errno));
+            break;
+        }
+
+        head = atomic_load_explicit(&q->head, memory_order_relaxed);
+        tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+        if (head == tail) {
+            if (atomic_load(&q->exit))
+                break;
+            continue;
+        }
+
+        pe = &q->slots[head % MAX_PENDING_EVENTS];
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        // The session check and claiming the model for delivery have to be
+        // atomic against wait_for_delivery(), or a stop could slip in between
+        pthread_mutex_lock(&q->delivery_lock);
+        is_current = atomic_load(pe->session_gen) == pe->gen;
+        if (is_current)
+            q->in_delivery = pe->session_gen;
+        pthread_mutex_unlock(&q->delivery_lock);
+
+        if (is_current) {
+            ALOGD("Sending recognition callback for id %d", pe->kw_id);
+            detection_trace_mark(pe->trace, TRACE_CALLBACK_ENTRY);
+            pe->callback(pe->event, pe->cookie);
+            detection_trace_mark(pe->trace, TRACE_CALLBACK_EXIT);
+
+            pthread_mutex_lock(&q->delivery_lock);
+            q->in_delivery = NULL;
+            pthread_cond_broadcast(&q->delivery_done);
+            pthread_mutex_unlock(&q->delivery_lock);
+
+            if (pe->preopen_capture_handle != NO_CAPTURE_HANDLE)
+                preopen_capture_stream(stdev, pe->preopen_capture_handle);
+        } else {
+            ALOGD("%s: Recognition stopped, drop event for id %d",
+                __func__, pe->kw_id);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        update_delivery_stats(&stdev->delivery_stats, pe->kw_id,
+                            timespec_diff_us(&start, &pe->detect_time),
+                            timespec_diff_us(&end, &pe->detect_time),
+                            pe->is_during_transition);
+
+        pe->event = NULL;
+        free(pe->heap_event);
+        pe->heap_event = NULL;
+        atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    }
+
+    // Drop whatever was queued after the exit request
+    head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    for (; head != tail; head++) {
+        pe = &q->slots[head % MAX_PENDING_EVENTS];
+        free(pe->heap_event);
+        pe->heap_event = NULL;
+    }
+    atomic_store_explicit(&q->head, tail, memory_order_release);
+
+    return NULL;
+}
+
+static int start_delivery_thread(struct knowles_sound_trigger_device *stdev)
+{
+    struct event_queue *q = &stdev->event_queue;
+    int err;
+
+    atomic_store(&q->head, 0);
+    atomic_store(&q->tail, 0);
+    atomic_store(&q->exit, false);
+    q->in_delivery = NULL;
+    memset(&stdev->delivery_stats, 0, sizeof(stdev->delivery_stats));
+
+    if (sem_init(&q->avail, 0, 0) != 0) {
+        ALOGE("%s: sem_init failed %d(%s)", __func__, errno, strerror(errno));
+        return -errno;
+    }
+    pthread_mutex_init(&q->delivery_lock, (const pthread_mutexattr_t *) NULL);
+    pthread_cond_init(&q->delivery_done, (const pthread_condattr_t *) NULL);
+
+    err = pthread_create(&stdev->delivery_thread,
+                        (const pthread_attr_t *) NULL,
+                        delivery_thread_loop, stdev);
+    if (err != 0) {
+        ALOGE("%s: Failed to create delivery thread %d", __func__, err);
+        pthread_cond_destroy(&q->delivery_done);
+        pthread_mutex_destroy(&q->delivery_lock);
+        sem_destroy(&q->avail);
+        return -err;
+    }
+
+    stdev->is_delivery_thread_created = true;
+    return 0;
+}
+
+static void stop_delivery_thread(struct knowles_sound_trigger_device *stdev)
+{
+    struct event_queue *q = &stdev->event_queue;
+
+    if (!stdev->is_delivery_thread_created)
+        return;
+
+    atomic_store(&q->exit, true);
+    sem_post(&q->avail);
+    pthread_join(stdev->delivery_thread, (void **)NULL);
+    pthread_cond_destroy(&q->delivery_done);
+    pthread_mutex_destroy(&q->delivery_lock);
+    sem_destroy(&q->avail);
+    stdev->is_delivery_thread_created = false;
+}
+
+/*
+ * Waits until a callback of the given model that raced with stop_recognition()
+ * has returned, events queued after that see the new session_gen and are
+ * dropped. Must be called without stdev->lock since the framework callback
+ * may take it. A callback that stops or unloads its own model is skipped, it
+ * can't wait for itself.
+ */
+static void wait_for_delivery(struct knowles_sound_trigger_device *stdev,
+                            sound_model_handle_t handle)
+{
+    struct event_queue *q = &stdev->event_queue;
+    atomic_uint *session_gen = &stdev->models[handle].session_gen;
+
+    if (!stdev->is_delivery_thread_created ||
+        pthread_equal(pthread_self(), stdev->delivery_thread))
+        return;
+
+    pthread_mutex_lock(&q->delivery_lock);
+    while (q->in_delivery == session_gen)
+        pthread_cond_wait(&q->delivery_done, &q->delivery_lock);
+    pthread_mutex_unlock(&q->delivery_lock);
+}
+
+static void init_recognition_event(struct model_info *model,
+                                union event_buf *ebuf,
+                                unsigned int payload_size,
+                                int recognition_status)
+{
+    if (model->type == SOUND_MODEL_TYPE_KEYPHRASE) {
+        stdev_keyphrase_event_init(&ebuf->phrase,
+                                model->model_handle,
+                                model->config,
+                                recognition_status);
+    } else {
+        stdev_generic_event_init(&ebuf->generic,
+                                model->model_handle,
+                                payload_size,
+                                recognition_status);
+    }
+}
+
+static void drop_held_detection(struct model_info *model)
+{
+    free(model->held_payload);
+    model->held_payload = NULL;
+    model->held_payload_size = 0;
+    model->has_held_detection = false;
+}
+
+/*
+ * A restored model listens before the framework has started it again. Its
+ * latest detection is kept until start_recognition hands us a callback and
+ * the capture session to build the event for. Called from the callback
+ * thread with stdev->lock held.
+ */
+static void hold_detection(struct model_info *model, const void *payload,
+                        unsigned int payload_size,
+                        const struct timespec *detect_time)
+{
+    void *held = NULL;
+
+    if (payload_size != 0) {
+        held = malloc(payload_size);
+        if (held != NULL)
+            memcpy(held, payload, payload_size);
+        else
+            payload_size = 0;
+    }
+
+    drop_held_detection(model);
+    model->held_payload = held;
+    model->held_payload_size = payload_size;
+    model->held_time = *detect_time;
+    model->has_held_detection = true;
+    ALOGI("%s: model %d has no callback yet, detection held", __func__,
+        model->model_handle);
+}
+
+/*
+ * Queues the detection held for a restored model now that the framework
+ * has started it, unless its audio is gone from the history. Called with
+ * stdev->lock held.
+ */
+static void deliver_held_detection(struct knowles_sound_trigger_device *stdev,
+                                struct model_info *model)
+{
+    unsigned int payload_size = model->held_payload_size;
+    union event_buf *ebuf;
+    struct timespec now;
+
+    if (!model->has_held_detection)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (timespec_diff_us(&now, &model->held_time) / 1000 >
+        HELD_DETECTION_MAX_AGE_MS) {
+        ALOGI("%s: held detection of model %d is stale", __func__,
+            model->model_handle);
+        goto exit;
+    }
+
+    ebuf = get_free_event_buf(stdev, &payload_size);
+    if (ebuf == NULL)
+        goto exit;
+
+    if (payload_size != 0)
+        memcpy(ebuf->data + sizeof(ebuf->generic), model->held_payload,
+            payload_size);
+    init_recognition_event(model, ebuf, payload_size,
+                        RECOGNITION_STATUS_SUCCESS);
+    if (queue_recognition_event(stdev, model, ebuf, &model->held_time,
+                                &stdev->detection_traces[model->desc->type]))
+        stdev->last_keyword_detected_config = model->config;
+    else
+        put_event_buf(stdev, ebuf);
+
+exit:
+    drop_held_detection(model);
+}
+
+/*
+ * Fetch the payload of a keyword detection and queue it for delivery to the
+ * model's recognition callback.
+ */
+static void dispatch_keyword_event(struct knowles_sound_trigger_device *stdev,
+                                const struct model_desc *desc,
+                                const struct iaxxx_get_event_info *ge,
+                                const struct timespec *detect_time,
+                                struct detection_trace *trace)
+{
+    union event_buf *ebuf;
+    unsigned int payload_size = ge->data;
+    int kwid = desc->kw_id;
+    int idx, err;
+
+    ALOGD("%s: Keyword ID %d", __func__, kwid);
+
+    ebuf = get_free_event_buf(stdev, &payload_size);
+    if (ebuf != NULL && payload_size != 0) {
+        ALOGD("Size of payload is %d", payload_size);
+        // Read straight into the event, behind its header
+        err = desc->plugin->get_param_blk(stdev->odsp_hdl,
+                                        ebuf->data + sizeof(ebuf->generic),
+                                        payload_size);
+        if (err != 0) {
+            ALOGE("Failed to get payload data");
+            payload_size = 0;
         }
-    } else if (event == AUDIO_EVENT_CAPTURE_DEVICE_ACTIVE) {
-        if (stdev->is_ahal_in_voice_voip_mode == false &&
-                (config->u.usecase.type == USECASE_TYPE_VOICE_CALL ||
-                 config->u.usecase.type == USECASE_TYPE_VOIP_CALL)) {
-            ALOGD("%s: voice/voip is actvie, close ST mic and don't use mic concurrently",
-                  __func__);
-            stdev->is_ahal_in_voice_voip_mode = true;
+    }
+    detection_trace_mark(trace, TRACE_PAYLOAD);
+
+    idx = find_handle_for_kw_id(stdev, kwid);
+    if (ebuf == NULL) {
+        ALOGE("No free event buffer, dropping event for id %d", kwid);
+    } else if (idx < MAX_MODELS && stdev->models[idx].is_active == true) {
+        struct model_info *model = &stdev->models[idx];
+        int recognition_status = RECOGNITION_STATUS_SUCCESS;
+        if (model->is_state_query == true) {
+            recognition_status = RECOGNITION_STATUS_GET_STATE_RESPONSE;
+
+            // We need to send this only once, so reset now
+            model->is_state_query = false;
         }
-        if (config->u.usecase.type == USECASE_TYPE_PCM_CAPTURE) {
-            stdev->is_ahal_media_recording = true;
+        if (model->recognition_callback == NULL) {
+            hold_detection(model, ebuf->data + sizeof(ebuf->generic),
+                        payload_size, detect_time);
+            put_event_buf(stdev, ebuf);
+            return;
         }
-        if (stdev->is_concurrent_capture == true &&
-            stdev->is_ahal_in_voice_voip_mode == false &&
-            stdev->is_con_mic_route_enabled == false &&
-            config->device_info.device == ST_DEVICE_HANDSET_MIC) {
-            ALOGD("%s: enable mic concurrency", __func__);
-                  stdev->is_con_mic_route_enabled = true;
+        init_recognition_event(model, ebuf, payload_size, recognition_status);
+
+        ALOGD("Queueing recognition callback for id %d", kwid);
+        queue_recognition_event(stdev, model, ebuf, detect_time, trace);
+        // Update the config so that it will be used
+        // during the streaming
+        stdev->last_keyword_detected_config = model->config;
+    } else {
+        ALOGE("Invalid id or keyword is not active, Subsume the event");
+        put_event_buf(stdev, ebuf);
+    }
+}
+
+static void handle_dsp_event(struct knowles_sound_trigger_device *stdev,
+                            const struct iaxxx_get_event_info *ge,
+                            const struct timespec *detect_time)
+{
+    const struct model_desc *desc;
+
+    desc = find_model_desc_by_event(stdev, ge->event_id);
+    if (desc != NULL) {
+        struct detection_trace *trace = &stdev->detection_traces[desc->type];
+
+        detection_trace_begin(trace, detect_time);
+        detection_trace_mark(trace, TRACE_GET_EVENT);
+        metric_add(stdev->metrics.detections[desc->type], 1);
+        ALOGD("Eventid received is %s %d", desc->name, ge->event_id);
+        if (desc->on_detect)
+            desc->on_detect(stdev->odsp_hdl);
+        atomic_store(&stdev->last_detected_model_type, desc->kw_id);
+        atomic_store(&stdev->strm_trace, trace);
+        dispatch_keyword_event(stdev, desc, ge, detect_time, trace);
+    } else if (ge->event_id == OSLO_EP_DISCONNECT) {
+        ALOGD("Eventid received is OSLO_EP_DISCONNECT %d", OSLO_EP_DISCONNECT);
+        if (stdev->is_sensor_destroy_in_prog == true) {
+            // A timer would have been created during stop, check and delete it
+            if (stdev->ss_timer_armed) {
+                arm_timer_ms(stdev->ss_timer_fd, 0);
+                stdev->ss_timer_armed = false;
+            }
+
+            destroy_sensor_model(stdev);
+        } else {
+            ALOGE("Unexpected OSLO_EP_DISCONNECT received, ignoring..");
         }
-    } else if (event == AUDIO_EVENT_CAPTURE_STREAM_INACTIVE) {
-        if (stdev->is_ahal_voice_voip_start == true &&
-                (config->u.usecase.type == USECASE_TYPE_VOICE_CALL ||
-                 config->u.usecase.type == USECASE_TYPE_VOIP_CALL)) {
-            stdev->is_ahal_voice_voip_stop = true;
-            stdev->is_ahal_voice_voip_start = false;
-        } else if (config->u.usecase.type == USECASE_TYPE_PCM_CAPTURE)
-            stdev->is_ahal_media_recording = false;
-    } else if (event == AUDIO_EVENT_CAPTURE_STREAM_ACTIVE) {
-        if (config->u.usecase.type == USECASE_TYPE_VOICE_CALL ||
-            config->u.usecase.type == USECASE_TYPE_VOIP_CALL) {
-            stdev->is_ahal_voice_voip_start = true;
+    } else if (ge->event_id == CHRE_EP_DISCONNECT) {
+        ALOGD("Eventid received is CHRE_EP_DISCONNECT %d", CHRE_EP_DISCONNECT);
+        if (stdev->is_chre_destroy_in_prog == true) {
+            // A timer would have been created during stop, check and delete it
+            if (stdev->chre_timer_armed) {
+                arm_timer_ms(stdev->chre_timer_fd, 0);
+                stdev->chre_timer_armed = false;
+            }
+
+            destroy_chre_model(stdev);
+        } else {
+            ALOGE("Unexpected CHRE_EP_DISCONNECT received, ignoring..");
         }
+    } else {
+        ALOGE("Unknown event id received, ignoring %d", ge->event_id);
+        atomic_store(&stdev->last_detected_model_type, -1);
+        atomic_store(&stdev->strm_trace, NULL);
     }
 }
 
-static bool do_handle_functions(struct knowles_sound_trigger_device *stdev,
-                                enum sthal_mode pre_mode,
-                                enum sthal_mode cur_mode,
-                                audio_event_type_t event)
+/*
+ * The driver queues DSP events, but uevents for events that arrive close
+ * together can be merged or delayed. Fetch everything that is pending on
+ * every wakeup and handle it in the order the chip reported it.
+ */
+static void drain_dsp_events(struct knowles_sound_trigger_device *stdev,
+                            const struct timespec *detect_time)
 {
-    int ret = 0;
-    int i = 0;
+    struct event_drain_stats *ds = &stdev->drain_stats;
+    struct iaxxx_get_event_info ge;
+    unsigned int depth = 0;
+    int err;
 
-    ALOGD("+%s+: pre %d, cur %d, event %d", __func__, pre_mode, cur_mode, event);
+    ds->wakeups++;
+    while (depth < MAX_EVENTS_PER_WAKEUP) {
+        err = get_event(stdev->odsp_hdl, &ge);
+        if (err != 0) {
+            // get_event() has logged anything but an empty queue
+            break;
+        }
+        depth++;
+        handle_dsp_event(stdev, &ge, detect_time);
+    }
 
-    // handle event AUDIO_EVENT_CAPTURE_DEVICE_ACTIVE
-    if (event == AUDIO_EVENT_CAPTURE_DEVICE_ACTIVE) {
-        if ((pre_mode == CON_DISABLED_ST && cur_mode == CON_DISABLED_CAPTURE) ||
-            (pre_mode == CON_DISABLED_ST && cur_mode == IN_CALL) ||
-            (pre_mode == CON_DISABLED_CAPTURE && cur_mode == IN_CALL) ||
-            (pre_mode == CON_ENABLED_CAPTURE_ST && cur_mode == IN_CALL) ||
-            (pre_mode == CON_ENABLED_ST && cur_mode == IN_CALL)) {
-            // disable all ST
-            // if tunnel is active, close it first
-            for (i = 0; i < MAX_MODELS; i++) {
-                if (stdev->adnc_strm_handle[i] != 0) {
-                    ALOGD("%s: stop tunnling for index:%d", __func__, i);
-                    stdev->adnc_strm_close(stdev->adnc_strm_handle[i]);
-                    stdev->adnc_strm_handle[i] = 0;
-                    stdev->adnc_strm_last_read[i] = reset_time;
-                }
-            }
-            stdev->is_streaming = 0;
+    ds->events += depth;
+    if (depth == 0)
+        ds->coalesced++;
+    if (depth > ds->max_depth)
+        ds->max_depth = depth;
 
-            for (i = 0; i < MAX_MODELS; i++) {
-                if (stdev->models[i].is_active == true) {
-                    update_recover_list(stdev, i, true);
-                    tear_package_route(stdev, stdev->models[i].uuid,
-                                       stdev->is_bargein_route_enabled);
-                    stdev->models[i].is_active = false;
-                    if (!check_uuid_equality(stdev->models[i].uuid,
-                                             stdev->chre_model_uuid))
-                        destroy_package(stdev, &stdev->models[i]);
+    ALOGD("%s: %u event(s) this wakeup, %u events over %u wakeups, "
+        "%u coalesced, max depth %u", __func__, depth, ds->events,
+        ds->wakeups, ds->coalesced, ds->max_depth);
+}
 
-                    if ((stdev->hotword_buffer_enable) &&
-                        !(stdev->current_enable & PLUGIN1_MASK)) {
-                        tear_hotword_buffer_route(stdev->route_hdl,
-                                                  stdev->is_bargein_route_enabled);
-                    }
+static void attach_uevent_filter(struct knowles_sound_trigger_device *stdev,
+                                int sock)
+{
+    struct sock_fprog fprog = {
+        .len = sizeof(uevent_filter_code) / sizeof(uevent_filter_code[0]),
+        .filter = uevent_filter_code,
+    };
+
+    stdev->uevent_stats.is_filter_attached = false;
+    if (!property_get_bool(UEVENT_FILTER_PROP, true)) {
+        ALOGD("%s: uevent filter disabled", __func__);
+        return;
+    }
 
-                    if ((stdev->music_buffer_enable) &&
-                        !(stdev->current_enable & PLUGIN2_MASK)) {
-                        tear_music_buffer_route(stdev->route_hdl,
-                                                stdev->is_bargein_route_enabled);
-                    }
+    if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER,
+                &fprog, sizeof(fprog)) != 0) {
+        ALOGE("%s: Failed to attach uevent filter %d(%s)",
+            __func__, errno, strerror(errno));
+        return;
+    }
+    stdev->uevent_stats.is_filter_attached = true;
+}
 
-                    setup_buffer(stdev, &stdev->models[i], false);
-                }
-            }
-            handle_input_source(stdev, false);
-            check_and_destroy_buffer_package(stdev);
-        } else if (pre_mode == CON_ENABLED_ST && cur_mode == CON_ENABLED_CAPTURE_ST) {
-            //reconfig mic
-            if (stdev->is_mic_route_enabled == true) {
-                if (stdev->is_bargein_route_enabled == true) {
-                    // close amp-ref first and reconfig it again with 48K after
-                    // main mic is turned on by media recording
-                    ret = enable_amp_ref_route(stdev->route_hdl, false, STRM_16K);
-                    if (ret != 0) {
-                        ALOGE("Failed to disable amp-ref route");
-                        goto exit;
-                    }
-                    ret = enable_mic_route(stdev->route_hdl, false,
-                                           EXTERNAL_OSCILLATOR);
-                    if (ret != 0) {
-                        ALOGE("Failed to disable mic route with EXT OSC");
-                        goto exit;
-                    }
+/*
+ * The iaxxx events come either as a bare "NAME" field or as the value of a
+ * "KEY=NAME" field, match both exactly rather than by substring.
+ */
+static enum iaxxx_uevent parse_uevent_field(const char *field)
+{
+    const char *value = strchr(field, '=');
+    unsigned int i;
 
-                    ret = enable_amp_ref_route(stdev->route_hdl, true, STRM_48K);
-                    if (ret != 0) {
-                        ALOGE("Failed to enable amp-ref route");
-                        goto exit;
-                    }
-                } else {
-                    ret = enable_mic_route(stdev->route_hdl, false,
-                                           INTERNAL_OSCILLATOR);
-                    if (ret != 0) {
-                        ALOGE("Failed to disable mic route with INT OSC");
-                        goto exit;
-                    }
-                }
-            } else {
-                ALOGD("%s: ST mic isn't enabled, recording mic is turned on",
-                       __func__);
-            }
-        }
+    if (value != NULL)
+        value++;
+
+    for (i = 0; i < sizeof(iaxxx_uevents) / sizeof(iaxxx_uevents[0]); i++) {
+        if (strcmp(field, iaxxx_uevents[i].name) == 0 ||
+            (value != NULL && strcmp(value, iaxxx_uevents[i].name) == 0))
+            return iaxxx_uevents[i].type;
     }
 
-    // handle event AUDIO_EVENT_CAPTURE_DEVICE_INACTIVE
-    if (event == AUDIO_EVENT_CAPTURE_DEVICE_INACTIVE) {
-        if ((pre_mode == IN_CALL && cur_mode == CON_DISABLED_ST) ||
-            (pre_mode == IN_CALL && cur_mode == CON_DISABLED_CAPTURE) ||
-            (pre_mode == IN_CALL && cur_mode == CON_ENABLED_ST) ||
-            (pre_mode == IN_CALL && cur_mode == CON_ENABLED_CAPTURE_ST) ||
-            (pre_mode == CON_DISABLED_CAPTURE && cur_mode == CON_DISABLED_ST)) {
-            //recover all STs
-            for (i = 0; i < MAX_MODELS; i++) {
-                // recover all models from list
-                if (is_uuid_in_recover_list(stdev, i)) {
-                    if (stdev->models[i].is_active == false) {
-                        check_and_setup_buffer_package(stdev);
-                        stdev->models[i].is_active = true;
-                        handle_input_source(stdev, true);
+    return IAXXX_UEVENT_NONE;
+}
 
-                        setup_buffer(stdev, &stdev->models[i], true);
-                        if (stdev->hotword_buffer_enable &&
-                            !(stdev->current_enable & PLUGIN1_MASK)) {
-                            set_hotword_buffer_route(stdev->route_hdl,
-                                                     stdev->is_bargein_route_enabled);
-                        }
-                        if (stdev->music_buffer_enable &&
-                            !(stdev->current_enable & PLUGIN2_MASK)) {
-                            set_music_buffer_route(stdev->route_hdl,
-                                                   stdev->is_bargein_route_enabled);
-                        }
+/*
+ * Returns the first iaxxx event found in a NUL separated uevent message,
+ * the header ("action@devpath") is skipped.
+ */
+static enum iaxxx_uevent parse_uevent(struct knowles_sound_trigger_device *stdev,
+                                    const char *msg, int len)
+{
+    enum iaxxx_uevent type = IAXXX_UEVENT_NONE;
+    int i = strnlen(msg, len) + 1;
 
-                        if (!check_uuid_equality(stdev->models[i].uuid,
-                                                 stdev->chre_model_uuid))
-                            setup_package(stdev, &stdev->models[i]);
-                        set_package_route(stdev, stdev->models[i].uuid,
-                                          stdev->is_bargein_route_enabled);
-                    }
-                }
-            }
-            stdev->recover_model_list = 0;
-        } else if (pre_mode == CON_ENABLED_CAPTURE_ST && cur_mode == CON_ENABLED_ST) {
-            // reconfig mic
-            if (stdev->is_mic_route_enabled == true) {
-                if (stdev->is_bargein_route_enabled == true) {
-                    ret = enable_amp_ref_route(stdev->route_hdl, false, STRM_48K);
-                    if (ret != 0) {
-                        ALOGE("Failed to disable amp-ref route");
-                        goto exit;
-                    }
-                    ret = enable_mic_route(stdev->route_hdl, true,
-                                           EXTERNAL_OSCILLATOR);
-                    if (ret != 0) {
-                        ALOGE("Failed to enable mic route with EXT OSC");
-                        goto exit;
-                    }
-                    // turn on amp-ref with 16khz
-                    ret = enable_amp_ref_route(stdev->route_hdl, true, STRM_16K);
-                    if (ret != 0) {
-                        ALOGE("Failed to enable amp-ref route");
-                        goto exit;
-                    }
-                } else {
-                    ret = enable_mic_route(stdev->route_hdl, true,
-                                           INTERNAL_OSCILLATOR);
-                    if (ret != 0) {
-                        ALOGE("Failed to enable mic route with INT OSC");
-                        goto exit;
-                    }
-                }
-            } else {
-                ALOGD("%s: ST mic isn't enabled, recording mic is turned off",
-                      __func__);
-            }
-        }
+    stdev->uevent_stats.received++;
+    while (i < len) {
+        type = parse_uevent_field(msg + i);
+        if (type != IAXXX_UEVENT_NONE)
+            break;
+        i += strnlen(msg + i, len - i) + 1;
     }
 
-exit:
-    ALOGD("-%s-: pre %d, cur %d, event %d", __func__, pre_mode, cur_mode, event);
-    return ret;
+    if (type != IAXXX_UEVENT_NONE) {
+        stdev->uevent_stats.relevant++;
+        ALOGV("%s: %u of %u uevents relevant, filter %s", __func__,
+            stdev->uevent_stats.relevant, stdev->uevent_stats.received,
+            stdev->uevent_stats.is_filter_attached ? "on" : "off");
+    }
+
+    return type;
 }
 
-// stdev needs to be locked before calling this function
-static int restart_recognition(struct knowles_sound_trigger_device *stdev)
+static int stop_recognition(struct knowles_sound_trigger_device *stdev,
+                            sound_model_handle_t handle)
 {
-    int err = 0;
-    int i = 0;
-    enum strm_type strmt = STRM_16K;
-    enum clock_type ct = INTERNAL_OSCILLATOR;
-    /*
-     * The libaudioroute library doesn't set the mixer controls if previously
-     * applied values are the same or the active_count > 0, so we need to
-     * teardown the route so that it can clear up the value and active_count.
-     * Then we could setup the routes again.
-     */
+    int status = 0;
+    struct model_info *model = &stdev->models[handle];
 
-    stdev->current_enable = 0;
-    stdev->hotword_buffer_enable = 0;
-    stdev->music_buffer_enable = 0;
+    if (stdev->is_st_hal_ready == false) {
+        ALOGE("%s: ST HAL is not ready yet", __func__);
+        status = -EAGAIN;
+        goto exit;
+    }
 
-    if (stdev->rx_active_count == 0 &&
-        stdev->is_bargein_route_enabled == true) {
-        /* rx stream is disabled during codec recovery.
-         * Need to reset the enabled flag
-         */
-        stdev->is_bargein_route_enabled = false;
+    if (model->config != NULL) {
+        dereg_hal_event_session(model->config, handle);
+        model->config = NULL;
+        update_capture_map(stdev, handle);
+    }
+
+    model->recognition_callback = NULL;
+    model->recognition_cookie = NULL;
+    atomic_fetch_add(&model->session_gen, 1);
+    drop_held_detection(model);
+    if (!is_model_kind(model, MODEL_KIND_KEYWORD)) {
+        // This avoids any processing of chre/oslo.
+        goto exit;
     }
-
-    if (stdev->is_buffer_package_loaded == true) {
-        err = setup_buffer_package(stdev->odsp_hdl);
-        if (err != 0) {
-            ALOGE("%s: Failed to restart Buffer package", __func__);
-        }
+    if (can_update_recover_list(stdev) == true) {
+        update_recover_list(stdev, handle, false);
+        model->is_active = false;
+        update_capture_map(stdev, model - stdev->models);
+        goto exit;
     }
 
-    if (stdev->is_src_package_loaded == true) {
-        err = setup_src_package(stdev->odsp_hdl);
-        if (err != 0) {
-            ALOGE("%s: Failed to restart SRC package", __func__);
-        }
+    lock_strm(stdev);
+    if (stdev->adnc_strm_handle[handle] != 0) {
+        ALOGD("%s: stop tunnling for index:%d", __func__, handle);
+        close_capture_stream(stdev, handle);
+        stdev->is_streaming--;
     }
+    // Their package and routes are about to go
+    release_lingering_tunnels(stdev);
+    unlock_strm(stdev);
 
-    /*
-     * If ST mode is IN_CALL, make sure mic route as false,
-     * that would be reloaded after ending the call
-     */
-    if (get_sthal_mode(stdev) == IN_CALL) {
-        ALOGD("%s: ST mode is in_call, reset all routes", __func__);
+    model->is_active = false;
+    update_capture_map(stdev, model - stdev->models);
 
-        stdev->is_mic_route_enabled = false;
-        stdev->is_bargein_route_enabled = false;
-        for (i = 0; i < MAX_MODELS; i++) {
-            if (stdev->models[i].is_active == true) {
-                update_recover_list(stdev, i, true);
-                stdev->models[i].is_active = false;
-            }
-        }
+    tear_package_route(stdev, model, stdev->is_bargein_route_enabled);
 
-        // if chre enabled before crash during call, need to setup package for SLPI.
-        if (stdev->is_chre_loaded == true) {
-            err = setup_chre_package(stdev->odsp_hdl);
-            if (err != 0) {
-                ALOGE("Failed to load CHRE package");
-            }
-            stdev->current_enable = stdev->current_enable | CHRE_MASK;
-        }
-        goto reload_oslo;
-    }
+    destroy_package(stdev, model);
 
 
-    /*
-     * Reset mic and src package if sound trigger recording is active
-     * The src-mic, src-amp must be enable before AEC enable, because
-     * the endpoint sequence control.
-     */
-    if (stdev->is_mic_route_enabled == true) {
-        // recover src package if sound trigger recording is active
-        err = setup_src_plugin(stdev->odsp_hdl, SRC_MIC);
-        if (err != 0) {
-            ALOGE("failed to load SRC package");
-        }
-        err = enable_src_route(stdev->route_hdl, true, SRC_MIC);
-        if (err != 0) {
-            ALOGE("Failed to restart SRC-mic route");
-        }
-        /*
-         * RX stream was enabled during codec recovery.
-         * Need to setup the barge-in package and routing.
-         */
-        if (stdev->rx_active_count > 0) {
-            stdev->is_bargein_route_enabled = true;
-            ct = EXTERNAL_OSCILLATOR;
-            if (is_mic_controlled_by_ahal(stdev) == true) {
-                strmt = STRM_48K;
-            }
-            err = setup_src_plugin(stdev->odsp_hdl, SRC_AMP_REF);
-            if (err != 0) {
-                ALOGE("failed to load SRC package");
-            }
-            err = enable_src_route(stdev->route_hdl, true, SRC_AMP_REF);
-            if (err != 0) {
-                ALOGE("Failed to restart SRC-amp route");
-            }
+    tear_model_buffer_route(stdev, model);
 
-            err = setup_aec_package(stdev->odsp_hdl);
-            if (err != 0) {
-                ALOGE("Failed to restart AEC package");
-            }
-            err = enable_bargein_route(stdev->route_hdl, true);
-            if (err != 0) {
-                ALOGE("Failed to restart bargein route");
-            }
-            err = enable_amp_ref_route(stdev->route_hdl, true, strmt);
-            if (err != 0) {
-                ALOGE("Failed to restart amp-ref route");
-            }
-        }
-        // The stream 0 should be enable at last moment for the data alignment.
-        if (is_mic_controlled_by_ahal(stdev) == false) {
-            err = enable_mic_route(stdev->route_hdl, true, ct);
-            if (err != 0) {
-                ALOGE("failed to restart mic route");
-            }
-        }
-    }
+    setup_buffer(stdev, model, false);
 
-    // Download all the keyword models files that were previously loaded
-    for (i = 0; i < MAX_MODELS; i++) {
-        if (stdev->models[i].is_active == true) {
-            if (stdev->is_buffer_package_loaded == true) {
-                setup_buffer(stdev, &stdev->models[i], true);
-            }
-            if (check_uuid_equality(stdev->models[i].uuid, stdev->hotword_model_uuid) ||
-                (check_uuid_equality(stdev->models[i].uuid, stdev->wakeup_model_uuid))) {
-                if ((stdev->hotword_buffer_enable) &&
-                    (!(stdev->current_enable & HOTWORD_MASK) ||
-                      (stdev->current_enable & WAKEUP_MASK))) {
-                    set_hotword_buffer_route(stdev->route_hdl,
-                                            stdev->is_bargein_route_enabled);
-                }
-            }
-            if (check_uuid_equality(stdev->models[i].uuid, stdev->ambient_model_uuid) ||
-                (check_uuid_equality(stdev->models[i].uuid, stdev->entity_model_uuid))) {
-                if ((stdev->music_buffer_enable) &&
-                    (!(stdev->current_enable & AMBIENT_MASK) ||
-                      (stdev->current_enable & ENTITY_MASK))) {
-                    set_music_buffer_route(stdev->route_hdl,
-                                        stdev->is_bargein_route_enabled);
-                }
-            }
-            setup_package(stdev, &stdev->models[i]);
-            set_package_route(stdev, stdev->models[i].uuid,
-                            stdev->is_bargein_route_enabled);
-        }
-    }
+    handle_input_source(stdev, false);
 
-reload_oslo:
-    // reload Oslo part after every package loaded to avoid HMD memory overlap
-    // issue, b/128914464
-    for (i = 0; i < MAX_MODELS; i++) {
-        if (stdev->models[i].is_loaded == true) {
-            if (check_uuid_equality(stdev->models[i].uuid,
-                                    stdev->sensor_model_uuid)) {
-                // setup the sensor route
-                err = setup_sensor_package(stdev->odsp_hdl);
-                if (err != 0) {
-                    ALOGE("%s: setup Sensor package failed", __func__);
-                    goto exit;
-                }
+    check_and_destroy_buffer_package(stdev);
 
-                err = set_sensor_route(stdev->route_hdl, true);
-                if (err != 0) {
-                    ALOGE("%s: Sensor route fail", __func__);
-                    goto exit;
-                }
-                stdev->is_sensor_route_enabled = true;
-            }
-        }
-    }
-    ALOGD("%s: recovery done", __func__);
 exit:
-    return err;
+    return status;
 }
 
-// stdev needs to be locked before calling this function
-static int crash_recovery(struct knowles_sound_trigger_device *stdev)
+// Sets up the chip side of recognition for a keyword model
+static int activate_model(struct knowles_sound_trigger_device *stdev,
+                        struct model_info *model)
 {
-    int err = 0;
+    int err;
 
-    set_default_apll_clk(stdev->mixer);
-    setup_slpi_wakeup_event(stdev->odsp_hdl, true);
-
-    // Redownload the keyword model files and start recognition
-    err = restart_recognition(stdev);
+    err = check_and_setup_buffer_package(stdev);
     if (err != 0) {
-        ALOGE("%s: ERROR: Failed to download the keyword models and restarting"
-            " recognition", __func__);
+        ALOGE("%s: ERROR: Failed to load the buffer package", __func__);
         goto exit;
     }
 
-    // Reset the flag only after successful recovery
-    stdev->is_st_hal_ready = true;
+    model->is_active = true;
+    update_capture_map(stdev, model - stdev->models);
+
+    handle_input_source(stdev, true);
+
+    if (stdev->is_buffer_package_loaded == true) {
+        setup_buffer(stdev, model, true);
+    }
+
+    set_model_buffer_route(stdev, model);
+
+    setup_package(stdev, model);
+
+    set_package_route(stdev, model, stdev->is_bargein_route_enabled);
 
 exit:
     return err;
 }
 
-static void sensor_crash_handler(struct knowles_sound_trigger_device *stdev)
-{
-    int i;
+/*
+ * Keyword models are kept in MODEL_CACHE_FILE so that a restarted HAL can
+ * have them listening again before the framework reconnects. The file is a
+ * header, one entry per model and the model blobs, and is read in place
+ * through mmap. CHRE and sensor models aren't cached, loading them involves
+ * the SLPI.
+ */
+struct model_cache_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entry_size;
+    uint32_t num_entries;
+    uint32_t file_size;
+    // FNV-1a of everything behind the header
+    uint32_t checksum;
+};
 
-    if (stdev->is_sensor_destroy_in_prog == false)
-        return;
+struct model_cache_entry {
+    sound_trigger_uuid_t uuid;
+    uint32_t handle;
+    uint32_t type;
+    uint32_t is_active;
+    // From the start of the file
+    uint32_t data_offset;
+    uint32_t data_sz;
+};
 
-    if (stdev->ss_timer_created) {
-        timer_delete(stdev->ss_timer);
-        stdev->ss_timer_created = false;
-    }
+static uint32_t model_cache_hash(uint32_t hash, const void *data, size_t len)
+{
+    const unsigned char *p = data;
 
-    if (stdev->is_sensor_route_enabled == true) {
-        for (i = 0; i < MAX_MODELS; i++) {
-            if (check_uuid_equality(stdev->models[i].uuid,
-                                    stdev->sensor_model_uuid) &&
-                stdev->models[i].is_loaded == true) {
-                stdev->models[i].is_loaded = false;
-                memset(&stdev->models[i].uuid, 0,
-                       sizeof(sound_trigger_uuid_t));
-                break;
-            }
-        }
-        stdev->is_sensor_route_enabled = false;
-        stdev->current_enable &= ~OSLO_MASK;
+    while (len--) {
+        hash ^= *p++;
+        hash *= 16777619u;
     }
-    stdev->is_sensor_destroy_in_prog = false;
 
-    // There could be another thread waiting for us to destroy
-    // so signal that thread, if no one is waiting then this signal
-    // will have no effect
-    pthread_cond_signal(&stdev->sensor_create);
+    return hash;
 }
 
-static void destroy_sensor_model(struct knowles_sound_trigger_device *stdev)
+// Blobs start MODEL_CACHE_ALIGN aligned in the mapping
+static inline uint32_t model_cache_align(uint32_t len)
 {
-    int ret, i;
-    ALOGD("+%s+", __func__);
-
-    if (stdev->is_sensor_route_enabled == true) {
-        ret = set_sensor_route(stdev->route_hdl, false);
-        if (ret != 0) {
-            ALOGE("%s: tear Sensor route fail", __func__);
-        }
-        stdev->is_sensor_route_enabled = false;
+    return (len + MODEL_CACHE_ALIGN - 1) & ~(MODEL_CACHE_ALIGN - 1);
+}
 
-        ret = destroy_sensor_package(stdev->odsp_hdl);
-        if (ret != 0) {
-            ALOGE("%s: destroy Sensor package failed %d",
-                  __func__, ret);
-        }
-        stdev->current_enable = stdev->current_enable & ~OSLO_MASK;
-    }
+static bool is_model_cacheable(const struct model_info *model)
+{
+    return model->is_loaded && model->data != NULL &&
+        is_model_kind(model, MODEL_KIND_KEYWORD);
+}
 
-    // now we can change the flag
-    for (i = 0 ; i < MAX_MODELS ; i++) {
-        if (check_uuid_equality(stdev->models[i].uuid,
-                                stdev->sensor_model_uuid) &&
-            stdev->models[i].is_loaded == true) {
-            memset(&stdev->models[i].uuid, 0, sizeof(sound_trigger_uuid_t));
-            stdev->models[i].is_loaded = false;
-            break;
-        }
-    }
+/*
+ * What the cache file is to hold, taken under stdev->lock and written once
+ * the lock is dropped. The blobs are copies, the models may be unloaded in
+ * the meantime.
+ */
+struct model_cache_snapshot {
+    struct model_cache_header hdr;
+    struct model_cache_entry entries[MAX_MODELS];
+    void *data[MAX_MODELS];
+};
 
-    stdev->is_sensor_destroy_in_prog = false;
-    check_and_destroy_buffer_package(stdev);
+static void free_model_cache_snapshot(struct model_cache_snapshot *snap)
+{
+    unsigned int i;
 
-    // There could be another thread waiting for us to destroy so signal that
-    // thread, if no one is waiting then this signal will have no effect
-    pthread_cond_signal(&stdev->sensor_create);
+    for (i = 0; i < snap->hdr.num_entries; i++)
+        free(snap->data[i]);
+    free(snap);
+}
 
-    ALOGD("-%s-", __func__);
+/*
+ * Model changes come in bursts (load then start), so the cache is written
+ * from the reactor once things have settled.
+ */
+static void schedule_model_cache_sync(struct knowles_sound_trigger_device *stdev)
+{
+    if (arm_timer_ms(stdev->cache_sync_fd, MODEL_CACHE_SYNC_DELAY_MS) == 0)
+        stdev->is_cache_sync_pending = true;
 }
 
-static void sensor_timeout_recover()
+/*
+ * Called with stdev->lock held, returns NULL if no sync is pending or the
+ * snapshot can't be taken. Hand the snapshot to write_model_cache() after
+ * dropping the lock.
+ */
+static struct model_cache_snapshot *take_model_cache_snapshot(
+                                struct knowles_sound_trigger_device *stdev)
 {
-    int err = 0;
-    ALOGD("+%s+", __func__);
+    struct model_cache_snapshot *snap;
+    struct model_cache_entry *entry;
+    struct model_info *model;
+    uint32_t offset;
+    unsigned int i, n = 0;
 
-    struct knowles_sound_trigger_device *stdev = &g_stdev;
-    pthread_mutex_lock(&stdev->lock);
-    // We are here because we timed out so check if we still need to destroy
-    // the sensor package, if yes then reset the firmware
-    if (stdev->is_sensor_destroy_in_prog == true) {
-        if (stdev->is_st_hal_ready) {
-            stdev->is_st_hal_ready = false;
-            // reset the firmware and wait for firmware download complete
-            err = reset_fw(stdev->odsp_hdl);
-            if (err == -1) {
-                ALOGE("%s: ERROR: Failed to reset the firmware %d(%s)",
-                      __func__, errno, strerror(errno));
-            }
-            reset_all_route(stdev->route_hdl);
-            sensor_crash_handler(stdev);
+    if (!stdev->is_cache_sync_pending)
+        return NULL;
+
+    arm_timer_ms(stdev->cache_sync_fd, 0);
+    stdev->is_cache_sync_pending = false;
+
+    snap = calloc(1, sizeof(*snap));
+    if (snap == NULL)
+        return NULL;
+
+    for (i = 0; i < MAX_MODELS; i++) {
+        model = &stdev->models[i];
+        if (!is_model_cacheable(model))
+            continue;
+
+        snap->data[n] = malloc(model->data_sz);
+        if (snap->data[n] == NULL) {
+            snap->hdr.num_entries = n;
+            free_model_cache_snapshot(snap);
+            return NULL;
         }
+        memcpy(snap->data[n], model->data, model->data_sz);
+
+        entry = &snap->entries[n];
+        entry->uuid = model->uuid;
+        entry->handle = i;
+        entry->type = model->type;
+        entry->is_active = model->is_active;
+        entry->data_sz = model->data_sz;
+        n++;
     }
-    pthread_mutex_unlock(&stdev->lock);
-    ALOGD("-%s-", __func__);
+
+    offset = model_cache_align(sizeof(snap->hdr) + n * sizeof(*entry));
+    for (i = 0; i < n; i++) {
+        snap->entries[i].data_offset = offset;
+        offset += model_cache_align(snap->entries[i].data_sz);
+    }
+
+    snap->hdr.magic = MODEL_CACHE_MAGIC;
+    snap->hdr.version = MODEL_CACHE_VERSION;
+    snap->hdr.entry_size = sizeof(*entry);
+    snap->hdr.num_entries = n;
+    snap->hdr.file_size = offset;
+
+    return snap;
 }
 
-static int start_sensor_model(struct knowles_sound_trigger_device * stdev)
+static int write_cache_chunk(int fd, const void *buf, size_t len)
 {
-    struct timespec ts;
-    int wait_counter = 0, err = 0;
+    const char *p = buf;
+    ssize_t written;
 
-    while (stdev->is_sensor_destroy_in_prog == true &&
-           wait_counter < SENSOR_CREATE_WAIT_MAX_COUNT) {
-        // We wait for 1sec * MAX_COUNT times for the HOST 1 to respond, if
-        // within that time we don't get any response, we will go ahead with the
-        // sensor model creation. Note this might result in an error which would
-        // be better than blocking the thread indefinitely.
-        clock_gettime(CLOCK_REALTIME, &ts);
-        ts.tv_sec += SENSOR_CREATE_WAIT_TIME_IN_S;
-        err = pthread_cond_timedwait(&stdev->sensor_create, &stdev->lock, &ts);
-        if (err == ETIMEDOUT) {
-            ALOGE("%s: WARNING: Sensor create timed out after %ds",
-                  __func__, SENSOR_CREATE_WAIT_TIME_IN_S);
-            wait_counter++;
-        }
+    while (len > 0) {
+        written = write(fd, p, len);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return written < 0 ? -errno : -EIO;
+        p += written;
+        len -= written;
     }
 
-    // If firmware crashed when we are waiting
-    if (stdev->is_st_hal_ready == false) {
-        err = -EAGAIN;
+    return 0;
+}
+
+/*
+ * Writes and frees a snapshot taken by take_model_cache_snapshot(), without
+ * any lock. Only the reactor writes the cache while the HAL is open, so the
+ * snapshots go out in the order they were taken.
+ */
+static int write_model_cache(struct model_cache_snapshot *snap)
+{
+    static const char pad[MODEL_CACHE_ALIGN];
+    struct model_cache_header *hdr = &snap->hdr;
+    char tmp_file[NAME_MAX_SIZE];
+    uint32_t offset, hash = 2166136261u;
+    unsigned int i, n = hdr->num_entries;
+    int fd = -1;
+    int err = 0;
+
+    // The checksum is known before anything goes out
+    hash = model_cache_hash(hash, snap->entries, n * sizeof(snap->entries[0]));
+    offset = sizeof(*hdr) + n * sizeof(snap->entries[0]);
+    for (i = 0; i < n; i++) {
+        hash = model_cache_hash(hash, pad,
+                                snap->entries[i].data_offset - offset);
+        hash = model_cache_hash(hash, snap->data[i], snap->entries[i].data_sz);
+        offset = snap->entries[i].data_offset + snap->entries[i].data_sz;
+    }
+    hash = model_cache_hash(hash, pad, hdr->file_size - offset);
+    hdr->checksum = hash;
+
+    if (mkdir(STHAL_DATA_DIR, 0770) != 0 && errno != EEXIST) {
+        err = -errno;
         goto exit;
     }
 
-    if (stdev->is_sensor_destroy_in_prog == true) {
-        ALOGE("%s: ERROR: Waited for %ds but we didn't get the event from "
-              "Host 1, and fw reset is not yet complete", __func__,
-              SENSOR_CREATE_WAIT_TIME_IN_S * SENSOR_CREATE_WAIT_MAX_COUNT);
-        err = -EAGAIN;
+    snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", MODEL_CACHE_FILE);
+    fd = open(tmp_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        err = -errno;
+        ALOGE("%s: Can't create %s %d(%s)", __func__, tmp_file, errno,
+            strerror(errno));
         goto exit;
     }
 
-    // setup the sensor route
-    err = check_and_setup_buffer_package(stdev);
+    err = write_cache_chunk(fd, hdr, sizeof(*hdr));
+    if (err == 0)
+        err = write_cache_chunk(fd, snap->entries,
+                                n * sizeof(snap->entries[0]));
+    offset = sizeof(*hdr) + n * sizeof(snap->entries[0]);
+    for (i = 0; i < n && err == 0; i++) {
+        err = write_cache_chunk(fd, pad,
+                                snap->entries[i].data_offset - offset);
+        if (err == 0)
+            err = write_cache_chunk(fd, snap->data[i],
+                                    snap->entries[i].data_sz);
+        offset = snap->entries[i].data_offset + snap->entries[i].data_sz;
+    }
+    if (err == 0)
+        err = write_cache_chunk(fd, pad, hdr->file_size - offset);
+    if (err == 0 && fsync(fd) != 0)
+        err = -errno;
+    close(fd);
     if (err != 0) {
-        ALOGE("%s: ERROR: Failed to load the buffer package", __func__);
+        unlink(tmp_file);
         goto exit;
     }
 
-    if(stdev->is_sensor_route_enabled == false) {
-        err = setup_sensor_package(stdev->odsp_hdl);
-        if (err) {
-            ALOGE("%s: Failed to setup sensor package", __func__);
-            goto exit;
-        }
-        // Don't download the keyword model file, just setup the
-        // sensor route
-        err = set_sensor_route(stdev->route_hdl, true);
-        if (err) {
-            ALOGE("%s: Sensor route fail", __func__);
-            goto exit;
-        }
-        stdev->is_sensor_route_enabled = true;
-        stdev->current_enable = stdev->current_enable | OSLO_MASK;
+    if (rename(tmp_file, MODEL_CACHE_FILE) != 0) {
+        err = -errno;
+        unlink(tmp_file);
+        goto exit;
     }
 
+    ALOGD("%s: %u models, %u bytes", __func__, n, hdr->file_size);
+
 exit:
+    if (err != 0)
+        ALOGE("%s: Failed to write %s %d", __func__, MODEL_CACHE_FILE, err);
+    free_model_cache_snapshot(snap);
     return err;
 }
 
-static void chre_crash_handler(struct knowles_sound_trigger_device *stdev)
+static const struct model_cache_entry *check_model_cache(const void *map,
+                                                        size_t len)
 {
-    int i;
-
-    if (stdev->is_chre_destroy_in_prog == false)
-        return;
+    const struct model_cache_header *hdr = map;
+    const struct model_cache_entry *entries;
+    unsigned int i;
+
+    if (len < sizeof(*hdr) || hdr->magic != MODEL_CACHE_MAGIC ||
+        hdr->version != MODEL_CACHE_VERSION ||
+        hdr->entry_size != sizeof(*entries) || hdr->file_size != len ||
+        hdr->num_entries > MAX_MODELS ||
+        sizeof(*hdr) + hdr->num_entries * sizeof(*entries) > len) {
+        ALOGW("%s: Unknown cache layout", __func__);
+        return NULL;
+    }
 
-    if (stdev->chre_timer_created) {
-        timer_delete(stdev->chre_timer);
-        stdev->chre_timer_created = false;
+    if (model_cache_hash(2166136261u, (const char *)map + sizeof(*hdr),
+                        len - sizeof(*hdr)) != hdr->checksum) {
+        ALOGW("%s: Checksum mismatch", __func__);
+        return NULL;
     }
 
-    if (stdev->is_chre_loaded == true) {
-        for (i = 0; i < MAX_MODELS; i++) {
-            if (check_uuid_equality(stdev->models[i].uuid,
-                                    stdev->chre_model_uuid)) {
-                stdev->models[i].is_active = false;
-                stdev->models[i].is_loaded = false;
-                memset(&stdev->models[i].uuid, 0,
-                       sizeof(sound_trigger_uuid_t));
-                break;
-            }
+    entries = (const struct model_cache_entry *)(hdr + 1);
+    for (i = 0; i < hdr->num_entries; i++) {
+        if (entries[i].handle >= MAX_MODELS || entries[i].data_sz == 0 ||
+            entries[i].data_offset > len ||
+            entries[i].data_sz > len - entries[i].data_offset) {
+            ALOGW("%s: Entry %u is out of bounds", __func__, i);
+            return NULL;
         }
-        stdev->is_chre_loaded = false;
-        stdev->current_enable &= ~CHRE_MASK;
     }
-    stdev->is_chre_destroy_in_prog = false;
 
-    // There could be another thread waiting for us to destroy
-    // so signal that thread, if no one is waiting then this signal
-    // will have no effect
-    pthread_cond_signal(&stdev->chre_create);
+    return entries;
 }
 
-static int start_chre_model(struct knowles_sound_trigger_device *stdev,
-                            int model_id)
+static int restore_cached_model(struct knowles_sound_trigger_device *stdev,
+                                const struct model_cache_entry *entry,
+                                const void *map)
 {
-    struct timespec ts;
-    int wait_counter = 0, err = 0;
+    const struct model_desc *desc = find_model_desc(stdev, entry->uuid);
+    struct model_info *model = &stdev->models[entry->handle];
 
-    while (stdev->is_chre_destroy_in_prog == true &&
-           wait_counter < CHRE_CREATE_WAIT_MAX_COUNT) {
-        // We wait for 1sec * MAX_COUNT times for the HOST 1 to respond, if
-        // within that time we don't get any response, we will go ahead with the
-        // sensor model creation. Note this might result in an error which would
-        // be better than blocking the thread indefinitely.
-        clock_gettime(CLOCK_REALTIME, &ts);
-        ts.tv_sec += CHRE_CREATE_WAIT_TIME_IN_S;
-        err = pthread_cond_timedwait(&stdev->chre_create, &stdev->lock, &ts);
-        if (err == ETIMEDOUT) {
-            ALOGE("%s: WARNING: CHRE create timed out after %ds",
-                    __func__, CHRE_CREATE_WAIT_TIME_IN_S);
-            wait_counter++;
-        }
+    if (desc == NULL || desc->kind != MODEL_KIND_KEYWORD ||
+        model->is_loaded || find_handle_for_uuid(stdev, entry->uuid) != -1)
+        return -EINVAL;
+
+    model->data = malloc(entry->data_sz);
+    if (model->data == NULL)
+        return -ENOMEM;
+    memcpy(model->data, (const char *)map + entry->data_offset,
+        entry->data_sz);
+    model->data_sz = entry->data_sz;
+
+    model->kw_id = desc->kw_id;
+    model->model_handle = entry->handle;
+    model->type = entry->type;
+    model->uuid = entry->uuid;
+    model->desc = desc;
+    model->sound_model_callback = NULL;
+    model->sound_model_cookie = NULL;
+    model->recognition_callback = NULL;
+    model->recognition_cookie = NULL;
+    // The capture session comes with the framework's start_recognition
+    model->config = NULL;
+    model->is_loaded = true;
+    model->is_restored = true;
+
+    if (!entry->is_active)
+        return 0;
+
+    // Detections are held until the framework hands us a callback
+    if (can_update_recover_list(stdev) == true) {
+        update_recover_list(stdev, entry->handle, true);
+        return 0;
     }
 
-    // If firmware crashed when we are waiting
-    if (stdev->is_st_hal_ready == false) {
-        err = -EAGAIN;
-        goto exit;
+    return activate_model(stdev, model);
+}
+
+/*
+ * Brings back the models the previous HAL instance had loaded, called once
+ * the chip is ready. Runs only once per process and only if the framework
+ * hasn't loaded anything yet.
+ */
+static void restore_model_cache(struct knowles_sound_trigger_device *stdev)
+{
+    const struct model_cache_header *hdr;
+    const struct model_cache_entry *entries;
+    struct timespec start, end;
+    struct stat st;
+    void *map = MAP_FAILED;
+    unsigned int i, num_restored = 0;
+    int fd;
+
+    if (stdev->is_model_cache_restored || stdev->route_hdl == NULL ||
+        !stdev->is_st_hal_ready)
+        return;
+    stdev->is_model_cache_restored = true;
+    if (is_any_model_loaded(stdev))
+        return;
+    finish_recovery(stdev, RECOVERY_MODELS);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fd = open(MODEL_CACHE_FILE, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno != ENOENT)
+            ALOGW("%s: Can't open %s %d(%s)", __func__, MODEL_CACHE_FILE,
+                errno, strerror(errno));
+        return;
     }
 
-    if (stdev->is_chre_destroy_in_prog == true) {
-        ALOGE("%s: ERROR: Waited for %ds but we didn't get the event from "
-              "Host 1, and fw reset is not yet complete", __func__,
-              CHRE_CREATE_WAIT_TIME_IN_S * CHRE_CREATE_WAIT_MAX_COUNT);
-        err = -EAGAIN;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+        goto exit;
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        ALOGW("%s: mmap failed %d(%s)", __func__, errno, strerror(errno));
         goto exit;
     }
 
-    err = check_and_setup_buffer_package(stdev);
-    if (err != 0) {
-        ALOGE("%s: ERROR: Failed to load the buffer package", __func__);
+    entries = check_model_cache(map, st.st_size);
+    if (entries == NULL)
         goto exit;
-    }
 
-    // add chre to recover list
-    if (can_enable_chre(stdev)) {
-        if(stdev->is_chre_loaded == false) {
-            stdev->models[model_id].is_active = true;
-            handle_input_source(stdev, true);
-            setup_chre_package(stdev->odsp_hdl);
-            set_chre_audio_route(stdev->route_hdl,
-                               stdev->is_bargein_route_enabled);
-            stdev->is_chre_loaded = true;
-            stdev->current_enable = stdev->current_enable | CHRE_MASK;
-        }
-    } else {
-        ALOGW("%s: device is in call, setup CHRE for SLPI",
-              __func__);
-        //Setup CHRE package and allow SLPI connect
-        //during in-call mode.
-        if (stdev->is_chre_loaded == false) {
-            setup_chre_package(stdev->odsp_hdl);
-            stdev->models[model_id].uuid = stdev->chre_model_uuid;
-            stdev->is_chre_loaded = true;
-            stdev->current_enable = stdev->current_enable | CHRE_MASK;
-            if (can_update_recover_list(stdev) == true)
-                update_recover_list(stdev, model_id, true);
-        }
+    hdr = map;
+    for (i = 0; i < hdr->num_entries; i++) {
+        if (restore_cached_model(stdev, &entries[i], map) == 0)
+            num_restored++;
+        else
+            ALOGW("%s: Skipped cached model %u", __func__,
+                entries[i].handle);
     }
 
+    if (num_restored > 0 &&
+        arm_timer_ms(stdev->claim_timer_fd, MODEL_CACHE_CLAIM_TIMEOUT_MS) == 0)
+        stdev->claim_timer_armed = true;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ALOGI("%s: restored %u of %u models in %lld us", __func__, num_restored,
+        hdr->num_entries, timespec_diff_us(&end, &start));
+
 exit:
-    return err;
+    if (map != MAP_FAILED)
+        munmap(map, st.st_size);
+    close(fd);
 }
 
-static void destroy_chre_model(struct knowles_sound_trigger_device *stdev)
+/*
+ * A restored model is claimed when the framework loads the same UUID again,
+ * the blob is replaced if it changed in the meantime.
+ */
+static int claim_restored_model(struct knowles_sound_trigger_device *stdev,
+                                int handle,
+                                const struct sound_trigger_sound_model *sound_model,
+                                sound_model_callback_t callback,
+                                void *cookie)
 {
-    int err = 0;
-    ALOGD("+%s+", __func__);
-
-    if (stdev->is_chre_loaded == true) {
-        int i;
-        tear_chre_audio_route(stdev->route_hdl,
-                              stdev->is_bargein_route_enabled);
-        err = destroy_chre_package(stdev->odsp_hdl);
-        if (err != 0) {
-            ALOGE("%s: ERROR: Failed to destroy chre package", __func__);
+    struct model_info *model = &stdev->models[handle];
+    const unsigned char *kw_buffer =
+        (const unsigned char *)sound_model + sound_model->data_offset;
+    void *data;
+    int err;
+
+    if (model->data_sz != (int)sound_model->data_size ||
+        memcmp(model->data, kw_buffer, sound_model->data_size) != 0) {
+        ALOGI("%s: model %d changed while the HAL was down", __func__,
+            handle);
+        if (model->is_active) {
+            err = stop_recognition(stdev, handle);
+            if (err != 0)
+                return err;
         }
 
-        //Need force reset the flag for chre due to in-call state
-        //The model is inactive, but need to clean if user disable it
-        //during call.
-        for (i = 0; i < MAX_MODELS; i++) {
-            if (check_uuid_equality(stdev->models[i].uuid,
-                                    stdev->chre_model_uuid)) {
-                stdev->models[i].is_active = false;
-                stdev->models[i].is_loaded = false;
-                memset(&stdev->models[i].uuid, 0,
-                       sizeof(sound_trigger_uuid_t));
-                break;
-            }
-        }
-        handle_input_source(stdev, false);
-        stdev->is_chre_loaded = false;
-        stdev->current_enable = stdev->current_enable & ~CHRE_MASK;
+        data = malloc(sound_model->data_size);
+        if (data == NULL)
+            return -ENOMEM;
+        memcpy(data, kw_buffer, sound_model->data_size);
+        free(model->data);
+        model->data = data;
+        model->data_sz = sound_model->data_size;
+        schedule_model_cache_sync(stdev);
     }
 
-    stdev->is_chre_destroy_in_prog = false;
+    model->type = sound_model->type;
+    model->sound_model_callback = callback;
+    model->sound_model_cookie = cookie;
+    model->is_restored = false;
+    ALOGD("%s: model %d claimed, %s", __func__, handle,
+        model->is_active ? "already listening" : "inactive");
 
-    // setup the sensor route
-    err = check_and_destroy_buffer_package(stdev);
-    if (err != 0) {
-        ALOGE("%s: ERROR: Failed to destroy buffer package", __func__);
+    return 0;
+}
+
+// Restored models that the framework didn't ask for again are dropped
+static void drop_unclaimed_models(struct knowles_sound_trigger_device *stdev)
+{
+    struct model_info *model;
+    int i;
+
+    // Try again once the firmware is back
+    if (stdev->is_st_hal_ready == false) {
+        if (arm_timer_ms(stdev->claim_timer_fd,
+                        MODEL_CACHE_CLAIM_TIMEOUT_MS) == 0)
+            stdev->claim_timer_armed = true;
+        return;
     }
 
-    // There could be another thread waiting for us to destroy so signal that
-    // thread, if no one is waiting then this signal will have no effect
-    pthread_cond_signal(&stdev->chre_create);
+    for (i = 0; i < MAX_MODELS; i++) {
+        model = &stdev->models[i];
+        if (!model->is_restored)
+            continue;
 
-    ALOGD("-%s-", __func__);
+        ALOGI("%s: model %d wasn't claimed", __func__, i);
+        if (model->is_active)
+            stop_recognition(stdev, i);
+        if (is_uuid_in_recover_list(stdev, i))
+            update_recover_list(stdev, i, false);
+        free(model->data);
+        model->data = NULL;
+        model->data_sz = 0;
+        model->is_restored = false;
+        clear_model_desc(model);
+        schedule_model_cache_sync(stdev);
+    }
 }
 
-static void chre_timeout_recover()
+/*
+ * Sets up the mixer paths from the compiled route table, which is rebuilt
+ * from the XML if it's missing or stale.
+ */
+static struct mixer_route *init_audio_route(
+                                struct knowles_sound_trigger_device *stdev)
 {
-    int err = 0;
-    ALOGD("+%s+", __func__);
+    struct mixer_route *route_hdl;
+    struct timespec start, end;
+
+    startup_stage_begin(&stdev->startup, STARTUP_ROUTE);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (mkdir(STHAL_DATA_DIR, 0770) != 0 && errno != EEXIST)
+        ALOGW("%s: Can't create %s %d(%s)", __func__, STHAL_DATA_DIR, errno,
+            strerror(errno));
+    route_hdl = mixer_route_init(stdev->snd_crd_num, stdev->mixer_path_xml,
+                                ROUTE_TABLE_FILE);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    startup_stage_end(&stdev->startup, STARTUP_ROUTE);
+
+    if (route_hdl != NULL)
+        ALOGD("%s: route table %s in %lld us", __func__,
+            mixer_route_is_cached(route_hdl) ? "mapped" : "compiled",
+            timespec_diff_us(&end, &start));
+
+    return route_hdl;
+}
 
-    struct knowles_sound_trigger_device *stdev = &g_stdev;
-    pthread_mutex_lock(&stdev->lock);
-    // We are here because we timed out so check if we still need to destroy
-    // the chre package, if yes then reset the firmware
-    if (stdev->is_chre_destroy_in_prog == true) {
-        if (stdev->is_st_hal_ready) {
-            stdev->is_st_hal_ready = false;
-            // reset the firmware and wait for firmware download complete
-            err = reset_fw(stdev->odsp_hdl);
-            if (err == -1) {
-                ALOGE("%s: ERROR: Failed to reset the firmware %d(%s)",
-                      __func__, errno, strerror(errno));
+/*
+ * Called from the reactor with stdev->lock held, returns an error only if the
+ * callback thread can't carry on.
+ */
+static int handle_uevent(struct knowles_sound_trigger_device *stdev, int fd)
+{
+    char msg[UEVENT_MSG_LEN];
+    enum iaxxx_uevent uevent;
+    struct timespec detect_time;
+    int n;
+
+    n = uevent_kernel_multicast_recv(fd, msg, UEVENT_MSG_LEN);
+    if (n <= 0)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &detect_time);
+    uevent = parse_uevent(stdev, msg, n);
+    switch (uevent) {
+    case IAXXX_UEVENT_VQ:
+        ALOGI("%s", IAXXX_VQ_EVENT_STR);
+        drain_dsp_events(stdev, &detect_time);
+        break;
+    case IAXXX_UEVENT_RECOVERY: {
+        /* If the ST HAL did the firmware reset then that means
+         * that the userspace crashed so we need to reinit the audio
+         * route library, if we didn't reset the firmware, then it
+         * was genuine firmware crash and we don't need to reinit
+         * the audio route library.
+         */
+        if (stdev->fw_reset_done_by_hal == true) {
+            stdev->route_hdl = init_audio_route(stdev);
+            if (stdev->route_hdl == NULL) {
+                ALOGE("Failed to init the mixer routes");
+                return -EIO;
             }
-            reset_all_route(stdev->route_hdl);
-            chre_crash_handler(stdev);
+
+            stdev->fw_reset_done_by_hal = false;
+        }
+
+        ALOGD("Firmware has redownloaded, start the recovery");
+        reset_chip_snapshot(stdev->odsp_hdl);
+        int err = crash_recovery(stdev);
+        if (err != 0) {
+            ALOGE("Crash recovery failed");
         }
+        restore_model_cache(stdev);
+        break;
     }
-    pthread_mutex_unlock(&stdev->lock);
-    ALOGD("-%s-", __func__);
+    case IAXXX_UEVENT_FW_DWNLD_SUCCESS:
+        ALOGD("Firmware downloaded successfully");
+        reset_chip_snapshot(stdev->odsp_hdl);
+        set_hal_ready(stdev, true);
+        log_startup_timeline(&stdev->startup, "ready after firmware download");
+        set_default_apll_clk(stdev->mixer);
+        restore_model_cache(stdev);
+        break;
+    case IAXXX_UEVENT_FW_CRASH:
+        ALOGD("Firmware has crashed");
+        metric_add(stdev->metrics.fw_crashes, 1);
+        // Don't allow any op on ST HAL until recovery is complete
+        set_hal_ready(stdev, false);
+        cancel_recovery(stdev);
+        invalidate_chip_snapshot();
+        reset_all_route(stdev->route_hdl);
+        lock_strm(stdev);
+        stdev->is_streaming = 0;
+        release_lingering_tunnels(stdev);
+        unlock_strm(stdev);
+
+        // Firmware crashed, clear CHRE/Oslo timer and flags here
+        sensor_crash_handler(stdev);
+        chre_crash_handler(stdev);
+        break;
+    default:
+        break;
+    }
+
+    return 0;
 }
 
-static void *transitions_thread_loop(void *context)
+static int reactor_add(int epoll_fd, int fd, enum reactor_source source)
 {
-    struct knowles_sound_trigger_device *stdev =
-        (struct knowles_sound_trigger_device *)context;
+    struct epoll_event ev;
 
-    int err = 0;
-    pthread_mutex_lock(&stdev->lock);
-    while (1) {
-            if (stdev->transit_case == TRANSIT_NONE)
-                pthread_cond_wait(&stdev->transition_cond, &stdev->lock);
-
-            acquire_wake_lock(PARTIAL_WAKE_LOCK, WAKE_LOCK_NAME);
-            switch (stdev->transit_case) {
-                case TRANSIT_NONE:
-                    break;
-                case TRANSIT_SETUP_AEC:
-                    err = async_setup_aec(stdev);
-                    break;
-            }
-            stdev->transit_case = TRANSIT_NONE;
-            release_wake_lock(WAKE_LOCK_NAME);
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = source;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        int err = errno;
+
+        ALOGE("%s: Failed to add source %d %d(%s)",
+            __func__, source, err, strerror(err));
+        return -err;
     }
-    pthread_mutex_unlock(&stdev->lock);
-}
 
+    return 0;
+}
 
-static void *monitor_thread_loop(void *context)
+/*
+ * The firmware status can't be read until the driver has brought the chip
+ * up, which it announces with a uevent. Retry as soon as one arrives, and at
+ * least every RETRY_US, within the old RETRY_NUMBER * RETRY_US budget. A
+ * uevent consumed here is superseded by the status read right after it.
+ * Called with stdev->lock held, which is dropped while waiting. Returns
+ * -ECANCELED without the lock if stdev_close() asked us to terminate.
+ */
+static int wait_for_fw_status(struct knowles_sound_trigger_device *stdev,
+                            int uevent_fd, unsigned int *fw_status)
 {
-    struct knowles_sound_trigger_device *stdev =
-        (struct knowles_sound_trigger_device *)context;
-    struct timespec now;
-    double diff;
+    struct pollfd fds[2] = {
+        { .fd = uevent_fd, .events = POLLIN },
+        { .fd = stdev->term_fd, .events = POLLIN },
+    };
+    const long long deadline_us = (long long)RETRY_NUMBER * RETRY_US;
+    char msg[UEVENT_MSG_LEN];
+    struct timespec start, now;
+    long long elapsed_us, wait_us;
+    int err, n, attempts = 0, uevents = 0;
 
-    pthread_mutex_lock(&stdev->lock);
-    while (1) {
-            if (!stdev->is_streaming)
-                pthread_cond_wait(&stdev->tunnel_create, &stdev->lock);
-            pthread_mutex_unlock(&stdev->lock);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (;;) {
+        attempts++;
+        err = get_fw_status(stdev->odsp_hdl, fw_status);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed_us = timespec_diff_us(&now, &start);
+        if (err == 0)
+            break;
 
-            sleep(TUNNEL_TIMEOUT);
+        ALOGE("%s: ERROR: Failed to get the firmware status %d(%s)",
+            __func__, errno, strerror(errno));
+        if (elapsed_us >= deadline_us) {
+            ALOGE("%s: ERROR: No firmware status after %lld us, %d tries",
+                __func__, elapsed_us, attempts);
+            return -ETIMEDOUT;
+        }
 
-            pthread_mutex_lock(&stdev->lock);
+        wait_us = deadline_us - elapsed_us;
+        if (wait_us > RETRY_US)
+            wait_us = RETRY_US;
+        unlock_stdev(stdev);
+        n = poll(fds, 2, (int)(wait_us / 1000));
 
-            acquire_wake_lock(PARTIAL_WAKE_LOCK, WAKE_LOCK_NAME);
-            clock_gettime(CLOCK_REALTIME, &now);
-            for (int i = 0; i < MAX_MODELS; i++) {
-                if (stdev->adnc_strm_handle[i] != 0) {
-                    diff = (now.tv_sec - stdev->adnc_strm_last_read[i].tv_sec)
-                        + (double) ((now.tv_nsec) - (stdev->adnc_strm_last_read[i].tv_nsec))
-                          / 1000000000.0;
-
-                    if (diff > TUNNEL_TIMEOUT) {
-                        ALOGE("%s: Waiting timeout for %f sec", __func__, diff);
-                        stdev->adnc_strm_close(stdev->adnc_strm_handle[i]);
-                        stdev->adnc_strm_handle[i] = 0;
-                        stdev->is_streaming--;
-                        stdev->adnc_strm_last_read[i] = reset_time;
-                    }
-                }
-            }
-            release_wake_lock(WAKE_LOCK_NAME);
+        // stdev_close() holds the lock while it waits for us
+        if (n > 0 && (fds[1].revents & POLLIN)) {
+            consume_fd(stdev->term_fd);
+            return -ECANCELED;
+        }
+
+        lock_stdev(stdev);
+        if (n > 0 && (fds[0].revents & POLLIN)) {
+            uevent_kernel_multicast_recv(uevent_fd, msg, UEVENT_MSG_LEN);
+            uevents++;
+        }
     }
-    pthread_mutex_unlock(&stdev->lock);
+
+    ALOGI("%s: firmware status %u after %lld us, %d tries, %d uevents",
+        __func__, *fw_status, elapsed_us, attempts, uevents);
+
+    return 0;
 }
 
 static void *callback_thread_loop(void *context)
 {
     struct knowles_sound_trigger_device *stdev =
         (struct knowles_sound_trigger_device *)context;
-    struct pollfd fds[2];
-    char msg[UEVENT_MSG_LEN];
-    int exit_sockets[2];
+    struct epoll_event events[REACTOR_SOURCE_MAX];
+    struct model_cache_snapshot *cache_snap = NULL;
+    int uevent_fd = -1, epoll_fd = -1;
     int err = 0;
     int i, n;
-    int kwid = 0;
-    struct iaxxx_get_event_info ge;
-    void *payload = NULL;
-    unsigned int payload_size = 0, fw_status = IAXXX_FW_IDLE;
-    int fw_status_retries = 0;
+    unsigned int fw_status = IAXXX_FW_IDLE;
+    int source_fds[REACTOR_SOURCE_MAX];
 
     ALOGI("%s", __func__);
     prctl(PR_SET_NAME, (unsigned long)"sound trigger callback", 0, 0, 0);
 
-    pthread_mutex_lock(&stdev->lock);
+    lock_stdev(stdev);
 
-    if (socketpair(AF_UNIX, SOCK_STREAM, 0, exit_sockets) == -1) {
-        ALOGE("%s: Failed to create termination socket", __func__);
+    uevent_fd = uevent_open_socket(64*1024, true);
+    if (uevent_fd == -1) {
+        ALOGE("Error opening socket for hotplug uevent errno %d(%s)",
+            errno, strerror(errno));
         goto exit;
     }
+    attach_uevent_filter(stdev, uevent_fd);
 
-    stdev_close_term_sock(stdev);
-    stdev->send_sock = exit_sockets[0];
-    stdev->recv_sock = exit_sockets[1];
-
-    memset(fds, 0, 2 * sizeof(struct pollfd));
-    int timeout = -1; // Wait for event indefinitely
-    fds[0].events = POLLIN;
-    fds[0].fd = uevent_open_socket(64*1024, true);
-    if (fds[0].fd == -1) {
-        ALOGE("Error opening socket for hotplug uevent errno %d(%s)",
-            errno, strerror(errno));
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        ALOGE("%s: Failed to create epoll fd %d(%s)",
+            __func__, errno, strerror(errno));
         goto exit;
     }
-    fds[1].events = POLLIN;
-    fds[1].fd = stdev->recv_sock;
 
-    ge.event_id = -1;
+    source_fds[REACTOR_UEVENT] = uevent_fd;
+    source_fds[REACTOR_TERM] = stdev->term_fd;
+    source_fds[REACTOR_TRANSIT] = stdev->transit_fd;
+    source_fds[REACTOR_STEP] = stdev->step_fd;
+    source_fds[REACTOR_STRM_TIMER] = stdev->strm_timer_fd;
+    source_fds[REACTOR_SENSOR_TIMER] = stdev->ss_timer_fd;
+    source_fds[REACTOR_CHRE_TIMER] = stdev->chre_timer_fd;
+    source_fds[REACTOR_CACHE_SYNC] = stdev->cache_sync_fd;
+    source_fds[REACTOR_CLAIM_TIMER] = stdev->claim_timer_fd;
+    source_fds[REACTOR_RECOVERY] = stdev->recovery_fd;
+    for (i = 0; i < REACTOR_SOURCE_MAX; i++) {
+        err = reactor_add(epoll_fd, source_fds[i], i);
+        if (err != 0)
+            goto exit;
+    }
 
-    // Try to get the firmware status, if we fail, try for 10 times with a gap
-    // of 500ms, if we are unable to get the status after that then exit
-    do {
-        err = get_fw_status(stdev->odsp_hdl, &fw_status);
-        if (err == -1) {
-            ALOGE("%s: ERROR: Failed to get the firmware status %d(%s)",
-                    __func__, errno, strerror(errno));
-            usleep(RETRY_US);
-            fw_status_retries++;
-        }
-    } while (err != 0 && fw_status_retries < RETRY_NUMBER);
+    memset(&stdev->reactor_stats, 0, sizeof(stdev->reactor_stats));
+    clock_gettime(CLOCK_MONOTONIC, &stdev->reactor_stats.start);
 
-    if (err != 0) {
-        ALOGE("%s: ERROR: Failed to get firmware status after %d tries",
-                __func__, RETRY_NUMBER);
+    startup_stage_begin(&stdev->startup, STARTUP_FW_STATUS);
+    err = wait_for_fw_status(stdev, uevent_fd, &fw_status);
+    startup_stage_end(&stdev->startup, STARTUP_FW_STATUS);
+
+    if (err == -ECANCELED) {
+        ALOGD("%s: Terminated while waiting for the firmware", __func__);
+        goto terminate;
+    } else if (err != 0) {
+        log_startup_timeline(&stdev->startup, "no firmware status");
         goto exit;
     }
 
     if (fw_status == IAXXX_FW_ACTIVE) {
-        stdev->is_st_hal_ready = false;
+        // Reuse what the previous HAL instance left running if we can
+        startup_stage_begin(&stdev->startup, STARTUP_ATTACH);
+        if (warm_attach_fw(stdev->odsp_hdl) == 0)
+            fw_status = IAXXX_FW_IDLE;
+        startup_stage_end(&stdev->startup, STARTUP_ATTACH);
+    }
+
+    if (fw_status == IAXXX_FW_ACTIVE) {
+        set_hal_ready(stdev, false);
         // reset the firmware and wait for firmware download complete
         err = reset_fw(stdev->odsp_hdl);
         if (err == -1) {
@@ -2262,262 +5591,133 @@ static void *callback_thread_loop(void *context)
         stdev->fw_reset_done_by_hal = true;
     } else if (fw_status == IAXXX_FW_CRASH) {
         // Firmware has crashed wait till it recovers
-        stdev->is_st_hal_ready = false;
+        set_hal_ready(stdev, false);
     } else if (fw_status == IAXXX_FW_IDLE) {
-        stdev->route_hdl = audio_route_init(stdev->snd_crd_num,
-                                            stdev->mixer_path_xml);
+        stdev->route_hdl = init_audio_route(stdev);
         if (stdev->route_hdl == NULL) {
-            ALOGE("Failed to init the audio_route library");
+            ALOGE("Failed to init the mixer routes");
             goto exit;
         }
 
+        reset_chip_snapshot(stdev->odsp_hdl);
         set_default_apll_clk(stdev->mixer);
         setup_slpi_wakeup_event(stdev->odsp_hdl, true);
-        stdev->is_st_hal_ready = true;
+        set_hal_ready(stdev, true);
+        log_startup_timeline(&stdev->startup, "ready");
+        restore_model_cache(stdev);
     }
-    pthread_mutex_unlock(&stdev->lock);
+    unlock_stdev(stdev);
 
+    /*
+     * Single reactor for the whole HAL: kernel uevents, AEC transitions,
+     * tunnel read timeouts, sensor/CHRE destroy timeouts and termination.
+     */
     while (1) {
-        err = poll(fds, 2, timeout);
+        n = epoll_wait(epoll_fd, events, REACTOR_SOURCE_MAX, -1);
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        // Leave on a termination request without touching the HAL state,
+        // stdev_close() tears it down once we are joined
+        for (i = 0; i < n; i++) {
+            if (events[i].data.u32 == REACTOR_TERM) {
+                consume_fd(stdev->term_fd);
+                ALOGD("%s: Termination message", __func__);
+                goto terminate;
+            }
+        }
 
-        pthread_mutex_lock(&stdev->lock);
-        if (err < 0) {
-            ALOGE("%s: Error in poll: %d (%s)",
+        lock_stdev(stdev);
+        if (n < 0) {
+            ALOGE("%s: Error in epoll_wait: %d (%s)",
                 __func__, errno, strerror(errno));
+            err = -errno;
             break;
         }
 
-        if (fds[0].revents & POLLIN) {
-            n = uevent_kernel_multicast_recv(fds[0].fd, msg, UEVENT_MSG_LEN);
-            if (n <= 0) {
-                pthread_mutex_unlock(&stdev->lock);
-                continue;
-            }
-            for (i = 0; i < n;) {
-                if (strstr(msg + i, IAXXX_VQ_EVENT_STR)) {
-                    ALOGI("%s", IAXXX_VQ_EVENT_STR);
-
-                    err = get_event(stdev->odsp_hdl, &ge);
-                    if (err == 0) {
-                        if (ge.event_id == OK_GOOGLE_KW_ID) {
-                            ALOGD("Eventid received is OK_GOOGLE_KW_ID %d",
-                                OK_GOOGLE_KW_ID);
-                            kwid = OK_GOOGLE_KW_ID;
-                        } else if (ge.event_id == AMBIENT_KW_ID) {
-                            ALOGD("Eventid received is AMBIENT_KW_ID %d",
-                                AMBIENT_KW_ID);
-                            kwid = AMBIENT_KW_ID;
-                            reset_ambient_plugin(stdev->odsp_hdl);
-                        } else if (ge.event_id == OSLO_EP_DISCONNECT) {
-                            ALOGD("Eventid received is OSLO_EP_DISCONNECT %d",
-                                  OSLO_EP_DISCONNECT);
-                            if (stdev->is_sensor_destroy_in_prog == true) {
-                                // A timer would have been created during stop,
-                                // check and delete it
-                                if (stdev->ss_timer_created) {
-                                    timer_delete(stdev->ss_timer);
-                                    stdev->ss_timer_created = false;
-                                }
-
-                                destroy_sensor_model(stdev);
-                            } else {
-                                ALOGE("Unexpected OSLO_EP_DISCONNECT received"
-                                      ", ignoring..");
-                            }
-                            break;
-                        } else if (ge.event_id == CHRE_EP_DISCONNECT) {
-                            ALOGD("Eventid received is CHRE_EP_DISCONNECT %d",
-                                  CHRE_EP_DISCONNECT);
-                            if (stdev->is_chre_destroy_in_prog == true) {
-                                // A timer would have been created during stop,
-                                // check and delete it
-                                if (stdev->chre_timer_created) {
-                                    timer_delete(stdev->chre_timer);
-                                    stdev->chre_timer_created = false;
-                                }
-
-                                destroy_chre_model(stdev);
-                            } else {
-                                ALOGE("Unexpected CHRE_EP_DISCONNECT received"
-                                      ", ignoring..");
-                            }
-                            break;
-                        } else if (ge.event_id == ENTITY_KW_ID) {
-                            ALOGD("Eventid received is ENTITY_KW_ID %d",
-                                ENTITY_KW_ID);
-                            kwid = ENTITY_KW_ID;
-                        } else if (ge.event_id == WAKEUP_KW_ID) {
-                            ALOGD("Eventid received is WAKEUP_KW_ID %d",
-                                WAKEUP_KW_ID);
-                            kwid = WAKEUP_KW_ID;
-                        } else {
-                            ALOGE("Unknown event id received, ignoring %d",
-                                ge.event_id);
-                        }
-                        stdev->last_detected_model_type = kwid;
-                        break;
-                    } else {
-                        ALOGE("get_event failed with error %d", err);
-                    }
-                } else if (strstr(msg + i, IAXXX_RECOVERY_EVENT_STR)) {
-                    /* If the ST HAL did the firmware reset then that means
-                     * that the userspace crashed so we need to reinit the audio
-                     * route library, if we didn't reset the firmware, then it
-                     * was genuine firmware crash and we don't need to reinit
-                     * the audio route library.
-                     */
-                    if (stdev->fw_reset_done_by_hal == true) {
-                        stdev->route_hdl = audio_route_init(stdev->snd_crd_num,
-                                                            stdev->mixer_path_xml);
-                        if (stdev->route_hdl == NULL) {
-                            ALOGE("Failed to init the audio_route library");
-                            goto exit;
-                        }
-
-                        stdev->fw_reset_done_by_hal = false;
-                    }
+        stdev->reactor_stats.wakeups++;
+        for (i = 0; i < n; i++) {
+            enum reactor_source source = events[i].data.u32;
 
-                    ALOGD("Firmware has redownloaded, start the recovery");
-                    int err = crash_recovery(stdev);
-                    if (err != 0) {
-                        ALOGE("Crash recovery failed");
-                    }
-                } else if (strstr(msg + i, IAXXX_FW_DWNLD_SUCCESS_STR)) {
-                    ALOGD("Firmware downloaded successfully");
-                    stdev->is_st_hal_ready = true;
-                    set_default_apll_clk(stdev->mixer);
-                } else if (strstr(msg + i, IAXXX_FW_CRASH_EVENT_STR)) {
-                    ALOGD("Firmware has crashed");
-                    // Don't allow any op on ST HAL until recovery is complete
-                    stdev->is_st_hal_ready = false;
-                    reset_all_route(stdev->route_hdl);
-                    stdev->is_streaming = 0;
-
-                    // Firmware crashed, clear CHRE/Oslo timer and flags here
-                    sensor_crash_handler(stdev);
-                    chre_crash_handler(stdev);
+            stdev->reactor_stats.by_source[source]++;
+            switch (source) {
+            case REACTOR_UEVENT:
+                err = handle_uevent(stdev, uevent_fd);
+                if (err != 0)
+                    goto exit;
+                break;
+            case REACTOR_TRANSIT:
+                if (consume_fd(stdev->transit_fd))
+                    handle_transition(stdev);
+                break;
+            case REACTOR_STEP:
+                if (consume_fd(stdev->step_fd))
+                    handle_transition_step(stdev);
+                break;
+            case REACTOR_STRM_TIMER:
+                if (consume_fd(stdev->strm_timer_fd))
+                    check_stream_timeout(stdev);
+                break;
+            case REACTOR_SENSOR_TIMER:
+                if (consume_fd(stdev->ss_timer_fd) && stdev->ss_timer_armed) {
+                    stdev->ss_timer_armed = false;
+                    sensor_timeout_recover(stdev);
                 }
-
-                i += strlen(msg + i) + 1;
-            }
-
-            if (ge.event_id == OK_GOOGLE_KW_ID ||
-                ge.event_id == AMBIENT_KW_ID ||
-                ge.event_id == ENTITY_KW_ID ||
-                ge.event_id == WAKEUP_KW_ID) {
-                ALOGD("%s: Keyword ID %d", __func__, kwid);
-
-                if (ge.data != 0) {
-                    ALOGD("Size of payload is %d", ge.data);
-                    payload_size = ge.data;
-                    payload = malloc(payload_size);
-                    if (payload != NULL) {
-                        if (ge.event_id == AMBIENT_KW_ID ||
-                            ge.event_id == ENTITY_KW_ID)
-                            err = get_entity_param_blk(stdev->odsp_hdl,
-                                                    payload,
-                                                    payload_size);
-                        else if (ge.event_id == OK_GOOGLE_KW_ID ||
-                            ge.event_id == WAKEUP_KW_ID)
-                            err = get_wakeup_param_blk(stdev->odsp_hdl,
-                                                    payload,
-                                                    payload_size);
-                        if (err != 0) {
-                            ALOGE("Failed to get payload data");
-                            free(payload);
-                            payload = NULL;
-                            payload_size = 0;
-                        }
-                    } else {
-                        ALOGE("Failed to allocate memory for payload");
-                    }
+                break;
+            case REACTOR_CHRE_TIMER:
+                if (consume_fd(stdev->chre_timer_fd) &&
+                    stdev->chre_timer_armed) {
+                    stdev->chre_timer_armed = false;
+                    chre_timeout_recover(stdev);
                 }
-                int idx = find_handle_for_kw_id(stdev, kwid);
-                if (idx < MAX_MODELS && stdev->models[idx].is_active == true) {
-                    int recognition_status = RECOGNITION_STATUS_SUCCESS;
-                    if (stdev->models[idx].is_state_query == true) {
-                        recognition_status =
-                            RECOGNITION_STATUS_GET_STATE_RESPONSE;
-
-                        // We need to send this only once, so reset now
-                        stdev->models[idx].is_state_query = false;
-                    }
-                    if (stdev->models[idx].type == SOUND_MODEL_TYPE_KEYPHRASE) {
-                        struct sound_trigger_phrase_recognition_event *event;
-                        event = (struct sound_trigger_phrase_recognition_event*)
-                                    stdev_keyphrase_event_alloc(
-                                                stdev->models[idx].model_handle,
-                                                stdev->models[idx].config,
-                                                recognition_status);
-                        if (event) {
-                            struct model_info *model;
-                            model = &stdev->models[idx];
-
-                            ALOGD("Sending recognition callback for id %d",
-                                kwid);
-                            model->recognition_callback(&event->common,
-                                                    model->recognition_cookie);
-                            // Update the config so that it will be used
-                            // during the streaming
-                            stdev->last_keyword_detected_config = model->config;
-
-                            free(event);
-                        } else {
-                            ALOGE("Failed to allocate memory for the event");
-                        }
-                    } else if (stdev->models[idx].type == SOUND_MODEL_TYPE_GENERIC) {
-                        struct sound_trigger_generic_recognition_event *event;
-                        event = (struct sound_trigger_generic_recognition_event*)
-                                stdev_generic_event_alloc(
-                                            stdev->models[idx].model_handle,
-                                            payload,
-                                            payload_size,
-                                            recognition_status);
-                        if (event) {
-                            struct model_info *model;
-                            model = &stdev->models[idx];
-
-                            ALOGD("Sending recognition callback for id %d",
-                                kwid);
-                            model->recognition_callback(&event->common,
-                                                    model->recognition_cookie);
-                            // Update the config so that it will be used
-                            // during the streaming
-                            stdev->last_keyword_detected_config = model->config;
-
-                            free(event);
-                        } else {
-                            ALOGE("Failed to allocate memory for the event");
-                        }
-                    }
-                } else {
-                    ALOGE("Invalid id or keyword is not active, Subsume the event");
+                break;
+            case REACTOR_CACHE_SYNC:
+                // Written below, once the lock is dropped
+                if (consume_fd(stdev->cache_sync_fd) && cache_snap == NULL)
+                    cache_snap = take_model_cache_snapshot(stdev);
+                break;
+            case REACTOR_CLAIM_TIMER:
+                if (consume_fd(stdev->claim_timer_fd) &&
+                    stdev->claim_timer_armed) {
+                    stdev->claim_timer_armed = false;
+                    drop_unclaimed_models(stdev);
                 }
-                // Reset all event related data
-                ge.event_id = -1;
-                ge.data = 0;
-                kwid = -1;
-            }
-            // Free the payload data
-            if (payload) {
-                free(payload);
-                payload = NULL;
-                payload_size = 0;
+                break;
+            case REACTOR_RECOVERY:
+                if (consume_fd(stdev->recovery_fd))
+                    handle_recovery_stage(stdev);
+                break;
+            default:
+                ALOGI("%s: Message ignored", __func__);
+                break;
             }
-        } else if (fds[1].revents & POLLIN) {
-            read(fds[1].fd, &n, sizeof(n)); /* clear the socket */
-            ALOGD("%s: Termination message", __func__);
-            break;
+
+            // A firmware crash or reset leaves nothing to roll back
+            if (stdev->is_st_hal_ready == false)
+                abort_transition(stdev);
         }
-        else {
-            ALOGI("%s: Message ignored", __func__);
+
+        if (stdev->reactor_stats.wakeups % REACTOR_STATS_LOG_INTERVAL == 0)
+            log_reactor_stats(stdev);
+        unlock_stdev(stdev);
+
+        if (cache_snap != NULL) {
+            write_model_cache(cache_snap);
+            cache_snap = NULL;
         }
-        pthread_mutex_unlock(&stdev->lock);
     }
 
 exit:
-    stdev_close_term_sock(stdev);
-    pthread_mutex_unlock(&stdev->lock);
+    unlock_stdev(stdev);
+    if (cache_snap != NULL)
+        write_model_cache(cache_snap);
+
+terminate:
+    log_reactor_stats(stdev);
+    if (epoll_fd >= 0)
+        close(epoll_fd);
+    if (uevent_fd >= 0)
+        close(uevent_fd);
 
     return (void *)(long)err;
 }
@@ -2534,80 +5734,6 @@ static int stdev_get_properties(
     return 0;
 }
 
-static int stop_recognition(struct knowles_sound_trigger_device *stdev,
-                            sound_model_handle_t handle)
-{
-    int status = 0;
-    struct model_info *model = &stdev->models[handle];
-
-    if (stdev->is_st_hal_ready == false) {
-        ALOGE("%s: ST HAL is not ready yet", __func__);
-        status = -EAGAIN;
-        goto exit;
-    }
-
-    if (model->config != NULL) {
-        dereg_hal_event_session(model->config, handle);
-        free(model->config);
-        model->config = NULL;
-    }
-
-    model->recognition_callback = NULL;
-    model->recognition_cookie = NULL;
-    if (check_uuid_equality(model->uuid, stdev->chre_model_uuid) ||
-        check_uuid_equality(model->uuid, stdev->sensor_model_uuid)) {
-        // This avoids any processing of chre/oslo.
-        goto exit;
-    }
-    if (can_update_recover_list(stdev) == true) {
-        update_recover_list(stdev, handle, false);
-        model->is_active = false;
-        goto exit;
-    }
-
-    if (stdev->adnc_strm_handle[handle] != 0) {
-        ALOGD("%s: stop tunnling for index:%d", __func__, handle);
-        stdev->adnc_strm_close(stdev->adnc_strm_handle[handle]);
-        stdev->adnc_strm_handle[handle] = 0;
-        stdev->is_streaming--;
-        stdev->adnc_strm_last_read[handle] = reset_time;
-    }
-
-    model->is_active = false;
-
-    tear_package_route(stdev, model->uuid, stdev->is_bargein_route_enabled);
-
-    destroy_package(stdev, model);
-
-
-    if (check_uuid_equality(model->uuid, stdev->hotword_model_uuid) ||
-        (check_uuid_equality(model->uuid, stdev->wakeup_model_uuid))) {
-        if ((stdev->hotword_buffer_enable) &&
-            !(stdev->current_enable & PLUGIN1_MASK)) {
-            tear_hotword_buffer_route(stdev->route_hdl,
-                                    stdev->is_bargein_route_enabled);
-        }
-    }
-
-    if (check_uuid_equality(model->uuid, stdev->ambient_model_uuid) ||
-        (check_uuid_equality(model->uuid, stdev->entity_model_uuid))) {
-        if ((stdev->music_buffer_enable) &&
-            !(stdev->current_enable & PLUGIN2_MASK)) {
-            tear_music_buffer_route(stdev->route_hdl,
-                                stdev->is_bargein_route_enabled);
-        }
-    }
-
-    setup_buffer(stdev, model, false);
-
-    handle_input_source(stdev, false);
-
-    check_and_destroy_buffer_package(stdev);
-
-exit:
-    return status;
-}
-
 static int stdev_load_sound_model(const struct sound_trigger_hw_device *dev,
                                 struct sound_trigger_sound_model *sound_model,
                                 sound_model_callback_t callback,
@@ -2619,11 +5745,14 @@ static int stdev_load_sound_model(const struct sound_trigger_hw_device *dev,
     int ret = 0;
     int kw_model_sz = 0;
     int i = 0;
+    const struct model_desc *desc = NULL;
+    bool was_sensor_enabled = false;
 
     unsigned char *kw_buffer = NULL;
 
     ALOGD("+%s+", __func__);
-    pthread_mutex_lock(&stdev->lock);
+    lock_stdev(stdev);
+    wait_for_transition(stdev);
 
     if (stdev->is_st_hal_ready == false) {
         ALOGE("%s: ST HAL is not ready yet", __func__);
@@ -2644,18 +5773,44 @@ static int stdev_load_sound_model(const struct sound_trigger_hw_device *dev,
         goto exit;
     }
 
+    desc = find_model_desc(stdev, sound_model->vendor_uuid);
+    finish_recovery(stdev, recovery_stage_for(desc));
+
     // When a delayed CHRE/Oslo destroy process is in progress,
     // we should not skip the new model and return the existing handle
     // which will be destroyed soon.
-    if ((check_uuid_equality(sound_model->vendor_uuid,
-                             stdev->chre_model_uuid) &&
+    if ((desc != NULL && desc->kind == MODEL_KIND_CHRE &&
             stdev->is_chre_destroy_in_prog) ||
-            (check_uuid_equality(sound_model->vendor_uuid,
-                                 stdev->sensor_model_uuid) &&
+            (desc != NULL && desc->kind == MODEL_KIND_SENSOR &&
             stdev->is_sensor_destroy_in_prog)) {
         ALOGD("%s: CHRE/Oslo destroy in progress, skipped handle check.",
               __func__);
     } else {
+        i = find_handle_for_uuid(stdev, sound_model->vendor_uuid);
+        if (i != -1 && stdev->models[i].is_restored) {
+            ret = claim_restored_model(stdev, i, sound_model, callback,
+                                    cookie);
+            if (ret == 0)
+                *handle = i;
+            goto exit;
+        } else if (i != -1) {
+            ALOGW("%s: model is existed at index %d", __func__, i);
+            *handle = i;
+            goto exit;
+        }
+    }
+
+    /*
+     * The sensor setup drops stdev->lock, so it goes before a slot is taken.
+     * Another load of the same model may have finished in the meantime.
+     */
+    if (desc != NULL && desc->kind == MODEL_KIND_SENSOR) {
+        was_sensor_enabled = stdev->is_sensor_route_enabled;
+        ret = start_sensor_model(stdev);
+        if (ret) {
+            ALOGE("%s: ERROR: Failed to start sensor model", __func__);
+            goto sensor_error;
+        }
         i = find_handle_for_uuid(stdev, sound_model->vendor_uuid);
         if (i != -1) {
             ALOGW("%s: model is existed at index %d", __func__, i);
@@ -2669,7 +5824,7 @@ static int stdev_load_sound_model(const struct sound_trigger_hw_device *dev,
     if (i == -1) {
         ALOGE("%s: Can't load model no free slots available", __func__);
         ret = -ENOSYS;
-        goto exit;
+        goto sensor_error;
     }
 
     kw_buffer = (unsigned char *) sound_model + sound_model->data_offset;
@@ -2682,46 +5837,25 @@ static int stdev_load_sound_model(const struct sound_trigger_hw_device *dev,
         ALOGE("%s: could not allocate memory for keyword model data",
             __func__);
         ret = -ENOMEM;
-        goto exit;
+        goto sensor_error;
     } else {
         memcpy(stdev->models[i].data, kw_buffer, kw_model_sz);
         stdev->models[i].data_sz = kw_model_sz;
     }
 
     // Send the keyword model to the chip only for hotword and ambient audio
-    if (check_uuid_equality(sound_model->vendor_uuid,
-                            stdev->hotword_model_uuid)) {
-        stdev->models[i].kw_id = OK_GOOGLE_KW_ID;
-    } else if (check_uuid_equality(sound_model->vendor_uuid,
-                                stdev->wakeup_model_uuid)) {
-        stdev->models[i].kw_id = WAKEUP_KW_ID;
-    } else if (check_uuid_equality(sound_model->vendor_uuid,
-                                stdev->ambient_model_uuid)) {
-        stdev->models[i].kw_id = AMBIENT_KW_ID;
-    } else if (check_uuid_equality(sound_model->vendor_uuid,
-                                stdev->entity_model_uuid)) {
-        stdev->models[i].kw_id = ENTITY_KW_ID;
-    } else if (check_uuid_equality(sound_model->vendor_uuid,
-                                stdev->sensor_model_uuid)) {
-        ret = start_sensor_model(stdev);
-        if (ret) {
-            ALOGE("%s: ERROR: Failed to start sensor model", __func__);
-            goto error;
-        }
-        stdev->models[i].kw_id = USELESS_KW_ID;
-    } else if (check_uuid_equality(sound_model->vendor_uuid,
-                                stdev->chre_model_uuid)) {
+    if (desc == NULL) {
+        ALOGE("%s: ERROR: unknown keyword model file", __func__);
+        ret = -EINVAL;
+        goto error;
+    } else if (desc->kind == MODEL_KIND_CHRE) {
         ret = start_chre_model(stdev, i);
         if (ret) {
             ALOGE("%s: ERROR: Failed to start chre model", __func__);
             goto error;
         }
-        stdev->models[i].kw_id = USELESS_KW_ID;
-    } else {
-        ALOGE("%s: ERROR: unknown keyword model file", __func__);
-        ret = -EINVAL;
-        goto error;
     }
+    stdev->models[i].kw_id = desc->kw_id;
 
     *handle = i;
     ALOGV("%s: Loading keyword model handle(%d) type(%d)", __func__,
@@ -2730,20 +5864,27 @@ static int stdev_load_sound_model(const struct sound_trigger_hw_device *dev,
     stdev->models[i].model_handle = *handle;
     stdev->models[i].type = sound_model->type;
     stdev->models[i].uuid = sound_model->vendor_uuid;
+    stdev->models[i].desc = desc;
     stdev->models[i].sound_model_callback = callback;
     stdev->models[i].sound_model_cookie = cookie;
     stdev->models[i].recognition_callback = NULL;
     stdev->models[i].recognition_cookie = NULL;
 
     stdev->models[i].is_loaded = true;
+    if (is_model_cacheable(&stdev->models[i]))
+        schedule_model_cache_sync(stdev);
 
 error:
+    if (ret != 0 && stdev->models[i].data) {
+        free(stdev->models[i].data);
+        stdev->models[i].data = NULL;
+        stdev->models[i].data_sz = 0;
+    }
+
+sensor_error:
     if (ret != 0) {
-        if (stdev->models[i].data) {
-            free(stdev->models[i].data);
-            stdev->models[i].data = NULL;
-            stdev->models[i].data_sz = 0;
-        }
+        if (!was_sensor_enabled && stdev->is_sensor_route_enabled)
+            destroy_sensor_model(stdev);
         if (!is_any_model_loaded(stdev) && stdev->is_buffer_package_loaded) {
             destroy_buffer_package(stdev->odsp_hdl);
             stdev->is_buffer_package_loaded = false;
@@ -2751,7 +5892,7 @@ error:
     }
 
 exit:
-    pthread_mutex_unlock(&stdev->lock);
+    unlock_stdev(stdev);
     ALOGD("-%s handle %d-", __func__, *handle);
     return ret;
 }
@@ -2763,7 +5904,9 @@ static int stdev_unload_sound_model(const struct sound_trigger_hw_device *dev,
         (struct knowles_sound_trigger_device *)dev;
     int ret = 0;
     ALOGD("+%s handle %d+", __func__, handle);
-    pthread_mutex_lock(&stdev->lock);
+    lock_stdev(stdev);
+    wait_for_transition(stdev);
+    finish_recovery(stdev, recovery_stage_for(stdev->models[handle].desc));
 
     if (stdev->is_st_hal_ready == false) {
         ALOGE("%s: ST HAL is not ready yet", __func__);
@@ -2785,102 +5928,49 @@ static int stdev_unload_sound_model(const struct sound_trigger_hw_device *dev,
             goto exit;
     }
 
-    if (check_uuid_equality(stdev->models[handle].uuid,
-                                stdev->sensor_model_uuid)) {
+    if (is_model_type(&stdev->models[handle], ST_MODEL_SENSOR)) {
         // Inform the Host 1 that sensor route/packages are about to be
         // torndown and then wait for confirmation from Host 1 that it can be
         // torndown. Also start a timer for 5 seconds, if the Host 1 doesn't
         // send us the event within 5 seconds we force remove the sensor pkgs
         if (stdev->is_sensor_route_enabled == true) {
-            struct itimerspec ss_timer_spec;
-            struct sigevent ss_sigevent;
-
             // Inform the host 1
             stdev->is_sensor_destroy_in_prog = true;
             trigger_sensor_destroy_event(stdev->odsp_hdl);
 
-            // Start timer for 5 seconds
-            ss_sigevent.sigev_notify = SIGEV_THREAD;
-            ss_sigevent.sigev_notify_function = sensor_timeout_recover;
-            ss_sigevent.sigev_notify_attributes = NULL;
-
-            ss_timer_spec.it_interval.tv_sec = 0;
-            ss_timer_spec.it_interval.tv_nsec = 0;
-            ss_timer_spec.it_value.tv_sec =
-                    SENSOR_CREATE_WAIT_TIME_IN_S * SENSOR_CREATE_WAIT_MAX_COUNT;
-            ss_timer_spec.it_value.tv_nsec = 0;
-
-            if (stdev->ss_timer_created) {
-                timer_delete(stdev->ss_timer);
-                stdev->ss_timer_created = false;
-            }
-
-            if (timer_create(CLOCK_REALTIME,
-                             &ss_sigevent, &stdev->ss_timer) == -1) {
-                ALOGE("%s: Timer Create Failed", __func__);
-            } else {
-                stdev->ss_timer_created = true;
-                if (timer_settime(stdev->ss_timer,
-                                  0, &ss_timer_spec, NULL) == -1) {
-                    ALOGE("%s: Timer Set Failed", __func__);
-                }
-            }
+            // Start timer for 5 seconds, handled by the reactor
+            if (arm_timer_ms(stdev->ss_timer_fd,
+                    SENSOR_CREATE_WAIT_TIME_IN_S *
+                    SENSOR_CREATE_WAIT_MAX_COUNT * 1000) == 0)
+                stdev->ss_timer_armed = true;
         }
-    } else if (check_uuid_equality(stdev->models[handle].uuid,
-                                   stdev->chre_model_uuid)) {
+    } else if (is_model_type(&stdev->models[handle], ST_MODEL_CHRE)) {
         // remove chre from recover list
         if (can_update_recover_list(stdev) == true)
             update_recover_list(stdev, handle, false);
 
          // Disable the CHRE route
         if (stdev->is_chre_loaded == true) {
-            struct itimerspec chre_timer_spec;
-            struct sigevent chre_sigevent;
-
             // Inform the host 1
             stdev->is_chre_destroy_in_prog = true;
             trigger_chre_destroy_event(stdev->odsp_hdl);
 
-            // Start timer for 5 seconds
-            chre_sigevent.sigev_notify = SIGEV_THREAD;
-            chre_sigevent.sigev_notify_function = chre_timeout_recover;
-            chre_sigevent.sigev_notify_attributes = NULL;
-
-            chre_timer_spec.it_interval.tv_sec = 0;
-            chre_timer_spec.it_interval.tv_nsec = 0;
-            chre_timer_spec.it_value.tv_sec =
-                    CHRE_CREATE_WAIT_TIME_IN_S * CHRE_CREATE_WAIT_MAX_COUNT;
-            chre_timer_spec.it_value.tv_nsec = 0;
-
-            if (stdev->chre_timer_created) {
-                timer_delete(stdev->chre_timer);
-                stdev->chre_timer_created = false;
-            }
-
-            if (timer_create(CLOCK_REALTIME,
-                             &chre_sigevent, &stdev->chre_timer) == -1) {
-                ALOGE("%s: Timer Create Failed", __func__);
-            } else {
-                stdev->chre_timer_created = true;
-                if (timer_settime(stdev->chre_timer,
-                                  0, &chre_timer_spec, NULL) == -1) {
-                    ALOGE("%s: Timer Set Failed", __func__);
-                }
-            }
+            // Start timer for 5 seconds, handled by the reactor
+            if (arm_timer_ms(stdev->chre_timer_fd,
+                    CHRE_CREATE_WAIT_TIME_IN_S *
+                    CHRE_CREATE_WAIT_MAX_COUNT * 1000) == 0)
+                stdev->chre_timer_armed = true;
         }
     }
 
     stdev->models[handle].sound_model_callback = NULL;
     stdev->models[handle].sound_model_cookie = NULL;
 
-    if (!(check_uuid_equality(stdev->models[handle].uuid,
-                              stdev->sensor_model_uuid) &&
+    if (!(is_model_type(&stdev->models[handle], ST_MODEL_SENSOR) &&
             stdev->is_sensor_destroy_in_prog) &&
-        !(check_uuid_equality(stdev->models[handle].uuid,
-                              stdev->chre_model_uuid) &&
+        !(is_model_type(&stdev->models[handle], ST_MODEL_CHRE) &&
             stdev->is_chre_destroy_in_prog)) {
-        memset(&stdev->models[handle].uuid, 0, sizeof(sound_trigger_uuid_t));
-        stdev->models[handle].is_loaded = false;
+        clear_model_desc(&stdev->models[handle]);
     }
 
     if (stdev->models[handle].data) {
@@ -2889,10 +5979,15 @@ static int stdev_unload_sound_model(const struct sound_trigger_hw_device *dev,
         stdev->models[handle].data_sz = 0;
     }
 
+    stdev->models[handle].is_restored = false;
+    schedule_model_cache_sync(stdev);
+
     ALOGD("%s: Successfully unloaded the model, handle - %d",
         __func__, handle);
 exit:
-    pthread_mutex_unlock(&stdev->lock);
+    unlock_stdev(stdev);
+    if (ret == 0)
+        wait_for_delivery(stdev, handle);
     ALOGD("-%s handle %d-", __func__, handle);
     return ret;
 }
@@ -2911,7 +6006,9 @@ static int stdev_start_recognition(
 
     ALOGD("%s stdev %p, sound model %d", __func__, stdev, handle);
 
-    pthread_mutex_lock(&stdev->lock);
+    lock_stdev(stdev);
+    wait_for_transition(stdev);
+    finish_recovery(stdev, recovery_stage_for(model->desc));
 
     if (stdev->is_st_hal_ready == false) {
         ALOGE("%s: ST HAL is not ready yet", __func__);
@@ -2927,19 +6024,12 @@ static int stdev_start_recognition(
 
     if (model->config != NULL) {
         dereg_hal_event_session(model->config, handle);
-        free(model->config);
         model->config = NULL;
     }
 
     if (config != NULL) {
-        model->config = (struct sound_trigger_recognition_config *)
-                            malloc(sizeof(*config));
-        if (model->config == NULL) {
-            ALOGE("%s: Failed to allocate memory for model config", __func__);
-            status = -ENOMEM;
-            goto exit;
-        }
-
+        // Reuse the per-model copy instead of allocating one per start
+        model->config = &model->config_storage;
         memcpy(model->config, config, sizeof(*config));
         reg_hal_event_session(model->config, handle);
 
@@ -2949,17 +6039,19 @@ static int stdev_start_recognition(
         ALOGD("%s: config is null", __func__);
         model->config = NULL;
     }
+    update_capture_map(stdev, handle);
 
     model->recognition_callback = callback;
     model->recognition_cookie = cookie;
-    if (check_uuid_equality(model->uuid, stdev->chre_model_uuid) ||
-        check_uuid_equality(model->uuid, stdev->sensor_model_uuid)) {
+    if (!is_model_kind(model, MODEL_KIND_KEYWORD)) {
         // This avoids any processing of chre/oslo.
         goto exit;
     }
+    schedule_model_cache_sync(stdev);
     if (model->is_active == true) {
         // This model is already active, do nothing except updating callbacks,
         // configs and cookie
+        deliver_held_detection(stdev, model);
         goto exit;
     }
     if (can_update_recover_list(stdev) == true) {
@@ -2969,46 +6061,10 @@ static int stdev_start_recognition(
         goto exit;
     }
 
-    status = check_and_setup_buffer_package(stdev);
-    if (status != 0) {
-        ALOGE("%s: ERROR: Failed to load the buffer package", __func__);
-        goto exit;
-    }
-
-    model->is_active = true;
-
-    handle_input_source(stdev, true);
-
-    if (stdev->is_buffer_package_loaded == true) {
-        setup_buffer(stdev, model, true);
-    }
-
-    if (check_uuid_equality(model->uuid, stdev->hotword_model_uuid) ||
-        (check_uuid_equality(model->uuid, stdev->wakeup_model_uuid))) {
-        if ((stdev->hotword_buffer_enable) &&
-            (!(stdev->current_enable & HOTWORD_MASK) ||
-              (stdev->current_enable & WAKEUP_MASK))) {
-            set_hotword_buffer_route(stdev->route_hdl,
-                                    stdev->is_bargein_route_enabled);
-        }
-    }
-
-    if (check_uuid_equality(model->uuid, stdev->ambient_model_uuid) ||
-        (check_uuid_equality(model->uuid, stdev->entity_model_uuid))) {
-        if ((stdev->music_buffer_enable) &&
-            (!(stdev->current_enable & AMBIENT_MASK) ||
-              (stdev->current_enable & ENTITY_MASK))) {
-            set_music_buffer_route(stdev->route_hdl,
-                                stdev->is_bargein_route_enabled);
-        }
-    }
-
-    setup_package(stdev, model);
-
-    set_package_route(stdev, model->uuid, stdev->is_bargein_route_enabled);
+    status = activate_model(stdev, model);
 
 exit:
-    pthread_mutex_unlock(&stdev->lock);
+    unlock_stdev(stdev);
     ALOGD("-%s sound model %d-", __func__, handle);
     return status;
 }
@@ -3020,7 +6076,9 @@ static int stdev_stop_recognition(
     struct knowles_sound_trigger_device *stdev =
         (struct knowles_sound_trigger_device *)dev;
     int status = 0;
-    pthread_mutex_lock(&stdev->lock);
+    lock_stdev(stdev);
+    wait_for_transition(stdev);
+    finish_recovery(stdev, recovery_stage_for(stdev->models[handle].desc));
     ALOGD("+%s sound model %d+", __func__, handle);
 
     status = stop_recognition(stdev, handle);
@@ -3028,9 +6086,16 @@ static int stdev_stop_recognition(
     if (status != 0)
         goto exit;
 
+    if (is_model_kind(&stdev->models[handle], MODEL_KIND_KEYWORD))
+        schedule_model_cache_sync(stdev);
+
     ALOGD("-%s sound model %d-", __func__, handle);
 exit:
-    pthread_mutex_unlock(&stdev->lock);
+    unlock_stdev(stdev);
+
+    // No callback of this session may run once we return
+    if (status == 0)
+        wait_for_delivery(stdev, handle);
 
     return status;
 }
@@ -3055,7 +6120,9 @@ static int stdev_get_model_state(const struct sound_trigger_hw_device *dev,
     struct model_info *model = &stdev->models[sound_model_handle];
     int ret = 0;
     ALOGD("+%s+", __func__);
-    pthread_mutex_lock(&stdev->lock);
+    lock_stdev(stdev);
+    wait_for_transition(stdev);
+    finish_recovery(stdev, recovery_stage_for(model->desc));
 
     if (!stdev->opened) {
         ALOGE("%s: stdev isn't initialized", __func__);
@@ -3085,18 +6152,9 @@ static int stdev_get_model_state(const struct sound_trigger_hw_device *dev,
 
     model->is_state_query = true;
 
-    if (check_uuid_equality(model->uuid, stdev->hotword_model_uuid))
-        ret = get_model_state(stdev->odsp_hdl, HOTWORD_INSTANCE_ID,
-                            HOTWORD_SLOT_ID);
-    else if (check_uuid_equality(model->uuid, stdev->wakeup_model_uuid))
-        ret = get_model_state(stdev->odsp_hdl, HOTWORD_INSTANCE_ID,
-                            WAKEUP_SLOT_ID);
-    else if (check_uuid_equality(model->uuid, stdev->ambient_model_uuid))
-        ret = get_model_state(stdev->odsp_hdl, AMBIENT_INSTANCE_ID,
-                            AMBIENT_SLOT_ID);
-    else if (check_uuid_equality(model->uuid, stdev->entity_model_uuid)) {
-        ret = get_model_state(stdev->odsp_hdl, AMBIENT_INSTANCE_ID,
-                            ENTITY_SLOT_ID);
+    if (is_model_kind(model, MODEL_KIND_KEYWORD)) {
+        ret = get_model_state(stdev->odsp_hdl, model->desc->plugin->inst_id,
+                            model->desc->slot_id);
     } else {
         ALOGE("%s: ERROR: %d model is not supported",
             __func__, sound_model_handle);
@@ -3109,7 +6167,7 @@ static int stdev_get_model_state(const struct sound_trigger_hw_device *dev,
     }
 
 exit:
-    pthread_mutex_unlock(&stdev->lock);
+    unlock_stdev(stdev);
     ALOGD("-%s-", __func__);
     return ret;
 }
@@ -3118,9 +6176,10 @@ static int stdev_close(hw_device_t *device)
 {
     struct knowles_sound_trigger_device *stdev =
         (struct knowles_sound_trigger_device *)device;
+    struct model_cache_snapshot *cache_snap = NULL;
     int ret = 0;
     ALOGD("+%s+", __func__);
-    pthread_mutex_lock(&stdev->lock);
+    lock_stdev(stdev);
 
     if (!stdev->opened) {
         ALOGE("%s: device already closed", __func__);
@@ -3134,26 +6193,56 @@ static int stdev_close(hw_device_t *device)
         goto exit;
     }
 
+    // Don't leave the chip half way through a barge-in transition
+    wait_for_transition(stdev);
+    finish_recovery(stdev, RECOVERY_OSLO);
+
     setup_slpi_wakeup_event(stdev->odsp_hdl, false);
 
     stdev->opened = false;
+    stdev->is_closing = true;
+
+    if (stdev->term_fd >= 0)
+        signal_reactor(stdev->term_fd);
 
-    if (stdev->send_sock >= 0)
-        write(stdev->send_sock, "T", 1);
+    /*
+     * The delivery thread runs the framework callbacks, which may call back
+     * into the HAL and take the lock, so the threads are joined without it.
+     */
+    unlock_stdev(stdev);
     pthread_join(stdev->callback_thread, (void **)NULL);
+    if (stdev->is_strm_lib_loading) {
+        pthread_join(stdev->strm_lib_thread, (void **)NULL);
+        stdev->is_strm_lib_loading = false;
+    }
+    stop_delivery_thread(stdev);
+    stop_prefill_thread(stdev);
+    lock_stdev(stdev);
+
+    stdev->is_closing = false;
+    cache_snap = take_model_cache_snapshot(stdev);
+
+    lock_strm(stdev);
+    release_lingering_tunnels(stdev);
+    unlock_strm(stdev);
 
     if (stdev->route_hdl)
-        audio_route_free(stdev->route_hdl);
+        mixer_route_free(stdev->route_hdl);
     if (stdev->odsp_hdl)
         iaxxx_odsp_deinit(stdev->odsp_hdl);
 
-    if (stdev->ss_timer_created) {
-        timer_delete(stdev->ss_timer);
-        stdev->ss_timer_created = false;
-    }
+    stdev->ss_timer_armed = false;
+    stdev->chre_timer_armed = false;
+    stdev->claim_timer_armed = false;
+    stdev_close_reactor_fds(stdev);
 
 exit:
-    pthread_mutex_unlock(&stdev->lock);
+    unlock_stdev(stdev);
+    if (cache_snap != NULL)
+        write_model_cache(cache_snap);
+    // A profiled session leaves its lock profile in the log
+    if (stdev->lock_prof.is_enabled)
+        stdev_dump_lock_profile(-1);
     ALOGD("-%s-", __func__);
     return ret;
 }
@@ -3172,44 +6261,53 @@ audio_io_handle_t stdev_get_audio_handle()
     return g_stdev.last_keyword_detected_config->capture_handle;
 }
 
-static int open_streaming_lib(struct knowles_sound_trigger_device *stdev) {
-    int ret = 0;
+/*
+ * Writes the lock profile of lock and strm_lock to fd, or to the log if fd
+ * is negative. Must not be called from within the HAL.
+ */
+__attribute__ ((visibility ("default")))
+void stdev_dump_lock_profile(int fd)
+{
+    lock_profile_dump(&g_stdev.lock_prof, fd);
+    lock_profile_dump(&g_stdev.strm_lock_prof, fd);
+}
 
-    if (access(ADNC_STRM_LIBRARY_PATH, R_OK) == 0) {
-        stdev->adnc_cvq_strm_lib = dlopen(ADNC_STRM_LIBRARY_PATH, RTLD_NOW);
-        if (stdev->adnc_cvq_strm_lib == NULL) {
-            char const *err_str = dlerror();
-            ALOGE("%s: module = %s error = %s", __func__,
-                ADNC_STRM_LIBRARY_PATH, err_str ? err_str : "unknown");
-            ALOGE("%s: DLOPEN failed for %s", __func__, ADNC_STRM_LIBRARY_PATH);
-        } else {
-            ALOGV("%s: DLOPEN successful for %s",
-                __func__, ADNC_STRM_LIBRARY_PATH);
-            for (int index = 0; index < MAX_MODELS; index++) {
-                stdev->adnc_strm_handle[index] = 0;
-                stdev->adnc_strm_last_read[index] = reset_time;
-            }
-            stdev->adnc_strm_open =
-                (int (*)(bool, int, int))dlsym(stdev->adnc_cvq_strm_lib,
-                "adnc_strm_open");
-            stdev->adnc_strm_read =
-               (size_t (*)(long, void *, size_t))dlsym(stdev->adnc_cvq_strm_lib,
-                "adnc_strm_read");
-            stdev->adnc_strm_close =
-                (int (*)(long))dlsym(stdev->adnc_cvq_strm_lib,
-                "adnc_strm_close");
-            if (!stdev->adnc_strm_open || !stdev->adnc_strm_read ||
-                !stdev->adnc_strm_close) {
-                ALOGE("%s: Error grabbing functions in %s", __func__,
-                    ADNC_STRM_LIBRARY_PATH);
-                stdev->adnc_strm_open = 0;
-                stdev->adnc_strm_read = 0;
-                stdev->adnc_strm_close = 0;
-            }
-        }
+/*
+ * Writes the detection latency percentiles of each model type to fd, or to
+ * the log if fd is negative.
+ */
+__attribute__ ((visibility ("default")))
+void stdev_dump_detection_trace(int fd)
+{
+    for (int i = 0; i < ST_MODEL_TYPE_MAX; i++) {
+        if (model_registry[i].kind == MODEL_KIND_KEYWORD)
+            detection_trace_dump(&g_stdev.detection_traces[i], fd);
     }
+}
 
-    return ret;
+/*
+ * Writes the metrics registry, the lock profile and the detection latency
+ * to fd, or to the log if fd is negative, and saves a binary snapshot of
+ * the registry next to the model cache for offline tools.
+ */
+__attribute__ ((visibility ("default")))
+void stdev_dump(int fd)
+{
+    int err;
+
+    metrics_dump(fd);
+    stdev_dump_lock_profile(fd);
+    stdev_dump_detection_trace(fd);
+
+    if (mkdir(STHAL_DATA_DIR, 0770) != 0 && errno != EEXIST) {
+        ALOGE("%s: Failed to create %s: %s", __func__, STHAL_DATA_DIR,
+            strerror(errno));
+        return;
+    }
+    err = metrics_write_snapshot(METRICS_SNAPSHOT_FILE);
+    if (err != 0)
+        ALOGE("%s: Failed to write %s: %s", __func__, METRICS_SNAPSHOT_FILE,
+            strerror(-err));
 }
 
 static struct mixer* find_stdev_mixer_path(int card_num, char *mixer_path_xml)
@@ -3268,23 +6366,67 @@ on_error:
     return mixer;
 }
 
+/*
+ * Waits up to timeout_ms for a change under SND_DEV_DIR, a new card's nodes
+ * are created there and then given their permissions. Falls back to sleeping
+ * if the directory couldn't be watched.
+ */
+static void wait_for_sound_card_change(int inotify_fd, int timeout_ms)
+{
+    char buf[sizeof(struct inotify_event) + NAME_MAX + 1]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct pollfd pfd = { .fd = inotify_fd, .events = POLLIN };
+
+    if (inotify_fd < 0) {
+        usleep(timeout_ms * 1000);
+        return;
+    }
+
+    if (poll(&pfd, 1, timeout_ms) > 0) {
+        while (read(inotify_fd, buf, sizeof(buf)) > 0)
+            ;
+    }
+}
+
 static int find_sound_card() {
-    int retry_num = 0, snd_card_num = 0, ret = -1;
+    int num_scans = 0, snd_card_num = 0, ret = -1;
     const char *snd_card_name;
     struct mixer *mixer = NULL;
     bool card_verifed[MAX_SND_CARD] = {false};
     const int retry_limit = property_get_int32("audio.snd_card.open.retries",
                                             RETRY_NUMBER);
+    const long long deadline_us = (long long)retry_limit * RETRY_US;
+    struct timespec start, now;
+    long long elapsed_us, wait_us;
+    int inotify_fd;
     ALOGD("+%s+", __func__);
 
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    // Watch before the first scan so a card showing up meanwhile isn't missed
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd >= 0 &&
+        inotify_add_watch(inotify_fd, SND_DEV_DIR, IN_CREATE | IN_ATTRIB) < 0) {
+        ALOGW("%s: Can't watch %s %d(%s), polling", __func__, SND_DEV_DIR,
+            errno, strerror(errno));
+        close(inotify_fd);
+        inotify_fd = -1;
+    }
+
     for (;;) {
         if (snd_card_num >= MAX_SND_CARD) {
-            if (retry_num++ >= retry_limit) {
+            num_scans++;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            elapsed_us = timespec_diff_us(&now, &start);
+            if (elapsed_us >= deadline_us) {
                 ALOGE("%s: iaxxx sound card not found", __func__);
                 goto exit;
             }
             snd_card_num = 0;
-            usleep(RETRY_US);
+            // Rescan on every change, and at least every RETRY_US
+            wait_us = deadline_us - elapsed_us;
+            if (wait_us > RETRY_US)
+                wait_us = RETRY_US;
+            wait_for_sound_card_change(inotify_fd, (int)(wait_us / 1000));
             continue;
         }
         if (card_verifed[snd_card_num]) {
@@ -3300,8 +6442,10 @@ static int find_sound_card() {
 
         snd_card_name = mixer_get_name(mixer);
         if (strstr(snd_card_name, CARD_NAME)) {
-            ALOGD("%s: find card %d has iaxxx - %s",
-                __func__, snd_card_num, snd_card_name);
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            ALOGD("%s: find card %d has iaxxx - %s after %lld us, %d rescans",
+                __func__, snd_card_num, snd_card_name,
+                timespec_diff_us(&now, &start), num_scans);
             ret = snd_card_num;
             break;
         }
@@ -3316,6 +6460,8 @@ static int find_sound_card() {
 exit:
     if (mixer)
         mixer_close(mixer);
+    if (inotify_fd >= 0)
+        close(inotify_fd);
 
     ALOGD("-%s-", __func__);
     return ret;
@@ -3367,13 +6513,53 @@ static int load_audio_hal()
             stdev->sthal_prop_api_version);
     }
 
-    ALOGD("%s: load AHAL successfully.", __func__);
-    return ret;
+    ALOGD("%s: load AHAL successfully.", __func__);
+    return ret;
+
+error:
+    dlclose(stdev->audio_hal_handle);
+    stdev->audio_hal_handle = NULL;
+    return ret;
+}
+
+static void *load_audio_hal_thread(void *context)
+{
+    struct knowles_sound_trigger_device *stdev =
+        (struct knowles_sound_trigger_device *)context;
+    int ret;
+
+    startup_stage_begin(&stdev->startup, STARTUP_AHAL);
+    ret = load_audio_hal();
+    startup_stage_end(&stdev->startup, STARTUP_AHAL);
 
-error:
-    dlclose(stdev->audio_hal_handle);
-    stdev->audio_hal_handle = NULL;
-    return ret;
+    return (void *)(intptr_t)ret;
+}
+
+static void load_capture_channel_eps(struct knowles_sound_trigger_device *stdev)
+{
+    char value[PROPERTY_VALUE_MAX];
+    char *token, *tmp = NULL, *end;
+    long end_point;
+
+    stdev->num_capture_channel_eps = 0;
+    if (property_get(CAPTURE_CHANNEL_EPS_PROP, value, "") <= 0)
+        return;
+
+    for (token = strtok_r(value, ",", &tmp);
+        token != NULL && stdev->num_capture_channel_eps <
+            MAX_CAPTURE_CHANNELS - 1;
+        token = strtok_r(NULL, ",", &tmp)) {
+        end_point = strtol(token, &end, 0);
+        if (end == token || end_point <= 0) {
+            ALOGE("%s: Invalid endpoint \"%s\" in %s", __func__, token,
+                CAPTURE_CHANNEL_EPS_PROP);
+            continue;
+        }
+        stdev->capture_channel_eps[stdev->num_capture_channel_eps++] =
+            end_point;
+    }
+    ALOGD("%s: Captures can have up to %d channels", __func__,
+        stdev->num_capture_channel_eps + 1);
 }
 
 static int stdev_open(const hw_module_t *module, const char *name,
@@ -3382,6 +6568,10 @@ static int stdev_open(const hw_module_t *module, const char *name,
     struct knowles_sound_trigger_device *stdev;
     int ret = 0, i = 0;
     int snd_card_num = 0;
+    pthread_t ahal_thread;
+    bool is_ahal_loading = false;
+    bool is_lock_profiled;
+    void *ahal_ret;
 
     ALOGE("!! Knowles SoundTrigger v1!!");
 
@@ -3392,30 +6582,55 @@ static int stdev_open(const hw_module_t *module, const char *name,
         return -EINVAL;
 
     stdev = &g_stdev;
-    pthread_mutex_lock(&stdev->lock);
-
-    snd_card_num = find_sound_card();
-    if (snd_card_num == -1) {
-        ALOGE("%s: Unable to find the sound card %s", __func__, CARD_NAME);
-        ret = -EAGAIN;
-        goto exit;
-    }
+#ifdef STHAL_LOCK_PROFILE
+    is_lock_profiled = true;
+#else
+    is_lock_profiled = property_get_bool(LOCK_PROFILE_PROP, false);
+#endif
+    lock_profile_enable(&stdev->lock_prof, is_lock_profiled);
+    lock_profile_enable(&stdev->strm_lock_prof, is_lock_profiled);
+    lock_stdev(stdev);
+    stdev->is_capture_preopen_enabled =
+        property_get_bool(CAPTURE_PREOPEN_PROP, false);
+#ifdef STHAL_CAPTURE_FLOAT
+    stdev->is_capture_float_enabled = true;
+#else
+    stdev->is_capture_float_enabled =
+        property_get_bool(CAPTURE_FLOAT_PROP, false);
+#endif
+    load_capture_channel_eps(stdev);
 
-    if (stdev->opened) {
+    if (stdev->opened || stdev->is_closing) {
         ALOGE("%s: Only one sountrigger can be opened at a time", __func__);
         ret = -EBUSY;
         goto exit;
     }
 
-    ret = open_streaming_lib(stdev);
-    if (ret != 0) {
-        ALOGE("%s: Couldnot open the streaming library", __func__);
-        goto error;
+    reset_startup_timeline(&stdev->startup);
+
+    /*
+     * The AHAL dlopen doesn't depend on the sound card, load it while the
+     * card, ODSP and mixer are brought up. The streaming library is
+     * loaded once the HAL is up, off the first read's path.
+     */
+    if (pthread_create(&ahal_thread, (const pthread_attr_t *) NULL,
+                    load_audio_hal_thread, stdev) == 0) {
+        is_ahal_loading = true;
+    } else {
+        ALOGW("%s: Loading AHAL inline", __func__);
+        ret = (int)(intptr_t)load_audio_hal_thread(stdev);
+        if (ret != 0) {
+            ALOGE("%s: Couldn't load AHAL", __func__);
+            goto error;
+        }
     }
 
-    ret = load_audio_hal();
-    if (ret != 0) {
-        ALOGE("%s: Couldn't load AHAL", __func__);
+    startup_stage_begin(&stdev->startup, STARTUP_CARD);
+    snd_card_num = find_sound_card();
+    startup_stage_end(&stdev->startup, STARTUP_CARD);
+    if (snd_card_num == -1) {
+        ALOGE("%s: Unable to find the sound card %s", __func__, CARD_NAME);
+        ret = -EAGAIN;
         goto error;
     }
 
@@ -3433,15 +6648,23 @@ static int stdev_open(const hw_module_t *module, const char *name,
     stdev->opened = true;
     /* Initialize all member variable */
     for (i = 0; i < MAX_MODELS; i++) {
+        stdev->adnc_strm_handle[i] = 0;
+        atomic_init(&stdev->adnc_strm_last_read_ms[i], 0);
+        atomic_init(&stdev->strm_capture_handle[i], NO_CAPTURE_HANDLE);
+        atomic_init(&stdev->strm_readers[i], 0);
+        atomic_init(&stdev->strm_closing[i], false);
         stdev->models[i].type = SOUND_MODEL_TYPE_UNKNOWN;
         memset(&stdev->models[i].uuid, 0, sizeof(sound_trigger_uuid_t));
         stdev->models[i].config = NULL;
         stdev->models[i].data = NULL;
         stdev->models[i].data_sz = 0;
+        stdev->models[i].desc = NULL;
         stdev->models[i].is_loaded = false;
         stdev->models[i].is_active = false;
+        update_capture_map(stdev, i);
         stdev->last_keyword_detected_config = NULL;
         stdev->models[i].is_state_query = false;
+        stdev->models[i].is_restored = false;
     }
 
     stdev->is_mic_route_enabled = false;
@@ -3462,73 +6685,426 @@ static int stdev_open(const hw_module_t *module, const char *name,
     stdev->is_concurrent_capture = hw_properties.concurrent_capture;
 
     stdev->is_sensor_destroy_in_prog = false;
-    stdev->ss_timer_created = false;
+    stdev->is_sensor_setup_in_prog = false;
+    stdev->ss_timer_armed = false;
 
     stdev->is_chre_destroy_in_prog = false;
-    stdev->chre_timer_created = false;
+    stdev->chre_timer_armed = false;
+
+    stdev->is_cache_sync_pending = false;
+    stdev->claim_timer_armed = false;
+    stdev->is_model_cache_restored = false;
+    stdev->recovery.next = RECOVERY_DONE;
+    stdev->recovery.is_crash_seen = false;
 
     stdev->snd_crd_num = snd_card_num;
     stdev->fw_reset_done_by_hal = false;
 
-    str_to_uuid(HOTWORD_AUDIO_MODEL, &stdev->hotword_model_uuid);
-    str_to_uuid(WAKEUP_MODEL, &stdev->wakeup_model_uuid);
-    str_to_uuid(SENSOR_MANAGER_MODEL, &stdev->sensor_model_uuid);
-    str_to_uuid(AMBIENT_AUDIO_MODEL, &stdev->ambient_model_uuid);
-    str_to_uuid(CHRE_AUDIO_MODEL, &stdev->chre_model_uuid);
-    str_to_uuid(ENTITY_AUDIO_MODEL, &stdev->entity_model_uuid);
+    init_model_registry(stdev);
+    init_hal_metrics(stdev);
 
+    startup_stage_begin(&stdev->startup, STARTUP_ODSP);
     stdev->odsp_hdl = iaxxx_odsp_init();
+    startup_stage_end(&stdev->startup, STARTUP_ODSP);
     if (stdev->odsp_hdl == NULL) {
         ALOGE("%s: Failed to get handle to ODSP HAL", __func__);
         ret = -EIO;
         goto error;
     }
+    startup_stage_begin(&stdev->startup, STARTUP_MIXER);
     stdev->mixer = find_stdev_mixer_path(stdev->snd_crd_num, stdev->mixer_path_xml);
+    startup_stage_end(&stdev->startup, STARTUP_MIXER);
     if (stdev->mixer == NULL) {
         ALOGE("Failed to init the mixer");
         ret = -EAGAIN;
         goto error;
     }
 
+    if (is_ahal_loading) {
+        pthread_join(ahal_thread, &ahal_ret);
+        is_ahal_loading = false;
+        ret = (int)(intptr_t)ahal_ret;
+        if (ret != 0) {
+            ALOGE("%s: Couldn't load AHAL", __func__);
+            goto error;
+        }
+    }
+
+    startup_stage_begin(&stdev->startup, STARTUP_THREADS);
+    ret = stdev_open_reactor_fds(stdev);
+    if (ret != 0)
+        goto error;
+
+    ret = start_delivery_thread(stdev);
+    if (ret != 0)
+        goto error;
+
+    // A preopened tunnel is only worth its power with the prefill
+    if (stdev->is_capture_preopen_enabled && start_prefill_thread(stdev) != 0)
+        stdev->is_capture_preopen_enabled = false;
+
     ALOGD("stdev before pthread_create %p", stdev);
-    // Create a thread to handle all events from kernel
+    // Create a thread to handle all events from kernel, timers and
+    // transitions
     pthread_create(&stdev->callback_thread, (const pthread_attr_t *) NULL,
                 callback_thread_loop, stdev);
+    startup_stage_end(&stdev->startup, STARTUP_THREADS);
 
-    pthread_create(&stdev->monitor_thread, (const pthread_attr_t *) NULL,
-                monitor_thread_loop, stdev);
-
-    pthread_create(&stdev->transitions_thread, (const pthread_attr_t *) NULL,
-                transitions_thread_loop, stdev);
+    // Nothing in open needs it, a read that comes first loads it inline
+    if (pthread_create(&stdev->strm_lib_thread, (const pthread_attr_t *) NULL,
+                    load_streaming_lib_thread, stdev) == 0)
+        stdev->is_strm_lib_loading = true;
+    else
+        ALOGW("%s: Loading the streaming library on the first read", __func__);
 
     *device = &stdev->device.common; /* same address as stdev */
 exit:
-    pthread_mutex_unlock(&stdev->lock);
+    unlock_stdev(stdev);
     return ret;
 
 error:
-    if (stdev->adnc_cvq_strm_lib)
+    if (is_ahal_loading)
+        pthread_join(ahal_thread, NULL);
+    log_startup_timeline(&stdev->startup, "open failed");
+    stdev->opened = false;
+    if (stdev->adnc_cvq_strm_lib) {
+        release_lingering_tunnels(stdev);
         dlclose(stdev->adnc_cvq_strm_lib);
-    if (stdev->audio_hal_handle)
+        stdev->adnc_cvq_strm_lib = NULL;
+        stdev->adnc_strm_open = NULL;
+        stdev->adnc_strm_read = NULL;
+        stdev->adnc_strm_close = NULL;
+        stdev->adnc_strm_get_first_frame_ts = NULL;
+        stdev->adnc_strm_prefill = NULL;
+        stdev->adnc_strm_release_lingering = NULL;
+        stdev->adnc_strm_open_multi = NULL;
+        stdev->adnc_strm_open_format = NULL;
+    }
+    stdev->is_strm_lib_probed = false;
+    if (stdev->audio_hal_handle) {
         dlclose(stdev->audio_hal_handle);
+        stdev->audio_hal_handle = NULL;
+    }
     if (stdev->route_hdl)
-        audio_route_free(stdev->route_hdl);
+        mixer_route_free(stdev->route_hdl);
     if (stdev->odsp_hdl)
         iaxxx_odsp_deinit(stdev->odsp_hdl);
     if (stdev->mixer)
         mixer_close(stdev->mixer);
+    stdev_close_reactor_fds(stdev);
 
-    pthread_mutex_unlock(&stdev->lock);
+    unlock_stdev(stdev);
     return ret;
 }
 
-/* AHAL calls this callback to communicate with STHAL */
-int sound_trigger_hw_call_back(audio_event_type_t event,
+// The wait is what a read pays when it can't take the lock-free path
+static void lock_for_read(struct knowles_sound_trigger_device *stdev)
+{
+    struct read_path_stats *rs = &stdev->read_stats;
+    struct timespec start, end;
+    long long wait_us;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    lock_strm(stdev);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    wait_us = timespec_diff_us(&end, &start);
+    rs->locked_reads++;
+    rs->lock_wait_us += wait_us;
+    if (wait_us > rs->max_lock_wait_us)
+        rs->max_lock_wait_us = wait_us;
+}
+
+// Whether a ring owns the tunnel of the capture handle, takes no lock
+static bool is_ring_capture(struct knowles_sound_trigger_device *stdev,
+                            int capture_handle)
+{
+    for (int i = 0; i < MAX_MODELS; i++) {
+        if (atomic_load(&stdev->capture_rings[i].is_active) &&
+            stdev->capture_rings[i].capture_handle == capture_handle)
+            return true;
+    }
+
+    return false;
+}
+
+// The channels the AHAL asks for in the session config
+static int requested_channels(const struct sound_trigger_session_info *ses_info)
+{
+    int channels = ses_info->config.channels;
+
+    if (channels < 1)
+        return 1;
+    if (channels > MAX_CAPTURE_CHANNELS)
+        return MAX_CAPTURE_CHANNELS;
+
+    return channels;
+}
+
+// Tells the AHAL what the tunnel at index streams
+static void report_capture_format(struct knowles_sound_trigger_device *stdev,
+                                int index,
+                                struct sound_trigger_session_info *ses_info)
+{
+    ses_info->config = stdev_hotword_pcm_config;
+    ses_info->config.channels = stdev->strm_channels[index];
+    ses_info->config.format = stdev->strm_formats[index];
+    atomic_store(&stdev->strm_format_reported[index], true);
+}
+
+/*
+ * Whether the published tunnel of the capture handle has had its format
+ * reported, the first read goes through the locked path otherwise. Takes
+ * no lock.
+ */
+static bool is_capture_format_reported(struct knowles_sound_trigger_device *stdev,
+                                    int capture_handle)
+{
+    for (int i = 0; i < MAX_MODELS; i++) {
+        if (atomic_load(&stdev->strm_capture_handle[i]) == capture_handle)
+            return atomic_load(&stdev->strm_format_reported[i]);
+    }
+
+    return false;
+}
+
+/*
+ * A tunnel opened on detection is mono. Before its format is reported,
+ * reopens it if the AHAL asks for more channels and more can be had, the
+ * history prefilled into it is lost. Called with stdev->strm_lock held.
+ */
+static void match_capture_channels(struct knowles_sound_trigger_device *stdev,
+                                int index, int channels)
+{
+    if (stdev->adnc_strm_handle[index] == 0 ||
+        atomic_load(&stdev->strm_format_reported[index]) ||
+        stdev->strm_channels[index] >= channels ||
+        stdev->strm_channels[index] >= stdev->num_capture_channel_eps + 1 ||
+        stdev->adnc_strm_open_multi == NULL)
+        return;
+
+    ALOGD("%s: Reopening index %d for %d channels", __func__, index, channels);
+    close_capture_stream(stdev, index);
+    stdev->is_streaming--;
+    open_capture_stream(stdev, index, FIRST_READ_ON_OPEN, channels);
+}
+
+/*
+ * Opens the tunnel on the first read of a capture handle, later reads go
+ * through read_capture_stream() without any lock.
+ */
+static int handle_read_samples(struct knowles_sound_trigger_device *stdev,
                             struct audio_event_info *config)
+{
+    int ret = 0;
+    int index = -1;
+    int capture_handle;
+    struct timespec start;
+
+    /* It is possible to change session info, check config */
+    if (config->u.aud_info.ses_info == NULL) {
+        ALOGE("%s: Invalid config, event:%d", __func__,
+            AUDIO_EVENT_READ_SAMPLES);
+        return -EINVAL;
+    }
+    capture_handle = config->u.aud_info.ses_info->capture_handle;
+    trace_stream_point(stdev, TRACE_FIRST_READ);
+
+    // Both would drain the same tunnel and get part of the audio each
+    if (is_ring_capture(stdev, capture_handle)) {
+        ALOGE("%s: capture handle %d is read through its ring", __func__,
+            capture_handle);
+        return -EBUSY;
+    }
+
+    if (is_capture_format_reported(stdev, capture_handle)) {
+        ret = read_capture_stream(stdev, capture_handle,
+                                config->u.aud_info.buf,
+                                config->u.aud_info.num_bytes, NULL);
+        if (ret == 0)
+            atomic_fetch_add_explicit(&stdev->read_stats.lock_free_reads, 1,
+                                    memory_order_relaxed);
+        // Only a tunnel that isn't published goes through the lock
+        if (ret != -ENOENT)
+            return ret;
+        ret = 0;
+    }
+
+    // The first read of a tunnel is always locked, it is timed from here
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    lock_for_read(stdev);
+    if (!is_hal_ready_for_strm(stdev)) {
+        ALOGE("%s: ST HAL is not ready yet", __func__);
+        ret = -EINVAL;
+        goto exit;
+    }
+    if (is_ring_capture(stdev, capture_handle)) {
+        ret = -EBUSY;
+        goto exit;
+    }
+
+    index = find_capture_slot(stdev, capture_handle);
+
+    /* Open Stream Driver */
+    if (index != -1 && stdev->adnc_strm_handle[index] == 0)
+        open_capture_stream(stdev, index, FIRST_READ_ON_OPEN,
+                            requested_channels(config->u.aud_info.ses_info));
+    else if (index != -1)
+        match_capture_channels(stdev, index,
+                            requested_channels(config->u.aud_info.ses_info));
+
+    if (index != -1 && stdev->adnc_strm_handle[index] != 0) {
+        report_capture_format(stdev, index, config->u.aud_info.ses_info);
+        // Later reads of this capture handle skip the lock
+        publish_capture_stream(stdev, index, capture_handle);
+        unlock_strm(stdev);
+        ret = read_capture_stream(stdev, capture_handle,
+                                config->u.aud_info.buf,
+                                config->u.aud_info.num_bytes, &start);
+        if (ret == -ENOENT)
+            ALOGW("%s: stream closed before the read", __func__);
+        return ret;
+    }
+    ALOGE("%s: soundtrigger is not streaming", __func__);
+
+exit:
+    unlock_strm(stdev);
+    return ret;
+}
+
+/*
+ * Hands the AHAL a dup of the ring's memfd, opening the tunnel and starting
+ * the ring on the first call. A ring whose reader went away is replaced.
+ */
+static int handle_get_capture_ring(struct knowles_sound_trigger_device *stdev,
+                                struct audio_event_info *config)
+{
+    struct audio_capture_ring_info *info = &config->u.ring_info;
+    struct capture_ring *ring;
+    int capture_handle;
+    int index = -1;
+    int ret = 0;
+
+    if (info->ses_info == NULL) {
+        ALOGE("%s: Invalid config, event:%d", __func__,
+            AUDIO_EVENT_GET_CAPTURE_RING);
+        return -EINVAL;
+    }
+    capture_handle = info->ses_info->capture_handle;
+    info->fd = -1;
+    info->size = 0;
+
+    lock_strm(stdev);
+    if (!is_hal_ready_for_strm(stdev)) {
+        ALOGE("%s: ST HAL is not ready yet", __func__);
+        ret = -EINVAL;
+        goto exit;
+    }
+
+    index = find_capture_slot(stdev, capture_handle);
+    if (index == -1) {
+        ALOGE("%s: soundtrigger is not streaming", __func__);
+        ret = -ENOENT;
+        goto exit;
+    }
+
+    ring = &stdev->capture_rings[index];
+    if (ring->hdr != NULL &&
+        (__atomic_load_n(&ring->hdr->flags, __ATOMIC_ACQUIRE) &
+        CAPTURE_RING_STOPPED))
+        stop_capture_ring(stdev, index);
+
+    if (ring->hdr == NULL) {
+        if (stdev->adnc_strm_handle[index] == 0) {
+            ret = open_capture_stream(stdev, index, FIRST_READ_ON_OPEN,
+                                    requested_channels(info->ses_info));
+            if (ret != 0)
+                goto exit;
+        } else {
+            match_capture_channels(stdev, index,
+                                requested_channels(info->ses_info));
+            if (stdev->adnc_strm_handle[index] == 0) {
+                ret = -EIO;
+                goto exit;
+            }
+        }
+        publish_capture_stream(stdev, index, capture_handle);
+        ret = start_capture_ring(stdev, index, capture_handle);
+        if (ret != 0)
+            goto exit;
+        ALOGD("%s: ring of %zu bytes for capture handle %d", __func__,
+            ring->map_size, capture_handle);
+    }
+
+    info->fd = fcntl(ring->fd, F_DUPFD_CLOEXEC, 0);
+    if (info->fd < 0) {
+        ret = -errno;
+        ALOGE("%s: Failed to dup the ring %d(%s)", __func__, errno,
+            strerror(errno));
+        goto exit;
+    }
+    info->size = ring->map_size;
+    report_capture_format(stdev, index, info->ses_info);
+
+exit:
+    unlock_strm(stdev);
+    return ret;
+}
+
+static int handle_stop_lab(struct knowles_sound_trigger_device *stdev,
+                        struct audio_event_info *config)
 {
     int ret = 0;
     int i = 0;
     int index = -1;
+
+    lock_strm(stdev);
+    if (!is_hal_ready_for_strm(stdev)) {
+        ALOGE("%s: ST HAL is not ready yet", __func__);
+        ret = -EINVAL;
+        goto exit;
+    }
+
+    /* Close Stream Driver */
+    index = find_capture_slot(stdev, config->u.ses_info.capture_handle);
+
+    /*
+     * Close unused adnc if ...
+     * 1. No capture handle is found
+     * 2. Model is inactive
+     * 3. adnc stream handle is existed
+     */
+    if (index == -1 && stdev->is_streaming > 0) {
+        ALOGD("%s: close unused adnc handle, cap_handle:%d", __func__,
+              config->u.ses_info.capture_handle);
+        for (i = 0; i < MAX_MODELS; i++) {
+            if (stdev->adnc_strm_handle[i] != 0 &&
+                !stdev->capture_map[i].is_active) {
+                close_capture_stream(stdev, i);
+                stdev->is_streaming--;
+            }
+        }
+        goto exit;
+    }
+
+    ALOGD("%s: close streaming %d, cap_handle:%d, index:%d",
+          __func__, AUDIO_EVENT_STOP_LAB, config->u.ses_info.capture_handle,
+          index);
+    if (index != -1 && stdev->adnc_strm_handle[index] != 0) {
+        close_capture_stream(stdev, index);
+        stdev->is_streaming--;
+    }
+
+exit:
+    unlock_strm(stdev);
+    return ret;
+}
+
+/* AHAL calls this callback to communicate with STHAL */
+int sound_trigger_hw_call_back(audio_event_type_t event,
+                            struct audio_event_info *config)
+{
+    int ret = 0;
     struct knowles_sound_trigger_device *stdev = &g_stdev;
     enum sthal_mode pre_mode, cur_mode;
 
@@ -3540,7 +7116,24 @@ int sound_trigger_hw_call_back(audio_event_type_t event,
         return -EINVAL;
     }
 
-    pthread_mutex_lock(&stdev->lock);
+    // Tunnels are handled in their own locking domain
+    if (event == AUDIO_EVENT_READ_SAMPLES)
+        return handle_read_samples(stdev, config);
+    if (event == AUDIO_EVENT_GET_CAPTURE_RING)
+        return handle_get_capture_ring(stdev, config);
+    if (event == AUDIO_EVENT_STOP_LAB)
+        return handle_stop_lab(stdev, config);
+
+    lock_stdev(stdev);
+
+    // Capture device changes reroute the mic and move the keyword models
+    // in and out of the recover list, against their recovered state. Let
+    // barge-in finish first. Oslo isn't touched.
+    if (event == AUDIO_EVENT_CAPTURE_DEVICE_INACTIVE ||
+        event == AUDIO_EVENT_CAPTURE_DEVICE_ACTIVE) {
+        wait_for_transition(stdev);
+        finish_recovery(stdev, RECOVERY_MODELS);
+    }
 
     // update conditions for mic concurrency whatever firmware status may be.
     if (event == AUDIO_EVENT_CAPTURE_DEVICE_INACTIVE ||
@@ -3584,119 +7177,9 @@ int sound_trigger_hw_call_back(audio_event_type_t event,
 
         if (stdev->rx_active_count == 0) {
             if (stdev->is_mic_route_enabled != false) {
-                // Atleast one keyword model is active so update the routes
-                // Check if the bargein route is enabled if not enable bargein route
-                // Check each model, if it is active then update it's route
-                if (stdev->is_bargein_route_enabled != false) {
-                    ALOGD("Bargein disabling");
-                    stdev->is_bargein_route_enabled = false;
-                    // Check each model, if it is active then update it's route
-                    // Disable the bargein route
-                    for (i = 0; i < MAX_MODELS; i++) {
-                        if (stdev->models[i].is_active == true) {
-                            // teardown the package route with bargein
-                            ret = tear_package_route(stdev,
-                                                    stdev->models[i].uuid,
-                                                    !stdev->is_bargein_route_enabled);
-                            if (ret != 0) {
-                                ALOGE("Failed to tear old package route");
-                                goto exit;
-                            }
-                            // resetup the package route with out bargein
-                            ret = set_package_route(stdev,
-                                                    stdev->models[i].uuid,
-                                                    stdev->is_bargein_route_enabled);
-                            if (ret != 0) {
-                                ALOGE("Failed to enable package route");
-                                goto exit;
-                            }
-                        }
-                    }
-
-                    //Switch buffer input source
-                    if (stdev->hotword_buffer_enable) {
-                        ret = tear_hotword_buffer_route(stdev->route_hdl,
-                                            !stdev->is_bargein_route_enabled);
-                        if (ret != 0) {
-                            ALOGE("Failed to tear old buffer route");
-                            goto exit;
-                        }
-                        ret = set_hotword_buffer_route(stdev->route_hdl,
-                                            stdev->is_bargein_route_enabled);
-                        if (ret != 0) {
-                            ALOGE("Failed to enable buffer route");
-                            goto exit;
-                        }
-                    }
-
-                    if (stdev->music_buffer_enable) {
-                        ret = tear_music_buffer_route(stdev->route_hdl,
-                                            !stdev->is_bargein_route_enabled);
-                        if (ret != 0) {
-                            ALOGE("Failed to tear old music buffer route");
-                            goto exit;
-                        }
-                        ret = set_music_buffer_route(stdev->route_hdl,
-                                            stdev->is_bargein_route_enabled);
-                        if (ret != 0) {
-                            ALOGE("Failed to enable buffer route");
-                            goto exit;
-                        }
-                    }
-
-                    ret = enable_bargein_route(stdev->route_hdl, false);
-                    if (ret != 0) {
-                        ALOGE("Failed to enable buffer route");
-                        goto exit;
-                    }
-
-                    ret = destroy_aec_package(stdev->odsp_hdl);
-                    if (ret != 0) {
-                        ALOGE("Failed to unload AEC package");
-                        goto exit;
-                    }
-
-                    ret = enable_src_route(stdev->route_hdl, false, SRC_AMP_REF);
-                    if (ret != 0) {
-                        ALOGE("Failed to disable SRC-amp route");
-                        goto exit;
-                    }
-
-                    ret = destroy_src_plugin(stdev->odsp_hdl, SRC_AMP_REF);
-                    if (ret != 0) {
-                        ALOGE("Failed to unload SRC-amp package");
-                        goto exit;
-                    }
-
-                    if (is_mic_controlled_by_ahal(stdev) == false) {
-                        ret = enable_amp_ref_route(stdev->route_hdl, false, STRM_16K);
-                        if (ret != 0) {
-                            ALOGE("Failed to disable amp-ref route");
-                            goto exit;
-                        }
-                        ret = enable_mic_route(stdev->route_hdl, false,
-                                            EXTERNAL_OSCILLATOR);
-                        if (ret != 0) {
-                            ALOGE("Failed to disable mic route with INT OSC");
-                            goto exit;
-                        }
-                        ret = enable_mic_route(stdev->route_hdl, true,
-                                            INTERNAL_OSCILLATOR);
-                        if (ret != 0) {
-                            ALOGE("Failed to enable mic route with EXT OSC");
-                            goto exit;
-                        }
-                    } else {
-                        // main mic is turned by media record, close it by 48khz
-                        ret = enable_amp_ref_route(stdev->route_hdl, false, STRM_48K);
-                        if (ret != 0) {
-                            ALOGE("Failed to disable amp-ref route");
-                            goto exit;
-                        }
-                    }
-                } else {
-                    ALOGW("%s: barge-in isn't enabled", __func__);
-                }
+                // Barge-in is torn down by the reactor once playback has
+                // stayed inactive for the debounce window
+                queue_transition(stdev, TRANSIT_TEARDOWN_AEC);
             }
         } else {
             ALOGD("%s: rx stream is still active", __func__);
@@ -3710,130 +7193,17 @@ int sound_trigger_hw_call_back(audio_event_type_t event,
                 // Atleast one keyword model is active so update the routes
                 // Check if the bargein route is enabled if not enable bargein route
                 // Check each model, if it is active then update it's route
-                stdev->transit_case = TRANSIT_SETUP_AEC;
-                pthread_cond_signal(&stdev->transition_cond);
+                queue_transition(stdev, TRANSIT_SETUP_AEC);
             }
         } else {
             ALOGW("%s: unexpeted stream active event", __func__);
         }
         break;
-    case AUDIO_EVENT_STOP_LAB:
-        /* Close Stream Driver */
-        for (i = 0; i < MAX_MODELS; i++) {
-            if (stdev->models[i].is_active &&
-                stdev->models[i].config &&
-                (stdev->models[i].config->capture_handle ==
-                 config->u.ses_info.capture_handle)) {
-                index = i;
-                break;
-            }
-        }
-
-        /*
-         * Close unused adnc if ...
-         * 1. No capture handle is found
-         * 2. Model is inactive
-         * 3. adnc stream handle is existed
-         */
-        if (index == -1 && stdev->is_streaming > 0) {
-            ALOGD("%s: close unused adnc handle, cap_handle:%d", __func__,
-                  config->u.ses_info.capture_handle);
-            for (i = 0; i < MAX_MODELS; i++) {
-                if (stdev->adnc_strm_handle[i] != 0 &&
-                    !stdev->models[i].is_active) {
-                    stdev->adnc_strm_close(stdev->adnc_strm_handle[i]);
-                    stdev->adnc_strm_handle[i] = 0;
-                    stdev->is_streaming--;
-                    stdev->adnc_strm_last_read[i] = reset_time;
-                }
-            }
-            goto exit;
-        }
-
-        ALOGD("%s: close streaming %d, cap_handle:%d, index:%d",
-              __func__, event, config->u.ses_info.capture_handle, index);
-        if (index != -1 && stdev->adnc_strm_handle[index] != 0) {
-            stdev->adnc_strm_close(stdev->adnc_strm_handle[index]);
-            stdev->adnc_strm_handle[index] = 0;
-            stdev->is_streaming--;
-            stdev->adnc_strm_last_read[index] = reset_time;
-        }
-
-        break;
-
     case AUDIO_EVENT_SSR:
         /*[TODO] Do we need to handle adsp SSR event ? */
         ALOGD("%s: handle audio subsystem restart %d", __func__, event);
         break;
 
-    case AUDIO_EVENT_READ_SAMPLES:
-        /* It is possible to change session info, check config */
-        if (config->u.aud_info.ses_info == NULL) {
-            ALOGE("%s: Invalid config, event:%d", __func__, event);
-            ret = -EINVAL;
-            goto exit;
-        }
-
-        for (i = 0; i < MAX_MODELS; i++) {
-            if (stdev->models[i].is_active &&
-                stdev->models[i].config &&
-                (stdev->models[i].config->capture_handle ==
-                 config->u.aud_info.ses_info->capture_handle)) {
-                index = i;
-                break;
-            }
-        }
-
-        /* Open Stream Driver */
-        if (index != -1 && stdev->adnc_strm_handle[index] == 0) {
-            if (stdev->adnc_strm_open == NULL) {
-                ALOGE("%s: Error adnc streaming not supported", __func__);
-            } else {
-                bool keyword_stripping_enabled = false;
-                int stream_end_point;
-                switch (stdev->last_detected_model_type) {
-                    case OK_GOOGLE_KW_ID:
-                        stream_end_point = CVQ_ENDPOINT;
-                        break;
-                    case AMBIENT_KW_ID:
-                    case ENTITY_KW_ID:
-                        stream_end_point = MUSIC_BUF_ENDPOINT;
-                        break;
-                    default:
-                        stream_end_point = CVQ_ENDPOINT;
-                        break;
-                };
-                stdev->adnc_strm_handle[index] = stdev->adnc_strm_open(
-                                            keyword_stripping_enabled, 0,
-                                            stream_end_point);
-                if (stdev->adnc_strm_handle[index]) {
-                    ALOGD("Successfully opened adnc strm! index %d handle %d",
-                          index, config->u.aud_info.ses_info->capture_handle);
-                    stdev->is_streaming++;
-
-                    clock_gettime(CLOCK_REALTIME, &stdev->adnc_strm_last_read[index]);
-                    if (stdev->is_streaming == 1)
-                        pthread_cond_signal(&stdev->tunnel_create);
-                } else {
-                    ALOGE("%s: DSP is currently not streaming", __func__);
-                }
-            }
-        }
-
-        if (index != -1 && stdev->adnc_strm_handle[index] != 0) {
-            //ALOGD("%s: soundtrigger HAL adnc_strm_read", __func__);
-            clock_gettime(CLOCK_REALTIME, &stdev->adnc_strm_last_read[index]);
-            pthread_mutex_unlock(&stdev->lock);
-            stdev->adnc_strm_read(stdev->adnc_strm_handle[index],
-                                config->u.aud_info.buf,
-                                config->u.aud_info.num_bytes);
-            pthread_mutex_lock(&stdev->lock);
-        } else {
-            ALOGE("%s: soundtrigger is not streaming", __func__);
-        }
-
-        break;
-
     case AUDIO_EVENT_NUM_ST_SESSIONS:
     case AUDIO_EVENT_DEVICE_CONNECT:
     case AUDIO_EVENT_DEVICE_DISCONNECT:
@@ -3848,7 +7218,7 @@ int sound_trigger_hw_call_back(audio_event_type_t event,
     }
 
 exit:
-    pthread_mutex_unlock(&stdev->lock);
+    unlock_stdev(stdev);
     return ret;
 }
 
@@ -17,6 +17,8 @@
 #ifndef SOUND_TRIGGER_INTF_H
 #define SOUND_TRIGGER_INTF_H
 
+#include <stdint.h>
+#include <string.h>
 #include <hardware/sound_trigger.h>
 #include "tinyalsa/asoundlib.h"
 
@@ -32,7 +34,11 @@
 
 /* Proprietary interface version used for compatibility with STHAL */
 #define STHAL_PROP_API_VERSION_1_0 MAKE_HAL_VERSION(1, 0)
-#define STHAL_PROP_API_CURRENT_VERSION STHAL_PROP_API_VERSION_1_0
+/* Adds AUDIO_EVENT_GET_CAPTURE_RING */
+#define STHAL_PROP_API_VERSION_1_1 MAKE_HAL_VERSION(1, 1)
+/* Negotiates the channel count of a capture through its session config */
+#define STHAL_PROP_API_VERSION_1_2 MAKE_HAL_VERSION(1, 2)
+#define STHAL_PROP_API_CURRENT_VERSION STHAL_PROP_API_VERSION_1_2
 
 #define ST_EVENT_CONFIG_MAX_STR_VALUE 32
 
@@ -83,6 +89,7 @@ typedef enum {
     AUDIO_EVENT_SVA_EXEC_MODE_STATUS,
     AUDIO_EVENT_CAPTURE_STREAM_INACTIVE,
     AUDIO_EVENT_CAPTURE_STREAM_ACTIVE,
+    AUDIO_EVENT_GET_CAPTURE_RING,
 } audio_event_type_t;
 
 typedef enum {
@@ -101,6 +108,13 @@ enum ssr_event_status {
     SLPI_STATUS_ONLINE
 };
 
+/*
+ * config is the format the session was registered with. The AHAL may ask for
+ * more channels in it on its first AUDIO_EVENT_READ_SAMPLES or
+ * AUDIO_EVENT_GET_CAPTURE_RING, the STHAL writes back the format it streams,
+ * which is interleaved S16 at SOUND_TRIGGER_SAMPLING_RATE with up to the
+ * channels asked for. The format stays the same until AUDIO_EVENT_STOP_LAB.
+ */
 struct sound_trigger_session_info {
     void* p_ses; /* opaque pointer to st_session obj */
     int capture_handle;
@@ -114,6 +128,22 @@ struct audio_read_samples_info {
     size_t num_bytes;
 };
 
+/*
+ * AUDIO_EVENT_GET_CAPTURE_RING, instead of AUDIO_EVENT_READ_SAMPLES. The
+ * STHAL returns a memfd holding a capture_ring_header followed by the PCM
+ * ring, and keeps it filled from the DSP until AUDIO_EVENT_STOP_LAB. The
+ * caller owns fd and maps size bytes of it read/write. Asking again for the
+ * same session returns the same ring. Fails with -ENOSYS on an STHAL that
+ * doesn't support it, the caller then reads with AUDIO_EVENT_READ_SAMPLES.
+ * While the ring is filled, AUDIO_EVENT_READ_SAMPLES on the session fails
+ * with -EBUSY.
+ */
+struct audio_capture_ring_info {
+    struct sound_trigger_session_info *ses_info;
+    int fd;
+    size_t size;
+};
+
 struct audio_hal_usecase {
     audio_stream_usecase_type_t type;
 };
@@ -138,6 +168,7 @@ struct audio_event_info {
         int value;
         struct sound_trigger_session_info ses_info;
         struct audio_read_samples_info aud_info;
+        struct audio_capture_ring_info ring_info;
         char str_value[ST_EVENT_CONFIG_MAX_STR_VALUE];
         struct audio_hal_usecase usecase;
         bool audio_ec_ref_enabled;
@@ -146,6 +177,121 @@ struct audio_event_info {
     struct sound_trigger_device_info device_info;
 };
 
+/*
+ * Lock-free single producer (STHAL), single consumer (AHAL) PCM ring shared
+ * through AUDIO_EVENT_GET_CAPTURE_RING. The indices count the bytes ever
+ * written and read, the data of index i is at i % data_size. Each side only
+ * writes its own index and publishes it with release semantics after the
+ * data it covers. The STHAL never overwrites unread data, it drops what
+ * doesn't fit and counts it in overruns.
+ */
+#define CAPTURE_RING_MAGIC          0x474e5253  /* "SRNG" */
+#define CAPTURE_RING_VERSION        1
+
+/* No more data will be written, what's in the ring can still be read */
+#define CAPTURE_RING_STOPPED        (1 << 0)
+
+struct capture_ring_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t header_size;       /* offset of the data in the mapping */
+    uint32_t data_size;         /* a multiple of frame_size */
+    uint32_t sample_rate;
+    uint32_t channels;
+    uint32_t format;            /* enum pcm_format */
+    uint32_t frame_size;        /* the indices only move by whole frames */
+    uint32_t flags;             /* CAPTURE_RING_*, atomic */
+    uint32_t overruns;          /* bytes dropped on a full ring, atomic */
+
+    /* Written by the STHAL only */
+    uint64_t write_index __attribute__((aligned(64)));
+    /*
+     * CLOCK_MONOTONIC in ns when the STHAL wrote the data up to ts_index,
+     * under ts_seq which is odd while they are updated. See
+     * capture_ring_get_timestamp(). This is not when the audio was captured:
+     * the history before the detection is written as fast as the DSP sends
+     * it, so the first seconds of a ring are written in far less time than
+     * they span. Only once the ring has caught up with the DSP does ts_ns
+     * follow the audio, delayed by the tunnel latency.
+     */
+    uint32_t ts_seq;
+    uint32_t reserved;
+    uint64_t ts_index;
+    uint64_t ts_ns;
+
+    /* Written by the AHAL only */
+    uint64_t read_index __attribute__((aligned(64)));
+};
+
+static inline size_t capture_ring_readable(const struct capture_ring_header *hdr)
+{
+    return __atomic_load_n(&hdr->write_index, __ATOMIC_ACQUIRE) -
+        hdr->read_index;
+}
+
+/*
+ * Returns the contiguous readable data at the read index in *data and its
+ * length, for consumers that process it in place. Release it with
+ * capture_ring_consume() when done.
+ */
+static inline size_t capture_ring_peek(const struct capture_ring_header *hdr,
+                                    const void **data)
+{
+    size_t avail = capture_ring_readable(hdr);
+    size_t offset = hdr->read_index % hdr->data_size;
+
+    *data = (const uint8_t *)hdr + hdr->header_size + offset;
+    return avail < hdr->data_size - offset ? avail : hdr->data_size - offset;
+}
+
+static inline void capture_ring_consume(struct capture_ring_header *hdr,
+                                        size_t bytes)
+{
+    __atomic_store_n(&hdr->read_index, hdr->read_index + bytes,
+                    __ATOMIC_RELEASE);
+}
+
+/* Copies out up to bytes, returns how many were copied */
+static inline size_t capture_ring_read(struct capture_ring_header *hdr,
+                                    void *buf, size_t bytes)
+{
+    size_t done = 0, n;
+    const void *data;
+
+    while (done < bytes) {
+        n = capture_ring_peek(hdr, &data);
+        if (n == 0)
+            break;
+        if (n > bytes - done)
+            n = bytes - done;
+        memcpy((uint8_t *)buf + done, data, n);
+        capture_ring_consume(hdr, n);
+        done += n;
+    }
+
+    return done;
+}
+
+/* Returns 0, or -1 if the writer kept updating it under us */
+static inline int capture_ring_get_timestamp(const struct capture_ring_header *hdr,
+                                            uint64_t *index, uint64_t *ns)
+{
+    uint32_t seq;
+
+    for (int i = 0; i < 8; i++) {
+        seq = __atomic_load_n(&hdr->ts_seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+        *index = __atomic_load_n(&hdr->ts_index, __ATOMIC_RELAXED);
+        *ns = __atomic_load_n(&hdr->ts_ns, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&hdr->ts_seq, __ATOMIC_RELAXED) == seq)
+            return 0;
+    }
+
+    return -1;
+}
+
 /* STHAL callback which is called by AHAL */
 typedef int (*sound_trigger_hw_call_back_t)(audio_event_type_t,
                                 struct audio_event_info*);
@@ -154,5 +300,15 @@ typedef int (*sound_trigger_hw_call_back_t)(audio_event_type_t,
 typedef void (*audio_hw_call_back_t)(sound_trigger_event_type_t,
                         struct sound_trigger_event_info*);
 
+/*
+ * STHAL debug dumps, written to fd or to the log if fd is negative. The AHAL
+ * can look up "stdev_dump" like the callback above and call it from its own
+ * dump. They take the STHAL locks, so not from an audio_hw_call_back_t.
+ */
+typedef void (*sthal_dump_t)(int);
+void stdev_dump(int fd);
+void stdev_dump_lock_profile(int fd);
+void stdev_dump_detection_trace(int fd);
+
 /*---------------- End: AHAL-STHAL Interface ----------------------------------*/
 #endif /* SOUND_TRIGGER_INTF_H */
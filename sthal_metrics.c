@@ -0,0 +1,243 @@
+/*
+ * Copyright (C) 2018 Knowles Electronics
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "SoundTriggerMetrics"
+#define LOG_NDEBUG 0
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <log/log.h>
+
+#include "sthal_metrics.h"
+#include "sthal_util.h"
+
+// Worst case record: header fields, name and every bucket
+#define SNAPSHOT_RECORD_MAX (2 + METRIC_NAME_MAX + 3 * 8 + 1 + \
+                            METRIC_BUCKETS * 5)
+#define SNAPSHOT_SIZE_MAX   (16 + METRICS_MAX * SNAPSHOT_RECORD_MAX)
+
+static struct metric registry[METRICS_MAX];
+static atomic_int num_metrics;
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+// Handed out once the registry is full so that callers needn't check
+static struct metric overflow_metric = { .name = "overflow" };
+
+struct metric *metrics_register(const char *name, enum metric_type type)
+{
+    struct metric *m = NULL;
+    int i, n;
+
+    pthread_mutex_lock(&registry_lock);
+    n = atomic_load_explicit(&num_metrics, memory_order_relaxed);
+    for (i = 0; i < n; i++) {
+        if (strncmp(registry[i].name, name, METRIC_NAME_MAX) == 0) {
+            m = &registry[i];
+            goto exit;
+        }
+    }
+
+    if (n == METRICS_MAX) {
+        ALOGE("%s: No room for %s", __func__, name);
+        m = &overflow_metric;
+        goto exit;
+    }
+
+    m = &registry[n];
+    strlcpy(m->name, name, sizeof(m->name));
+    m->type = type;
+    // Published only once it's filled in, dump doesn't take the lock
+    atomic_store_explicit(&num_metrics, n + 1, memory_order_release);
+
+exit:
+    pthread_mutex_unlock(&registry_lock);
+    return m;
+}
+
+static int metric_bucket(long long v)
+{
+    int bucket;
+
+    if (v <= 0)
+        return 0;
+
+    bucket = 64 - __builtin_clzll((unsigned long long)v);
+    return bucket < METRIC_BUCKETS ? bucket : METRIC_BUCKETS - 1;
+}
+
+void metric_record(struct metric *m, long long v)
+{
+    long long max = atomic_load_explicit(&m->max, memory_order_relaxed);
+
+    atomic_fetch_add_explicit(&m->buckets[metric_bucket(v)], 1,
+                            memory_order_relaxed);
+    atomic_fetch_add_explicit(&m->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&m->value, v, memory_order_relaxed);
+    while (v > max &&
+            !atomic_compare_exchange_weak_explicit(&m->max, &max, v,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed))
+        ;
+}
+
+static void dump_histogram(struct metric *m, int fd)
+{
+    long long count = atomic_load_explicit(&m->count, memory_order_relaxed);
+    long long sum = atomic_load_explicit(&m->value, memory_order_relaxed);
+    char buf[256];
+    size_t len = 0;
+    unsigned int samples;
+    int i;
+
+    buf[0] = '\0';
+    for (i = 0; i < METRIC_BUCKETS && len < sizeof(buf); i++) {
+        samples = atomic_load_explicit(&m->buckets[i], memory_order_relaxed);
+        if (samples == 0)
+            continue;
+        len += snprintf(buf + len, sizeof(buf) - len, " %s%lld:%u",
+                        i == METRIC_BUCKETS - 1 ? ">=" : "<",
+                        i == METRIC_BUCKETS - 1 ? 1LL << (i - 1) : 1LL << i,
+                        samples);
+    }
+
+    DUMP(fd, "  %s: n %lld avg %lld max %lld%s\n", m->name, count,
+        count ? sum / count : 0,
+        atomic_load_explicit(&m->max, memory_order_relaxed), buf);
+}
+
+void metrics_dump(int fd)
+{
+    int i, n = atomic_load_explicit(&num_metrics, memory_order_acquire);
+
+    DUMP(fd, "metrics: %d registered\n", n);
+    for (i = 0; i < n; i++) {
+        struct metric *m = &registry[i];
+
+        if (m->type == METRIC_HISTOGRAM)
+            dump_histogram(m, fd);
+        else
+            DUMP(fd, "  %s: %lld\n", m->name,
+                atomic_load_explicit(&m->value, memory_order_relaxed));
+    }
+}
+
+static size_t put(uint8_t *buf, size_t off, const void *data, size_t len)
+{
+    memcpy(buf + off, data, len);
+    return off + len;
+}
+
+static size_t put_metric(uint8_t *buf, size_t off, struct metric *m)
+{
+    uint8_t type = m->type;
+    uint8_t name_len = strnlen(m->name, METRIC_NAME_MAX);
+    int64_t v = atomic_load_explicit(&m->value, memory_order_relaxed);
+    uint8_t num_buckets = 0;
+    size_t num_buckets_off;
+    uint32_t samples;
+    uint8_t i;
+
+    off = put(buf, off, &type, sizeof(type));
+    off = put(buf, off, &name_len, sizeof(name_len));
+    off = put(buf, off, m->name, name_len);
+    off = put(buf, off, &v, sizeof(v));
+    if (m->type != METRIC_HISTOGRAM)
+        return off;
+
+    v = atomic_load_explicit(&m->count, memory_order_relaxed);
+    off = put(buf, off, &v, sizeof(v));
+    v = atomic_load_explicit(&m->max, memory_order_relaxed);
+    off = put(buf, off, &v, sizeof(v));
+    num_buckets_off = off++;
+    for (i = 0; i < METRIC_BUCKETS; i++) {
+        samples = atomic_load_explicit(&m->buckets[i], memory_order_relaxed);
+        if (samples == 0)
+            continue;
+        off = put(buf, off, &i, sizeof(i));
+        off = put(buf, off, &samples, sizeof(samples));
+        num_buckets++;
+    }
+    buf[num_buckets_off] = num_buckets;
+
+    return off;
+}
+
+int metrics_write_snapshot(const char *path)
+{
+    char tmp_path[PATH_MAX];
+    uint32_t magic = METRICS_SNAPSHOT_MAGIC;
+    uint16_t version = METRICS_SNAPSHOT_VERSION, count;
+    uint64_t boottime_ms;
+    struct timespec now;
+    uint8_t *buf = NULL;
+    size_t off = 0;
+    ssize_t written;
+    int i, n, fd = -1, err = 0;
+
+    buf = malloc(SNAPSHOT_SIZE_MAX);
+    if (buf == NULL)
+        return -ENOMEM;
+
+    n = atomic_load_explicit(&num_metrics, memory_order_acquire);
+    count = n;
+    clock_gettime(CLOCK_BOOTTIME, &now);
+    boottime_ms = (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+    off = put(buf, off, &magic, sizeof(magic));
+    off = put(buf, off, &version, sizeof(version));
+    off = put(buf, off, &count, sizeof(count));
+    off = put(buf, off, &boottime_ms, sizeof(boottime_ms));
+    for (i = 0; i < n; i++)
+        off = put_metric(buf, off, &registry[i]);
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0660);
+    if (fd < 0) {
+        err = -errno;
+        ALOGE("%s: Failed to open %s %d(%s)", __func__, tmp_path, errno,
+            strerror(errno));
+        goto exit;
+    }
+
+    written = write(fd, buf, off);
+    if (written != (ssize_t)off) {
+        err = written < 0 ? -errno : -EIO;
+        ALOGE("%s: Failed to write %s %d(%s)", __func__, tmp_path, -err,
+            strerror(-err));
+        goto exit;
+    }
+
+    if (rename(tmp_path, path) != 0) {
+        err = -errno;
+        ALOGE("%s: Failed to rename %s %d(%s)", __func__, tmp_path, errno,
+            strerror(errno));
+    }
+
+exit:
+    if (fd >= 0)
+        close(fd);
+    if (err != 0)
+        unlink(tmp_path);
+    free(buf);
+    return err;
+}
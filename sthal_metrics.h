@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2018 Knowles Electronics
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _STHAL_METRICS_H_
+#define _STHAL_METRICS_H_
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#if __cplusplus
+extern "C"
+{
+#endif
+
+#define METRICS_MAX             (96)
+#define METRIC_NAME_MAX         (32)
+// Log2 buckets, bucket i holds values below 2^i, the last one the rest
+#define METRIC_BUCKETS          (28)
+
+enum metric_type {
+    METRIC_COUNTER,
+    METRIC_GAUGE,
+    METRIC_HISTOGRAM
+};
+
+/*
+ * Counters and gauges only use value, histograms keep the sum of their
+ * samples in value. Updates are relaxed atomics, a reader can see a sample
+ * in count before its bucket but never loses one.
+ */
+struct metric {
+    char name[METRIC_NAME_MAX];
+    enum metric_type type;
+    atomic_llong value;
+    atomic_llong count;
+    atomic_llong max;
+    atomic_uint buckets[METRIC_BUCKETS];
+};
+
+/*
+ * Binary snapshot, fields in host byte order (little endian on every target):
+ *
+ *   header  u32 magic, u16 version, u16 num_metrics, u64 boottime_ms
+ *   metric  u8 type, u8 name_len, name (not terminated), i64 value
+ *           histograms only: i64 count, i64 max, u8 num_buckets, then
+ *           num_buckets times u8 bucket, u32 samples for the non empty ones
+ */
+#define METRICS_SNAPSHOT_MAGIC      (0x534d5453)
+#define METRICS_SNAPSHOT_VERSION    (1)
+
+/**
+ * Returns the metric called name, registering it on first use. Modules look
+ * their metrics up once and keep the pointer. Never returns NULL, once the
+ * registry is full the metric is counted but not reported.
+ */
+struct metric *metrics_register(const char *name, enum metric_type type);
+
+static inline void metric_add(struct metric *m, long long v)
+{
+    atomic_fetch_add_explicit(&m->value, v, memory_order_relaxed);
+}
+
+static inline void metric_set(struct metric *m, long long v)
+{
+    atomic_store_explicit(&m->value, v, memory_order_relaxed);
+}
+
+void metric_record(struct metric *m, long long v);
+
+/**
+ * Writes every metric to fd as text, or to the log if fd is negative.
+ */
+void metrics_dump(int fd);
+
+/**
+ * Writes a binary snapshot of every metric to path, atomically replacing
+ * the previous one. Returns 0 or -errno.
+ */
+int metrics_write_snapshot(const char *path);
+
+#if __cplusplus
+} // extern "C"
+#endif
+
+#endif
@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2018 Knowles Electronics
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _STHAL_UTIL_H_
+#define _STHAL_UTIL_H_
+
+#include <stdio.h>
+#include <time.h>
+#include <log/log.h>
+
+#if __cplusplus
+extern "C"
+{
+#endif
+
+// Writes a dump line to fd, or to the log when there is no fd
+#define DUMP(fd, ...) \
+    do { \
+        if ((fd) >= 0) \
+            dprintf((fd), __VA_ARGS__); \
+        else \
+            ALOGI(__VA_ARGS__); \
+    } while (0)
+
+static inline long long timespec_diff_us(const struct timespec *end,
+                                        const struct timespec *start)
+{
+    return (long long)(end->tv_sec - start->tv_sec) * 1000000LL +
+            (end->tv_nsec - start->tv_nsec) / 1000;
+}
+
+#if __cplusplus
+} // extern "C"
+#endif
+
+#endif
@@ -0,0 +1,304 @@
+/*
+ * Copyright (C) 2018 Knowles Electronics
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Fake streaming library for sthal_stress. Tunnels only exist in memory and
+ * reads return a known afloat signal after the configured latency, turned
+ * into the stream's format by the same conversions as the real library. A
+ * float read is checked against the Q15 conversion of the same samples.
+ * Each tunnel counts the reads in it, so a read of a closed tunnel or a
+ * close under a read, which the HAL's lock-free read path must never allow,
+ * is caught and counted instead of reading freed memory.
+ */
+
+#define LOG_TAG "fake_adnc_strm"
+
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <log/log.h>
+
+#include "adnc_strm.h"
+#include "adnc_strm_convert.h"
+#include "fake_adnc_strm.h"
+
+#define FAKE_MAX_STREAMS    (16)
+// Samples converted at a time
+#define FAKE_CHUNK_SAMPLES  (256)
+
+/*
+ * A handle is the slot index plus one in the low byte and the generation of
+ * the slot above it, so a stale handle doesn't match a reopened slot.
+ */
+struct fake_stream {
+    atomic_uint gen;
+    atomic_bool is_open;
+    atomic_int readers;
+    int format;
+    atomic_uint next_sample;
+};
+
+static pthread_mutex_t streams_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct fake_stream streams[FAKE_MAX_STREAMS];
+static atomic_uint latency_us;
+
+static atomic_uint num_opens;
+static atomic_uint num_closes;
+static atomic_uint num_reads;
+static atomic_uint num_prefills;
+static atomic_uint num_stale_calls;
+static atomic_uint num_closed_under_reader;
+static atomic_uint num_float_reads;
+static atomic_uint num_format_mismatches;
+
+void fake_adnc_strm_set_latency_us(uint32_t us)
+{
+    atomic_store(&latency_us, us);
+}
+
+void fake_adnc_strm_get_stats(struct fake_adnc_strm_stats *stats)
+{
+    stats->opens = atomic_load(&num_opens);
+    stats->closes = atomic_load(&num_closes);
+    stats->reads = atomic_load(&num_reads);
+    stats->prefills = atomic_load(&num_prefills);
+    stats->stale_calls = atomic_load(&num_stale_calls);
+    stats->closed_under_reader = atomic_load(&num_closed_under_reader);
+    stats->float_reads = atomic_load(&num_float_reads);
+    stats->format_mismatches = atomic_load(&num_format_mismatches);
+}
+
+static struct fake_stream *find_stream(long handle)
+{
+    long slot = (handle & 0xff) - 1;
+    struct fake_stream *s;
+
+    if (slot < 0 || slot >= FAKE_MAX_STREAMS)
+        return NULL;
+
+    s = &streams[slot];
+    if (atomic_load(&s->gen) != (unsigned int)(handle >> 8) ||
+        !atomic_load(&s->is_open))
+        return NULL;
+
+    return s;
+}
+
+/*
+ * Marks a reader before checking the handle, so that it and a close racing
+ * with it can't both miss each other.
+ */
+static struct fake_stream *get_reader(long handle, const char *func)
+{
+    long slot = (handle & 0xff) - 1;
+    struct fake_stream *s;
+
+    if (slot < 0 || slot >= FAKE_MAX_STREAMS) {
+        ALOGE("%s: Invalid handle %lx", func, handle);
+        atomic_fetch_add(&num_stale_calls, 1);
+        return NULL;
+    }
+
+    atomic_fetch_add(&streams[slot].readers, 1);
+    s = find_stream(handle);
+    if (s == NULL) {
+        ALOGE("%s: Tunnel %lx is closed", func, handle);
+        atomic_fetch_sub(&streams[slot].readers, 1);
+        atomic_fetch_add(&num_stale_calls, 1);
+    }
+
+    return s;
+}
+
+static void wait_for_data(void)
+{
+    uint32_t us = atomic_load(&latency_us);
+
+    if (us > 0)
+        usleep(us);
+}
+
+/*
+ * Sample n of the signal as the chip would send it in afloat: full scale
+ * Q15 values a quarter of an LSB off, so that the Q15 conversion has to
+ * round. afloat is an IEEE float with a 6 bit exponent biased by 32 and two
+ * more mantissa bits.
+ */
+static uint32_t fake_afloat_sample(uint32_t n)
+{
+    float value = (int16_t)((n * 2654435761u) >> 16) / 32768.0f +
+                1.0f / 131072.0f;
+    uint32_t bits;
+
+    memcpy(&bits, &value, sizeof(bits));
+    if ((bits & 0x7fffffff) == 0)
+        return bits;
+
+    return (bits & 0x80000000) |
+            ((((bits >> 23) & 0xff) - 127 + 32) << 25) |
+            ((bits & 0x7fffff) << 2);
+}
+
+// Counts the samples where the float and Q15 conversions are an LSB apart
+static void check_float_samples(const float *f32, uint32_t *afloat,
+                                uint32_t count)
+{
+    int16_t q15[FAKE_CHUNK_SAMPLES];
+    float q15_f32[FAKE_CHUNK_SAMPLES];
+    uint32_t i;
+
+    kst_float_to_q15_vector(q15, afloat, count);
+    kst_q15_to_f32_vector(q15_f32, q15, count);
+    for (i = 0; i < count; i++) {
+        float diff = f32[i] - q15_f32[i];
+
+        if (diff >= 1.0f / 32768.0f || diff <= -1.0f / 32768.0f) {
+            ALOGE("%s: float %f, Q15 %d", __func__, f32[i], q15[i]);
+            atomic_fetch_add(&num_format_mismatches, 1);
+            return;
+        }
+    }
+}
+
+static void fill_samples(struct fake_stream *s, void *buffer, size_t bytes)
+{
+    size_t sample_size = s->format == ADNC_STRM_FORMAT_FLOAT ?
+                        sizeof(float) : sizeof(int16_t);
+    size_t count = bytes / sample_size;
+    uint32_t afloat[FAKE_CHUNK_SAMPLES];
+    uint8_t *dst = buffer;
+    uint32_t n, chunk, i;
+
+    n = atomic_fetch_add(&s->next_sample, count);
+    while (count > 0) {
+        chunk = count < FAKE_CHUNK_SAMPLES ? count : FAKE_CHUNK_SAMPLES;
+        for (i = 0; i < chunk; i++)
+            afloat[i] = fake_afloat_sample(n + i);
+
+        if (s->format == ADNC_STRM_FORMAT_FLOAT) {
+            kst_float_to_f32_vector((uint32_t *)dst, afloat, chunk);
+            check_float_samples((const float *)dst, afloat, chunk);
+        } else {
+            kst_float_to_q15_vector(dst, afloat, chunk);
+        }
+        dst += chunk * sample_size;
+        n += chunk;
+        count -= chunk;
+    }
+    memset(dst, 0, bytes % sample_size);
+}
+
+static long open_stream(int format)
+{
+    long handle = 0;
+    int i;
+
+    pthread_mutex_lock(&streams_lock);
+    for (i = 0; i < FAKE_MAX_STREAMS; i++) {
+        struct fake_stream *s = &streams[i];
+
+        if (atomic_load(&s->is_open))
+            continue;
+        handle = ((long)(atomic_fetch_add(&s->gen, 1) + 1) << 8) | (i + 1);
+        s->format = format;
+        atomic_store(&s->next_sample, 0);
+        atomic_store(&s->is_open, true);
+        atomic_fetch_add(&num_opens, 1);
+        break;
+    }
+    pthread_mutex_unlock(&streams_lock);
+
+    if (handle == 0)
+        ALOGE("%s: Out of tunnels", __func__);
+
+    return handle;
+}
+
+long adnc_strm_open(bool enable_stripping, unsigned int kw_start_frame,
+                    int stream_end_point)
+{
+    return open_stream(ADNC_STRM_FORMAT_Q15);
+}
+
+long adnc_strm_open_format(bool enable_stripping, unsigned int kw_start_frame,
+                        int stream_end_point, int format)
+{
+    if (format != ADNC_STRM_FORMAT_Q15 && format != ADNC_STRM_FORMAT_FLOAT) {
+        ALOGE("%s: Unsupported format %d", __func__, format);
+        return 0;
+    }
+
+    return open_stream(format);
+}
+
+size_t adnc_strm_read(long handle, void *buffer, size_t bytes)
+{
+    struct fake_stream *s = get_reader(handle, __func__);
+
+    if (s == NULL)
+        return 0;
+
+    wait_for_data();
+    fill_samples(s, buffer, bytes);
+    atomic_fetch_add(&num_reads, 1);
+    if (s->format == ADNC_STRM_FORMAT_FLOAT)
+        atomic_fetch_add(&num_float_reads, 1);
+    atomic_fetch_sub(&s->readers, 1);
+
+    return bytes;
+}
+
+int adnc_strm_prefill(long handle, size_t bytes)
+{
+    struct fake_stream *s = get_reader(handle, __func__);
+
+    if (s == NULL)
+        return -EINVAL;
+
+    wait_for_data();
+    atomic_fetch_add(&num_prefills, 1);
+    atomic_fetch_sub(&s->readers, 1);
+
+    // Pretend it all arrived at once, the HAL then stops prefilling
+    return bytes;
+}
+
+int adnc_strm_close(long handle)
+{
+    struct fake_stream *s;
+
+    pthread_mutex_lock(&streams_lock);
+    s = find_stream(handle);
+    if (s == NULL) {
+        pthread_mutex_unlock(&streams_lock);
+        ALOGE("%s: Tunnel %lx is already closed", __func__, handle);
+        atomic_fetch_add(&num_stale_calls, 1);
+        return -EINVAL;
+    }
+
+    atomic_store(&s->is_open, false);
+    if (atomic_load(&s->readers) > 0) {
+        ALOGE("%s: Tunnel %lx closed under a reader", __func__, handle);
+        atomic_fetch_add(&num_closed_under_reader, 1);
+    }
+    atomic_fetch_add(&num_closes, 1);
+    pthread_mutex_unlock(&streams_lock);
+
+    return 0;
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2018 Knowles Electronics
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _FAKE_ADNC_STRM_H_
+#define _FAKE_ADNC_STRM_H_
+
+#include <stdint.h>
+
+/*
+ * Stand-in for adnc_strm.primary.default, see fake_adnc_strm.c. It is
+ * dlopened by the HAL, sthal_stress gets at these through dlsym() on the
+ * same library.
+ */
+struct fake_adnc_strm_stats {
+    uint32_t opens;
+    uint32_t closes;
+    uint32_t reads;
+    uint32_t prefills;
+    // Reads, prefills or closes of a tunnel that was already closed
+    uint32_t stale_calls;
+    // Closes while a read or prefill was still in the tunnel
+    uint32_t closed_under_reader;
+    uint32_t float_reads;
+    // Float reads that didn't match the Q15 conversion of the same samples
+    uint32_t format_mismatches;
+};
+
+// Every read and prefill sleeps this long, the time a period takes to arrive
+void fake_adnc_strm_set_latency_us(uint32_t latency_us);
+void fake_adnc_strm_get_stats(struct fake_adnc_strm_stats *stats);
+
+typedef void (*fake_adnc_strm_set_latency_us_t)(uint32_t latency_us);
+typedef void (*fake_adnc_strm_get_stats_t)(struct fake_adnc_strm_stats *stats);
+
+#endif
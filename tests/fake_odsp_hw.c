@@ -0,0 +1,384 @@
+/*
+ * Copyright (C) 2018 Knowles Electronics
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Fake chip backend for sthal_stress. It implements the part of the libodsp
+ * API used by the HAL without touching /dev/iaxxx-odsp-celldrv: packages and
+ * plugins are only tracked in memory, parameters are accepted and dropped,
+ * and the firmware always reports idle so that the HAL comes up without a
+ * download. Event reads return what fake_odsp_queue_event() queued, as
+ * the driver's event queue would.
+ */
+
+#define LOG_TAG "fake_odsp_hw"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <log/log.h>
+
+#include "iaxxx_odsp_hw.h"
+#include "fake_odsp_hw.h"
+
+#define FAKE_MAX_INSTANCES  (32)
+#define FAKE_FW_VERSION     (0x00010000)
+#define FAKE_FW_VERSION_STR "fake-odsp-1.0"
+#define FAKE_MAX_EVENTS     (32)
+
+struct iaxxx_odsp_hw {
+    pthread_mutex_t lock;
+    bool is_created[FAKE_MAX_INSTANCES];
+};
+
+static atomic_uint latency_us;
+static atomic_uint num_calls;
+
+static pthread_mutex_t events_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct iaxxx_get_event_info events[FAKE_MAX_EVENTS];
+static unsigned int events_head, events_tail;
+
+void fake_odsp_set_latency_us(uint32_t us)
+{
+    atomic_store(&latency_us, us);
+}
+
+uint32_t fake_odsp_get_num_calls(void)
+{
+    return atomic_load(&num_calls);
+}
+
+int fake_odsp_queue_event(uint16_t event_id, uint32_t data)
+{
+    int err = 0;
+
+    pthread_mutex_lock(&events_lock);
+    if (events_tail - events_head == FAKE_MAX_EVENTS) {
+        err = -ENOSPC;
+    } else {
+        events[events_tail % FAKE_MAX_EVENTS].event_id = event_id;
+        events[events_tail % FAKE_MAX_EVENTS].data = data;
+        events_tail++;
+    }
+    pthread_mutex_unlock(&events_lock);
+
+    return err;
+}
+
+static int fake_call(struct iaxxx_odsp_hw *odsp_hw_hdl)
+{
+    uint32_t us = atomic_load(&latency_us);
+
+    if (odsp_hw_hdl == NULL) {
+        ALOGE("%s: ERROR: Invalid handle to iaxxx_odsp_hw", __func__);
+        errno = EINVAL;
+        return -1;
+    }
+
+    atomic_fetch_add(&num_calls, 1);
+    if (us > 0)
+        usleep(us);
+
+    return 0;
+}
+
+static int set_created(struct iaxxx_odsp_hw *odsp_hw_hdl, uint32_t inst_id,
+                    bool is_created)
+{
+    if (fake_call(odsp_hw_hdl) != 0)
+        return -1;
+
+    if (inst_id >= FAKE_MAX_INSTANCES) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&odsp_hw_hdl->lock);
+    odsp_hw_hdl->is_created[inst_id] = is_created;
+    pthread_mutex_unlock(&odsp_hw_hdl->lock);
+
+    return 0;
+}
+
+struct iaxxx_odsp_hw* iaxxx_odsp_init()
+{
+    struct iaxxx_odsp_hw *ioh;
+
+    ioh = (struct iaxxx_odsp_hw *)calloc(1, sizeof(struct iaxxx_odsp_hw));
+    if (ioh == NULL) {
+        ALOGE("%s: ERROR: Failed to allocate memory for iaxxx_odsp_hw",
+                __func__);
+        return NULL;
+    }
+    pthread_mutex_init(&ioh->lock, NULL);
+
+    return ioh;
+}
+
+int iaxxx_odsp_deinit(struct iaxxx_odsp_hw *odsp_hw_hdl)
+{
+    if (odsp_hw_hdl == NULL)
+        return -1;
+
+    pthread_mutex_destroy(&odsp_hw_hdl->lock);
+    free(odsp_hw_hdl);
+
+    return 0;
+}
+
+int iaxxx_odsp_package_load(struct iaxxx_odsp_hw *odsp_hw_hdl,
+                            const char *pkg_name, const uint32_t pkg_id)
+{
+    ALOGV("%s: %s id %u", __func__, pkg_name, pkg_id);
+    return fake_call(odsp_hw_hdl);
+}
+
+int iaxxx_odsp_package_unload(struct iaxxx_odsp_hw *odsp_hw_hdl,
+                            const uint32_t pkg_id)
+{
+    return fake_call(odsp_hw_hdl);
+}
+
+int iaxxx_odsp_plugin_get_package_version(struct iaxxx_odsp_hw *odsp_hw_hdl,
+                                        uint8_t inst_id, char *version,
+                                        uint32_t len)
+{
+    if (fake_call(odsp_hw_hdl) != 0)
+        return -1;
+
+    strlcpy(version, FAKE_FW_VERSION_STR, len);
+    return 0;
+}
+
+int iaxxx_odsp_plugin_get_plugin_version(struct iaxxx_odsp_hw *odsp_hw_hdl,
+                                        uint8_t inst_id, char *version,
+                                        uint32_t len)
+{
+    if (fake_call(odsp_hw_hdl) != 0)
+        return -1;
+
+    strlcpy(version, FAKE_FW_VERSION_STR, len);
+    return 0;
+}
+
+int iaxxx_odsp_plugin_create(struct iaxxx_odsp_hw *odsp_hw_hdl,
+                            const uint32_t inst_id,
+                            const uint32_t priority,
+                            const uint32_t pkg_id,
+                            const uint32_t plg_idx,
+                            const uint32_t block_id,
+                            const uint32_t config_id)
+{
+    return set_created(odsp_hw_hdl, inst_id, true);
+}
+
+int iaxxx_odsp_plugin_set_creation_config(struct iaxxx_odsp_hw *odsp_hw_hdl,
+                                        const uint32_t inst_id,
+                                        const uint32_t block_id,
+                                        struct iaxxx_create_config_data cdata)
+{
+    return fake_call(odsp_hw_hdl);
+}
+
+int iaxxx_odsp_plugin_destroy(struct iaxxx_odsp_hw *odsp_hw_hdl,
+                            const uint32_t inst_id,
+                            const uint32_t block_id)
+{
+    return set_created(odsp_hw_hdl, inst_id, false);
+}
+
+int iaxxx_odsp_plugin_set_parameter(struct iaxxx_odsp_hw *odsp_hw_hdl,
+                                    const uint32_t inst_id,
+                                    const uint32_t param_id,
+                                    const uint32_t param_val,
+                                    const uint32_t block_id)
+{
+    return fake_call(odsp_hw_hdl);
+}
+
+int iaxxx_odsp_plugin_set_parameter_blk(struct iaxxx_odsp_hw *odsp_hw_hdl,
+                                        const uint32_t inst_id,
+                                        const uint32_t param_blk_id,
+                                        const uint32_t block_id,
+                                        const void *param_buf,
+                                        const uint32_t param_buf_sz)
+{
+    return fake_call(odsp_hw_hdl);
+}
+
+int iaxxx_odsp_plugin_get_parameter_blk(struct iaxxx_odsp_hw *odsp_hw_hdl,
+                                        const uint32_t inst_id,
+                                        const uint32_t block_id,
+                                        const uint32_t param_blk_id,
+                                        uint32_t *param_buf,
+                                        const uint32_t param_buf_sz)
+{
+    if (fake_call(odsp_hw_hdl) != 0)
+        return -1;
+
+    memset(param_buf, 0, param_buf_sz * sizeof(uint32_t));
+    return 0;
+}
+
+int iaxxx_odsp_plugin_setevent(struct iaxxx_odsp_hw *odsp_hw_hdl,
+                              const uint32_t inst_id,
+                              const uint32_t eventEnableMask,
+                              const uint32_t block_id)
+{
+    return fake_call(odsp_hw_hdl);
+}
+
+int iaxxx_odsp_plugin_get_status_info(struct iaxxx_odsp_hw *odsp_hw_hdl,
+                            const uint32_t inst_id,
+                            struct iaxxx_plugin_status_data *plugin_status_data)
+{
+    if (fake_call(odsp_hw_hdl) != 0)
+        return -1;
+
+    if (inst_id >= FAKE_MAX_INSTANCES) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(plugin_status_data, 0, sizeof(*plugin_status_data));
+    pthread_mutex_lock(&odsp_hw_hdl->lock);
+    plugin_status_data->create_status = odsp_hw_hdl->is_created[inst_id];
+    pthread_mutex_unlock(&odsp_hw_hdl->lock);
+
+    return 0;
+}
+
+int iaxxx_odsp_plugin_get_ep_timestamps(struct iaxxx_odsp_hw *odsp_hw_hdl,
+                                    uint64_t *timestamps,
+                                    uint8_t proc_id)
+{
+    struct timespec now;
+    int i;
+
+    if (fake_call(odsp_hw_hdl) != 0)
+        return -1;
+
+    // The chip clock runs in us from the host's boot
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (i = 0; i < 16; i++)
+        timestamps[i] = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+
+    return 0;
+}
+
+int iaxxx_odsp_evt_subscribe(struct iaxxx_odsp_hw *odsp_hw_hdl,
+                            const uint16_t src_id,
+                            const uint16_t event_id,
+                            const uint16_t dst_id,
+                            const uint32_t dst_opaque)
+{
+    return fake_call(odsp_hw_hdl);
+}
+
+int iaxxx_odsp_evt_unsubscribe(struct iaxxx_odsp_hw *odsp_hw_hdl,
+                            const uint16_t src_id,
+                            const uint16_t event_id,
+                            const uint16_t dst_id)
+{
+    return fake_call(odsp_hw_hdl);
+}
+
+int iaxxx_odsp_evt_trigger(struct iaxxx_odsp_hw *odsp_hw_hdl,
+                        uint16_t src_id,
+                        uint16_t evt_id,
+                        uint32_t src_opaque)
+{
+    return fake_call(odsp_hw_hdl);
+}
+
+int iaxxx_odsp_evt_getevent(struct iaxxx_odsp_hw *odsp_hw_hdl,
+                            struct iaxxx_get_event_info *event_info)
+{
+    int err = 0;
+
+    if (fake_call(odsp_hw_hdl) != 0)
+        return -1;
+
+    pthread_mutex_lock(&events_lock);
+    if (events_head == events_tail) {
+        errno = ENOENT;
+        err = -1;
+    } else {
+        *event_info = events[events_head % FAKE_MAX_EVENTS];
+        events_head++;
+    }
+    pthread_mutex_unlock(&events_lock);
+
+    return err;
+}
+
+int iaxxx_odsp_evt_read_subscription(struct iaxxx_odsp_hw *odsp_hw_hdl,
+                                    uint16_t *src_id,
+                                    uint16_t *evt_id,
+                                    uint16_t *dst_id,
+                                    uint32_t *dst_opaque)
+{
+    if (fake_call(odsp_hw_hdl) != 0)
+        return -1;
+
+    // The subscription table is always empty
+    errno = ENOENT;
+    return -1;
+}
+
+int iaxxx_odsp_evt_reset_read_index(struct iaxxx_odsp_hw *odsp_hw_hdl)
+{
+    return fake_call(odsp_hw_hdl);
+}
+
+int iaxxx_odsp_get_sys_versions(struct iaxxx_odsp_hw *odsp_hw_hdl,
+                                uint32_t *rom_ver_num,
+                                char *rom_ver_str,
+                                uint32_t rom_ver_str_len,
+                                uint32_t *app_ver_num,
+                                char *app_ver_str,
+                                uint32_t app_ver_str_len)
+{
+    if (fake_call(odsp_hw_hdl) != 0)
+        return -1;
+
+    *rom_ver_num = FAKE_FW_VERSION;
+    strlcpy(rom_ver_str, FAKE_FW_VERSION_STR, rom_ver_str_len);
+    *app_ver_num = FAKE_FW_VERSION;
+    strlcpy(app_ver_str, FAKE_FW_VERSION_STR, app_ver_str_len);
+
+    return 0;
+}
+
+int iaxxx_odsp_get_fw_status(struct iaxxx_odsp_hw *odsp_hw_hdl,
+                            uint32_t *status)
+{
+    if (fake_call(odsp_hw_hdl) != 0)
+        return -1;
+
+    *status = IAXXX_FW_IDLE;
+    return 0;
+}
+
+int iaxxx_odsp_reset_fw(struct iaxxx_odsp_hw *odsp_hw_hdl)
+{
+    return fake_call(odsp_hw_hdl);
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright (C) 2018 Knowles Electronics
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _FAKE_ODSP_HW_H_
+#define _FAKE_ODSP_HW_H_
+
+#include <stdint.h>
+
+/*
+ * In-memory stand-in for libodsp, see fake_odsp_hw.c. Every call sleeps for
+ * the configured latency to mimic the SPI round trip to the chip.
+ */
+void fake_odsp_set_latency_us(uint32_t latency_us);
+uint32_t fake_odsp_get_num_calls(void);
+
+/*
+ * Queues an event for iaxxx_odsp_evt_getevent(), returns -ENOSPC if the
+ * queue is full. The HAL only looks for it on its next IAXXX_VQ_EVENT.
+ */
+int fake_odsp_queue_event(uint16_t event_id, uint32_t data);
+
+#endif
@@ -0,0 +1,595 @@
+/*
+ * Copyright (C) 2018 Knowles Electronics
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Drives the HAL from several threads at once to catch lock contention and
+ * locking regressions. The HAL is linked in with the fake chip backend of
+ * fake_odsp_hw.c and dlopens the fake tunnels of fake_adnc_strm.c, so models
+ * are loaded, started, detected and stopped without any firmware, while the
+ * framework, AHAL and tunnel read paths are hammered concurrently.
+ *
+ * The run fails if any HAL call fails or takes longer than the -m limit, if
+ * a recognition callback comes in after stop_recognition() returned, or if
+ * a tunnel is read after its close or closed under a read. Repeated reads
+ * of a tunnel go through the HAL's lock-free read path. The lock profile of
+ * the HAL is printed at the end.
+ *
+ * Detections are queued on the fake chip and announced to the HAL with a
+ * synthetic IAXXX_VQ_EVENT uevent, written to the uevent file of -u. That
+ * needs root and a kernel with synthetic uevent arguments (4.13 or later).
+ * The HAL still opens the iaxxx sound card and its mixer paths, so run this
+ * on the target with the sound trigger HAL service stopped.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <hardware/hardware.h>
+#include <hardware/sound_trigger.h>
+
+// The AHAL exports this one, don't clash with the HAL's copy of it
+#define sthal_prop_api_version sthal_stress_prop_api_version
+#include "sound_trigger_intf.h"
+#undef sthal_prop_api_version
+#include "sound_trigger_hw_iaxxx.h"
+#include "fake_odsp_hw.h"
+#include "fake_adnc_strm.h"
+
+#define DEFAULT_DURATION_S      (10)
+#define DEFAULT_LATENCY_US      (200)
+#define DEFAULT_TUNNEL_LATENCY_US   (1000)
+#define DEFAULT_MAX_CALL_MS     (250)
+#define DEFAULT_UEVENT_PATH     "/sys/devices/virtual/mem/null/uevent"
+#define READ_BUF_SIZE           (640)
+#define READS_PER_BURST         (16)
+#define FAKE_MODEL_SIZE         (1024)
+#define HAL_READY_TIMEOUT_MS    (5000)
+
+// The HAL matches the value of any field against its event names
+#define SYNTH_VQ_EVENT \
+    "change 00000000-0000-0000-0000-000000000000 EVENT=IAXXX_VQ_EVENT"
+
+// Provided by the HAL
+extern struct sound_trigger_module HAL_MODULE_INFO_SYM;
+extern int sound_trigger_hw_call_back(audio_event_type_t event,
+                                    struct audio_event_info *config);
+extern bool str_to_uuid(char *uuid_str, sound_trigger_uuid_t *uuid);
+
+// The slowest HAL call a worker made
+struct call_stats {
+    long long max_us;
+    const char *max_call;
+};
+
+struct model_worker {
+    const char *name;
+    const char *uuid_str;
+    sound_trigger_sound_model_type_t type;
+    // Event id the HAL maps to this model, its keyword id
+    uint16_t event_id;
+    // Capture handle of the recognition config, used by the reader
+    int capture_handle;
+    pthread_t thread;
+    unsigned int cycles;
+    unsigned int errors;
+    struct call_stats calls;
+    // From before start_recognition() until its stop has returned
+    atomic_bool is_started;
+    atomic_uint callbacks;
+    atomic_uint late_callbacks;
+};
+
+struct event_worker {
+    const char *name;
+    void *(*loop)(void *);
+    pthread_t thread;
+    unsigned int cycles;
+    unsigned int errors;
+    struct call_stats calls;
+};
+
+static struct sound_trigger_hw_device *stdev;
+static atomic_bool is_running;
+static const char *uevent_path = DEFAULT_UEVENT_PATH;
+
+static struct model_worker model_workers[] = {
+    {
+        .name = "hotword",
+        .uuid_str = HOTWORD_AUDIO_MODEL,
+        .type = SOUND_MODEL_TYPE_KEYPHRASE,
+        .event_id = 0,
+        .capture_handle = 1001,
+    },
+    {
+        .name = "ambient",
+        .uuid_str = AMBIENT_AUDIO_MODEL,
+        .type = SOUND_MODEL_TYPE_GENERIC,
+        .event_id = 1,
+        .capture_handle = 1002,
+    },
+    {
+        .name = "entity",
+        .uuid_str = ENTITY_AUDIO_MODEL,
+        .type = SOUND_MODEL_TYPE_GENERIC,
+        .event_id = 2,
+        .capture_handle = 1003,
+    },
+};
+
+#define NUM_MODEL_WORKERS \
+    (sizeof(model_workers) / sizeof(model_workers[0]))
+
+static long long now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void note_call(struct call_stats *cs, const char *call,
+                    long long start_us)
+{
+    long long us = now_us() - start_us;
+
+    if (us > cs->max_us) {
+        cs->max_us = us;
+        cs->max_call = call;
+    }
+}
+
+// No callback of a session may come in once its stop has returned
+static void recognition_cb(struct sound_trigger_recognition_event *event,
+                        void *cookie)
+{
+    struct model_worker *w = (struct model_worker *)cookie;
+
+    atomic_fetch_add(&w->callbacks, 1);
+    if (!atomic_load(&w->is_started))
+        atomic_fetch_add(&w->late_callbacks, 1);
+}
+
+static void sound_model_cb(struct sound_trigger_model_event *event,
+                        void *cookie)
+{
+}
+
+static void pause_us(unsigned int max_us)
+{
+    usleep(rand() % (max_us + 1));
+}
+
+static void *model_loop(void *arg)
+{
+    struct model_worker *w = (struct model_worker *)arg;
+    struct sound_trigger_sound_model *model;
+    struct sound_trigger_recognition_config config;
+    sound_model_handle_t handle;
+
+    model = calloc(1, sizeof(*model) + FAKE_MODEL_SIZE);
+    if (model == NULL)
+        return NULL;
+
+    model->type = w->type;
+    str_to_uuid((char *)w->uuid_str, &model->vendor_uuid);
+    model->data_size = FAKE_MODEL_SIZE;
+    model->data_offset = sizeof(*model);
+
+    memset(&config, 0, sizeof(config));
+    config.capture_handle = w->capture_handle;
+    config.capture_requested = true;
+
+    while (atomic_load(&is_running)) {
+        long long start = now_us();
+        bool is_stopped;
+
+        if (stdev->load_sound_model(stdev, model, sound_model_cb, NULL,
+                                    &handle) != 0) {
+            w->errors++;
+            pause_us(1000);
+            continue;
+        }
+        note_call(&w->calls, "load_sound_model", start);
+
+        atomic_store(&w->is_started, true);
+        start = now_us();
+        if (stdev->start_recognition(stdev, handle, &config,
+                                    recognition_cb, w) != 0)
+            w->errors++;
+        note_call(&w->calls, "start_recognition", start);
+        pause_us(2000);
+
+        start = now_us();
+        is_stopped = stdev->stop_recognition(stdev, handle) == 0;
+        note_call(&w->calls, "stop_recognition", start);
+        if (is_stopped)
+            atomic_store(&w->is_started, false);
+        else
+            w->errors++;
+
+        start = now_us();
+        if (stdev->unload_sound_model(stdev, handle) != 0)
+            w->errors++;
+        note_call(&w->calls, "unload_sound_model", start);
+        atomic_store(&w->is_started, false);
+        w->cycles++;
+    }
+
+    free(model);
+    return NULL;
+}
+
+/*
+ * Reads a burst from one capture handle before stopping it. The first read
+ * opens the tunnel under strm_lock, the others are lock-free and race with
+ * the close of stop_recognition().
+ */
+static void *read_loop(void *arg)
+{
+    struct event_worker *w = (struct event_worker *)arg;
+    struct sound_trigger_session_info ses_info;
+    struct audio_event_info info;
+    char buf[READ_BUF_SIZE];
+    long long start;
+    int i = 0, j, n;
+
+    memset(&ses_info, 0, sizeof(ses_info));
+    while (atomic_load(&is_running)) {
+        struct model_worker *m = &model_workers[i++ % NUM_MODEL_WORKERS];
+
+        n = 1 + rand() % READS_PER_BURST;
+        for (j = 0; j < n && atomic_load(&is_running); j++) {
+            ses_info.capture_handle = m->capture_handle;
+            memset(&info, 0, sizeof(info));
+            info.u.aud_info.ses_info = &ses_info;
+            info.u.aud_info.buf = buf;
+            info.u.aud_info.num_bytes = sizeof(buf);
+            start = now_us();
+            // Fails whenever the model isn't started, which is fine
+            if (sound_trigger_hw_call_back(AUDIO_EVENT_READ_SAMPLES,
+                                        &info) != 0)
+                break;
+            note_call(&w->calls, "AUDIO_EVENT_READ_SAMPLES", start);
+        }
+
+        memset(&info, 0, sizeof(info));
+        info.u.ses_info.capture_handle = m->capture_handle;
+        start = now_us();
+        sound_trigger_hw_call_back(AUDIO_EVENT_STOP_LAB, &info);
+        note_call(&w->calls, "AUDIO_EVENT_STOP_LAB", start);
+        w->cycles++;
+        pause_us(500);
+    }
+
+    return NULL;
+}
+
+static void *playback_loop(void *arg)
+{
+    struct event_worker *w = (struct event_worker *)arg;
+    struct audio_event_info info;
+
+    memset(&info, 0, sizeof(info));
+    info.u.usecase.type = USECASE_TYPE_PCM_PLAYBACK;
+    info.device_info.device = AUDIO_DEVICE_OUT_SPEAKER;
+    while (atomic_load(&is_running)) {
+        long long start = now_us();
+
+        if (sound_trigger_hw_call_back(AUDIO_EVENT_PLAYBACK_STREAM_ACTIVE,
+                                    &info) != 0)
+            w->errors++;
+        note_call(&w->calls, "AUDIO_EVENT_PLAYBACK_STREAM_ACTIVE", start);
+        pause_us(5000);
+        start = now_us();
+        if (sound_trigger_hw_call_back(AUDIO_EVENT_PLAYBACK_STREAM_INACTIVE,
+                                    &info) != 0)
+            w->errors++;
+        note_call(&w->calls, "AUDIO_EVENT_PLAYBACK_STREAM_INACTIVE", start);
+        w->cycles++;
+        pause_us(5000);
+    }
+
+    return NULL;
+}
+
+static void *capture_loop(void *arg)
+{
+    struct event_worker *w = (struct event_worker *)arg;
+    struct audio_event_info info;
+
+    memset(&info, 0, sizeof(info));
+    info.u.usecase.type = USECASE_TYPE_PCM_CAPTURE;
+    while (atomic_load(&is_running)) {
+        long long start = now_us();
+
+        if (sound_trigger_hw_call_back(AUDIO_EVENT_CAPTURE_DEVICE_ACTIVE,
+                                    &info) != 0)
+            w->errors++;
+        note_call(&w->calls, "AUDIO_EVENT_CAPTURE_DEVICE_ACTIVE", start);
+        pause_us(20000);
+        start = now_us();
+        if (sound_trigger_hw_call_back(AUDIO_EVENT_CAPTURE_DEVICE_INACTIVE,
+                                    &info) != 0)
+            w->errors++;
+        note_call(&w->calls, "AUDIO_EVENT_CAPTURE_DEVICE_INACTIVE", start);
+        w->cycles++;
+        pause_us(20000);
+    }
+
+    return NULL;
+}
+
+/*
+ * Detects a random model, whether it's started or not, so that detections
+ * race with stop_recognition() and the delivery of their callbacks too.
+ */
+static void *detect_loop(void *arg)
+{
+    struct event_worker *w = (struct event_worker *)arg;
+    int fd;
+
+    fd = open(uevent_path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open %s %d(%s)\n", uevent_path, errno,
+            strerror(errno));
+        w->errors++;
+        return NULL;
+    }
+
+    while (atomic_load(&is_running)) {
+        struct model_worker *m = &model_workers[rand() % NUM_MODEL_WORKERS];
+
+        if (fake_odsp_queue_event(m->event_id, 0) == 0 &&
+            write(fd, SYNTH_VQ_EVENT, strlen(SYNTH_VQ_EVENT)) < 0)
+            w->errors++;
+        w->cycles++;
+        pause_us(10000);
+    }
+
+    close(fd);
+    return NULL;
+}
+
+static struct event_worker event_workers[] = {
+    { .name = "read", .loop = read_loop },
+    { .name = "playback", .loop = playback_loop },
+    { .name = "capture", .loop = capture_loop },
+    { .name = "detect", .loop = detect_loop },
+};
+
+/*
+ * The HAL finishes its bring up on the callback thread, load_sound_model
+ * fails with -EAGAIN until then.
+ */
+static int wait_for_hal_ready(void)
+{
+    struct sound_trigger_sound_model *model;
+    sound_model_handle_t handle;
+    int waited_ms, err = -EAGAIN;
+
+    model = calloc(1, sizeof(*model) + FAKE_MODEL_SIZE);
+    if (model == NULL)
+        return -ENOMEM;
+
+    model->type = SOUND_MODEL_TYPE_KEYPHRASE;
+    str_to_uuid((char *)HOTWORD_AUDIO_MODEL, &model->vendor_uuid);
+    model->data_size = FAKE_MODEL_SIZE;
+    model->data_offset = sizeof(*model);
+
+    for (waited_ms = 0; waited_ms < HAL_READY_TIMEOUT_MS; waited_ms += 10) {
+        err = stdev->load_sound_model(stdev, model, sound_model_cb, NULL,
+                                    &handle);
+        if (err != -EAGAIN)
+            break;
+        usleep(10 * 1000);
+    }
+
+    if (err == 0)
+        stdev->unload_sound_model(stdev, handle);
+
+    free(model);
+    return err;
+}
+
+void usage() {
+    fputs("\
+    USAGE -\n\
+    -------\n\
+    sthal_stress [-d <seconds>] [-l <odsp-latency-us>]\n\
+                 [-t <tunnel-latency-us>] [-m <max-call-ms>]\n\
+                 [-u <uevent-file>]\n\
+    Runs model load/start/stop/unload, detections, tunnel reads and AHAL\n\
+    playback and capture events concurrently against the HAL on a fake\n\
+    chip, then prints the lock profile of the HAL. Exits with 1 if a HAL\n\
+    call failed or took longer than max-call-ms, a callback came in after\n\
+    its stop, or a tunnel was read after its close.\n\n", stdout);
+
+    exit(0);
+}
+
+// Prints a worker's results, returns true if it failed
+static bool report_worker(const char *name, unsigned int cycles,
+                        unsigned int errors, const struct call_stats *cs,
+                        long long max_call_us)
+{
+    bool is_failed = errors > 0 || cs->max_us > max_call_us;
+
+    fprintf(stdout, "%s: %u cycles, %u errors, slowest %s %lld us%s\n", name,
+        cycles, errors, cs->max_call ? cs->max_call : "-", cs->max_us,
+        is_failed ? "  FAIL" : "");
+
+    return is_failed;
+}
+
+int main(int argc, char **argv)
+{
+    struct hw_device_t *device = NULL;
+    struct fake_adnc_strm_stats strm_stats;
+    fake_adnc_strm_set_latency_us_t strm_set_latency_us;
+    fake_adnc_strm_get_stats_t strm_get_stats;
+    void *strm_lib;
+    unsigned int duration_s = DEFAULT_DURATION_S;
+    unsigned int latency_us = DEFAULT_LATENCY_US;
+    unsigned int tunnel_latency_us = DEFAULT_TUNNEL_LATENCY_US;
+    long long max_call_us = DEFAULT_MAX_CALL_MS * 1000LL;
+    unsigned int num_events, i;
+    bool is_failed = false;
+    int err = 0;
+    int ch;
+
+    while ((ch = getopt(argc, argv, "d:l:t:m:u:h")) != -1) {
+        switch (ch) {
+        case 'd':
+            duration_s = atoi(optarg);
+            break;
+        case 'l':
+            latency_us = atoi(optarg);
+            break;
+        case 't':
+            tunnel_latency_us = atoi(optarg);
+            break;
+        case 'm':
+            max_call_us = atoi(optarg) * 1000LL;
+            break;
+        case 'u':
+            uevent_path = optarg;
+            break;
+        case 'h':
+        default:
+            usage();
+        }
+    }
+
+    srand(time(NULL));
+    fake_odsp_set_latency_us(latency_us);
+
+    // The same library the HAL dlopens for its tunnels
+    strm_lib = dlopen(ADNC_STRM_LIBRARY_PATH, RTLD_NOW);
+    if (strm_lib == NULL) {
+        fprintf(stderr, "Failed to load %s: %s\n", ADNC_STRM_LIBRARY_PATH,
+            dlerror());
+        return -1;
+    }
+    strm_set_latency_us = (fake_adnc_strm_set_latency_us_t)dlsym(strm_lib,
+                                            "fake_adnc_strm_set_latency_us");
+    strm_get_stats = (fake_adnc_strm_get_stats_t)dlsym(strm_lib,
+                                            "fake_adnc_strm_get_stats");
+    if (strm_set_latency_us == NULL || strm_get_stats == NULL) {
+        fprintf(stderr, "%s isn't the fake tunnel library\n",
+            ADNC_STRM_LIBRARY_PATH);
+        dlclose(strm_lib);
+        return -1;
+    }
+    strm_set_latency_us(tunnel_latency_us);
+
+    err = HAL_MODULE_INFO_SYM.common.methods->open(
+        &HAL_MODULE_INFO_SYM.common, SOUND_TRIGGER_HARDWARE_INTERFACE,
+        &device);
+    if (err != 0) {
+        fprintf(stderr, "Failed to open the HAL %d(%s)\n", err, strerror(-err));
+        dlclose(strm_lib);
+        return -1;
+    }
+    stdev = (struct sound_trigger_hw_device *)device;
+
+    err = wait_for_hal_ready();
+    if (err != 0) {
+        fprintf(stderr, "HAL isn't ready %d(%s)\n", err, strerror(-err));
+        goto exit;
+    }
+
+    num_events = sizeof(event_workers) / sizeof(event_workers[0]);
+
+    fprintf(stdout, "Running %zu threads for %u s, %u us per chip access, "
+        "%u us per tunnel read, calls limited to %lld ms\n",
+        NUM_MODEL_WORKERS + num_events, duration_s, latency_us,
+        tunnel_latency_us, max_call_us / 1000);
+    atomic_store(&is_running, true);
+    for (i = 0; i < NUM_MODEL_WORKERS; i++)
+        pthread_create(&model_workers[i].thread, NULL, model_loop,
+                    &model_workers[i]);
+    for (i = 0; i < num_events; i++)
+        pthread_create(&event_workers[i].thread, NULL, event_workers[i].loop,
+                    &event_workers[i]);
+
+    sleep(duration_s);
+    atomic_store(&is_running, false);
+
+    for (i = 0; i < NUM_MODEL_WORKERS; i++) {
+        struct model_worker *w = &model_workers[i];
+        unsigned int late;
+
+        pthread_join(w->thread, NULL);
+        is_failed |= report_worker(w->name, w->cycles, w->errors, &w->calls,
+                                max_call_us);
+        late = atomic_load(&w->late_callbacks);
+        fprintf(stdout, "%s: %u callbacks, %u after stop%s\n", w->name,
+            atomic_load(&w->callbacks), late, late > 0 ? "  FAIL" : "");
+        is_failed |= late > 0;
+    }
+    for (i = 0; i < num_events; i++) {
+        struct event_worker *w = &event_workers[i];
+
+        pthread_join(w->thread, NULL);
+        is_failed |= report_worker(w->name, w->cycles, w->errors, &w->calls,
+                                max_call_us);
+    }
+    fprintf(stdout, "%u chip accesses\n", fake_odsp_get_num_calls());
+
+    strm_get_stats(&strm_stats);
+    fprintf(stdout, "tunnels: %u opens, %u closes, %u reads, %u prefills, "
+        "%u stale calls, %u closed under a reader\n", strm_stats.opens,
+        strm_stats.closes, strm_stats.reads, strm_stats.prefills,
+        strm_stats.stale_calls, strm_stats.closed_under_reader);
+    if (strm_stats.stale_calls > 0 || strm_stats.closed_under_reader > 0) {
+        fprintf(stdout, "tunnels: reads raced with a close  FAIL\n");
+        is_failed = true;
+    }
+    // More reads than opens means some went through the lock-free path
+    if (strm_stats.reads <= strm_stats.opens) {
+        fprintf(stdout, "tunnels: no lock-free read was exercised  FAIL\n");
+        is_failed = true;
+    }
+    // Built with STHAL_CAPTURE_FLOAT, every capture streams float
+    fprintf(stdout, "tunnels: %u float reads, %u off from Q15%s\n",
+        strm_stats.float_reads, strm_stats.format_mismatches,
+        strm_stats.float_reads == 0 || strm_stats.format_mismatches > 0 ?
+        "  FAIL" : "");
+    if (strm_stats.float_reads == 0 || strm_stats.format_mismatches > 0)
+        is_failed = true;
+
+    fflush(stdout);
+    stdev_dump_lock_profile(STDOUT_FILENO);
+    stdev_dump_detection_trace(STDOUT_FILENO);
+    fprintf(stdout, "%s\n", is_failed ? "FAIL" : "PASS");
+    if (is_failed)
+        err = 1;
+
+exit:
+    device->close(device);
+    dlclose(strm_lib);
+    return err;
+}
@@ -21,6 +21,8 @@
 #include <ctype.h>
 #include <errno.h>
 #include <string.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <unistd.h>
 
@@ -28,6 +30,7 @@
 #include <linux/mfd/adnc/iaxxx-tunnel-intf.h>
 #include <linux/mfd/adnc/iaxxx-system-identifiers.h>
 #include "tunnel.h"
+#include "sthal_metrics.h"
 
 #define TUNNELING_DEVICE "/dev/tunnel0"
 #define FUNCTION_ENTRY_LOG ALOGV("Entering %s", __func__);
@@ -37,12 +40,30 @@ struct ia_tunneling_hal {
     int tunnel_dev;
 };
 
+static struct {
+    struct metric *open;
+    struct metric *reads;
+    struct metric *bytes;
+    struct metric *read_failures;
+} metrics;
+static pthread_once_t metrics_once = PTHREAD_ONCE_INIT;
+
+static void register_metrics(void)
+{
+    metrics.open = metrics_register("tunnel.open", METRIC_GAUGE);
+    metrics.reads = metrics_register("tunnel.reads", METRIC_COUNTER);
+    metrics.bytes = metrics_register("tunnel.bytes", METRIC_COUNTER);
+    metrics.read_failures = metrics_register("tunnel.read_failures",
+                                            METRIC_COUNTER);
+}
+
 struct ia_tunneling_hal* ia_start_tunneling(int buffering_size __unused)
 {
     struct ia_tunneling_hal *thdl;
 
     FUNCTION_ENTRY_LOG;
 
+    pthread_once(&metrics_once, register_metrics);
     thdl = (struct ia_tunneling_hal *)malloc(sizeof(struct ia_tunneling_hal));
     if (thdl == NULL) {
         ALOGE("%s: ERROR Failed to allocate memory of ia_tunneling_hal",
@@ -57,6 +78,7 @@ struct ia_tunneling_hal* ia_start_tunneling(int buffering_size __unused)
         free(thdl);
         return NULL;
     }
+    metric_add(metrics.open, 1);
 
     return thdl;
 }
@@ -69,6 +91,7 @@ int ia_stop_tunneling(struct ia_tunneling_hal *thdl)
         close(thdl->tunnel_dev);
         thdl->tunnel_dev = 0;
         free(thdl);
+        metric_add(metrics.open, -1);
     }
 
     return 0;
@@ -146,14 +169,42 @@ int ia_read_tunnel_data(struct ia_tunneling_hal *thdl,
     }
 
     read_bytes = read(thdl->tunnel_dev, buf, buf_sz);
-    if (read_bytes == 0) {
-        ALOGE("%s: Warning zero bytes read from tunneling device, "
-            "trying again..", __func__);
+    metric_add(metrics.reads, 1);
+    if (read_bytes > 0) {
+        metric_add(metrics.bytes, read_bytes);
+    } else {
+        metric_add(metrics.read_failures, 1);
+        if (read_bytes == 0)
+            ALOGE("%s: Warning zero bytes read from tunneling device, "
+                "trying again..", __func__);
     }
 
     return read_bytes;
 }
 
+int ia_poll_tunnel_data(struct ia_tunneling_hal *thdl, int timeout_ms)
+{
+    struct pollfd pfd;
+    int ret;
+
+    if (thdl == NULL) {
+        ALOGE("%s: ERROR Tunneling hdl is NULL", __func__);
+        return -EIO;
+    }
+
+    pfd.fd = thdl->tunnel_dev;
+    pfd.events = POLLIN;
+    do {
+        ret = poll(&pfd, 1, timeout_ms);
+    } while (ret == -1 && errno == EINTR);
+    if (ret == -1) {
+        ret = -errno;
+        ALOGE("%s: ERROR poll failed %s", __func__, strerror(errno));
+    }
+
+    return ret;
+}
+
 int ia_set_tunnel_out_buf_threshold(struct ia_tunneling_hal *thdl,
                                     uint32_t threshold)
 {
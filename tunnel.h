@@ -76,6 +76,16 @@ int ia_disable_tunneling_source(struct ia_tunneling_hal *tun_hdl,
  */
 int ia_read_tunnel_data(struct ia_tunneling_hal *tun_hdl, void *buf, int buf_size);
 
+/**
+ * Wait for tunneled data to be available
+ *
+ * Input  - tun_hdl - Handle to the Tunneling HAL.
+ *          timeout_ms - How long to wait, 0 to only check, -1 for ever
+ * Output - Positive if data can be read without blocking, zero on timeout,
+ *          -errno on failure.
+ */
+int ia_poll_tunnel_data(struct ia_tunneling_hal *tun_hdl, int timeout_ms);
+
 /**
  * Set the output buffer threshold for the event generation.
  *